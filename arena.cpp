@@ -0,0 +1,168 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "arena.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const size_t c_align = 16;
+static const size_t c_min_block = 4096;
+
+struct Arena::Block
+{
+    Block*          prev;
+    size_t          size;           // Bytes of data after the header.
+};
+
+static size_t
+AlignUp(size_t cb)
+{
+    return (cb + c_align - 1) & ~(c_align - 1);
+}
+
+// The data starts after the header, at the next aligned offset.
+unsigned char*
+Arena::BlockData(Block* block)
+{
+    return reinterpret_cast<unsigned char*>(block) + AlignUp(sizeof(Block));
+}
+
+void
+Arena::Lock()
+{
+    while (m_lock.test_and_set(std::memory_order_acquire))
+    {
+    }
+}
+
+void
+Arena::Unlock()
+{
+    m_lock.clear(std::memory_order_release);
+}
+
+bool
+Arena::AddBlock(size_t cb)
+{
+    // Later blocks grow, so a bad guess for the first block only costs a
+    // few more blocks.
+    size_t size = m_block ? m_block->size * 2 : (m_first_size ? m_first_size : c_min_block);
+    if (size < cb)
+        size = AlignUp(cb);
+
+    const size_t header = AlignUp(sizeof(Block));
+    if (size > size_t(-1) - header)
+        return false;
+    Block* block = static_cast<Block*>(malloc(header + size));
+    if (!block)
+        return false;
+
+    block->prev = m_block;
+    block->size = size;
+    m_block = block;
+    m_offset = 0;
+    m_stats.reserved += size;
+    ++m_stats.blocks;
+    return true;
+}
+
+bool
+Arena::Reserve(size_t cb)
+{
+    Lock();
+    bool ok = true;
+    if (!m_block)
+    {
+        m_first_size = AlignUp(cb < c_min_block ? c_min_block : cb);
+        ok = AddBlock(m_first_size);
+    }
+    Unlock();
+    return ok;
+}
+
+void*
+Arena::Alloc(size_t cb)
+{
+    cb = AlignUp(cb ? cb : 1);
+    if (!cb)
+        return nullptr;
+
+    Lock();
+    void* p = nullptr;
+    if ((m_block && m_block->size - m_offset >= cb) || AddBlock(cb))
+    {
+        p = BlockData(m_block) + m_offset;
+        m_offset += cb;
+        m_stats.used += cb;
+        if (m_stats.peak < m_stats.used)
+            m_stats.peak = m_stats.used;
+        ++m_stats.allocations;
+    }
+    Unlock();
+    return p;
+}
+
+wchar_t*
+Arena::Copy(const wchar_t* s, size_t len)
+{
+    wchar_t* copy = static_cast<wchar_t*>(Alloc((len + 1) * sizeof(*copy)));
+    if (copy)
+    {
+        memcpy(copy, s, len * sizeof(*copy));
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+wchar_t*
+Arena::Copy(const wchar_t* s)
+{
+    return Copy(s, wcslen(s));
+}
+
+char*
+Arena::Copy(const char* s)
+{
+    const size_t len = strlen(s);
+    char* copy = static_cast<char*>(Alloc(len + 1));
+    if (copy)
+        memcpy(copy, s, len + 1);
+    return copy;
+}
+
+Arena::Mark
+Arena::GetMark()
+{
+    Lock();
+    const Mark mark = { m_block, m_offset, m_stats.used };
+    Unlock();
+    return mark;
+}
+
+void
+Arena::Reset(const Mark& mark)
+{
+    Lock();
+    while (m_block && m_block != mark.block)
+    {
+        Block* prev = m_block->prev;
+        m_stats.reserved -= m_block->size;
+        --m_stats.blocks;
+        free(m_block);
+        m_block = prev;
+    }
+    m_offset = m_block ? mark.offset : 0;
+    m_stats.used = mark.used;
+    Unlock();
+}
+
+void
+Arena::Release()
+{
+    const Mark empty = {};
+    Reset(empty);
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+// How much an arena has been used, for measuring it.
+struct ArenaStats
+{
+    unsigned long long  allocations;    // Calls to Alloc().
+    size_t              used;           // Bytes allocated now (incl. alignment).
+    size_t              peak;           // Most bytes allocated at once.
+    size_t              reserved;       // Bytes in blocks held now.
+    unsigned            blocks;         // Blocks held now.
+};
+
+// A bump allocator for the strings and buffers of one sudo invocation.
+// Allocating just advances an offset in the current block, and everything
+// is released at once.  Nothing is freed individually.  When a block runs
+// out another block is added, so there are no fixed limits, but sizing the
+// first block well makes the whole invocation a single malloc.
+//
+// Alloc() may be called from more than one thread.
+class Arena
+{
+public:
+                    ~Arena() { Release(); }
+
+    // Sets the size of the first block.  Does nothing if there already is
+    // a block.
+    bool            Reserve(size_t cb);
+
+    // Returns memory aligned for any fundamental type, or nullptr if out of
+    // memory.
+    void*           Alloc(size_t cb);
+
+    wchar_t*        Copy(const wchar_t* s);
+    wchar_t*        Copy(const wchar_t* s, size_t len);
+    char*           Copy(const char* s);
+
+    void            Release();
+
+    const ArenaStats& Stats() const { return m_stats; }
+
+    // A position in the arena; Reset() frees everything allocated after it.
+    struct Mark
+    {
+        void*           block;
+        size_t          offset;
+        size_t          used;
+    };
+
+    Mark            GetMark();
+    void            Reset(const Mark& mark);
+
+private:
+    struct Block;
+
+    static unsigned char* BlockData(Block* block);
+    bool            AddBlock(size_t cb);
+    void            Lock();
+    void            Unlock();
+
+    Block*          m_block = nullptr;
+    size_t          m_offset = 0;
+    size_t          m_first_size = 0;
+    ArenaStats      m_stats = {};
+    std::atomic_flag m_lock = ATOMIC_FLAG_INIT;
+};
+
+// Frees everything allocated in the arena during the scope, for work that
+// repeats within one process (e.g. each command the broker launches).
+class ArenaScope
+{
+public:
+    explicit        ArenaScope(Arena& arena) : m_arena(arena), m_mark(arena.GetMark()) {}
+                    ~ArenaScope() { m_arena.Reset(m_mark); }
+
+private:
+    Arena&          m_arena;
+    const Arena::Mark m_mark;
+};
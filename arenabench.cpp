@@ -0,0 +1,296 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark for the per-invocation arena:  replays the string work of one
+// sudo invocation (parsing options, resolving paths, searching %PATH% for
+// the program, and building the elevated command line), once with malloc
+// and free for each string as sudo used to, and once with an arena sized
+// from the command line.  It reports the allocation count, peak bytes, and
+// time for each, for a short command line and for one far longer than the
+// old 1024 character buffers allowed.
+//
+//      g++ -std=c++17 -O2 arenabench.cpp arena.cpp cmdline.cpp -o arenabench
+//      ./arenabench [-n invocations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "arena.h"
+#include "cmdline.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Counts what goes through malloc, the way sudo used to allocate.
+struct HeapCounter
+{
+    unsigned long long  allocations;
+    size_t              used;
+    size_t              peak;
+};
+
+static HeapCounter s_heap;
+
+static wchar_t*
+HeapString(size_t cch)
+{
+    // The size is stored in front, so HeapFree() can track live bytes.
+    const size_t cb = cch * sizeof(wchar_t);
+    size_t* p = static_cast<size_t*>(malloc(sizeof(size_t) + cb));
+    if (!p)
+        return nullptr;
+    *p = cb;
+    ++s_heap.allocations;
+    s_heap.used += cb;
+    if (s_heap.peak < s_heap.used)
+        s_heap.peak = s_heap.used;
+    return reinterpret_cast<wchar_t*>(p + 1);
+}
+
+static void
+HeapFree(wchar_t* psz)
+{
+    if (psz)
+    {
+        size_t* p = reinterpret_cast<size_t*>(psz) - 1;
+        s_heap.used -= *p;
+        free(p);
+    }
+}
+
+// Where the strings come from.
+struct Allocator
+{
+    Arena*              arena;
+
+    wchar_t*            Alloc(size_t cch) { return arena ? static_cast<wchar_t*>(arena->Alloc(cch * sizeof(wchar_t))) : HeapString(cch); }
+    void                Free(wchar_t* psz) { if (!arena) HeapFree(psz); }
+
+    wchar_t*            Copy(const wchar_t* s)
+                        {
+                            wchar_t* p = Alloc(wcslen(s) + 1);
+                            if (p)
+                                wcscpy(p, s);
+                            return p;
+                        }
+};
+
+static const wchar_t* const c_module = L"C:\\Program Files\\sudo\\sudo.exe";
+static const wchar_t* const c_user = L"alice";
+static const wchar_t* const c_host = L"workstation.contoso.com";
+static const wchar_t* const c_exts = L".COM;.EXE;.BAT;.CMD;.VBS;.VBE;.JS;.JSE;.WSF;.WSH;.MSC";
+
+static wchar_t s_path[4096];
+
+// A fake file system, where only one candidate exists.
+static bool
+IsProgramFile(const wchar_t* psz)
+{
+    return wcscmp(psz, L"C:\\Tools\\bin29\\build.EXE") == 0;
+}
+
+// Searches the fake %PATH% the old way (one allocation per candidate), or
+// the new way (one buffer for all candidates).
+static wchar_t*
+FindProgram(Allocator& a, const wchar_t* name, const wchar_t* dir)
+{
+    const size_t cch_name = wcslen(name);
+    wchar_t* const path = a.Copy(s_path);
+    wchar_t* const exts = a.Copy(c_exts);
+    wchar_t* shared = a.arena ? a.Alloc(wcslen(s_path) + wcslen(dir) + 1 + cch_name + wcslen(c_exts) + 1) : nullptr;
+    wchar_t* found = nullptr;
+
+    const wchar_t* next_dir = dir;
+    bool first = true;
+    while (!found && next_dir)
+    {
+        const wchar_t* this_dir = next_dir;
+        size_t cch_dir;
+        if (first)
+        {
+            cch_dir = wcslen(this_dir);
+            next_dir = path;
+            first = false;
+        }
+        else
+        {
+            const wchar_t* sep = wcschr(this_dir, ';');
+            cch_dir = sep ? size_t(sep - this_dir) : wcslen(this_dir);
+            next_dir = sep ? sep + 1 : nullptr;
+        }
+
+        for (const wchar_t* ext = exts; !found && ext && *ext;)
+        {
+            const wchar_t* sep = wcschr(ext, ';');
+            const size_t cch_ext = sep ? size_t(sep - ext) : wcslen(ext);
+
+            wchar_t* psz = shared ? shared : a.Alloc(cch_dir + 1 + cch_name + cch_ext + 1);
+            if (!psz)
+                break;
+            wmemcpy(psz, this_dir, cch_dir);
+            psz[cch_dir] = '\\';
+            wmemcpy(psz + cch_dir + 1, name, cch_name);
+            wmemcpy(psz + cch_dir + 1 + cch_name, ext, cch_ext);
+            psz[cch_dir + 1 + cch_name + cch_ext] = '\0';
+
+            if (IsProgramFile(psz))
+                found = psz;
+            else if (!shared)
+                a.Free(psz);
+            ext = sep ? sep + 1 : nullptr;
+        }
+    }
+
+    a.Free(path);
+    a.Free(exts);
+    return found;
+}
+
+// The string work of one invocation, unelevated and then elevated.
+static bool
+RunInvocation(Allocator& a, const wchar_t* line)
+{
+    bool ok = true;
+
+    // Option storage, and the full paths derived from the options.
+    const size_t cch_line = wcslen(line);
+    wchar_t* storage = a.Alloc(cch_line + 1);
+    wchar_t* dir = a.Copy(L"C:\\Users\\alice\\src\\project");
+    wchar_t* trace = a.Copy(L"C:\\Users\\alice\\AppData\\Local\\Temp\\sudo-trace.json");
+    wchar_t* audit = a.Copy(L"C:\\ProgramData\\sudo\\audit.jsonl");
+    wchar_t* module = a.Copy(c_module);
+    wchar_t* user = a.Copy(c_user);
+    wchar_t* host = a.Copy(c_host);
+    ok = ok && storage && dir && trace && audit && module && user && host;
+    if (storage)
+        wcscpy(storage, line);
+
+    // The command line for the elevated sudo.
+    CommandLineBuilder forward;
+    forward.Arg(L"--trace");
+    forward.Arg(trace ? trace : L"");
+    forward.Arg(L"--audit-log");
+    forward.Arg(audit ? audit : L"");
+    CommandLineBuilder args;
+    args.Program(module ? module : L"");
+    args.Arg(L"--elevated");
+    args.Arg(1234u);
+    args.Append(forward);
+    args.Arg(L"-D");
+    args.Arg(dir ? dir : L"");
+    args.Arg(L"--");
+    args.Raw(line);
+    wchar_t* params = a.Alloc(args.Length() + 1);
+    ok = ok && params && args.Emit(params);
+
+    // The elevated sudo finds the program and builds its command line.
+    wchar_t* program = FindProgram(a, L"build", dir ? dir : L".");
+    wchar_t* cmdline = a.Copy(line);
+    wchar_t* comspec = a.Copy(L"C:\\Windows\\system32\\cmd.exe");
+    ok = ok && program && cmdline && comspec;
+
+    a.Free(storage);
+    a.Free(dir);
+    a.Free(trace);
+    a.Free(audit);
+    a.Free(module);
+    a.Free(user);
+    a.Free(host);
+    a.Free(params);
+    a.Free(program);
+    a.Free(cmdline);
+    a.Free(comspec);
+    return ok;
+}
+
+static bool
+RunBench(const char* name, const wchar_t* line, unsigned invocations)
+{
+    const size_t cch_line = wcslen(line);
+
+    // Before:  malloc and free per string.
+    s_heap = HeapCounter();
+    Allocator heap = { nullptr };
+    unsigned long long start = NowMicroseconds();
+    bool ok = true;
+    for (unsigned i = 0; ok && i < invocations; ++i)
+        ok = RunInvocation(heap, line);
+    const unsigned long long heap_time = NowMicroseconds() - start;
+    const HeapCounter heap_counts = s_heap;
+
+    // After:  one arena per invocation, sized like sudo sizes it.
+    ArenaStats arena_stats = {};
+    start = NowMicroseconds();
+    for (unsigned i = 0; ok && i < invocations; ++i)
+    {
+        Arena arena;
+        arena.Reserve((cch_line * 8 + 4096) * sizeof(wchar_t));
+        Allocator a = { &arena };
+        ok = RunInvocation(a, line);
+        arena_stats = arena.Stats();
+    }
+    const unsigned long long arena_time = NowMicroseconds() - start;
+
+    if (!ok)
+    {
+        fprintf(stderr, "%s: an invocation failed.\n", name);
+        return false;
+    }
+
+    printf("%-6s %6zu chars  malloc: %4llu allocs %8zu bytes peak %7.2f us   arena: %3llu allocs %8zu bytes peak %2u blocks (%8zu bytes) %7.2f us\n",
+           name, cch_line,
+           heap_counts.allocations / invocations, heap_counts.peak, double(heap_time) / invocations,
+           arena_stats.allocations, arena_stats.peak, arena_stats.blocks, arena_stats.reserved,
+           double(arena_time) / invocations);
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned invocations = 100000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            invocations = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: arenabench [-n invocations]\n");
+            return 1;
+        }
+    }
+    if (!invocations)
+        return 1;
+
+    // A %PATH% with 30 directories, where the program is in the last one.
+    size_t len = 0;
+    for (unsigned i = 0; i < 30; ++i)
+        len += swprintf(s_path + len, sizeof(s_path) / sizeof(s_path[0]) - len, L"%lsC:\\Tools\\bin%u", i ? L";" : L"", i);
+
+    const wchar_t* short_line = L"build --config release \"C:\\Users\\alice\\src\\project\\build.json\"";
+
+    // Longer than the 1024 character buffers sudo used to have.
+    const size_t cch_long = 40000;
+    wchar_t* long_line = static_cast<wchar_t*>(malloc((cch_long + 1) * sizeof(*long_line)));
+    if (!long_line)
+        return 1;
+    wcscpy(long_line, L"build");
+    for (size_t i = wcslen(long_line); i < cch_long; ++i)
+        long_line[i] = (i % 16) ? L'x' : L' ';
+    long_line[cch_long] = '\0';
+
+    const bool ok = (RunBench("short", short_line, invocations) &&
+                     RunBench("long", long_line, invocations / 10 ? invocations / 10 : 1));
+    free(long_line);
+    return ok ? 0 : 1;
+}
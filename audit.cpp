@@ -0,0 +1,242 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audit.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// The commit state is shared between processes, which only works if the
+// atomics don't need a lock.
+static_assert(std::atomic<unsigned long long>::is_always_lock_free, "Shared atomics must be lock free.");
+static_assert(std::atomic<unsigned>::is_always_lock_free, "Shared atomics must be lock free.");
+
+struct AuditText
+{
+    char*       p = nullptr;
+    size_t      len = 0;
+    size_t      capacity = 0;
+    bool        ok = true;
+};
+
+static void
+Append(AuditText& text, const char* p, size_t len)
+{
+    if (!text.ok)
+        return;
+    if (text.len + len + 1 > text.capacity)
+    {
+        size_t capacity = text.capacity ? text.capacity * 2 : 256;
+        while (capacity < text.len + len + 1)
+            capacity *= 2;
+        char* q = static_cast<char*>(realloc(text.p, capacity));
+        if (!q)
+        {
+            text.ok = false;
+            return;
+        }
+        text.p = q;
+        text.capacity = capacity;
+    }
+    memcpy(text.p + text.len, p, len);
+    text.len += len;
+    text.p[text.len] = '\0';
+}
+
+static void
+Append(AuditText& text, const char* p)
+{
+    Append(text, p, strlen(p));
+}
+
+static void
+AppendEscaped(AuditText& text, unsigned c)
+{
+    char sz[8];
+    switch (c)
+    {
+    case '"':   Append(text, "\\\"", 2); break;
+    case '\\':  Append(text, "\\\\", 2); break;
+    case '\n':  Append(text, "\\n", 2); break;
+    case '\r':  Append(text, "\\r", 2); break;
+    case '\t':  Append(text, "\\t", 2); break;
+    default:
+        snprintf(sz, sizeof(sz), "\\u%04x", c);
+        Append(text, sz, 6);
+        break;
+    }
+}
+
+// Appends a UTF-16 string as a JSON string in UTF-8.  Unpaired surrogates
+// become U+FFFD.
+static void
+AppendString(AuditText& text, const wchar_t* s)
+{
+    Append(text, "\"", 1);
+    for (; *s; ++s)
+    {
+        unsigned c = unsigned(*s) & 0xffff;
+        if (c >= 0xd800 && c <= 0xdbff && (s[1] & 0xfc00) == 0xdc00)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + ((unsigned(s[1]) & 0xffff) - 0xdc00);
+            ++s;
+        }
+        else if (c >= 0xd800 && c <= 0xdfff)
+        {
+            c = 0xfffd;
+        }
+
+        char utf8[4];
+        if (c < 0x20 || c == '"' || c == '\\')
+        {
+            AppendEscaped(text, c);
+        }
+        else if (c < 0x80)
+        {
+            utf8[0] = char(c);
+            Append(text, utf8, 1);
+        }
+        else if (c < 0x800)
+        {
+            utf8[0] = char(0xc0 | (c >> 6));
+            utf8[1] = char(0x80 | (c & 0x3f));
+            Append(text, utf8, 2);
+        }
+        else if (c < 0x10000)
+        {
+            utf8[0] = char(0xe0 | (c >> 12));
+            utf8[1] = char(0x80 | ((c >> 6) & 0x3f));
+            utf8[2] = char(0x80 | (c & 0x3f));
+            Append(text, utf8, 3);
+        }
+        else
+        {
+            utf8[0] = char(0xf0 | (c >> 18));
+            utf8[1] = char(0x80 | ((c >> 12) & 0x3f));
+            utf8[2] = char(0x80 | ((c >> 6) & 0x3f));
+            utf8[3] = char(0x80 | (c & 0x3f));
+            Append(text, utf8, 4);
+        }
+    }
+    Append(text, "\"", 1);
+}
+
+static void
+AppendField(AuditText& text, const char* name, const wchar_t* value)
+{
+    if (!value)
+        return;
+    Append(text, ",\"");
+    Append(text, name);
+    Append(text, "\":");
+    AppendString(text, value);
+}
+
+static void
+AppendField(AuditText& text, const char* name, unsigned value)
+{
+    char sz[32];
+    snprintf(sz, sizeof(sz), ",\"%s\":%u", name, value);
+    Append(text, sz);
+}
+
+char*
+FormatAuditRecord(const AuditRecord& record, size_t& len)
+{
+    AuditText text;
+
+    // ISO 8601 in UTC, with microseconds.
+    const time_t secs = time_t(record.time / 1000000);
+    struct tm tm = {};
+#ifdef _WIN32
+    gmtime_s(&tm, &secs);
+#else
+    gmtime_r(&secs, &tm);
+#endif
+    char sz[96];
+    snprintf(sz, sizeof(sz), "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06uZ\",\"side\":\"%s\"",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             unsigned(record.time % 1000000), record.side);
+    Append(text, sz);
+
+    if (record.via)
+    {
+        Append(text, ",\"via\":\"");
+        Append(text, record.via);
+        Append(text, "\"");
+    }
+    AppendField(text, "pid", record.pid);
+    if (record.parent_pid)
+        AppendField(text, "parent_pid", record.parent_pid);
+    AppendField(text, "user", record.user);
+    AppendField(text, "run_as", record.run_as);
+    AppendField(text, "dir", record.dir);
+    AppendField(text, "command", record.command);
+    AppendField(text, "batch", record.batch);
+    if (record.background)
+        Append(text, ",\"background\":true");
+    if (record.error)
+        AppendField(text, "error", record.error);
+    else if (!record.background)
+        AppendField(text, "exit_code", record.exit_code);
+    Append(text, "}\n", 2);
+
+    if (!text.ok)
+    {
+        free(text.p);
+        return nullptr;
+    }
+    len = text.len;
+    return text.p;
+}
+
+bool
+AuditAppend(const AuditJournalOps& ops, const char* line, size_t len)
+{
+    if (!ops.append(line, len, ops.context))
+        return false;
+
+    AuditCommitState* const shared = ops.shared;
+    if (!shared)
+        return ops.flush(ops.context);
+
+    // The count goes up only after the append has completed, so any flush
+    // that starts after reading a count that includes this line also
+    // includes this line.
+    const unsigned long long mine = shared->appended.fetch_add(1) + 1;
+
+    for (unsigned pauses = 0;;)
+    {
+        if (shared->flushed.load() >= mine)
+            return true;
+
+        unsigned expected = 0;
+        if (shared->flushing.compare_exchange_strong(expected, 1))
+        {
+            // Flush on behalf of everything appended so far.
+            const unsigned long long target = shared->appended.load();
+            const bool ok = ops.flush(ops.context);
+            if (ok)
+            {
+                unsigned long long flushed = shared->flushed.load();
+                while (flushed < target && !shared->flushed.compare_exchange_weak(flushed, target))
+                {
+                }
+            }
+            shared->flushing.store(0);
+            if (!ok)
+                return false;
+            continue;
+        }
+
+        // If the process that is flushing takes too long (or died while
+        // flushing), flush alone rather than wait forever.
+        if (pauses >= ops.max_pauses)
+            return ops.flush(ops.context);
+        ops.pause(pauses++, ops.context);
+    }
+}
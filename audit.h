@@ -0,0 +1,68 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+// The audit journal (%SUDO_AUDIT_LOG%) gets one JSON line per sudo process:
+// who ran what, as whom, in which directory, and how it ended.  Both the
+// unelevated and the elevated sudo write a line, so a journal shows both
+// the request and what the elevated side actually did.
+
+struct AuditRecord
+{
+    unsigned long long  time;           // Microseconds since 1970-01-01 UTC.
+    const char*         side;           // "sudo" or "elevated".
+    const char*         via;            // How the command ran, or nullptr.
+    unsigned            pid;
+    unsigned            parent_pid;     // The unelevated sudo, if elevated.
+    const wchar_t*      user;           // Invoking user.
+    const wchar_t*      run_as;         // Target of -u, or nullptr.
+    const wchar_t*      dir;
+    const wchar_t*      command;
+    const wchar_t*      batch;
+    bool                background;
+    unsigned            exit_code;
+    unsigned            error;          // Why sudo failed, or 0.
+};
+
+// Returns a malloc'd UTF-8 line ending with \n, or nullptr if out of memory.
+char* FormatAuditRecord(const AuditRecord& record, size_t& len);
+
+// Lets concurrent sudo processes share the cost of flushing the journal to
+// disk.  It lives in memory shared by every process that appends to the same
+// journal.
+struct AuditCommitState
+{
+    std::atomic<unsigned long long> appended;   // Records appended so far.
+    std::atomic<unsigned long long> flushed;    // Records known to be on disk.
+    std::atomic<unsigned>           flushing;   // Nonzero while one process flushes.
+};
+
+struct AuditJournalOps
+{
+    // Appends the whole line with a single write to a file opened for
+    // appending, so the OS reserves each line's place atomically and
+    // concurrent lines never interleave.
+    bool                (*append)(const char* line, size_t len, void* context);
+
+    // Flushes the file to disk (fsync, FlushFileBuffers).
+    bool                (*flush)(void* context);
+
+    // Waits briefly for another process's flush.  Flushes usually take
+    // about a millisecond, so early attempts should just yield the CPU, and
+    // later ones should sleep.
+    void                (*pause)(unsigned attempt, void* context);
+
+    AuditCommitState*   shared;         // Optional; nullptr flushes alone.
+    unsigned            max_pauses;     // After this many, flush alone.
+    void*               context;
+};
+
+// Appends a line and returns once it is on disk.  Appending never takes a
+// lock.  Flushing uses group commit:  one process flushes on behalf of
+// every line appended before its flush started, while the processes that
+// appended those lines wait for it instead of each flushing on their own.
+bool AuditAppend(const AuditJournalOps& ops, const char* line, size_t len);
@@ -0,0 +1,236 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Stress benchmark for the audit journal:  many processes append records to
+// the same journal at once, first with group commit and then with each
+// process flushing on its own, and the results are compared.  Afterwards it
+// checks that every record arrived exactly once and intact.
+//
+// This uses fork(), so it only builds on Linux (and other POSIX systems):
+//
+//      g++ -std=c++17 -O2 auditbench.cpp audit.cpp -o auditbench
+//      ./auditbench [-p processes] [-n records] [-f file]
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "audit.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+struct BenchShared
+{
+    AuditCommitState    state;
+    std::atomic<unsigned> flushes;
+    std::atomic<unsigned> start;
+};
+
+struct WriterContext
+{
+    int                 fd;
+    BenchShared*        shared;
+};
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool
+AppendLine(const char* line, size_t len, void* context)
+{
+    const WriterContext* ctx = static_cast<const WriterContext*>(context);
+    return write(ctx->fd, line, len) == ssize_t(len);
+}
+
+static bool
+FlushFile(void* context)
+{
+    const WriterContext* ctx = static_cast<const WriterContext*>(context);
+    ctx->shared->flushes.fetch_add(1);
+    return fdatasync(ctx->fd) == 0;
+}
+
+static void
+Pause(unsigned attempt, void*)
+{
+    if (attempt < 100)
+    {
+        sched_yield();
+    }
+    else
+    {
+        const struct timespec ts = { 0, 100 * 1000 };
+        nanosleep(&ts, nullptr);
+    }
+}
+
+static int
+RunWriter(const char* file, BenchShared* shared, bool group, unsigned index, unsigned records)
+{
+    WriterContext ctx = { open(file, O_WRONLY|O_APPEND|O_CREAT, 0644), shared };
+    if (ctx.fd < 0)
+        return 1;
+
+    AuditJournalOps ops = {};
+    ops.append = AppendLine;
+    ops.flush = FlushFile;
+    ops.pause = Pause;
+    ops.shared = group ? &shared->state : nullptr;
+    ops.max_pauses = 10000;
+    ops.context = &ctx;
+
+    // Start together, to maximize contention.
+    while (!shared->start.load())
+        sched_yield();
+
+    wchar_t command[64];
+    AuditRecord record = {};
+    record.side = "sudo";
+    record.via = "bench";
+    record.pid = unsigned(getpid());
+    record.user = L"bench";
+    record.dir = L"/tmp";
+    record.command = command;
+
+    for (unsigned i = 0; i < records; ++i)
+    {
+        swprintf(command, sizeof(command) / sizeof(command[0]), L"writer %u record %u \"quoted\" é中", index, i);
+        record.time = NowMicroseconds();
+        record.exit_code = i;
+
+        size_t len;
+        char* line = FormatAuditRecord(record, len);
+        const bool ok = line && AuditAppend(ops, line, len);
+        free(line);
+        if (!ok)
+            return 1;
+    }
+
+    close(ctx.fd);
+    return 0;
+}
+
+// Checks that each writer's records all arrived, once each, intact.
+static bool
+Verify(const char* file, unsigned processes, unsigned records)
+{
+    FILE* f = fopen(file, "rb");
+    if (!f)
+        return false;
+
+    unsigned char* seen = static_cast<unsigned char*>(calloc(size_t(processes) * records, 1));
+    unsigned lines = 0;
+    bool ok = !!seen;
+    char line[1024];
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        ++lines;
+        const size_t len = strlen(line);
+        unsigned index;
+        unsigned i;
+        const char* command = strstr(line, "\"command\":\"writer ");
+        if (len < 3 || line[0] != '{' || strcmp(line + len - 2, "}\n") ||
+            !command || sscanf(command, "\"command\":\"writer %u record %u", &index, &i) != 2 ||
+            index >= processes || i >= records || seen[size_t(index) * records + i]++)
+        {
+            fprintf(stderr, "bad line %u: %s", lines, line);
+            ok = false;
+        }
+    }
+    fclose(f);
+    free(seen);
+    return ok && lines == processes * records;
+}
+
+static bool
+RunBench(const char* file, bool group, unsigned processes, unsigned records)
+{
+    unlink(file);
+
+    BenchShared* shared = static_cast<BenchShared*>(mmap(nullptr, sizeof(BenchShared), PROT_READ|PROT_WRITE,
+                                                         MAP_SHARED|MAP_ANONYMOUS, -1, 0));
+    if (shared == MAP_FAILED)
+        return false;
+    memset(static_cast<void*>(shared), 0, sizeof(*shared));
+
+    for (unsigned i = 0; i < processes; ++i)
+    {
+        const pid_t pid = fork();
+        if (pid < 0)
+            return false;
+        if (!pid)
+            _exit(RunWriter(file, shared, group, i, records));
+    }
+
+    const unsigned long long start = NowMicroseconds();
+    shared->start.store(1);
+
+    bool ok = true;
+    for (unsigned i = 0; i < processes; ++i)
+    {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            ok = false;
+    }
+    const unsigned long long elapsed = NowMicroseconds() - start;
+
+    const unsigned total = processes * records;
+    const unsigned flushes = shared->flushes.load();
+    printf("%-16s %8u records  %8.1f ms  %10.0f records/s  %7u flushes  %6.1f records/flush\n",
+           group ? "group commit" : "flush per record", total, elapsed / 1000.0,
+           total * 1000000.0 / (elapsed ? elapsed : 1), flushes, flushes ? double(total) / flushes : 0.0);
+
+    munmap(shared, sizeof(*shared));
+
+    if (!ok)
+        fprintf(stderr, "a writer failed.\n");
+    else if (!(ok = Verify(file, processes, records)))
+        fprintf(stderr, "the journal is damaged.\n");
+    return ok;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned processes = 200;
+    unsigned records = 20;
+    const char* file = "auditbench.jsonl";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            processes = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            records = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            file = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: auditbench [-p processes] [-n records] [-f file]\n");
+            return 1;
+        }
+    }
+
+    if (!processes || !records)
+        return 1;
+
+    if (!RunBench(file, true, processes, records) ||
+        !RunBench(file, false, processes, records))
+        return 1;
+
+    unlink(file);
+    return 0;
+}
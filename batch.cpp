@@ -0,0 +1,208 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <stdlib.h>
+
+#include "batch.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static_assert(unsigned(BATCH_MAX_JOBS) == c_batch_max_jobs, "batch job limits differ");
+
+static LPWSTR
+DecodeBatchText(const BYTE* p, DWORD cb)
+{
+    LPWSTR out = nullptr;
+
+    size_t bom;
+    const BatchEncoding encoding = DetectBatchEncoding(p, cb, bom);
+    p += bom;
+    cb -= DWORD(bom);
+
+    if (encoding == BatchEncoding::Utf16)
+    {
+        const DWORD cch = cb / sizeof(WCHAR);
+        out = LPWSTR(malloc((cch + 1) * sizeof(*out)));
+        if (out)
+        {
+            memcpy(out, p, cch * sizeof(*out));
+            out[cch] = '\0';
+        }
+        return out;
+    }
+
+    UINT cp = CP_UTF8;
+    DWORD dwFlags = MB_ERR_INVALID_CHARS;
+    int cch = cb ? MultiByteToWideChar(cp, dwFlags, LPCSTR(p), cb, nullptr, 0) : 0;
+    if (!cch && cb)
+    {
+        // Not valid UTF-8, so it's presumably ANSI.
+        cp = CP_ACP;
+        dwFlags = 0;
+        cch = MultiByteToWideChar(cp, dwFlags, LPCSTR(p), cb, nullptr, 0);
+        if (!cch)
+            return nullptr;
+    }
+
+    out = LPWSTR(malloc((cch + 1) * sizeof(*out)));
+    if (out)
+    {
+        if (cch)
+            MultiByteToWideChar(cp, dwFlags, LPCSTR(p), cb, out, cch);
+        out[cch] = '\0';
+    }
+    return out;
+}
+
+// Batch files larger than this are rejected.
+enum : DWORD { c_max_batch_file = 64 * 1024 * 1024 };
+
+// Reads a file or pipe until it ends.
+static BYTE*
+ReadToEnd(HANDLE h, DWORD& cb)
+{
+    DWORD cbAlloc = 64 * 1024;
+    BYTE* raw = static_cast<BYTE*>(malloc(cbAlloc));
+    if (!raw)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return nullptr;
+    }
+
+    cb = 0;
+    while (true)
+    {
+        if (cb == cbAlloc)
+        {
+            BYTE* const grown = (cbAlloc < c_max_batch_file) ? static_cast<BYTE*>(realloc(raw, cbAlloc * 2)) : nullptr;
+            if (!grown)
+            {
+                free(raw);
+                SetLastError((cbAlloc < c_max_batch_file) ? ERROR_OUTOFMEMORY : ERROR_FILE_TOO_LARGE);
+                return nullptr;
+            }
+            raw = grown;
+            cbAlloc *= 2;
+        }
+
+        DWORD cbRead = 0;
+        if (!ReadFile(h, raw + cb, cbAlloc - cb, &cbRead, nullptr))
+        {
+            const DWORD err = GetLastError();
+            if (err == ERROR_BROKEN_PIPE)
+                break;
+            free(raw);
+            SetLastError(err);
+            return nullptr;
+        }
+        if (!cbRead)
+            break;
+        cb += cbRead;
+    }
+    return raw;
+}
+
+LPWSTR
+ReadBatchText(LPCWSTR pszFile)
+{
+    const bool fStdin = (wcscmp(pszFile, L"-") == 0);
+    HANDLE h = fStdin ? GetStdHandle(STD_INPUT_HANDLE) :
+                        CreateFileW(pszFile, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    DWORD cb = 0;
+    BYTE* raw = ReadToEnd(h, cb);
+    const DWORD err = GetLastError();
+    if (!fStdin)
+        CloseHandle(h);
+    if (!raw)
+    {
+        SetLastError(err ? err : ERROR_READ_FAULT);
+        return nullptr;
+    }
+
+    LPWSTR pszText = DecodeBatchText(raw, cb);
+    free(raw);
+    if (!pszText)
+        SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+    return pszText;
+}
+
+bool
+LoadBatchText(LPCWSTR pszText, BatchList& list)
+{
+    const size_t cch = wcslen(pszText);
+    LPWSTR pszCopy = LPWSTR(malloc((cch + 1) * sizeof(*pszCopy)));
+    if (pszCopy)
+        memcpy(pszCopy, pszText, (cch + 1) * sizeof(*pszCopy));
+    if (!pszCopy || !SplitBatchLines(pszCopy, list))
+    {
+        FreeBatchList(list);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+    return true;
+}
+
+// RunBatchList's processes are process handles here.
+struct BatchProcs
+{
+    BatchLaunchProc     launch;
+    BatchReportProc     report;
+    void*               context;
+};
+
+static void*
+LaunchBatchProcess(const wchar_t* line, unsigned& err, void* context)
+{
+    const BatchProcs* const procs = static_cast<const BatchProcs*>(context);
+    HANDLE hProcess = procs->launch(line, procs->context);
+    if (!hProcess)
+        err = GetLastError();
+    return hProcess;
+}
+
+static unsigned
+WaitBatchProcess(void* const* processes, unsigned count, unsigned& exit_code, unsigned& err, void* /*context*/)
+{
+    const DWORD dwWait = WaitForMultipleObjects(count, processes, false, INFINITE);
+    if (dwWait >= WAIT_OBJECT_0 + count)
+    {
+        err = GetLastError();
+        return count;
+    }
+
+    const unsigned i = dwWait - WAIT_OBJECT_0;
+    DWORD dwExit = DWORD(-1);
+    GetExitCodeProcess(processes[i], &dwExit);
+    exit_code = dwExit;
+    return i;
+}
+
+static void
+CloseBatchProcess(void* process, void* /*context*/)
+{
+    CloseHandle(process);
+}
+
+static void
+ReportBatchProcess(unsigned index, unsigned count, const wchar_t* line, unsigned exit_code, unsigned err, void* context)
+{
+    const BatchProcs* const procs = static_cast<const BatchProcs*>(context);
+    procs->report(index, count, line, exit_code, err, procs->context);
+}
+
+DWORD
+RunBatch(const BatchList& list, DWORD cJobs, BatchLaunchProc launch, BatchReportProc report, void* context)
+{
+    BatchProcs procs = { launch, report, context };
+    const BatchOps ops = { LaunchBatchProcess, WaitBatchProcess, CloseBatchProcess, ReportBatchProcess, &procs };
+
+    unsigned err = NOERROR;
+    const DWORD dwExit = RunBatchList(list, cJobs, ops, err);
+    if (dwExit == DWORD(-1) && err)
+        SetLastError(err);
+    return dwExit;
+}
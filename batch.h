@@ -0,0 +1,34 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "batchrun.h"
+
+// Batch mode runs many command lines through a single elevation.  The batch
+// file has one command line per line; blank lines and lines starting with #
+// are ignored.  The file may be UTF-16 (with a BOM), UTF-8, or ANSI.
+
+enum { BATCH_MAX_JOBS = MAXIMUM_WAIT_OBJECTS };
+
+// Launches one command line and returns a process handle, or returns nullptr
+// and sets the last error.
+typedef HANDLE (*BatchLaunchProc)(LPCWSTR pszLine, void* context);
+
+// Reports the result of one command line.  If the command could not be
+// started, err is the error code and dwExit is -1.
+typedef void (*BatchReportProc)(unsigned index, unsigned count, LPCWSTR pszLine, DWORD dwExit, DWORD err, void* context);
+
+// Reads and decodes the batch file, or stdin for "-".  The unelevated sudo
+// reads it, and hands the text to the elevated sudo.  Returns the text (free
+// it with free()), or nullptr with the last error set.
+LPWSTR ReadBatchText(LPCWSTR pszFile);
+
+// Splits a copy of the text from ReadBatchText().  Free the list with
+// FreeBatchList().
+bool LoadBatchText(LPCWSTR pszText, BatchList& list);
+
+// Runs the commands with at most cJobs running at once.  Returns 0 if all
+// commands succeeded, otherwise the exit code of the first command (in file
+// order) that failed.
+DWORD RunBatch(const BatchList& list, DWORD cJobs, BatchLaunchProc launch, BatchReportProc report, void* context);
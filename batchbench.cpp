@@ -0,0 +1,493 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for batch mode:  splitting batch files into command
+// lines, and the scheduler that runs them with a bounded number at once.
+//
+// The checker splits a table of batch texts (blank lines, comments,
+// whitespace, \r\n, a missing last line ending) and compares the lines, and
+// checks the BOM detection.  Then it runs random batches through
+// RunBatchList with a fake launcher on a simulated clock, and checks that
+// no more than -j commands run at once, that a slot is refilled as soon as a
+// command exits, that every command is reported once, that launch failures
+// are reported, and that the exit code is the first failure in file order.
+// It also checks the path where waiting fails.  The benchmark reports the
+// cost of splitting a large batch file and of scheduling each command.
+//
+//      g++ -std=c++17 -O2 batchbench.cpp batchrun.cpp -o batchbench
+//      ./batchbench [-n batches] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "batchrun.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static wchar_t*
+Duplicate(const wchar_t* s)
+{
+    const size_t len = wcslen(s);
+    wchar_t* copy = static_cast<wchar_t*>(malloc((len + 1) * sizeof(*copy)));
+    wmemcpy(copy, s, len + 1);
+    return copy;
+}
+
+//------------------------------------------------------------------------------
+// Splitting.
+
+struct SplitCase
+{
+    const wchar_t*      text;
+    const wchar_t*      lines[4];
+    unsigned            count;
+};
+
+static const SplitCase c_split_cases[] =
+{
+    { L"",                                      {},                                 0 },
+    { L"\n\n\r\n",                              {},                                 0 },
+    { L"cmd /c ver",                            { L"cmd /c ver" },                  1 },
+    { L"a\nb\n",                                { L"a", L"b" },                     2 },
+    { L"a\r\n\r\nb\r\n",                        { L"a", L"b" },                     2 },
+    { L"  \t indented  \t\r\n",                 { L"indented" },                    1 },
+    { L"# comment\n  # indented comment\nx",    { L"x" },                           1 },
+    { L"echo a#b\n#\n",                         { L"echo a#b" },                    1 },
+    { L"\"C:\\Program Files\\x.exe\" \"a b\"",  { L"\"C:\\Program Files\\x.exe\" \"a b\"" }, 1 },
+    { L"\r\r\na\r\rb",                          { L"a\r\rb" },                      1 },
+};
+
+struct BomCase
+{
+    const char*         bytes;
+    size_t              cb;
+    BatchEncoding       encoding;
+    size_t              bom;
+};
+
+static const BomCase c_bom_cases[] =
+{
+    { "",                       0,  BatchEncoding::Utf8,    0 },
+    { "\xff",                   1,  BatchEncoding::Utf8,    0 },
+    { "\xff\xfe",               2,  BatchEncoding::Utf16,   2 },
+    { "\xff\xfe" "a\0",         4,  BatchEncoding::Utf16,   2 },
+    { "\xfe\xff" "\0a",         4,  BatchEncoding::Utf8,    0 },
+    { "\xef\xbb",               2,  BatchEncoding::Utf8,    0 },
+    { "\xef\xbb\xbf",           3,  BatchEncoding::Utf8,    3 },
+    { "\xef\xbb\xbf" "dir",     6,  BatchEncoding::Utf8,    3 },
+    { "dir",                    3,  BatchEncoding::Utf8,    0 },
+};
+
+static bool
+CheckSplit()
+{
+    for (const SplitCase& c : c_split_cases)
+    {
+        BatchList list;
+        const bool ok = SplitBatchLines(Duplicate(c.text), list);
+        bool same = ok && list.count == c.count;
+        for (unsigned i = 0; same && i < c.count; ++i)
+            same = !wcscmp(list.lines[i], c.lines[i]);
+        FreeBatchList(list);
+        if (!same)
+        {
+            fprintf(stderr, "splitting \"%ls\" gave %u lines instead of %u.\n", c.text, list.count, c.count);
+            return false;
+        }
+    }
+
+    for (const BomCase& c : c_bom_cases)
+    {
+        size_t bom = 99;
+        const BatchEncoding encoding = DetectBatchEncoding(reinterpret_cast<const unsigned char*>(c.bytes), c.cb, bom);
+        if (encoding != c.encoding || bom != c.bom)
+        {
+            fprintf(stderr, "BOM detection failed for %zu bytes starting 0x%02x.\n", c.cb, c.cb ? unsigned(c.bytes[0] & 0xff) : 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Scheduling, with a fake launcher on a simulated clock.  Each command line
+// is "run <duration> <exit code>", or "missing", which fails to launch.
+
+enum : unsigned { c_err_missing = 2, c_err_wait = 6 };
+
+struct FakeProcess
+{
+    unsigned            index;
+    unsigned long long  end;
+    unsigned            exit_code;
+};
+
+struct Sim
+{
+    const BatchList*    list;
+    unsigned            jobs;
+    unsigned long long  now;
+    unsigned            running;
+    unsigned            peak;
+    unsigned            launched;
+    unsigned            next;               // The next line to be launched.
+    unsigned            closed;
+    unsigned            fail_wait_after;    // Fail the nth wait, or 0.
+    unsigned            waits;
+    bool                wait_failed;
+    unsigned*           reported;           // How many times each line was reported.
+    unsigned*           reported_exit;
+    unsigned*           reported_err;
+    unsigned long long* start;              // When each line was launched.
+    bool                ok;
+};
+
+static void*
+FakeLaunch(const wchar_t* line, unsigned& err, void* context)
+{
+    // Lines are launched in order.
+    Sim* const sim = static_cast<Sim*>(context);
+    const unsigned i = sim->next++;
+    if (i >= sim->list->count || sim->list->lines[i] != line)
+    {
+        sim->ok = false;
+        err = c_err_missing;
+        return nullptr;
+    }
+    sim->start[i] = sim->now;
+
+    unsigned duration = 0;
+    unsigned exit_code = 0;
+    if (swscanf(line, L"run %u %u", &duration, &exit_code) != 2)
+    {
+        err = c_err_missing;
+        return nullptr;
+    }
+
+    FakeProcess* process = new FakeProcess{ i, sim->now + duration, exit_code };
+    ++sim->running;
+    ++sim->launched;
+    if (sim->running > sim->peak)
+        sim->peak = sim->running;
+    return process;
+}
+
+static unsigned
+FakeWaitAny(void* const* processes, unsigned count, unsigned& exit_code, unsigned& err, void* context)
+{
+    Sim* const sim = static_cast<Sim*>(context);
+    if (sim->fail_wait_after && ++sim->waits >= sim->fail_wait_after && count > 1)
+    {
+        sim->wait_failed = true;
+        err = c_err_wait;
+        return count;
+    }
+
+    // The process that ends first (the first of them, on a tie).
+    unsigned found = 0;
+    for (unsigned i = 1; i < count; ++i)
+    {
+        if (static_cast<FakeProcess*>(processes[i])->end < static_cast<FakeProcess*>(processes[found])->end)
+            found = i;
+    }
+
+    FakeProcess* const process = static_cast<FakeProcess*>(processes[found]);
+    if (process->end > sim->now)
+        sim->now = process->end;
+    exit_code = process->exit_code;
+    return found;
+}
+
+static void
+FakeClose(void* process, void* context)
+{
+    Sim* const sim = static_cast<Sim*>(context);
+    --sim->running;
+    ++sim->closed;
+    delete static_cast<FakeProcess*>(process);
+}
+
+static void
+FakeReport(unsigned index, unsigned count, const wchar_t* line, unsigned exit_code, unsigned err, void* context)
+{
+    Sim* const sim = static_cast<Sim*>(context);
+    if (index >= sim->list->count || count != sim->list->count || line != sim->list->lines[index])
+    {
+        sim->ok = false;
+        return;
+    }
+    ++sim->reported[index];
+    sim->reported_exit[index] = exit_code;
+    sim->reported_err[index] = err;
+}
+
+// Builds a random batch.  Returns the expected exit code.
+static wchar_t*
+MakeBatch(unsigned count, unsigned& expected)
+{
+    const size_t max = count * 40 + 1;
+    wchar_t* text = static_cast<wchar_t*>(malloc(max * sizeof(*text)));
+    size_t len = 0;
+    expected = 0;
+    unsigned index = 0;
+    while (index < count)
+    {
+        if (!Random(6))
+        {
+            len += swprintf(text + len, max - len, Random(2) ? L"# comment\r\n" : L"\n");
+            continue;
+        }
+
+        unsigned exit_code = Random(5) ? 0 : 1 + Random(200);
+        if (!Random(12))
+        {
+            len += swprintf(text + len, max - len, L"  missing\r\n");
+            exit_code = unsigned(-1);
+        }
+        else
+        {
+            len += swprintf(text + len, max - len, L"run %u %u\n", Random(3) ? 1 + Random(50) : 1000, exit_code);
+        }
+        if (exit_code && !expected)
+            expected = exit_code;
+        ++index;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+// Greedy list scheduling, which is what RunBatchList should do:  each
+// command starts as soon as a slot is free.  Fills in each line's start.
+static void
+RefSchedule(const BatchList& list, unsigned jobs, unsigned long long* start)
+{
+    unsigned long long slots[c_batch_max_jobs] = {};
+    for (unsigned i = 0; i < list.count; ++i)
+    {
+        unsigned slot = 0;
+        for (unsigned s = 1; s < jobs; ++s)
+        {
+            if (slots[s] < slots[slot])
+                slot = s;
+        }
+        start[i] = slots[slot];
+
+        unsigned duration = 0;
+        unsigned exit_code = 0;
+        if (swscanf(list.lines[i], L"run %u %u", &duration, &exit_code) == 2)
+            slots[slot] += duration;
+    }
+}
+
+static bool
+RunSim(const BatchList& list, unsigned jobs, unsigned fail_wait_after, unsigned expected, const char* what)
+{
+    const unsigned clamped = jobs < 1 ? 1 : jobs > c_batch_max_jobs ? c_batch_max_jobs : jobs;
+    const unsigned n = list.count ? list.count : 1;
+    unsigned* const counts = static_cast<unsigned*>(calloc(n * 3, sizeof(*counts)));
+    unsigned long long* const start = static_cast<unsigned long long*>(calloc(n * 2, sizeof(*start)));
+
+    Sim sim = {};
+    sim.list = &list;
+    sim.jobs = clamped;
+    sim.fail_wait_after = fail_wait_after;
+    sim.reported = counts;
+    sim.reported_exit = counts + n;
+    sim.reported_err = counts + 2 * n;
+    sim.start = start;
+    sim.ok = true;
+
+    const BatchOps ops = { FakeLaunch, FakeWaitAny, FakeClose, FakeReport, &sim };
+    unsigned err = 0;
+    const unsigned exit_code = RunBatchList(list, jobs, ops, err);
+
+    bool ok = sim.ok && sim.peak <= clamped && sim.running == 0 && sim.closed == sim.launched;
+    if (!ok)
+        fprintf(stderr, "%s:  %u running at once with -j %u, %u left running.\n", what, sim.peak, clamped, sim.running);
+
+    if (ok && sim.wait_failed)
+    {
+        // Stops launching, but every command that was launched is reported.
+        ok = (exit_code == unsigned(-1) && err == c_err_wait);
+        for (unsigned i = 0; ok && i < list.count; ++i)
+            ok = (counts[i] <= 1);
+        if (!ok)
+            fprintf(stderr, "%s:  a failed wait returned %d (error %u).\n", what, int(exit_code), err);
+    }
+    else if (ok)
+    {
+        ok = (exit_code == expected);
+        if (!ok)
+            fprintf(stderr, "%s:  exit code %d instead of %d.\n", what, int(exit_code), int(expected));
+
+        RefSchedule(list, clamped, start + n);
+        for (unsigned i = 0; ok && i < list.count; ++i)
+        {
+            unsigned duration, code;
+            const bool missing = (swscanf(list.lines[i], L"run %u %u", &duration, &code) != 2);
+            ok = (counts[i] == 1 &&
+                  (missing ? (counts[n + i] == unsigned(-1) && counts[2 * n + i] == c_err_missing)
+                           : (counts[n + i] == code && !counts[2 * n + i])) &&
+                  start[i] == start[n + i]);
+            if (!ok)
+                fprintf(stderr, "%s:  line %u reported %u times, exit code %d, error %u, started at %llu instead of %llu.\n",
+                        what, i, counts[i], int(counts[n + i]), counts[2 * n + i], start[i], start[n + i]);
+        }
+    }
+
+    free(counts);
+    free(start);
+    return ok;
+}
+
+static bool
+CheckScheduler(unsigned batches)
+{
+    for (unsigned b = 0; b < batches; ++b)
+    {
+        unsigned expected;
+        BatchList list;
+        SplitBatchLines(MakeBatch(Random(4) ? Random(40) : 200 + Random(200), expected), list);
+
+        static const unsigned c_jobs[] = { 0, 1, 2, 3, 8, 64, 100 };
+        bool ok = true;
+        for (unsigned jobs : c_jobs)
+            ok = ok && RunSim(list, jobs, 0, expected, "random batch");
+        ok = ok && RunSim(list, 4, 1 + Random(10), expected, "failed wait");
+        FreeBatchList(list);
+        if (!ok)
+        {
+            fprintf(stderr, "(batch %u)\n", b);
+            return false;
+        }
+    }
+
+    // Equal commands make a known schedule:  100 of them in 8 slots take 13
+    // rounds.
+    wchar_t* text = static_cast<wchar_t*>(malloc(100 * 16 * sizeof(wchar_t)));
+    size_t len = 0;
+    for (unsigned i = 0; i < 100; ++i)
+        len += swprintf(text + len, 16, L"run 10 0\n");
+    BatchList list;
+    SplitBatchLines(text, list);
+    const unsigned long long end = 13 * 10;
+    Sim sim = {};
+    unsigned counts[300] = {};
+    unsigned long long start[100];
+    sim.list = &list;
+    sim.reported = counts;
+    sim.reported_exit = counts + 100;
+    sim.reported_err = counts + 200;
+    sim.start = start;
+    sim.ok = true;
+    const BatchOps ops = { FakeLaunch, FakeWaitAny, FakeClose, FakeReport, &sim };
+    unsigned err = 0;
+    const unsigned exit_code = RunBatchList(list, 8, ops, err);
+    FreeBatchList(list);
+    if (exit_code || sim.now != end || sim.peak != 8)
+    {
+        fprintf(stderr, "100 equal commands with -j 8 took %llu instead of %llu.\n", sim.now, end);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static void
+RunBench()
+{
+    // A large batch file, as the elevated sudo reads it.
+    const unsigned lines = 200000;
+    const wchar_t* const line = L"  icacls \"C:\\ProgramData\\App\\data\" /grant Users:R /T  \r\n";
+    const size_t line_len = wcslen(line);
+    wchar_t* const text = static_cast<wchar_t*>(malloc((lines * line_len + 1) * sizeof(wchar_t)));
+    for (unsigned i = 0; i < lines; ++i)
+        wmemcpy(text + i * line_len, line, line_len);
+    text[lines * line_len] = '\0';
+
+    unsigned long long start = NowMicroseconds();
+    BatchList list;
+    SplitBatchLines(text, list);
+    const unsigned long long split_us = NowMicroseconds() - start;
+
+    // Scheduling them as short fake commands measures the scheduler.
+    static const wchar_t c_run[] = L"run 1 0";
+    const size_t run_len = sizeof(c_run) / sizeof(*c_run);
+    wchar_t* const runs = static_cast<wchar_t*>(malloc(list.count * sizeof(c_run)));
+    for (unsigned i = 0; i < list.count; ++i)
+    {
+        wmemcpy(runs + i * run_len, c_run, run_len);
+        list.lines[i] = runs + i * run_len;
+    }
+
+    unsigned* const counts = static_cast<unsigned*>(calloc(list.count * 3, sizeof(*counts)));
+    unsigned long long* const starts = static_cast<unsigned long long*>(calloc(list.count, sizeof(*starts)));
+    Sim sim = {};
+    sim.list = &list;
+    sim.reported = counts;
+    sim.reported_exit = counts + list.count;
+    sim.reported_err = counts + 2 * list.count;
+    sim.start = starts;
+    sim.ok = true;
+    const BatchOps ops = { FakeLaunch, FakeWaitAny, FakeClose, FakeReport, &sim };
+    unsigned err = 0;
+    start = NowMicroseconds();
+    RunBatchList(list, 8, ops, err);
+    const unsigned long long run_us = NowMicroseconds() - start;
+
+    printf("%u lines:  split %.1f ns/line, scheduled with -j 8 in %.1f ns/command (with the fake launcher).\n",
+           lines, split_us * 1000.0 / lines, run_us * 1000.0 / lines);
+
+    free(counts);
+    free(starts);
+    free(runs);
+    FreeBatchList(list);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned batches = 300;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            batches = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: batchbench [-n batches] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!CheckSplit() || !CheckScheduler(batches))
+        return 1;
+    printf("checks passed (%u random batches).\n", batches);
+
+    RunBench();
+    return 0;
+}
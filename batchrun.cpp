@@ -0,0 +1,169 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+
+#include "batchrun.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+BatchEncoding
+DetectBatchEncoding(const unsigned char* p, size_t cb, size_t& bom)
+{
+    if (cb >= 2 && p[0] == 0xff && p[1] == 0xfe)
+    {
+        bom = 2;
+        return BatchEncoding::Utf16;
+    }
+
+    bom = (cb >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf) ? 3 : 0;
+    return BatchEncoding::Utf8;
+}
+
+static bool
+IsBatchSpace(wchar_t ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+bool
+SplitBatchLines(wchar_t* text, BatchList& list)
+{
+    list.buffer = text;
+    list.lines = nullptr;
+    list.count = 0;
+
+    // Count lines to size the pointer array in one allocation.
+    unsigned max_lines = 1;
+    for (const wchar_t* walk = text; *walk; ++walk)
+    {
+        if (*walk == '\n')
+            ++max_lines;
+    }
+
+    list.lines = static_cast<const wchar_t**>(malloc(max_lines * sizeof(*list.lines)));
+    if (!list.lines)
+        return false;
+
+    // Split in place, trimming whitespace and skipping blanks and comments.
+    wchar_t* walk = text;
+    while (*walk)
+    {
+        wchar_t* line = walk;
+        while (*walk && *walk != '\n')
+            ++walk;
+        wchar_t* end = walk;
+        if (*walk)
+            *(walk++) = '\0';
+
+        while (IsBatchSpace(*line))
+            ++line;
+        while (end > line && IsBatchSpace(end[-1]))
+            *(--end) = '\0';
+
+        if (*line && *line != '#')
+            list.lines[list.count++] = line;
+    }
+
+    return true;
+}
+
+void
+FreeBatchList(BatchList& list)
+{
+    free(list.buffer);
+    free(list.lines);
+    list.buffer = nullptr;
+    list.lines = nullptr;
+    list.count = 0;
+}
+
+// Tracks the first command in list order that failed, so no exit codes need
+// to be kept.
+struct BatchResult
+{
+    unsigned            first;
+    unsigned            exit_code;
+};
+
+static void
+Failed(BatchResult& result, unsigned index, unsigned exit_code)
+{
+    if (exit_code && index < result.first)
+    {
+        result.first = index;
+        result.exit_code = exit_code;
+    }
+}
+
+static void
+Finish(const BatchList& list, BatchResult& result, unsigned index, void* process, unsigned exit_code, const BatchOps& ops)
+{
+    Failed(result, index, exit_code);
+    ops.report(index, list.count, list.lines[index], exit_code, 0, ops.context);
+    ops.close(process, ops.context);
+}
+
+unsigned
+RunBatchList(const BatchList& list, unsigned jobs, const BatchOps& ops, unsigned& err)
+{
+    if (jobs < 1)
+        jobs = 1;
+    if (jobs > c_batch_max_jobs)
+        jobs = c_batch_max_jobs;
+
+    BatchResult result = { list.count, 0 };
+    void* running[c_batch_max_jobs];
+    unsigned indices[c_batch_max_jobs];
+    unsigned count = 0;
+    unsigned next = 0;
+
+    while (next < list.count || count)
+    {
+        while (next < list.count && count < jobs)
+        {
+            unsigned launch_err = 0;
+            void* process = ops.launch(list.lines[next], launch_err, ops.context);
+            if (process)
+            {
+                running[count] = process;
+                indices[count] = next;
+                ++count;
+            }
+            else
+            {
+                Failed(result, next, unsigned(-1));
+                ops.report(next, list.count, list.lines[next], unsigned(-1), launch_err, ops.context);
+            }
+            ++next;
+        }
+
+        if (!count)
+            continue;
+
+        unsigned exit_code = unsigned(-1);
+        const unsigned i = ops.wait_any(running, count, exit_code, err, ops.context);
+        if (i >= count)
+        {
+            // Should never happen; stop scheduling but still collect the
+            // commands that are running, one at a time.
+            for (unsigned j = 0; j < count; ++j)
+            {
+                unsigned ignored;
+                exit_code = unsigned(-1);
+                if (ops.wait_any(&running[j], 1, exit_code, ignored, ops.context) != 0)
+                    exit_code = unsigned(-1);
+                Finish(list, result, indices[j], running[j], exit_code, ops);
+            }
+            return unsigned(-1);
+        }
+
+        Finish(list, result, indices[i], running[i], exit_code, ops);
+
+        --count;
+        running[i] = running[count];
+        indices[i] = indices[count];
+    }
+
+    return result.exit_code;
+}
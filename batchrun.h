@@ -0,0 +1,62 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// The portable part of batch mode (see batch.h):  splitting the batch text
+// into command lines, and running them with a bounded number at once.
+// Starting and waiting for processes go through BatchOps, so batch.cpp runs
+// Windows processes and batchbench.cpp runs a fake launcher.
+
+enum : unsigned { c_batch_max_jobs = 64 };     // WaitForMultipleObjects' limit.
+
+struct BatchList
+{
+    wchar_t*            buffer = nullptr;
+    const wchar_t**     lines = nullptr;
+    unsigned            count = 0;
+};
+
+enum class BatchEncoding
+{
+    Utf16,                      // UTF-16 LE with a BOM.
+    Utf8,                       // UTF-8 (with or without a BOM), or else ANSI.
+};
+
+// Returns the encoding of the raw batch file, and the length of its BOM in
+// bom.
+BatchEncoding DetectBatchEncoding(const unsigned char* p, size_t cb, size_t& bom);
+
+// Splits the decoded text (allocated with malloc) into lines in place,
+// trimming whitespace and skipping blank lines and lines that start with #.
+// The list owns text afterwards, even if it fails.  Returns false if out of
+// memory.
+bool SplitBatchLines(wchar_t* text, BatchList& list);
+void FreeBatchList(BatchList& list);
+
+struct BatchOps
+{
+    // Starts a command line.  Returns its process, or nullptr with the
+    // reason in err.
+    void*               (*launch)(const wchar_t* line, unsigned& err, void* context);
+
+    // Waits for any of the processes to exit, and returns its index with its
+    // exit code.  Returns count with the reason in err if waiting failed.
+    unsigned            (*wait_any)(void* const* processes, unsigned count, unsigned& exit_code, unsigned& err, void* context);
+
+    void                (*close)(void* process, void* context);
+
+    // Reports how a command line ended.  If it could not be started, err is
+    // the reason and exit_code is -1.
+    void                (*report)(unsigned index, unsigned count, const wchar_t* line, unsigned exit_code, unsigned err, void* context);
+
+    void*               context;
+};
+
+// Runs the commands with at most jobs running at once.  Returns 0 if all
+// commands succeeded, otherwise the exit code of the first command (in list
+// order) that failed.  Returns -1 with the reason in err if waiting failed,
+// once the commands that were running have ended.
+unsigned RunBatchList(const BatchList& list, unsigned jobs, const BatchOps& ops, unsigned& err);
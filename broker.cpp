@@ -0,0 +1,457 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <strsafe.h>
+#include <stdlib.h>
+
+#include "broker.h"
+#include "coalesce.h"
+#include "jobrecord.h"
+#include "pipe.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// The wire protocol is in brokerwire.cpp; here its transport is the pipe.
+static bool
+TransferPipe(void* p, size_t cb, bool fWrite, void* context)
+{
+    return TransferExact(HANDLE(context), p, DWORD(cb), fWrite);
+}
+
+static BrokerLaunchProc s_launch = nullptr;
+static CRITICAL_SECTION s_csLaunch;
+
+// The pipe name is scoped to the user and the console session, so requests
+// from other users or sessions never reach the broker.  An elevated token
+// has the same user SID as its unelevated counterpart.
+static bool
+GetBrokerPipeName(WCHAR* pszName, size_t cchName, LPWSTR* ppszSid=nullptr)
+{
+    DWORD dwSession = 0;
+    if (!ProcessIdToSessionId(GetCurrentProcessId(), &dwSession))
+        return false;
+
+    LPWSTR pszSid = GetUserSidString();
+    if (!pszSid)
+        return false;
+
+    const bool ok = SUCCEEDED(StringCchPrintfW(pszName, cchName, L"\\\\.\\pipe\\sudo-broker-%u-%s", dwSession, pszSid));
+
+    if (ok && ppszSid)
+        *ppszSid = pszSid;
+    else
+        LocalFree(pszSid);
+    return ok;
+}
+
+// Only talk to a broker that is this same sudo.exe running elevated.  A
+// process at the same integrity level as the caller would let us query its
+// token, so a token we cannot query belongs to a more privileged process.
+static bool
+IsTrustedBroker(HANDLE hPipe)
+{
+    ULONG ulServerPID = 0;
+    if (!GetNamedPipeServerProcessId(hPipe, &ulServerPID))
+        return false;
+
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, ulServerPID);
+    if (!hProcess)
+        return false;
+
+    // A broker whose token can't be read is not trusted.
+
+    bool fTrusted = false;
+    HANDLE hToken;
+    if (IsSudoProcess(hProcess) && OpenProcessToken(hProcess, TOKEN_QUERY, &hToken))
+    {
+        TOKEN_ELEVATION elevation = {};
+        DWORD dummy;
+        fTrusted = (GetTokenInformation(hToken, TokenElevation, &elevation, sizeof(elevation), &dummy) &&
+                    elevation.TokenIsElevated);
+        CloseHandle(hToken);
+    }
+
+    CloseHandle(hProcess);
+    return fTrusted;
+}
+
+static bool
+ReceiveReply(const BrokerTransport& transport, BrokerReply& reply)
+{
+    switch (ReadBrokerReply(transport, reply))
+    {
+    case BrokerWireResult::Ok:
+        break;
+    case BrokerWireResult::TransferFailed:
+        return false;
+    default:
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+    if (reply.error)
+    {
+        SetLastError(reply.error);
+        return false;
+    }
+    return true;
+}
+
+BrokerResult
+BrokerSendRequest(const BrokerRequest& req, DWORD& dwExit, void (*pfnLaunched)(void* context), void* context)
+{
+    WCHAR szPipe[256];
+    if (!GetBrokerPipeName(szPipe, _countof(szPipe)))
+        return BrokerResult::Unavailable;
+
+    const size_t cchDir = req.pszDir ? wcslen(req.pszDir) : 0;
+    if (cchDir >= BROKER_MAX_STRING || wcslen(req.pszLine) >= BROKER_MAX_STRING)
+        return BrokerResult::Unavailable;
+
+    HANDLE hPipe;
+    while (true)
+    {
+        hPipe = CreateFileW(szPipe, GENERIC_READ|FILE_WRITE_DATA, 0, nullptr, OPEN_EXISTING,
+                            SECURITY_SQOS_PRESENT|SECURITY_IDENTIFICATION, nullptr);
+        if (hPipe != INVALID_HANDLE_VALUE)
+            break;
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(szPipe, 2000))
+            return BrokerResult::Unavailable;
+    }
+
+    if (!IsTrustedBroker(hPipe))
+    {
+        CloseHandle(hPipe);
+        return BrokerResult::Unavailable;
+    }
+
+    // Until the whole request is written, the broker cannot have launched
+    // anything, so it is still safe to fall back to a normal elevation.
+
+    const BrokerTransport transport = { TransferPipe, hPipe };
+    BrokerMessage msg = {};
+    msg.pid = req.dwPID;
+    msg.flags = req.dwFlags;
+    msg.job = req.dwJob;
+    msg.job_table = req.ullJobTable;
+    if (WriteBrokerRequest(transport, msg, req.pszDir, req.pszLine) != BrokerWireResult::Ok)
+    {
+        CloseHandle(hPipe);
+        return BrokerResult::Unavailable;
+    }
+
+    BrokerReply reply = {};
+    bool ok = ReceiveReply(transport, reply);
+    if (ok && pfnLaunched)
+        pfnLaunched(context);
+    ok = ok && ReceiveReply(transport, reply);
+    const DWORD err = GetLastError();
+    CloseHandle(hPipe);
+
+    if (!ok)
+    {
+        SetLastError(err);
+        return BrokerResult::Failed;
+    }
+
+    dwExit = reply.exit_code;
+    return BrokerResult::Launched;
+}
+
+bool
+BrokerSpawn(LPCWSTR pszModule, DWORD dwIdleSeconds)
+{
+    const size_t cch = wcslen(pszModule) + 64;
+    LPWSTR pszCmdLine = LPWSTR(malloc(cch * sizeof(*pszCmdLine)));
+    if (!pszCmdLine)
+        return false;
+
+    StringCchPrintfW(pszCmdLine, cch, L"\"%s\" --broker-serve %u", pszModule, dwIdleSeconds);
+
+    // Run from the system directory so the broker doesn't keep the caller's
+    // current directory in use.
+    WCHAR szSysDir[MAX_PATH];
+    const UINT cchSysDir = GetSystemDirectoryW(szSysDir, _countof(szSysDir));
+
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = {};
+    const bool ok = !!CreateProcessW(pszModule, pszCmdLine, nullptr, nullptr, false,
+                                     DETACHED_PROCESS|CREATE_NEW_PROCESS_GROUP, nullptr,
+                                     (cchSysDir && cchSysDir < _countof(szSysDir)) ? szSysDir : nullptr,
+                                     &si, &pi);
+    if (ok)
+    {
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+    }
+
+    free(pszCmdLine);
+    return ok;
+}
+
+bool
+BrokerWaitReady(HANDLE hElevated, DWORD dwTimeoutMs)
+{
+    WCHAR szPipe[256];
+    if (!GetBrokerPipeName(szPipe, _countof(szPipe)))
+        return false;
+
+    // The elevated sudo starts the broker before it launches its command,
+    // but may still exit before the broker's pipe exists.
+    const ULONGLONG ullStart = GetTickCount64();
+    while (!WaitNamedPipeW(szPipe, 50))
+    {
+        if (GetTickCount64() - ullStart >= dwTimeoutMs)
+            return false;
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            WaitForSingleObject(hElevated, 50);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// The queue that concurrent elevations coalesce in.  Only unelevated sudo
+// processes of the same user use it, so it is an ordinary named section in
+// the session's namespace.  Processes can't wait on each other's memory, so
+// a named event wakes them; a wake that is missed only costs one timeout.
+
+static HANDLE s_hQueueChanged = nullptr;
+
+static bool
+IsQueueProcessAlive(unsigned pid, void* /*context*/)
+{
+    HANDLE hProcess = OpenProcess(SYNCHRONIZE, false, pid);
+    if (!hProcess)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    const bool fAlive = (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT);
+    CloseHandle(hProcess);
+    return fAlive;
+}
+
+static void
+WaitQueue(std::atomic<unsigned>* word, unsigned expected, unsigned timeout_ms, void* /*context*/)
+{
+    if (word->load() != expected)
+        return;
+    if (WaitForSingleObject(s_hQueueChanged, timeout_ms < 50 ? timeout_ms : 50) == WAIT_OBJECT_0)
+        ResetEvent(s_hQueueChanged);
+}
+
+static void
+WakeQueue(std::atomic<unsigned>* /*word*/, void* /*context*/)
+{
+    SetEvent(s_hQueueChanged);
+}
+
+static const ElevationQueueOps c_queueOps = { IsQueueProcessAlive, WaitQueue, WakeQueue, nullptr };
+
+ElevationQueue*
+BrokerOpenQueue()
+{
+    static ElevationQueue s_queue(c_queueOps, GetCurrentProcessId());
+
+    LPWSTR pszSid = GetUserSidString();
+    if (!pszSid)
+        return nullptr;
+
+    WCHAR szSection[256];
+    WCHAR szEvent[256];
+    const bool fNames = (SUCCEEDED(StringCchPrintfW(szSection, _countof(szSection), L"Local\\sudo-queue-%s", pszSid)) &&
+                         SUCCEEDED(StringCchPrintfW(szEvent, _countof(szEvent), L"Local\\sudo-queue-%s-changed", pszSid)));
+    LocalFree(pszSid);
+    if (!fNames)
+        return nullptr;
+
+    // The section and the event stay open until the process exits.
+    const DWORD cbImage = DWORD(ElevationQueue::ImageSize());
+    HANDLE hSection = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, cbImage, szSection);
+    if (!hSection)
+        return nullptr;
+    void* pImage = MapViewOfFile(hSection, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, cbImage);
+    s_hQueueChanged = CreateEventW(nullptr, true, false, szEvent);
+    if (!pImage || !s_hQueueChanged || !s_queue.Attach(pImage, cbImage))
+    {
+        if (pImage)
+            UnmapViewOfFile(pImage);
+        if (s_hQueueChanged)
+            CloseHandle(s_hQueueChanged);
+        CloseHandle(hSection);
+        s_hQueueChanged = nullptr;
+        return nullptr;
+    }
+    return &s_queue;
+}
+
+// The broker has no console of its own.  It attaches to the client's console
+// just long enough to spawn the command, so the command inherits it.  Only
+// one console can be attached at a time, so launches are serialized.
+static HANDLE
+LaunchInConsole(const BrokerRequest& req)
+{
+    HANDLE hProcess = nullptr;
+    DWORD err = NOERROR;
+
+    EnterCriticalSection(&s_csLaunch);
+
+    FreeConsole();
+    if (!AttachConsole(req.dwPID))
+    {
+        err = GetLastError();
+    }
+    else
+    {
+        SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, true };
+        const DWORD dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE;
+        HANDLE hIn = CreateFileW(L"CONIN$", GENERIC_READ|GENERIC_WRITE, dwShare, &sa, OPEN_EXISTING, 0, 0);
+        HANDLE hOut = CreateFileW(L"CONOUT$", GENERIC_READ|GENERIC_WRITE, dwShare, &sa, OPEN_EXISTING, 0, 0);
+        SetStdHandle(STD_INPUT_HANDLE, hIn);
+        SetStdHandle(STD_OUTPUT_HANDLE, hOut);
+        SetStdHandle(STD_ERROR_HANDLE, hOut);
+
+        hProcess = s_launch(req);
+        if (!hProcess)
+            err = GetLastError();
+
+        SetStdHandle(STD_INPUT_HANDLE, nullptr);
+        SetStdHandle(STD_OUTPUT_HANDLE, nullptr);
+        SetStdHandle(STD_ERROR_HANDLE, nullptr);
+        if (hIn != INVALID_HANDLE_VALUE)
+            CloseHandle(hIn);
+        if (hOut != INVALID_HANDLE_VALUE)
+            CloseHandle(hOut);
+
+        FreeConsole();
+    }
+
+    LeaveCriticalSection(&s_csLaunch);
+
+    SetLastError(err);
+    return hProcess;
+}
+
+// Returns the process of a background job in hWatch, for the caller to
+// record how it ends once the client has its reply.
+static DWORD
+HandleRequest(const BrokerTransport& transport, DWORD& dwExit, JobRecord& job, HANDLE& hWatch)
+{
+    HANDLE hPipe = HANDLE(transport.context);
+    BrokerMessage msg;
+    switch (ReadBrokerHeader(transport, msg))
+    {
+    case BrokerWireResult::Ok:              break;
+    case BrokerWireResult::TransferFailed:  return GetLastError();
+    default:                                return ERROR_INVALID_DATA;
+    }
+
+    // The client may only attach the broker to its own console, and only
+    // from the broker's own session.
+    ULONG ulClientPID = 0;
+    DWORD dwClientSession = 0;
+    DWORD dwSession = 0;
+    if (!GetNamedPipeClientProcessId(hPipe, &ulClientPID) ||
+        ulClientPID != msg.pid ||
+        !ProcessIdToSessionId(ulClientPID, &dwClientSession) ||
+        !ProcessIdToSessionId(GetCurrentProcessId(), &dwSession) ||
+        dwClientSession != dwSession)
+        return ERROR_ACCESS_DENIED;
+
+    WCHAR* buffer = nullptr;
+    LPCWSTR pszDir = nullptr;
+    LPCWSTR pszLine = nullptr;
+    switch (ReadBrokerStrings(transport, msg, buffer, pszDir, pszLine))
+    {
+    case BrokerWireResult::Ok:              break;
+    case BrokerWireResult::NoMemory:        return ERROR_OUTOFMEMORY;
+    default:                                return GetLastError();
+    }
+
+    // The client waits for the reply, so its handle to the job table is
+    // still open.
+    if (msg.job && (msg.flags & BROKER_FLAG_BACKGROUND))
+        job.Adopt(msg.pid, msg.job_table, msg.job);
+
+    DWORD err = NOERROR;
+    const BrokerRequest req = { msg.pid, msg.flags, pszDir, pszLine };
+    HANDLE hProcess = LaunchInConsole(req);
+    if (!hProcess)
+    {
+        err = GetLastError();
+        job.Failed(err);
+    }
+    else
+    {
+        // The client may let the next queued request go now.  If it went
+        // away, the command still runs.
+        job.Launched(hProcess);
+        const BrokerReply launched = { BROKER_MAGIC };
+        WriteBrokerReply(transport, launched);
+
+        if (!(msg.flags & BROKER_FLAG_BACKGROUND))
+        {
+            WaitForSingleObject(hProcess, INFINITE);
+            GetExitCodeProcess(hProcess, &dwExit);
+        }
+        if (job.Id())
+            hWatch = hProcess;
+        else
+            CloseHandle(hProcess);
+    }
+
+    free(buffer);
+    return err;
+}
+
+static void
+ServeClient(HANDLE hPipe, void* /*context*/)
+{
+    const BrokerTransport transport = { TransferPipe, hPipe };
+    JobRecord job;
+    HANDLE hWatch = nullptr;
+    BrokerReply reply = { BROKER_MAGIC };
+    DWORD dwExit = 0;
+    reply.error = HandleRequest(transport, dwExit, job, hWatch);
+    reply.exit_code = dwExit;
+
+    if (WriteBrokerReply(transport, reply))
+        FlushFileBuffers(hPipe);
+
+    // Watching a background job keeps the broker alive, like serving a
+    // client does.
+    if (hWatch)
+    {
+        job.WaitForExit(hWatch);
+        CloseHandle(hWatch);
+    }
+}
+
+static bool
+IsBrokerIdle(ULONGLONG ullIdleMs, void* context)
+{
+    return ullIdleMs >= ULONGLONG(*static_cast<const DWORD*>(context)) * 1000;
+}
+
+int
+BrokerServe(DWORD dwIdleSeconds, BrokerLaunchProc launch)
+{
+    WCHAR szPipe[256];
+    LPWSTR pszSid = nullptr;
+    if (!GetBrokerPipeName(szPipe, _countof(szPipe), &pszSid))
+        return 1;
+
+    // Only the invoking user (and SYSTEM and Administrators) may connect.
+    // Clients get read and write-data access, but not FILE_CREATE_PIPE_INSTANCE,
+    // so they cannot impersonate the broker by creating more instances.  The
+    // medium label lets the unelevated clients write to the elevated pipe.
+    WCHAR szSddl[256];
+    const bool fSddl = SUCCEEDED(StringCchPrintfW(szSddl, _countof(szSddl), L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x0012019b;;;%s)S:(ML;;NW;;;ME)", pszSid));
+    LocalFree(pszSid);
+    if (!fSddl)
+        return 1;
+
+    s_launch = launch;
+    InitializeCriticalSection(&s_csLaunch);
+
+    const PipeServerOps ops = { ServeClient, IsBrokerIdle, &dwIdleSeconds };
+    return ServePipe(szPipe, szSddl, ops) ? 0 : 1;
+}
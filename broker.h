@@ -0,0 +1,61 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// The broker is an opt-in elevated helper process.  The first elevated sudo
+// spawns it, and it stays alive until it has been idle for a timeout.  While
+// it is alive, later sudo invocations from the same user and console session
+// send their launch requests to it over a named pipe, which avoids another
+// consent prompt and two more process startups.
+//
+// Sudo invocations that find no broker and start at about the same time
+// coalesce (see coalesce.h):  the first elevates and the rest wait for its
+// broker, instead of each showing a consent prompt.
+
+#include "brokerwire.h"
+
+class ElevationQueue;
+
+struct BrokerRequest
+{
+    DWORD       dwPID;          // Client process (whose console to attach to).
+    DWORD       dwFlags;        // BROKER_FLAG_* values.
+    LPCWSTR     pszDir;         // Absolute directory for the command.
+    LPCWSTR     pszLine;        // Command line to run.
+    DWORD       dwJob;          // The -b job's ID (see jobrecord.h), or 0.
+    ULONGLONG   ullJobTable;    // The client's handle to the job table.
+};
+
+enum class BrokerResult
+{
+    Unavailable,                // No broker; elevate the normal way.
+    Launched,                   // The broker ran the command.
+    Failed,                     // The broker failed; see GetLastError().
+};
+
+// Launches a command in the calling process's console and returns a process
+// handle, or returns nullptr and sets the last error.  The broker supplies
+// the console; the callback only needs to spawn the process.
+typedef HANDLE (*BrokerLaunchProc)(const BrokerRequest& req);
+
+// Client side:  sends the request to a running broker and waits for the exit
+// code (unless BROKER_FLAG_BACKGROUND is set).  Calls pfnLaunched, if given,
+// as soon as the broker has launched the command.
+BrokerResult BrokerSendRequest(const BrokerRequest& req, DWORD& dwExit,
+                               void (*pfnLaunched)(void* context)=nullptr, void* context=nullptr);
+
+// Client side:  opens the queue shared by this user's sudo processes in the
+// session, or returns nullptr.
+ElevationQueue* BrokerOpenQueue();
+
+// Client side:  after elevating, waits up to dwTimeoutMs for the broker that
+// the elevated sudo (hElevated) starts.
+bool BrokerWaitReady(HANDLE hElevated, DWORD dwTimeoutMs);
+
+// Elevated side:  starts a detached broker process, unless one is already
+// running for this user and session.
+bool BrokerSpawn(LPCWSTR pszModule, DWORD dwIdleSeconds);
+
+// Broker process:  serves requests until idle for dwIdleSeconds.
+int BrokerServe(DWORD dwIdleSeconds, BrokerLaunchProc launch);
@@ -0,0 +1,516 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for the broker's wire protocol, with a Unix socket
+// standing in for the named pipe.
+//
+// The stand-in broker serves each client the way broker.cpp does, in its own
+// process:  it reads the header, checks the client's process ID against the
+// socket's peer (SO_PEERCRED, for GetNamedPipeClientProcessId), reads the
+// strings, launches the command (a forked child that exits with a code
+// derived from the directory and command line), replies once it launched,
+// and replies again with the exit code.  The checker sends requests from
+// many clients at once with random strings up to the longest allowed, and
+// checks each exit code, and it checks that malformed, truncated, and
+// spoofed requests get an error reply without disturbing the broker.  The
+// benchmark compares a request to the broker with the two process startups
+// of an elevation.
+//
+//      g++ -std=c++17 -O2 brokerbench.cpp brokerwire.cpp -o brokerbench
+//      ./brokerbench [-n requests] [-c clients]
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "brokerwire.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static char s_path[108];
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool
+TransferSocket(void* p, size_t cb, bool write, void* context)
+{
+    const int fd = int(intptr_t(context));
+    char* bytes = static_cast<char*>(p);
+    while (cb)
+    {
+        const ssize_t n = write ? send(fd, bytes, cb, MSG_NOSIGNAL) : recv(fd, bytes, cb, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        cb -= size_t(n);
+    }
+    return true;
+}
+
+// The exit code the stand-in command exits with, so the client can tell
+// whether the broker got its strings intact.
+static unsigned
+ExitCodeFor(const wchar_t* dir, const wchar_t* line)
+{
+    unsigned hash = 2166136261u;
+    for (const wchar_t* s = dir ? dir : L""; *s; ++s)
+        hash = (hash ^ unsigned(*s)) * 16777619u;
+    hash = (hash ^ '|') * 16777619u;
+    for (const wchar_t* s = line; *s; ++s)
+        hash = (hash ^ unsigned(*s)) * 16777619u;
+    return (hash >> 8) & 0x7f;
+}
+
+static const wchar_t c_missing[] = L"missing.exe";  // Fails to launch.
+static const wchar_t c_sleeper[] = L"sleeper.exe";  // Runs for a while.
+
+//------------------------------------------------------------------------------
+// Stand-in broker.
+
+static unsigned
+HandleRequest(const BrokerTransport& transport, unsigned& exit_code)
+{
+    const int fd = int(intptr_t(transport.context));
+    BrokerMessage msg;
+    switch (ReadBrokerHeader(transport, msg))
+    {
+    case BrokerWireResult::Ok:              break;
+    case BrokerWireResult::TransferFailed:  return EPIPE;
+    default:                                return EINVAL;
+    }
+
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || unsigned(cred.pid) != msg.pid)
+        return EACCES;
+
+    wchar_t* buffer = nullptr;
+    const wchar_t* dir = nullptr;
+    const wchar_t* line = nullptr;
+    switch (ReadBrokerStrings(transport, msg, buffer, dir, line))
+    {
+    case BrokerWireResult::Ok:              break;
+    case BrokerWireResult::NoMemory:        return ENOMEM;
+    default:                                return EPIPE;
+    }
+
+    const bool missing = !wcscmp(line, c_missing);
+    const bool sleeper = !wcscmp(line, c_sleeper);
+    const unsigned code = ExitCodeFor(dir, line);
+    free(buffer);
+    if (missing)
+        return ENOENT;
+
+    const pid_t child = fork();
+    if (child < 0)
+        return unsigned(errno);
+    if (!child)
+    {
+        if (sleeper)
+            usleep(300 * 1000);
+        _exit(int(code));
+    }
+
+    const BrokerReply launched = { BROKER_MAGIC, 0, 0 };
+    WriteBrokerReply(transport, launched);
+
+    if (!(msg.flags & BROKER_FLAG_BACKGROUND))
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        exit_code = WIFEXITED(status) ? unsigned(WEXITSTATUS(status)) : unsigned(-1);
+    }
+    return 0;
+}
+
+static void
+ServeClient(int fd)
+{
+    const BrokerTransport transport = { TransferSocket, reinterpret_cast<void*>(intptr_t(fd)) };
+    BrokerReply reply = { BROKER_MAGIC, 0, 0 };
+    reply.error = HandleRequest(transport, reply.exit_code);
+    WriteBrokerReply(transport, reply);
+    close(fd);
+}
+
+static pid_t
+StartBroker()
+{
+    snprintf(s_path, sizeof(s_path), "/tmp/brokerbench-%d.sock", int(getpid()));
+    unlink(s_path);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, s_path);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(listener, 128))
+    {
+        perror("broker socket");
+        return -1;
+    }
+
+    const pid_t broker = fork();
+    if (broker)
+    {
+        close(listener);
+        return broker;
+    }
+
+    // Each client is served in its own process, as the broker serves each on
+    // its own thread.  Those processes are not waited for.
+    signal(SIGCHLD, SIG_IGN);
+    while (true)
+    {
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+        if (!fork())
+        {
+            close(listener);
+            signal(SIGCHLD, SIG_DFL);
+            ServeClient(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
+
+static void
+StopBroker(pid_t broker)
+{
+    kill(broker, SIGTERM);
+    waitpid(broker, nullptr, 0);
+    unlink(s_path);
+}
+
+//------------------------------------------------------------------------------
+// Client.
+
+static int
+Connect()
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, s_path);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct Outcome
+{
+    BrokerWireResult    sent;
+    bool                launched;       // Got the reply that says it launched.
+    unsigned            error;
+    unsigned            exit_code;
+};
+
+// Follows BrokerSendRequest.  If pid is 0, the request claims the client's
+// own process ID.
+static Outcome
+SendRequest(unsigned flags, const wchar_t* dir, const wchar_t* line, unsigned pid=0)
+{
+    Outcome outcome = { BrokerWireResult::TransferFailed, false, 0, 0 };
+    const int fd = Connect();
+    if (fd < 0)
+        return outcome;
+
+    const BrokerTransport transport = { TransferSocket, reinterpret_cast<void*>(intptr_t(fd)) };
+    BrokerMessage msg = {};
+    msg.pid = pid ? pid : unsigned(getpid());
+    msg.flags = flags;
+    outcome.sent = WriteBrokerRequest(transport, msg, dir, line);
+    if (outcome.sent == BrokerWireResult::Ok)
+    {
+        BrokerReply reply = {};
+        if (ReadBrokerReply(transport, reply) == BrokerWireResult::Ok)
+        {
+            outcome.error = reply.error;
+            outcome.launched = !reply.error;
+            if (!reply.error && ReadBrokerReply(transport, reply) == BrokerWireResult::Ok)
+            {
+                outcome.error = reply.error;
+                outcome.exit_code = reply.exit_code;
+            }
+            else if (!reply.error)
+            {
+                outcome.sent = BrokerWireResult::TransferFailed;
+            }
+        }
+        else
+        {
+            outcome.sent = BrokerWireResult::TransferFailed;
+        }
+    }
+    close(fd);
+    return outcome;
+}
+
+// Sends raw bytes and returns the error in the broker's reply, or -1 if
+// there was no reply.
+static int
+SendRaw(const void* p, size_t cb, bool shut)
+{
+    const int fd = Connect();
+    if (fd < 0)
+        return -1;
+    const BrokerTransport transport = { TransferSocket, reinterpret_cast<void*>(intptr_t(fd)) };
+    int error = -1;
+    BrokerReply reply = {};
+    if (TransferSocket(const_cast<void*>(p), cb, true, transport.context))
+    {
+        if (shut)
+            shutdown(fd, SHUT_WR);
+        if (ReadBrokerReply(transport, reply) == BrokerWireResult::Ok)
+            error = int(reply.error);
+    }
+    close(fd);
+    return error;
+}
+
+static void
+RandomString(wchar_t* s, unsigned len)
+{
+    for (unsigned i = 0; i < len; ++i)
+    {
+        // Mostly ASCII, with some wider characters (but no surrogates).
+        s[i] = Random(8) ? wchar_t(0x20 + Random(0x5f)) : wchar_t(0xa0 + Random(0xd700 - 0xa0));
+    }
+    s[len] = '\0';
+}
+
+//------------------------------------------------------------------------------
+// Checks.
+
+static bool
+RunClient(unsigned index, unsigned requests)
+{
+    s_seed = 7919 * (index + 1);
+    static wchar_t dir[BROKER_MAX_STRING];
+    static wchar_t line[BROKER_MAX_STRING];
+    for (unsigned i = 0; i < requests; ++i)
+    {
+        // Now and then a string as long as the protocol allows.
+        const unsigned max = BROKER_MAX_STRING - 1;
+        const unsigned cch_dir = Random(4) ? Random(300) : (Random(2) ? max : Random(max));
+        const unsigned cch_line = 1 + (Random(4) ? Random(300) : Random(max));
+        RandomString(dir, cch_dir);
+        RandomString(line, cch_line);
+
+        const Outcome outcome = SendRequest(0, cch_dir ? dir : nullptr, line);
+        if (outcome.sent != BrokerWireResult::Ok || !outcome.launched || outcome.error ||
+            outcome.exit_code != ExitCodeFor(cch_dir ? dir : nullptr, line))
+        {
+            fprintf(stderr, "client %u request %u (%u, %u chars):  error %u, exit code %u.\n",
+                    index, i, cch_dir, cch_line, outcome.error, outcome.exit_code);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+CheckRoundTrips(unsigned clients, unsigned requests)
+{
+    pid_t pids[64];
+    for (unsigned i = 0; i < clients; ++i)
+    {
+        pids[i] = fork();
+        if (!pids[i])
+            _exit(RunClient(i, requests) ? 0 : 1);
+    }
+
+    bool ok = true;
+    for (unsigned i = 0; i < clients; ++i)
+    {
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        ok = ok && WIFEXITED(status) && !WEXITSTATUS(status);
+    }
+    if (!ok)
+        fprintf(stderr, "round trips failed.\n");
+    return ok;
+}
+
+static bool
+Expect(bool ok, const char* what)
+{
+    if (!ok)
+        fprintf(stderr, "%s failed.\n", what);
+    return ok;
+}
+
+static bool
+CheckMalformed()
+{
+    const BrokerMessage good = { BROKER_MAGIC, BROKER_VERSION, unsigned(getpid()), 0, 0, 2, 0, 0 };
+    BrokerMessage msg;
+    bool ok = true;
+
+    msg = good;
+    msg.magic ^= 1;
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EINVAL, "wrong magic") && ok;
+    msg = good;
+    msg.version = BROKER_VERSION + 1;
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EINVAL, "wrong version") && ok;
+    msg = good;
+    msg.cch_line = BROKER_MAX_STRING;
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EINVAL, "line too long") && ok;
+    msg = good;
+    msg.cch_dir = 0x80000000;
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EINVAL, "dir too long") && ok;
+    msg = good;
+    msg.cch_line = 0;
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EINVAL, "empty line") && ok;
+    msg = good;
+    msg.pid = unsigned(getppid());
+    ok = Expect(SendRaw(&msg, sizeof(msg), false) == EACCES, "another process's ID") && ok;
+
+    // Truncated in the header, and in the strings.
+    ok = Expect(SendRaw(&good, sizeof(good) / 2, true) == EPIPE, "truncated header") && ok;
+    struct { BrokerMessage msg; unsigned short line[1]; } partial = { good, { 'x' } };
+    ok = Expect(SendRaw(&partial, sizeof(partial.msg) + sizeof(partial.line), true) == EPIPE, "truncated line") && ok;
+
+    // The client refuses strings that are too long, without sending anything.
+    static wchar_t line[BROKER_MAX_STRING + 1];
+    wmemset(line, 'x', BROKER_MAX_STRING);
+    line[BROKER_MAX_STRING] = '\0';
+    ok = Expect(SendRequest(0, nullptr, line).sent == BrokerWireResult::Invalid, "sending too long a line") && ok;
+
+    // A spoofed process ID through the real client path.
+    const Outcome spoofed = SendRequest(0, nullptr, L"cmd.exe", unsigned(getppid()));
+    ok = Expect(!spoofed.launched && spoofed.error == EACCES, "spoofed client") && ok;
+
+    // A launch failure is the only reply.
+    const Outcome missing = SendRequest(0, L"C:\\", c_missing);
+    ok = Expect(missing.sent == BrokerWireResult::Ok && !missing.launched && missing.error == ENOENT, "launch failure") && ok;
+
+    // And the broker still serves well formed requests afterwards.
+    const Outcome after = SendRequest(0, L"C:\\", L"cmd.exe /c ver");
+    ok = Expect(after.launched && after.exit_code == ExitCodeFor(L"C:\\", L"cmd.exe /c ver"), "request after errors") && ok;
+    return ok;
+}
+
+static bool
+CheckBackground()
+{
+    // A background command's exit code is not waited for, so the second
+    // reply comes at once.
+    const unsigned long long start = NowMicroseconds();
+    const Outcome outcome = SendRequest(BROKER_FLAG_BACKGROUND, nullptr, c_sleeper);
+    const unsigned long long elapsed = NowMicroseconds() - start;
+    if (!Expect(outcome.launched && !outcome.error && !outcome.exit_code, "background request"))
+        return false;
+    return Expect(elapsed < 200 * 1000, "background reply without waiting");
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static void
+RunBench(unsigned requests)
+{
+    const wchar_t* const dir = L"C:\\Users\\Me\\src\\project";
+    const wchar_t* const line = L"msbuild project.sln /t:Rebuild /p:Configuration=Release";
+
+    unsigned long long start = NowMicroseconds();
+    for (unsigned i = 0; i < requests; ++i)
+        SendRequest(0, dir, line);
+    const unsigned long long broker_us = NowMicroseconds() - start;
+
+    // Elevating without a broker starts two sudo processes (the caller's
+    // sudo already runs); here each is an exec of this program.
+    start = NowMicroseconds();
+    for (unsigned i = 0; i < requests; ++i)
+    {
+        const pid_t pid = fork();
+        if (!pid)
+        {
+            execl("/proc/self/exe", "brokerbench", "--hop", "2", static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    const unsigned long long hop_us = NowMicroseconds() - start;
+
+    printf("%u requests, each also launching a stand-in command:\n", requests);
+    printf("  broker request         %8.1f us\n", double(broker_us) / requests);
+    printf("  two process startups   %8.1f us\n", double(hop_us) / requests);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned requests = 500;
+    unsigned clients = 8;
+
+    if (argc == 3 && !strcmp(argv[1], "--hop"))
+    {
+        if (atoi(argv[2]) > 1)
+            execl("/proc/self/exe", "brokerbench", "--hop", "1", static_cast<char*>(nullptr));
+        return 0;
+    }
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            requests = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            clients = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: brokerbench [-n requests] [-c clients]\n");
+            return 1;
+        }
+    }
+
+    if (!requests || !clients || clients > 64)
+        return 1;
+
+    const pid_t broker = StartBroker();
+    if (broker < 0)
+        return 1;
+
+    const bool ok = CheckRoundTrips(clients, requests / clients + 1) && CheckMalformed() && CheckBackground();
+    if (ok)
+    {
+        printf("checks passed (%u clients).\n", clients);
+        RunBench(requests);
+    }
+
+    StopBroker(broker);
+    return ok ? 0 : 1;
+}
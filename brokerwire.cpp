@@ -0,0 +1,117 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "brokerwire.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static_assert(sizeof(wchar_t) == 2 || sizeof(wchar_t) == 4, "unexpected wchar_t");
+
+// The strings are UTF-16 on the wire.  Where wchar_t is wider (Linux), each
+// character is narrowed or widened as it moves; sudo itself never needs to.
+static bool
+TransferString(const BrokerTransport& transport, wchar_t* s, unsigned cch, bool write)
+{
+    if (sizeof(wchar_t) == 2)
+        return !cch || transport.transfer(s, cch * sizeof(wchar_t), write, transport.context);
+
+    unsigned short chunk[256];
+    while (cch)
+    {
+        const unsigned n = cch < 256 ? cch : 256;
+        if (write)
+        {
+            for (unsigned i = 0; i < n; ++i)
+                chunk[i] = static_cast<unsigned short>(s[i]);
+        }
+        if (!transport.transfer(chunk, n * sizeof(*chunk), write, transport.context))
+            return false;
+        if (!write)
+        {
+            for (unsigned i = 0; i < n; ++i)
+                s[i] = wchar_t(chunk[i]);
+        }
+        s += n;
+        cch -= n;
+    }
+    return true;
+}
+
+BrokerWireResult
+WriteBrokerRequest(const BrokerTransport& transport, BrokerMessage& msg, const wchar_t* dir, const wchar_t* line)
+{
+    const size_t cch_dir = dir ? wcslen(dir) : 0;
+    const size_t cch_line = wcslen(line);
+    if (cch_dir >= BROKER_MAX_STRING || cch_line >= BROKER_MAX_STRING)
+        return BrokerWireResult::Invalid;
+
+    msg.magic = BROKER_MAGIC;
+    msg.version = BROKER_VERSION;
+    msg.cch_dir = unsigned(cch_dir);
+    msg.cch_line = unsigned(cch_line);
+
+    if (!transport.transfer(&msg, sizeof(msg), true, transport.context) ||
+        !TransferString(transport, const_cast<wchar_t*>(dir), msg.cch_dir, true) ||
+        !TransferString(transport, const_cast<wchar_t*>(line), msg.cch_line, true))
+        return BrokerWireResult::TransferFailed;
+    return BrokerWireResult::Ok;
+}
+
+BrokerWireResult
+ReadBrokerHeader(const BrokerTransport& transport, BrokerMessage& msg)
+{
+    if (!transport.transfer(&msg, sizeof(msg), false, transport.context))
+        return BrokerWireResult::TransferFailed;
+
+    if (msg.magic != BROKER_MAGIC ||
+        msg.version != BROKER_VERSION ||
+        msg.cch_dir >= BROKER_MAX_STRING ||
+        msg.cch_line >= BROKER_MAX_STRING ||
+        !msg.cch_line)
+        return BrokerWireResult::Invalid;
+    return BrokerWireResult::Ok;
+}
+
+BrokerWireResult
+ReadBrokerStrings(const BrokerTransport& transport, const BrokerMessage& msg,
+                  wchar_t*& buffer, const wchar_t*& dir, const wchar_t*& line)
+{
+    buffer = static_cast<wchar_t*>(malloc((msg.cch_dir + 1 + msg.cch_line + 1) * sizeof(wchar_t)));
+    if (!buffer)
+        return BrokerWireResult::NoMemory;
+
+    wchar_t* const dir_buf = buffer;
+    wchar_t* const line_buf = buffer + msg.cch_dir + 1;
+    if (!TransferString(transport, dir_buf, msg.cch_dir, false) ||
+        !TransferString(transport, line_buf, msg.cch_line, false))
+    {
+        free(buffer);
+        buffer = nullptr;
+        return BrokerWireResult::TransferFailed;
+    }
+
+    dir_buf[msg.cch_dir] = '\0';
+    line_buf[msg.cch_line] = '\0';
+    dir = msg.cch_dir ? dir_buf : nullptr;
+    line = line_buf;
+    return BrokerWireResult::Ok;
+}
+
+bool
+WriteBrokerReply(const BrokerTransport& transport, const BrokerReply& reply)
+{
+    return transport.transfer(const_cast<BrokerReply*>(&reply), sizeof(reply), true, transport.context);
+}
+
+BrokerWireResult
+ReadBrokerReply(const BrokerTransport& transport, BrokerReply& reply)
+{
+    if (!transport.transfer(&reply, sizeof(reply), false, transport.context))
+        return BrokerWireResult::TransferFailed;
+    if (reply.magic != BROKER_MAGIC)
+        return BrokerWireResult::Invalid;
+    return BrokerWireResult::Ok;
+}
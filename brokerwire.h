@@ -0,0 +1,86 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// The broker's wire protocol (see broker.h), apart from the transport.  A
+// request is a fixed header followed by the directory and the command line
+// as UTF-16 (without terminators).  The broker replies once the command is
+// launched, and again once it exits; if launching fails, the only reply has
+// the error.  Both ends are the same sudo.exe, but the version still guards
+// against a broker left running across an upgrade.
+//
+// The bytes move through a BrokerTransport, which is a named pipe in
+// broker.cpp, so the same code runs over a Unix socket in brokerbench.cpp.
+
+enum : unsigned
+{
+    BROKER_MAGIC                = 0x4b524253,  // 'SBRK'
+    BROKER_VERSION              = 3,
+    BROKER_MAX_STRING           = 32768,
+};
+
+enum : unsigned
+{
+    BROKER_FLAG_BACKGROUND      = 0x0001,
+    BROKER_FLAG_DEBUG           = 0x0002,
+    BROKER_FLAG_DIRECT          = 0x0004,
+    BROKER_FLAG_SHELL           = 0x0008,
+};
+
+struct BrokerMessage
+{
+    unsigned            magic;
+    unsigned            version;
+    unsigned            pid;
+    unsigned            flags;          // BROKER_FLAG_* values.
+    unsigned            cch_dir;
+    unsigned            cch_line;
+    unsigned            job;
+    unsigned long long  job_table;
+};
+
+struct BrokerReply
+{
+    unsigned            magic;
+    unsigned            error;          // Nonzero if launching failed.
+    unsigned            exit_code;
+};
+
+struct BrokerTransport
+{
+    // Reads or writes exactly cb bytes.  Returns false on failure.
+    bool                (*transfer)(void* p, size_t cb, bool write, void* context);
+    void*               context;
+};
+
+enum class BrokerWireResult
+{
+    Ok,
+    TransferFailed,             // See the transport's error.
+    Invalid,                    // Malformed, or a different version.
+    NoMemory,
+};
+
+// Client side:  fills in the header's magic, version, and lengths, and sends
+// it with the strings.  dir may be nullptr.  Fails without sending anything
+// if a string is BROKER_MAX_STRING characters or longer.
+BrokerWireResult WriteBrokerRequest(const BrokerTransport& transport, BrokerMessage& msg,
+                                    const wchar_t* dir, const wchar_t* line);
+
+// Broker side:  receives and validates the header.  The caller checks who
+// the client is before reading the strings.
+BrokerWireResult ReadBrokerHeader(const BrokerTransport& transport, BrokerMessage& msg);
+
+// Broker side:  receives the strings that follow the header, in one
+// allocation that the caller frees with free().  dir is nullptr if the
+// request has none.
+BrokerWireResult ReadBrokerStrings(const BrokerTransport& transport, const BrokerMessage& msg,
+                                   wchar_t*& buffer, const wchar_t*& dir, const wchar_t*& line);
+
+// Either side:  sends or receives a reply.  A received reply with the wrong
+// magic is Invalid; its error is left for the caller to check.
+bool WriteBrokerReply(const BrokerTransport& transport, const BrokerReply& reply);
+BrokerWireResult ReadBrokerReply(const BrokerTransport& transport, BrokerReply& reply);
@@ -0,0 +1,428 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+
+#include "cmdline.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static bool
+IsArgSpace(wchar_t c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static bool
+NeedsQuotes(const wchar_t* arg)
+{
+    if (!*arg)
+        return true;
+    for (; *arg; ++arg)
+    {
+        if (*arg == ' ' || *arg == '\t' || *arg == '\n' || *arg == '\v' || *arg == '"')
+            return true;
+    }
+    return false;
+}
+
+static size_t
+StrLen(const wchar_t* s)
+{
+    size_t len = 0;
+    while (s[len])
+        ++len;
+    return len;
+}
+
+static size_t
+NumberLength(unsigned number)
+{
+    size_t len = 1;
+    while (number >= 10)
+    {
+        number /= 10;
+        ++len;
+    }
+    return len;
+}
+
+static wchar_t*
+AppendNumber(wchar_t* out, unsigned number)
+{
+    wchar_t* end = out + NumberLength(number);
+    wchar_t* p = end;
+    do
+    {
+        *(--p) = wchar_t('0' + number % 10);
+        number /= 10;
+    }
+    while (number);
+    return end;
+}
+
+static wchar_t*
+AppendBackslashes(wchar_t* out, size_t count)
+{
+    while (count--)
+        *(out++) = '\\';
+    return out;
+}
+
+const wchar_t*
+ScanCommandArg(const wchar_t* p, wchar_t*& out)
+{
+    bool quote = false;
+    while (true)
+    {
+        size_t backslashes = 0;
+        while (*p == '\\')
+        {
+            ++backslashes;
+            ++p;
+        }
+
+        if (*p == '"')
+        {
+            if (out)
+                out = AppendBackslashes(out, backslashes / 2);
+            if (backslashes & 1)
+            {
+                if (out)
+                    *(out++) = '"';
+            }
+            else if (quote && p[1] == '"')
+            {
+                // CommandLineToArgvW ends the quoted section here.
+                if (out)
+                    *(out++) = '"';
+                quote = false;
+                ++p;
+            }
+            else
+            {
+                quote = !quote;
+            }
+            ++p;
+            continue;
+        }
+
+        if (out)
+            out = AppendBackslashes(out, backslashes);
+
+        if (!*p || (!quote && IsArgSpace(*p)))
+            break;
+
+        if (out)
+            *(out++) = *p;
+        ++p;
+    }
+    return p;
+}
+
+const wchar_t*
+ScanProgramName(const wchar_t* p, wchar_t*& out)
+{
+    bool quote = false;
+    for (; *p; ++p)
+    {
+        if (*p == '"')
+            quote = !quote;
+        else if (!quote && IsArgSpace(*p))
+            break;
+        else if (out)
+            *(out++) = *p;
+    }
+    return p;
+}
+
+static wchar_t
+ToLower(wchar_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? wchar_t(c - 'A' + 'a') : c;
+}
+
+// CMD treats these as the end of a built-in command's name, as in "cd.." or
+// "echo.".
+static bool
+IsBuiltinDelimiter(wchar_t c)
+{
+    return !c || IsArgSpace(c) || c == '.' || c == '/' || c == '\\' || c == ':' ||
+           c == ';' || c == ',' || c == '=' || c == '+' || c == '[' || c == ']';
+}
+
+static bool
+IsBuiltin(const wchar_t* name)
+{
+    static const char* const c_builtins[] =
+    {
+        "assoc", "break", "call", "cd", "chdir", "cls", "color", "copy",
+        "date", "del", "dir", "dpath", "echo", "endlocal", "erase", "exit",
+        "for", "ftype", "goto", "if", "keys", "md", "mkdir", "mklink", "move",
+        "path", "pause", "popd", "prompt", "pushd", "rd", "rem", "ren",
+        "rename", "rmdir", "set", "setlocal", "shift", "start", "time",
+        "title", "type", "ver", "verify", "vol",
+    };
+
+    for (const char* builtin : c_builtins)
+    {
+        const wchar_t* p = name;
+        const char* s = builtin;
+        while (*s && ToLower(*p) == wchar_t(*s))
+        {
+            ++p;
+            ++s;
+        }
+        if (!*s && IsBuiltinDelimiter(*p))
+            return true;
+    }
+    return false;
+}
+
+static bool
+HasExtension(const wchar_t* name, const wchar_t* end, const char* ext)
+{
+    size_t len = 0;
+    while (ext[len])
+        ++len;
+    if (size_t(end - name) < len)
+        return false;
+    for (const wchar_t* p = end - len; *ext; ++p, ++ext)
+    {
+        if (ToLower(*p) != wchar_t(*ext))
+            return false;
+    }
+    return true;
+}
+
+bool
+NeedsShell(const wchar_t* line)
+{
+    // CMD expands variables even inside quotes, and CMD /c can strip the
+    // outer quotes from the command line, which exposes whatever they
+    // enclosed.  So these characters need CMD wherever they appear.
+    for (const wchar_t* p = line; *p; ++p)
+    {
+        switch (*p)
+        {
+        case '&':
+        case '|':
+        case '<':
+        case '>':
+        case '^':
+        case '(':
+        case ')':
+        case '%':
+        case '\r':
+        case '\n':
+            return true;
+        }
+    }
+
+    while (IsArgSpace(*line))
+        ++line;
+    if (!*line || *line == '@')
+        return true;
+
+    // Only check an unquoted name for built-ins; "echo" in quotes is not the
+    // echo command.
+    if (*line != '"' && IsBuiltin(line))
+        return true;
+
+    wchar_t* out = nullptr;
+    const wchar_t* end = ScanProgramName(line, out);
+    if (end > line && end[-1] == '"')
+        --end;
+    return HasExtension(line, end, ".bat") || HasExtension(line, end, ".cmd");
+}
+
+size_t
+CommandLineBuilder::QuotedLength(const wchar_t* arg)
+{
+    if (!NeedsQuotes(arg))
+        return StrLen(arg);
+
+    size_t len = 2;
+    size_t backslashes = 0;
+    for (; *arg; ++arg)
+    {
+        if (*arg == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        // Backslashes before a quote are doubled, plus one for the quote.
+        len += (*arg == '"') ? backslashes * 2 + 2 : backslashes + 1;
+        backslashes = 0;
+    }
+    // Backslashes before the closing quote are doubled.
+    return len + backslashes * 2;
+}
+
+wchar_t*
+CommandLineBuilder::AppendQuoted(wchar_t* out, const wchar_t* arg)
+{
+    if (!NeedsQuotes(arg))
+    {
+        while (*arg)
+            *(out++) = *(arg++);
+        return out;
+    }
+
+    *(out++) = '"';
+    size_t backslashes = 0;
+    for (; *arg; ++arg)
+    {
+        if (*arg == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        // Backslashes before a quote are doubled, plus one to escape it.
+        out = AppendBackslashes(out, (*arg == '"') ? backslashes * 2 + 1 : backslashes);
+        *(out++) = *arg;
+        backslashes = 0;
+    }
+    out = AppendBackslashes(out, backslashes * 2);
+    *(out++) = '"';
+    return out;
+}
+
+CommandLineBuilder::~CommandLineBuilder()
+{
+    if (m_pieces != m_inline)
+        free(m_pieces);
+}
+
+bool
+CommandLineBuilder::Add(Kind kind, const wchar_t* text, unsigned number)
+{
+    if (m_failed)
+        return false;
+
+    if (m_count >= m_capacity)
+    {
+        // Only malloc and free, since sudo_min provides nothing else.
+        const unsigned capacity = m_capacity * 2;
+        Piece* const pieces = static_cast<Piece*>(malloc(capacity * sizeof(*pieces)));
+        if (!pieces)
+        {
+            m_failed = true;
+            return false;
+        }
+        for (unsigned i = 0; i < m_count; ++i)
+            pieces[i] = m_pieces[i];
+        if (m_pieces != m_inline)
+            free(m_pieces);
+        m_pieces = pieces;
+        m_capacity = capacity;
+    }
+
+    Piece& piece = m_pieces[m_count++];
+    piece.kind = kind;
+    piece.number = number;
+    piece.text = text;
+    return true;
+}
+
+void
+CommandLineBuilder::Program(const wchar_t* name)
+{
+    Add(Kind::Program, name);
+}
+
+void
+CommandLineBuilder::Arg(const wchar_t* arg)
+{
+    Add(Kind::Arg, arg);
+}
+
+void
+CommandLineBuilder::Arg(unsigned number)
+{
+    Add(Kind::Number, nullptr, number);
+}
+
+void
+CommandLineBuilder::Raw(const wchar_t* text)
+{
+    if (*text)
+        Add(Kind::Raw, text);
+}
+
+void
+CommandLineBuilder::Append(const CommandLineBuilder& other)
+{
+    for (unsigned i = 0; i < other.m_count; ++i)
+        Add(other.m_pieces[i].kind, other.m_pieces[i].text, other.m_pieces[i].number);
+    if (other.m_failed)
+        m_failed = true;
+}
+
+size_t
+CommandLineBuilder::Length() const
+{
+    size_t len = m_count ? m_count - 1 : 0;
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        const Piece& piece = m_pieces[i];
+        switch (piece.kind)
+        {
+        case Kind::Program:     len += StrLen(piece.text) + 2; break;
+        case Kind::Arg:         len += QuotedLength(piece.text); break;
+        case Kind::Number:      len += NumberLength(piece.number); break;
+        case Kind::Raw:         len += StrLen(piece.text); break;
+        }
+    }
+    return len;
+}
+
+wchar_t*
+CommandLineBuilder::Build() const
+{
+    if (m_failed)
+        return nullptr;
+
+    wchar_t* const buffer = static_cast<wchar_t*>(malloc((Length() + 1) * sizeof(*buffer)));
+    if (buffer)
+        Emit(buffer);
+    return buffer;
+}
+
+bool
+CommandLineBuilder::Emit(wchar_t* buffer) const
+{
+    if (m_failed)
+        return false;
+
+    wchar_t* out = buffer;
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        const Piece& piece = m_pieces[i];
+        if (i)
+            *(out++) = ' ';
+        switch (piece.kind)
+        {
+        case Kind::Program:
+            // A path cannot contain quotes, and backslashes in the program
+            // name are literal, so it only needs to be enclosed in quotes.
+            *(out++) = '"';
+            for (const wchar_t* s = piece.text; *s; ++s)
+                *(out++) = *s;
+            *(out++) = '"';
+            break;
+        case Kind::Arg:
+            out = AppendQuoted(out, piece.text);
+            break;
+        case Kind::Number:
+            out = AppendNumber(out, piece.number);
+            break;
+        case Kind::Raw:
+            for (const wchar_t* s = piece.text; *s; ++s)
+                *(out++) = *s;
+            break;
+        }
+    }
+    *out = '\0';
+    return true;
+}
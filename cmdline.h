@@ -0,0 +1,101 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Unquoting follows the CommandLineToArgvW rules:
+//
+//  - Arguments are separated by spaces or tabs outside quotes.
+//  - 2n backslashes followed by " produce n backslashes, and the " begins or
+//    ends a quoted section.
+//  - 2n+1 backslashes followed by " produce n backslashes and a literal ".
+//  - Backslashes not followed by " are literal.
+//  - "" inside a quoted section produces a literal " and ends the quoted
+//    section.
+//
+// The MSVCRT since Visual C++ 2008 (and the UCRT) differs only in the last
+// rule:  it stays in the quoted section after "".  CommandLineBuilder never
+// produces "" inside quotes, so an argument it quotes reads back exactly the
+// same under either rule.
+//
+// The program name (the first argument) is special:  quotes only delimit it,
+// and backslashes are always literal.
+
+// Scans one argument, copying it (unquoted) to out if out is not null, and
+// advancing out past the copy.  The copy is never longer than the text it
+// came from.  Returns the end of the argument (not past any spaces).
+const wchar_t* ScanCommandArg(const wchar_t* p, wchar_t*& out);
+
+// Scans the program name at the start of a command line, copying it
+// (without quotes) to out if out is not null, and advancing out past the
+// copy.  Returns the end of the program name.
+const wchar_t* ScanProgramName(const wchar_t* p, wchar_t*& out);
+
+// How the elevated sudo runs a command line.
+enum class ExecMode : unsigned char
+{
+    Auto,                       // Direct, unless NeedsShell() says otherwise.
+    Direct,                     // Run the program without CMD.
+    Shell,                      // Run the command line with CMD /c.
+};
+
+// Returns whether a command line needs CMD to run it:  whether it uses
+// redirection, pipes, command separators, escapes, variables, or a CMD
+// built-in command, or runs a batch script.
+bool NeedsShell(const wchar_t* line);
+
+// Builds a command line from pieces.  The pieces are only referenced, so the
+// strings must outlive the builder.  Build() computes the exact length first
+// and then emits the command line into a single allocation, so there is no
+// limit other than the 32767 character limit imposed by CreateProcess.  The
+// first few pieces are kept in the builder, and more go in a heap array; if
+// that runs out of memory, Build() and Emit() fail.
+class CommandLineBuilder
+{
+public:
+                    CommandLineBuilder() = default;
+                    ~CommandLineBuilder();
+
+    void            Program(const wchar_t* name);
+    void            Arg(const wchar_t* arg);
+    void            Arg(unsigned number);
+    void            Raw(const wchar_t* text);   // Appended verbatim.
+    void            Append(const CommandLineBuilder& other);
+
+    // Length in characters, not counting the terminator.
+    size_t          Length() const;
+
+    // Returns a malloc'd string, or nullptr if out of memory.
+    wchar_t*        Build() const;
+
+    // Writes the command line (Length() + 1 characters, including the
+    // terminator) to a buffer provided by the caller.
+    bool            Emit(wchar_t* out) const;
+
+    static size_t   QuotedLength(const wchar_t* arg);
+    static wchar_t* AppendQuoted(wchar_t* out, const wchar_t* arg);
+
+private:
+    enum class Kind : unsigned char { Program, Arg, Number, Raw };
+
+    struct Piece
+    {
+        Kind            kind;
+        unsigned        number;
+        const wchar_t*  text;
+    };
+
+    bool            Add(Kind kind, const wchar_t* text, unsigned number=0);
+
+    enum { c_inline_pieces = 16 };
+    Piece*          m_pieces = m_inline;
+    unsigned        m_count = 0;
+    unsigned        m_capacity = c_inline_pieces;
+    bool            m_failed = false;
+    Piece           m_inline[c_inline_pieces];
+
+                    CommandLineBuilder(const CommandLineBuilder&) = delete;
+    CommandLineBuilder& operator=(const CommandLineBuilder&) = delete;
+};
@@ -0,0 +1,406 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for quoting and unquoting command lines.
+//
+// The checker splits a table of command lines whose CommandLineToArgvW
+// results are known, including the cases where "" inside quotes differs
+// from the MSVCRT since Visual C++ 2008.  Then it builds random command
+// lines from random arguments (spaces, tabs, quotes, runs of backslashes,
+// and non-ASCII characters) with CommandLineBuilder, with enough pieces to
+// outgrow the ones kept in the builder, and checks that the arguments read
+// back the same under both rules, that Length() is exact, and that Emit()
+// writes nothing past it.  The benchmark times building and splitting a
+// command line like the one sudo forwards to the elevated sudo.
+//
+//      g++ -std=c++17 -O2 cmdlinebench.cpp cmdline.cpp -o cmdlinebench
+//      ./cmdlinebench [-n iterations] [-r lines] [-s seed]
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "cmdline.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum { c_max_args = 400 };
+
+struct Args
+{
+    wchar_t*            buffer;
+    const wchar_t*      argv[c_max_args];
+    unsigned            argc;
+};
+
+// Splits a command line the way CommandLineToArgvW does, using the scanners
+// in cmdline.cpp.
+static bool
+SplitLine(const wchar_t* line, Args& args)
+{
+    args.buffer = static_cast<wchar_t*>(malloc((wcslen(line) + 1) * sizeof(wchar_t)));
+    args.argc = 0;
+
+    wchar_t* out = args.buffer;
+    const wchar_t* p = line;
+    while (*p == ' ' || *p == '\t')
+        ++p;
+    args.argv[args.argc++] = out;
+    p = ScanProgramName(p, out);
+    *(out++) = '\0';
+
+    while (true)
+    {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (!*p)
+            break;
+        if (args.argc >= c_max_args)
+            return false;
+        args.argv[args.argc++] = out;
+        p = ScanCommandArg(p, out);
+        *(out++) = '\0';
+    }
+    return true;
+}
+
+// Splits an argument the way the MSVCRT has since Visual C++ 2008:  "" inside
+// quotes is a literal " and stays in the quoted section.
+static const wchar_t*
+ScanCrtArg(const wchar_t* p, wchar_t*& out)
+{
+    bool quote = false;
+    while (true)
+    {
+        size_t backslashes = 0;
+        while (*p == '\\')
+        {
+            ++backslashes;
+            ++p;
+        }
+
+        if (*p == '"')
+        {
+            for (size_t i = 0; i < backslashes / 2; ++i)
+                *(out++) = '\\';
+            if (backslashes & 1)
+                *(out++) = '"';
+            else if (quote && p[1] == '"')
+            {
+                *(out++) = '"';
+                ++p;
+            }
+            else
+                quote = !quote;
+            ++p;
+            continue;
+        }
+
+        for (size_t i = 0; i < backslashes; ++i)
+            *(out++) = '\\';
+        if (!*p || (!quote && (*p == ' ' || *p == '\t')))
+            return p;
+        *(out++) = *(p++);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Known CommandLineToArgvW results.
+
+struct SplitCase
+{
+    const wchar_t*      line;
+    const wchar_t*      argv[6];
+    unsigned            argc;
+    bool                crt_differs = false;    // The MSVCRT splits it differently.
+};
+
+static const SplitCase c_split_cases[] =
+{
+    { L"prog",                                  { L"prog" }, 1 },
+    { L"prog  ",                                { L"prog" }, 1 },
+    { L"\"C:\\Program Files\\x.exe\" a",        { L"C:\\Program Files\\x.exe", L"a" }, 2 },
+    { L"C:\\dir\\prog.exe \\\\server\\share",   { L"C:\\dir\\prog.exe", L"\\\\server\\share" }, 2 },
+    { L"prog \"a b c\" d e",                    { L"prog", L"a b c", L"d", L"e" }, 4 },
+    { L"prog \"ab\\\"c\" \"\\\\\" d",           { L"prog", L"ab\"c", L"\\", L"d" }, 4 },
+    { L"prog a\\\\\\b d\"e f\"g h",             { L"prog", L"a\\\\\\b", L"de fg", L"h" }, 4 },
+    { L"prog a\\\\\\\"b c d",                   { L"prog", L"a\\\"b", L"c", L"d" }, 4 },
+    { L"prog a\\\\\\\\\"b c\" d e",             { L"prog", L"a\\\\b c", L"d", L"e" }, 4 },
+    { L"prog a \"\" b",                         { L"prog", L"a", L"", L"b" }, 4 },
+    { L"prog a\"\"b",                           { L"prog", L"ab" }, 2 },
+    { L"prog\ta\t\tb",                          { L"prog", L"a", L"b" }, 3 },
+    { L"prog \"a",                              { L"prog", L"a" }, 2 },
+    { L"prog \"a b\\\\\"",                      { L"prog", L"a b\\" }, 2 },
+    { L"prog a\\",                              { L"prog", L"a\\" }, 2 },
+    { L"prog \"\"\"\"",                         { L"prog", L"\"" }, 2 },
+    { L"prog \"a b c\"\"",                      { L"prog", L"a b c\"" }, 2 },
+    { L"prog \"\"\"CallMeIshmael\"\"\"  b  c",  { L"prog", L"\"CallMeIshmael\"", L"b", L"c" }, 4 },
+    { L"prog a\"b\"\" c d",                     { L"prog", L"ab\"", L"c", L"d" }, 4, true },
+    { L"prog \"a\"\"b c\"",                     { L"prog", L"a\"b", L"c" }, 3, true },
+    { L"prog \"\"\"Call Me Ishmael\"\"\"",      { L"prog", L"\"Call", L"Me", L"Ishmael\"" }, 4, true },
+    { L"prog \"\"\"\"Call Me Ishmael\"\" b c",  { L"prog", L"\"Call Me Ishmael\"", L"b", L"c" }, 4, true },
+};
+
+static bool
+CheckSplitCases()
+{
+    for (const SplitCase& c : c_split_cases)
+    {
+        Args args;
+        bool ok = SplitLine(c.line, args) && args.argc == c.argc;
+        for (unsigned i = 0; ok && i < c.argc; ++i)
+            ok = !wcscmp(args.argv[i], c.argv[i]);
+
+        // Whether the MSVCRT splits it the same, as a check on the table.
+        wchar_t crt[256];
+        bool crt_same = true;
+        const wchar_t* p = c.line + wcslen(c.argv[0]) + (c.line[0] == '"' ? 2 : 0);
+        for (unsigned i = 1; ok && crt_same; ++i)
+        {
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            if (!*p)
+            {
+                crt_same = (i == c.argc);
+                break;
+            }
+            wchar_t* out = crt;
+            p = ScanCrtArg(p, out);
+            *out = '\0';
+            crt_same = (i < c.argc && !wcscmp(crt, c.argv[i]));
+        }
+        ok = ok && crt_same != c.crt_differs;
+
+        if (!ok)
+            fprintf(stderr, "splitting %ls did not match CommandLineToArgvW.\n", c.line);
+        free(args.buffer);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Random round trips.
+
+static wchar_t*
+RandomArg(wchar_t* p)
+{
+    static const wchar_t c_chars[] = L"ab  \t\"\"\\\\\\/:.=-\u00e9\u4e2d";
+    const unsigned len = Random(4) ? Random(12) : Random(80);
+    for (unsigned i = 0; i < len; ++i)
+        *(p++) = c_chars[Random(sizeof(c_chars) / sizeof(c_chars[0]) - 1)];
+    *p = '\0';
+    return p;
+}
+
+static bool
+RoundTrip(unsigned lines)
+{
+    wchar_t* storage = static_cast<wchar_t*>(malloc(c_max_args * 81 * sizeof(wchar_t)));
+    const wchar_t* args[c_max_args];
+    unsigned numbers[c_max_args];
+    unsigned max_pieces = 0;
+
+    for (unsigned n = 0; n < lines; ++n)
+    {
+        // A program name (which can't contain quotes) and random arguments.
+        const unsigned count = 1 + (Random(8) ? Random(24) : Random(c_max_args - 1));
+        wchar_t* p = storage;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            args[i] = p;
+            numbers[i] = (!i || Random(4)) ? unsigned(-1) : s_seed;
+            if (!i)
+            {
+                wcscpy(p, Random(2) ? L"C:\\Program Files\\x.exe" : L"prog");
+                p += wcslen(p);
+            }
+            else
+                p = RandomArg(p);
+            ++p;
+        }
+
+        CommandLineBuilder builder;
+        CommandLineBuilder tail;
+        const unsigned split = Random(count);
+        builder.Program(args[0]);
+        for (unsigned i = 1; i < count; ++i)
+        {
+            CommandLineBuilder& to = (i > split) ? tail : builder;
+            if (numbers[i] != unsigned(-1))
+                to.Arg(numbers[i]);
+            else
+                to.Arg(args[i]);
+        }
+        builder.Append(tail);
+        if (count > max_pieces)
+            max_pieces = count;
+
+        // Length() is exact, and Emit() stays within it.
+        const size_t len = builder.Length();
+        wchar_t* line = static_cast<wchar_t*>(malloc((len + 9) * sizeof(wchar_t)));
+        wmemset(line, 0xfffe, len + 9);
+        bool ok = builder.Emit(line) && wcslen(line) == len;
+        for (size_t i = len + 1; i < len + 9; ++i)
+            ok = ok && line[i] == 0xfffe;
+        wchar_t* built = builder.Build();
+        ok = ok && built && !wcscmp(built, line);
+
+        // Each argument reads back the same, under both rules.
+        Args split_args;
+        split_args.buffer = nullptr;
+        ok = ok && SplitLine(line, split_args) && split_args.argc == count;
+        const wchar_t* walk = line + wcslen(args[0]) + 2;
+        for (unsigned i = 0; ok && i < count; ++i)
+        {
+            wchar_t number[16];
+            const wchar_t* want = args[i];
+            if (numbers[i] != unsigned(-1))
+            {
+                swprintf(number, 16, L"%u", numbers[i]);
+                want = number;
+            }
+            ok = !wcscmp(split_args.argv[i], want);
+
+            if (ok && i)
+            {
+                while (*walk == ' ')
+                    ++walk;
+                wchar_t crt[128];
+                wchar_t* out = crt;
+                walk = ScanCrtArg(walk, out);
+                *out = '\0';
+                ok = !wcscmp(crt, want);
+            }
+
+            if (ok && numbers[i] == unsigned(-1))
+            {
+                wchar_t quoted[256];
+                const size_t quoted_len = CommandLineBuilder::QuotedLength(args[i]);
+                ok = (i == 0 || size_t(CommandLineBuilder::AppendQuoted(quoted, args[i]) - quoted) == quoted_len);
+            }
+        }
+
+        if (!ok)
+            fprintf(stderr, "round trip failed for %ls\n", line);
+        free(split_args.buffer);
+        free(built);
+        free(line);
+        if (!ok)
+        {
+            free(storage);
+            return false;
+        }
+    }
+
+    free(storage);
+    printf("checks passed (%zu split cases, %u round trips of up to %u pieces).\n",
+           sizeof(c_split_cases) / sizeof(c_split_cases[0]), lines, max_pieces);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static void
+RunBench(unsigned iterations)
+{
+    // Like the command line sudo forwards to the elevated sudo.
+    static const wchar_t* const c_forward[] =
+    {
+        L"--elevated", L"1234", L"--broker", L"0", L"-j", L"4", L"-b", L"--stats",
+        L"--log-output", L"C:\\Users\\Me\\AppData\\Local\\Temp\\sudo out.log",
+        L"--trace", L"C:\\Users\\Me\\trace.json", L"--controls", L"priority=below-normal;affinity=0x3",
+        L"--timeout", L"90", L"--kill-after", L"5", L"-D", L"C:\\Users\\Me\\src\\project with spaces\\",
+        L"cmd", L"/c", L"echo \"quoted\" & dir",
+    };
+    const unsigned count = sizeof(c_forward) / sizeof(c_forward[0]);
+
+    size_t total = 0;
+    unsigned long long start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        CommandLineBuilder builder;
+        builder.Program(L"C:\\Program Files\\sudo\\sudo.exe");
+        for (unsigned i = 0; i < count; ++i)
+            builder.Arg(c_forward[i]);
+        wchar_t* line = builder.Build();
+        total += line ? wcslen(line) : 0;
+        free(line);
+    }
+    const unsigned long long build_us = NowMicroseconds() - start;
+
+    CommandLineBuilder builder;
+    builder.Program(L"C:\\Program Files\\sudo\\sudo.exe");
+    for (unsigned i = 0; i < count; ++i)
+        builder.Arg(c_forward[i]);
+    wchar_t* line = builder.Build();
+
+    unsigned argc = 0;
+    start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        Args args;
+        SplitLine(line, args);
+        argc += args.argc;
+        free(args.buffer);
+    }
+    const unsigned long long split_us = NowMicroseconds() - start;
+
+    printf("forwarded command line (%zu characters, %u pieces):  build %.1f ns, split %.1f ns\n",
+           total / iterations, argc / iterations, build_us * 1000.0 / iterations, split_us * 1000.0 / iterations);
+    free(line);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned iterations = 200000;
+    unsigned lines = 20000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            lines = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: cmdlinebench [-n iterations] [-r lines] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!iterations)
+        return 1;
+
+    setlocale(LC_CTYPE, "C.UTF-8");
+    if (!CheckSplitCases() || !RoundTrip(lines))
+        return 1;
+
+    RunBench(iterations);
+    return 0;
+}
@@ -0,0 +1,333 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "coalesce.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// The line is a ticket lock:  each sudo takes the next ticket, and it is a
+// sudo's turn once every earlier ticket has left.  Each ticket claims a slot
+// in a ring, so a ticket whose sudo exited without leaving can be skipped.
+//
+// Who elevates is decided by one word, which holds the generation (one per
+// elevation), the phase, and the leader's process ID, so a follower always
+// sees which leader it is waiting for.
+
+enum : unsigned
+{
+    c_magic             = 0x51455553,   // 'SUEQ'
+    c_check_ms          = 250,          // How often to check on other processes.
+    c_unclaimed_checks  = 20,           // Checks before skipping an unclaimed ticket.
+};
+
+enum : unsigned
+{
+    c_idle,
+    c_elevating,
+    c_ready,
+    c_failed,
+};
+
+static_assert(std::atomic<unsigned long long>::is_always_lock_free,
+              "The queue is shared between processes, so it must not use locks.");
+
+struct ElevationQueue::Shared
+{
+    struct Slot
+    {
+        std::atomic<unsigned long long> claim;  // Ticket + 1, and whether it left.
+        std::atomic<unsigned>   pid;
+    };
+
+    std::atomic<unsigned>   magic;
+    std::atomic<unsigned>   changes;            // Bumped on every change; waiters wait on it.
+    std::atomic<unsigned>   next_ticket;
+    std::atomic<unsigned>   serving;            // Tickets before this one have left.
+    std::atomic<unsigned long long> state;      // Generation, phase, and leader.
+    std::atomic<unsigned long long> failure;    // Generation and error of the last failure.
+    Slot                    slots[c_queue_slots];
+};
+
+static unsigned long long
+MakeState(unsigned generation, unsigned phase, unsigned pid)
+{
+    return ((static_cast<unsigned long long>(generation & 0xffffff) << 40) |
+            (static_cast<unsigned long long>(phase) << 32) |
+            pid);
+}
+
+static unsigned
+Generation(unsigned long long state)
+{
+    return unsigned(state >> 40);
+}
+
+static unsigned
+Phase(unsigned long long state)
+{
+    return unsigned(state >> 32) & 0xff;
+}
+
+static unsigned
+LeaderPid(unsigned long long state)
+{
+    return unsigned(state);
+}
+
+static unsigned long long
+MakeClaim(unsigned ticket, bool left)
+{
+    return (static_cast<unsigned long long>(ticket + 1) << 32) | (left ? 1 : 0);
+}
+
+ElevationQueue::ElevationQueue(const ElevationQueueOps& ops, unsigned pid)
+: m_ops(ops)
+, m_pid(pid)
+{
+}
+
+ElevationQueue::~ElevationQueue()
+{
+    Leave();
+}
+
+size_t
+ElevationQueue::ImageSize()
+{
+    return sizeof(Shared);
+}
+
+bool
+ElevationQueue::Attach(void* image, size_t size)
+{
+    m_shared = nullptr;
+    if (!image || size < ImageSize())
+        return false;
+
+    // Zeroed memory is an empty queue, so the first sudo only stamps it.
+    Shared* shared = static_cast<Shared*>(image);
+    unsigned magic = 0;
+    if (!shared->magic.compare_exchange_strong(magic, c_magic) && magic != c_magic)
+        return false;
+
+    m_shared = shared;
+    return true;
+}
+
+void
+ElevationQueue::Bump()
+{
+    m_shared->changes.fetch_add(1, std::memory_order_acq_rel);
+    m_ops.wake(&m_shared->changes, m_ops.context);
+}
+
+// Lets the line move past tickets that have left.  With check_alive, also
+// past tickets whose sudo exited, and with skip_unclaimed, past one ticket
+// that was taken but never claimed its slot (its sudo exited in between).
+void
+ElevationQueue::Advance(bool check_alive, bool skip_unclaimed)
+{
+    Shared& shared = *m_shared;
+    while (true)
+    {
+        unsigned serving = shared.serving.load(std::memory_order_acquire);
+        if (serving == shared.next_ticket.load(std::memory_order_acquire))
+            return;
+
+        const Shared::Slot& slot = shared.slots[serving % c_queue_slots];
+        const unsigned long long claim = slot.claim.load(std::memory_order_acquire);
+        bool pass;
+        if ((claim & ~1ull) == MakeClaim(serving, false))
+            pass = ((claim & 1) ||
+                    (check_alive && !m_ops.is_alive(slot.pid.load(std::memory_order_relaxed), m_ops.context)));
+        else
+            pass = skip_unclaimed;
+        if (!pass)
+            return;
+
+        skip_unclaimed = false;
+        if (shared.serving.compare_exchange_strong(serving, serving + 1))
+            Bump();
+    }
+}
+
+bool
+ElevationQueue::TakeOver(unsigned long long state)
+{
+    const unsigned generation = (Generation(state) + 1) & 0xffffff;
+    if (!m_shared->state.compare_exchange_strong(state, MakeState(generation, c_elevating, m_pid)))
+        return false;
+
+    m_generation = generation;
+    m_leader = true;
+    Bump();
+    return true;
+}
+
+QueueRole
+ElevationQueue::Join()
+{
+    Leave();
+
+    Shared& shared = *m_shared;
+    m_ticket = shared.next_ticket.fetch_add(1, std::memory_order_acq_rel);
+    m_joined = true;
+
+    // The role is decided on arrival, so a sudo that has to wait for a slot
+    // still follows the elevation that was in progress when it arrived.
+    QueueRole role;
+    while (true)
+    {
+        const unsigned long long state = shared.state.load(std::memory_order_acquire);
+        const unsigned phase = Phase(state);
+        if (phase == c_elevating || phase == c_ready)
+        {
+            m_generation = Generation(state);
+            role = QueueRole::Follower;
+            break;
+        }
+        if (TakeOver(state))
+        {
+            role = QueueRole::Leader;
+            break;
+        }
+    }
+
+    // A slot is only reused once the ticket c_queue_slots earlier has left.
+    for (bool timed_out = false; m_ticket - shared.serving.load(std::memory_order_acquire) >= c_queue_slots;)
+    {
+        const unsigned changes = shared.changes.load(std::memory_order_acquire);
+        Advance(timed_out, false);
+        if (m_ticket - shared.serving.load(std::memory_order_acquire) < c_queue_slots)
+            break;
+        m_ops.wait(&shared.changes, changes, c_check_ms, m_ops.context);
+        timed_out = (shared.changes.load(std::memory_order_acquire) == changes);
+    }
+
+    Shared::Slot& slot = shared.slots[m_ticket % c_queue_slots];
+    slot.pid.store(m_pid, std::memory_order_relaxed);
+    slot.claim.store(MakeClaim(m_ticket, false), std::memory_order_release);
+    Bump();
+    return role;
+}
+
+void
+ElevationQueue::Publish(bool ready, unsigned error)
+{
+    if (!m_leader)
+        return;
+    m_leader = false;
+
+    Shared& shared = *m_shared;
+    if (!ready)
+    {
+        const unsigned long long failure = (static_cast<unsigned long long>(m_generation) << 32) | error;
+        shared.failure.store(failure, std::memory_order_release);
+    }
+
+    // If another sudo took over (it thought this one had exited), its
+    // outcome is the one that counts.
+    unsigned long long state = MakeState(m_generation, c_elevating, m_pid);
+    shared.state.compare_exchange_strong(state, MakeState(m_generation, ready ? c_ready : c_failed, m_pid));
+    Bump();
+}
+
+QueueOutcome
+ElevationQueue::WaitForLeader(unsigned& error)
+{
+    Shared& shared = *m_shared;
+    bool timed_out = false;
+    error = 0;
+    while (true)
+    {
+        const unsigned changes = shared.changes.load(std::memory_order_acquire);
+        const unsigned long long state = shared.state.load(std::memory_order_acquire);
+        if (Generation(state) != m_generation)
+        {
+            // Another elevation started since:  either this one failed (and
+            // a later sudo is trying again), or another follower took over.
+            const unsigned long long failure = shared.failure.load(std::memory_order_acquire);
+            if (unsigned(failure >> 32) == m_generation)
+            {
+                error = unsigned(failure);
+                return QueueOutcome::Failed;
+            }
+            m_generation = Generation(state);
+            continue;
+        }
+
+        switch (Phase(state))
+        {
+        case c_ready:
+            return QueueOutcome::Ready;
+        case c_failed:
+            error = unsigned(shared.failure.load(std::memory_order_acquire));
+            return QueueOutcome::Failed;
+        case c_idle:
+            if (TakeOver(state))
+                return QueueOutcome::Leader;
+            continue;
+        default:
+            if (timed_out && !m_ops.is_alive(LeaderPid(state), m_ops.context) && TakeOver(state))
+                return QueueOutcome::Leader;
+            break;
+        }
+
+        m_ops.wait(&shared.changes, changes, c_check_ms, m_ops.context);
+        timed_out = (shared.changes.load(std::memory_order_acquire) == changes);
+    }
+}
+
+void
+ElevationQueue::WaitTurn()
+{
+    if (!m_joined)
+        return;
+
+    Shared& shared = *m_shared;
+    bool timed_out = false;
+    unsigned stuck = 0;
+    unsigned last_serving = m_ticket;
+    while (true)
+    {
+        const unsigned changes = shared.changes.load(std::memory_order_acquire);
+        const unsigned serving = shared.serving.load(std::memory_order_acquire);
+        if (int(serving - m_ticket) >= 0)
+            return;
+
+        stuck = (timed_out && serving == last_serving) ? stuck + 1 : 0;
+        last_serving = serving;
+        Advance(timed_out, stuck >= c_unclaimed_checks);
+        if (shared.serving.load(std::memory_order_acquire) != serving)
+            continue;
+
+        m_ops.wait(&shared.changes, changes, c_check_ms, m_ops.context);
+        timed_out = (shared.changes.load(std::memory_order_acquire) == changes);
+    }
+}
+
+void
+ElevationQueue::Leave()
+{
+    if (!m_joined)
+        return;
+    if (m_leader)
+        Publish(false, 0);
+    m_joined = false;
+
+    // If this ticket was skipped and its slot reused, the claim no longer
+    // matches and is left alone.
+    unsigned long long claim = MakeClaim(m_ticket, false);
+    m_shared->slots[m_ticket % c_queue_slots].claim.compare_exchange_strong(claim, MakeClaim(m_ticket, true));
+    Advance(false, false);
+    Bump();
+}
+
+void
+ElevationQueue::Stale()
+{
+    unsigned long long state = m_shared->state.load(std::memory_order_acquire);
+    if (Generation(state) == m_generation && Phase(state) == c_ready &&
+        m_shared->state.compare_exchange_strong(state, MakeState(m_generation, c_idle, 0)))
+        Bump();
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Coalesces concurrent elevations from the same user and session, e.g. a
+// parallel build that runs many sudo commands at once.  The first sudo to
+// join the queue becomes the leader and elevates; the others wait for it
+// instead of each asking for consent.  Once the leader's elevated helper
+// (the broker) is up, each waiting sudo hands it its own request, in the
+// order they joined, and gets its own exit code back.  If the user declines
+// the leader's elevation, the others fail the same way instead of asking
+// again.  If the leader exits without saying how its elevation went, one of
+// the others takes over.
+//
+// The queue lives in memory shared by the sudo processes (a named section on
+// Windows), and zeroed memory is an empty queue.  Waiting and checking on
+// other processes go through ElevationQueueOps, so the same logic runs
+// between processes on Windows, on Linux, or between threads.
+
+enum : unsigned { c_queue_slots = 1024 };
+
+struct ElevationQueueOps
+{
+    // Returns false if the process has exited.
+    bool                (*is_alive)(unsigned pid, void* context);
+
+    // Waits until *word may differ from expected, or until timeout_ms has
+    // passed.  Returning early is harmless.
+    void                (*wait)(std::atomic<unsigned>* word, unsigned expected, unsigned timeout_ms, void* context);
+
+    // Wakes every process waiting on *word.
+    void                (*wake)(std::atomic<unsigned>* word, void* context);
+
+    void*               context;
+};
+
+enum class QueueRole : unsigned char
+{
+    Leader,                     // Elevate, then Publish() how it went.
+    Follower,                   // WaitForLeader().
+};
+
+enum class QueueOutcome : unsigned char
+{
+    Ready,                      // The helper is up; WaitTurn() and use it.
+    Failed,                     // The elevation failed with the error (0 means elevate alone).
+    Leader,                     // Took over from a leader that exited; elevate.
+};
+
+class ElevationQueue
+{
+public:
+                    ElevationQueue(const ElevationQueueOps& ops, unsigned pid);
+                    ~ElevationQueue();
+
+    // The size of the shared memory, and attaching to it.  Fails if the
+    // memory was set up by an incompatible sudo.
+    static size_t   ImageSize();
+    bool            Attach(void* image, size_t size);
+
+    // Takes a place in line, and says whether to elevate or to wait for the
+    // elevation in progress.
+    QueueRole       Join();
+
+    // Leader:  says whether the helper is up, or else why the elevation
+    // failed.  The leader keeps its place until Leave().
+    void            Publish(bool ready, unsigned error);
+
+    // Follower:  waits for the leader to publish.
+    QueueOutcome    WaitForLeader(unsigned& error);
+
+    // Waits until everyone who joined earlier has left.
+    void            WaitTurn();
+
+    // Gives up the place in line.  Call it as soon as the request has been
+    // handed to the helper, so the next one can go.  A leader that leaves
+    // without publishing lets the others elevate alone.
+    void            Leave();
+
+    // The helper the leader published has gone away; the next Join()
+    // elevates again.
+    void            Stale();
+
+    unsigned        Ticket() const { return m_ticket; }
+
+    struct Shared;
+
+private:
+    void            Bump();
+    void            Advance(bool check_alive, bool skip_unclaimed);
+    bool            TakeOver(unsigned long long state);
+
+    const ElevationQueueOps m_ops;
+    const unsigned  m_pid;
+    Shared*         m_shared = nullptr;
+    unsigned        m_ticket = 0;
+    unsigned        m_generation = 0;
+    bool            m_joined = false;
+    bool            m_leader = false;
+
+                    ElevationQueue(const ElevationQueue&) = delete;
+    ElevationQueue& operator=(const ElevationQueue&) = delete;
+};
@@ -0,0 +1,440 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark and checker for coalescing concurrent elevations, with many
+// client processes contending for one queue in shared memory.
+//
+// Each client is a forked process that runs the same steps as sudo:  join
+// the queue, and either "elevate" (sleep for the consent prompt and start
+// the helper) or wait for the leader and then take its turn to hand its
+// request to the helper.  The checker verifies that a burst elevates once,
+// that requests reach the helper in the order they joined, and that the
+// queue survives a leader or followers exiting without leaving, a declined
+// elevation, and a helper that went away.  The benchmark reports elevations
+// and the time for a burst, and the cost of a turn under contention.
+//
+//      g++ -std=c++17 -O2 coalescebench.cpp coalesce.cpp -o coalescebench
+//      ./coalescebench [-n clients] [-e elevate ms] [-r rounds]
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <new>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coalesce.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+enum : unsigned
+{
+    c_max_clients       = c_queue_slots,
+    c_error_cancelled   = 1223,         // ERROR_CANCELLED, as when consent is declined.
+};
+
+// How a client ended, as its exit status.
+enum : int
+{
+    c_exit_follower     = 0,            // Handed its request to the helper.
+    c_exit_leader       = 10,           // Elevated.
+    c_exit_cancelled    = 20,           // The leader's elevation was declined.
+    c_exit_alone        = 30,           // Elevated alone (no helper).
+    c_exit_crashed      = 40,           // Exited on purpose without leaving.
+    c_exit_hung         = 63,           // Killed by its alarm, or any other status.
+};
+
+enum : unsigned
+{
+    FAULT_LEADER_CRASH  = 0x01,         // The first leader exits while elevating.
+    FAULT_DECLINE       = 0x02,         // The first elevation is declined.
+    FAULT_FOLLOWERS     = 0x04,         // Every 5th follower exits in line.
+    FAULT_STALE         = 0x08,         // The helper went away after a burst.
+};
+
+// What the clients share besides the queue:  the simulated helper, and a
+// log of the tickets in the order their requests reached it.
+struct Sim
+{
+    std::atomic<unsigned>   start;
+    std::atomic<unsigned>   elevations;
+    std::atomic<unsigned>   helper_up;
+    std::atomic<unsigned>   faults;
+    std::atomic<unsigned>   launches;
+    std::atomic<unsigned>   joined;
+    unsigned                clients;
+    unsigned                elevate_ms;
+    unsigned                log[c_max_clients * 2];
+};
+
+static unsigned long long
+NowMicroseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+SleepMs(unsigned ms)
+{
+    timespec ts = { time_t(ms / 1000), long(ms % 1000) * 1000000 };
+    nanosleep(&ts, nullptr);
+}
+
+//------------------------------------------------------------------------------
+// Queue operations between processes:  a futex in the shared mapping, and
+// /proc to tell whether a process exited (an unreaped child is a zombie).
+
+static bool
+IsAliveProc(unsigned pid, void* /*context*/)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char buffer[256];
+    const size_t len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[len] = '\0';
+    const char* state = strrchr(buffer, ')');
+    return !(state && state[1] == ' ' && (state[2] == 'Z' || state[2] == 'X'));
+}
+
+static void
+WaitProc(std::atomic<unsigned>* word, unsigned expected, unsigned timeout_ms, void* /*context*/)
+{
+    timespec ts = { time_t(timeout_ms / 1000), long(timeout_ms % 1000) * 1000000 };
+    syscall(SYS_futex, reinterpret_cast<unsigned*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+static void
+WakeProc(std::atomic<unsigned>* word, void* /*context*/)
+{
+    syscall(SYS_futex, reinterpret_cast<unsigned*>(word), FUTEX_WAKE, 0x7fffffff, nullptr, nullptr, 0);
+}
+
+static const ElevationQueueOps c_ops = { IsAliveProc, WaitProc, WakeProc, nullptr };
+
+//------------------------------------------------------------------------------
+// Clients.
+
+// Elevates:  the consent prompt, and starting the helper, take elevate_ms.
+// A burst is everyone joining while the consent prompt is up, so the prompt
+// waits until every client has joined.
+static int
+Elevate(Sim& sim, ElevationQueue& queue)
+{
+    const unsigned faults = sim.faults.load();
+    sim.elevations.fetch_add(1);
+    while (sim.joined.load() < sim.clients)
+        SleepMs(1);
+    SleepMs(sim.elevate_ms);
+
+    unsigned expected = faults;
+    if ((faults & FAULT_LEADER_CRASH) && sim.faults.compare_exchange_strong(expected, faults & ~FAULT_LEADER_CRASH))
+        _exit(c_exit_crashed);
+    if (faults & FAULT_DECLINE)
+    {
+        queue.Publish(false, c_error_cancelled);
+        queue.Leave();
+        return c_exit_cancelled;
+    }
+
+    sim.helper_up.store(1);
+    queue.Publish(true, 0);
+    queue.Leave();
+    return c_exit_leader;
+}
+
+static int
+RunClient(Sim& sim, ElevationQueue& queue, unsigned index)
+{
+    for (unsigned tries = 0; tries < 2; ++tries)
+    {
+        const QueueRole role = queue.Join();
+        if (!tries)
+            sim.joined.fetch_add(1);
+        if (role == QueueRole::Leader)
+            return Elevate(sim, queue);
+
+        unsigned error;
+        switch (queue.WaitForLeader(error))
+        {
+        case QueueOutcome::Leader:
+            return Elevate(sim, queue);
+        case QueueOutcome::Failed:
+            queue.Leave();
+            return (error == c_error_cancelled) ? c_exit_cancelled : c_exit_alone;
+        default:
+            break;
+        }
+
+        if ((sim.faults.load() & FAULT_FOLLOWERS) && index % 5 == 4)
+            _exit(c_exit_crashed);
+
+        queue.WaitTurn();
+        if (sim.helper_up.load())
+        {
+            // The helper has the request once it answers; then the next one
+            // may go.
+            sim.log[sim.launches.fetch_add(1)] = queue.Ticket();
+            queue.Leave();
+            return c_exit_follower;
+        }
+
+        queue.Stale();
+        queue.Leave();
+    }
+    return c_exit_alone;
+}
+
+struct Burst
+{
+    unsigned            clients;
+    unsigned            faults;
+    unsigned            elevate_ms;
+
+    unsigned            exits[c_exit_hung + 1];
+    unsigned            elevations;
+    unsigned            launches;
+    bool                fifo;
+    unsigned long long  elapsed_us;
+};
+
+// Runs a burst of clients that all start at once, in a fresh queue.
+static bool
+RunBurst(Burst& burst)
+{
+    const size_t size = sizeof(Sim) + ElevationQueue::ImageSize();
+    void* image = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED)
+        return false;
+
+    Sim& sim = *new (image) Sim();
+    sim.clients = burst.clients;
+    sim.elevate_ms = burst.elevate_ms;
+    sim.faults = burst.faults;
+    void* queue_image = static_cast<char*>(image) + sizeof(Sim);
+
+    // A helper from an earlier burst:  the queue says it is up, but it is
+    // gone by the time anyone uses it.
+    if (burst.faults & FAULT_STALE)
+    {
+        ElevationQueue queue(c_ops, unsigned(getpid()));
+        queue.Attach(queue_image, ElevationQueue::ImageSize());
+        queue.Join();
+        queue.Publish(true, 0);
+        queue.Leave();
+    }
+
+    pid_t pids[c_max_clients];
+    for (unsigned i = 0; i < burst.clients; ++i)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            // A client that hangs is reported as killed, instead of hanging
+            // the checker.
+            alarm(60);
+            ElevationQueue queue(c_ops, unsigned(getpid()));
+            if (!queue.Attach(queue_image, ElevationQueue::ImageSize()))
+                _exit(1);
+            while (!sim.start.load())
+                WaitProc(&sim.start, 0, 100, nullptr);
+            _exit(RunClient(sim, queue, i));
+        }
+    }
+
+    const unsigned long long start = NowMicroseconds();
+    sim.start.store(1);
+    WakeProc(&sim.start, nullptr);
+
+    memset(burst.exits, 0, sizeof(burst.exits));
+    for (unsigned i = 0; i < burst.clients; ++i)
+    {
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        const unsigned code = WIFEXITED(status) ? unsigned(WEXITSTATUS(status)) : unsigned(c_exit_hung);
+        ++burst.exits[code < c_exit_hung ? code : unsigned(c_exit_hung)];
+    }
+    burst.elapsed_us = NowMicroseconds() - start;
+
+    burst.elevations = sim.elevations.load();
+    burst.launches = sim.launches.load();
+    burst.fifo = true;
+    for (unsigned i = 1; i < burst.launches; ++i)
+        burst.fifo = burst.fifo && (sim.log[i - 1] < sim.log[i]);
+
+    munmap(image, size);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Checker.
+
+static bool
+Expect(bool ok, const char* scenario, const char* what, const Burst& burst)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILED %s: %s (elevations %u, launches %u, leader %u, follower %u, cancelled %u, alone %u, crashed %u, hung %u)\n",
+                scenario, what, burst.elevations, burst.launches, burst.exits[c_exit_leader], burst.exits[c_exit_follower],
+                burst.exits[c_exit_cancelled], burst.exits[c_exit_alone], burst.exits[c_exit_crashed], burst.exits[c_exit_hung]);
+    }
+    return ok;
+}
+
+static bool
+CheckScenarios(unsigned clients)
+{
+    bool ok = true;
+    Burst burst = {};
+    burst.clients = clients;
+    burst.elevate_ms = 50;
+
+    RunBurst(burst);
+    ok &= Expect(burst.elevations == 1, "burst", "elevates once", burst);
+    ok &= Expect(burst.exits[c_exit_follower] == clients - 1, "burst", "every follower uses the helper", burst);
+    ok &= Expect(burst.fifo, "burst", "requests reach the helper in order", burst);
+
+    burst.faults = FAULT_LEADER_CRASH;
+    RunBurst(burst);
+    ok &= Expect(burst.elevations == 2, "leader crash", "one follower takes over", burst);
+    ok &= Expect(burst.exits[c_exit_crashed] == 1 && burst.exits[c_exit_leader] == 1, "leader crash", "one leader", burst);
+    ok &= Expect(burst.exits[c_exit_follower] == clients - 2, "leader crash", "every follower uses the helper", burst);
+    ok &= Expect(burst.fifo, "leader crash", "requests reach the helper in order", burst);
+
+    burst.faults = FAULT_DECLINE;
+    RunBurst(burst);
+    ok &= Expect(burst.elevations == 1, "declined", "asks once", burst);
+    ok &= Expect(burst.exits[c_exit_cancelled] == clients, "declined", "everyone fails as cancelled", burst);
+
+    burst.faults = FAULT_FOLLOWERS;
+    RunBurst(burst);
+    const unsigned crashed = burst.exits[c_exit_crashed];
+    ok &= Expect(burst.elevations == 1, "followers crash", "elevates once", burst);
+    ok &= Expect(burst.exits[c_exit_follower] + crashed + 1 == clients, "followers crash", "the line moves past them", burst);
+    ok &= Expect(burst.fifo, "followers crash", "requests reach the helper in order", burst);
+
+    burst.faults = FAULT_STALE;
+    RunBurst(burst);
+    ok &= Expect(burst.elevations == 1, "stale helper", "elevates once more", burst);
+    ok &= Expect(burst.exits[c_exit_follower] == clients - 1, "stale helper", "every follower uses the new helper", burst);
+    ok &= Expect(burst.exits[c_exit_alone] == 0, "stale helper", "nobody elevates alone", burst);
+
+    if (ok)
+        printf("check            %8u clients, 5 scenarios passed\n", clients);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+// Clients that take turns over and over with the helper up, to measure what
+// a turn costs when many processes contend for the line.
+static void
+RunTurns(unsigned clients, unsigned rounds)
+{
+    const size_t size = sizeof(Sim) + ElevationQueue::ImageSize();
+    void* image = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED)
+        return;
+
+    Sim& sim = *new (image) Sim();
+    void* queue_image = static_cast<char*>(image) + sizeof(Sim);
+    {
+        ElevationQueue queue(c_ops, unsigned(getpid()));
+        queue.Attach(queue_image, ElevationQueue::ImageSize());
+        queue.Join();
+        queue.Publish(true, 0);
+    }
+
+    pid_t pids[c_max_clients];
+    for (unsigned i = 0; i < clients; ++i)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            ElevationQueue queue(c_ops, unsigned(getpid()));
+            queue.Attach(queue_image, ElevationQueue::ImageSize());
+            while (!sim.start.load())
+                WaitProc(&sim.start, 0, 100, nullptr);
+            for (unsigned r = 0; r < rounds; ++r)
+            {
+                unsigned error;
+                queue.Join();
+                queue.WaitForLeader(error);
+                queue.WaitTurn();
+                sim.launches.fetch_add(1);
+                queue.Leave();
+            }
+            _exit(0);
+        }
+    }
+
+    const unsigned long long start = NowMicroseconds();
+    sim.start.store(1);
+    WakeProc(&sim.start, nullptr);
+    for (unsigned i = 0; i < clients; ++i)
+        waitpid(pids[i], nullptr, 0);
+    const unsigned long long elapsed = NowMicroseconds() - start;
+
+    const unsigned turns = sim.launches.load();
+    printf("turns   %4u     %8u turns    %8.1f ms  %10.2f us/turn\n",
+           clients, turns, elapsed / 1000.0, turns ? double(elapsed) / turns : 0.0);
+    munmap(image, size);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned clients = 64;
+    unsigned elevate_ms = 1500;
+    unsigned rounds = 200;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            clients = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            elevate_ms = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            rounds = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: coalescebench [-n clients] [-e elevate ms] [-r rounds]\n");
+            return 1;
+        }
+    }
+    if (clients < 2 || clients > c_max_clients)
+    {
+        fprintf(stderr, "coalescebench: clients must be 2 to %u\n", unsigned(c_max_clients));
+        return 1;
+    }
+
+    if (!CheckScenarios(clients))
+        return 1;
+
+    // Without coalescing, every client elevates (and asks for consent) on
+    // its own; with it, the burst waits for one elevation.
+    Burst burst = {};
+    burst.clients = clients;
+    burst.elevate_ms = elevate_ms;
+    RunBurst(burst);
+    printf("alone   %4u     %8u elevations\n", clients, clients);
+    printf("burst   %4u     %8u elevations %6.1f ms  (%u ms to elevate, FIFO %s)\n",
+           clients, burst.elevations, burst.elapsed_us / 1000.0, elevate_ms, burst.fifo ? "yes" : "NO");
+
+    for (unsigned n = 2; n <= clients; n *= 4)
+        RunTurns(n, rounds);
+    return 0;
+}
@@ -0,0 +1,324 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+#include <wchar.h>
+
+#include "controls.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const wchar_t* const c_priority_names[] =
+{
+    nullptr,
+    L"idle",
+    L"below-normal",
+    L"normal",
+    L"above-normal",
+    L"high",
+};
+
+static const wchar_t* const c_io_priority_names[] =
+{
+    nullptr,
+    L"very-low",
+    L"low",
+    L"normal",
+};
+
+bool
+ProcessControls::Any() const
+{
+    return (priority != PriorityLevel::Default ||
+            io_priority != IoPriorityLevel::Default ||
+            affinity || max_memory || cpu_rate);
+}
+
+static unsigned
+ToLower(wchar_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Compares case-insensitively, up to end (or the terminator).
+static bool
+Matches(const wchar_t* text, const wchar_t* end, const wchar_t* name)
+{
+    for (; text < end && *text; ++text, ++name)
+    {
+        if (!*name || ToLower(*text) != unsigned(*name))
+            return false;
+    }
+    return !*name;
+}
+
+static const wchar_t*
+FindEnd(const wchar_t* text, wchar_t stop)
+{
+    while (*text && *text != stop)
+        ++text;
+    return text;
+}
+
+static bool
+ParseName(const wchar_t* text, const wchar_t* end, const wchar_t* const* names, unsigned count, unsigned& index)
+{
+    for (unsigned i = 1; i < count; ++i)
+    {
+        if (Matches(text, end, names[i]))
+        {
+            index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads decimal digits, failing on overflow.  Stops at the first non-digit.
+static const wchar_t*
+ReadNumber(const wchar_t* p, unsigned long long& value)
+{
+    const wchar_t* const start = p;
+    value = 0;
+    for (; *p >= '0' && *p <= '9'; ++p)
+    {
+        const unsigned digit = *p - '0';
+        if (value > (~0ull - digit) / 10)
+            return nullptr;
+        value = value * 10 + digit;
+    }
+    return (p > start) ? p : nullptr;
+}
+
+static bool
+ParsePriorityRange(const wchar_t* text, const wchar_t* end, PriorityLevel& level)
+{
+    unsigned i;
+    if (!ParseName(text, end, c_priority_names, sizeof(c_priority_names) / sizeof(*c_priority_names), i))
+        return false;
+    level = PriorityLevel(i);
+    return true;
+}
+
+static bool
+ParseIoPriorityRange(const wchar_t* text, const wchar_t* end, IoPriorityLevel& level)
+{
+    unsigned i;
+    if (!ParseName(text, end, c_io_priority_names, sizeof(c_io_priority_names) / sizeof(*c_io_priority_names), i))
+        return false;
+    level = IoPriorityLevel(i);
+    return true;
+}
+
+static bool
+ParseAffinityRange(const wchar_t* text, const wchar_t* end, unsigned long long& mask)
+{
+    mask = 0;
+    if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        const wchar_t* p = text + 2;
+        if (p >= end)
+            return false;
+        for (; p < end; ++p)
+        {
+            const unsigned c = ToLower(*p);
+            const unsigned digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 16;
+            if (digit > 15 || (mask >> 60))
+                return false;
+            mask = (mask << 4) | digit;
+        }
+        return mask != 0;
+    }
+
+    // A list of CPU numbers and ranges, such as 0,2-3.
+    for (const wchar_t* p = text; p < end;)
+    {
+        unsigned long long first, last;
+        p = ReadNumber(p, first);
+        if (!p)
+            return false;
+        last = first;
+        if (*p == '-')
+        {
+            p = ReadNumber(p + 1, last);
+            if (!p)
+                return false;
+        }
+        if (first > last || last >= 64)
+            return false;
+        for (unsigned long long cpu = first; cpu <= last; ++cpu)
+            mask |= 1ull << cpu;
+        if (p < end && *(p++) != ',')
+            return false;
+        if (p == end && p[-1] == ',')
+            return false;
+    }
+    return mask != 0;
+}
+
+static bool
+ParseMemorySizeRange(const wchar_t* text, const wchar_t* end, unsigned long long& bytes)
+{
+    const wchar_t* p = ReadNumber(text, bytes);
+    if (!p)
+        return false;
+
+    unsigned shift = 0;
+    if (p < end)
+    {
+        switch (ToLower(*(p++)))
+        {
+        case 'k':   shift = 10; break;
+        case 'm':   shift = 20; break;
+        case 'g':   shift = 30; break;
+        default:    return false;
+        }
+        if (p < end && ToLower(*p) == 'b')
+            ++p;
+    }
+    if (p != end || (bytes >> (64 - shift - 1)) >> 1)
+        return false;
+    bytes <<= shift;
+    return bytes != 0;
+}
+
+static bool
+ParseCpuRateRange(const wchar_t* text, const wchar_t* end, unsigned& rate)
+{
+    unsigned long long whole;
+    const wchar_t* p = ReadNumber(text, whole);
+    if (!p || whole > 100)
+        return false;
+
+    // Up to two decimals.
+    unsigned fraction = 0;
+    if (p < end && *p == '.')
+    {
+        unsigned digits = 0;
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+        {
+            if (digits >= 2)
+                return false;
+            fraction = fraction * 10 + (*p - '0');
+        }
+        if (!digits)
+            return false;
+        if (digits == 1)
+            fraction *= 10;
+    }
+    if (p < end && *p == '%')
+        ++p;
+    if (p != end)
+        return false;
+
+    rate = unsigned(whole) * 100 + fraction;
+    return rate >= 1 && rate <= 10000;
+}
+
+bool
+ParsePriority(const wchar_t* text, PriorityLevel& level)
+{
+    return ParsePriorityRange(text, text + wcslen(text), level);
+}
+
+bool
+ParseIoPriority(const wchar_t* text, IoPriorityLevel& level)
+{
+    return ParseIoPriorityRange(text, text + wcslen(text), level);
+}
+
+bool
+ParseAffinity(const wchar_t* text, unsigned long long& mask)
+{
+    return ParseAffinityRange(text, text + wcslen(text), mask);
+}
+
+bool
+ParseMemorySize(const wchar_t* text, unsigned long long& bytes)
+{
+    return ParseMemorySizeRange(text, text + wcslen(text), bytes);
+}
+
+bool
+ParseCpuRate(const wchar_t* text, unsigned& rate)
+{
+    return ParseCpuRateRange(text, text + wcslen(text), rate);
+}
+
+static wchar_t*
+AppendField(wchar_t* out, const wchar_t* start, const wchar_t* field)
+{
+    if (out > start)
+        *(out++) = ';';
+    while (*field)
+        *(out++) = *(field++);
+    return out;
+}
+
+// The spec is name=value pairs separated by semicolons, using the same
+// names and value syntax as the options.
+void
+FormatControls(const ProcessControls& controls, wchar_t* out)
+{
+    wchar_t* const start = out;
+    wchar_t sz[48];
+    if (controls.priority != PriorityLevel::Default)
+    {
+        swprintf(sz, sizeof(sz) / sizeof(*sz), L"priority=%ls", c_priority_names[unsigned(controls.priority)]);
+        out = AppendField(out, start, sz);
+    }
+    if (controls.io_priority != IoPriorityLevel::Default)
+    {
+        swprintf(sz, sizeof(sz) / sizeof(*sz), L"io-priority=%ls", c_io_priority_names[unsigned(controls.io_priority)]);
+        out = AppendField(out, start, sz);
+    }
+    if (controls.affinity)
+    {
+        swprintf(sz, sizeof(sz) / sizeof(*sz), L"affinity=0x%llx", controls.affinity);
+        out = AppendField(out, start, sz);
+    }
+    if (controls.max_memory)
+    {
+        swprintf(sz, sizeof(sz) / sizeof(*sz), L"max-memory=%llu", controls.max_memory);
+        out = AppendField(out, start, sz);
+    }
+    if (controls.cpu_rate)
+    {
+        swprintf(sz, sizeof(sz) / sizeof(*sz), L"cpu-rate=%u.%02u", controls.cpu_rate / 100, controls.cpu_rate % 100);
+        out = AppendField(out, start, sz);
+    }
+    *out = '\0';
+}
+
+bool
+ParseControls(const wchar_t* spec, ProcessControls& controls)
+{
+    controls = ProcessControls();
+    for (const wchar_t* p = spec; *p;)
+    {
+        const wchar_t* const end = FindEnd(p, ';');
+        const wchar_t* const eq = FindEnd(p, '=');
+        if (eq >= end)
+            return false;
+
+        const wchar_t* const value = eq + 1;
+        bool ok;
+        if (Matches(p, eq, L"priority"))
+            ok = ParsePriorityRange(value, end, controls.priority);
+        else if (Matches(p, eq, L"io-priority"))
+            ok = ParseIoPriorityRange(value, end, controls.io_priority);
+        else if (Matches(p, eq, L"affinity"))
+            ok = ParseAffinityRange(value, end, controls.affinity);
+        else if (Matches(p, eq, L"max-memory"))
+            ok = ParseMemorySizeRange(value, end, controls.max_memory);
+        else if (Matches(p, eq, L"cpu-rate"))
+            ok = ParseCpuRateRange(value, end, controls.cpu_rate);
+        else
+            ok = false;
+        if (!ok)
+            return false;
+
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Scheduling and resource controls for a launched command and everything it
+// starts (--priority, --io-priority, --affinity, --max-memory, --cpu-rate).
+// The values are parsed here; the platform layer applies them before the
+// command runs (see SpawnOptions::controls):  through a job object on
+// Windows, or setpriority, ioprio_set, sched_setaffinity, and setrlimit on
+// Linux.
+
+enum class PriorityLevel : unsigned char
+{
+    Default,                    // Inherited from sudo.
+    Idle,
+    BelowNormal,
+    Normal,
+    AboveNormal,
+    High,
+};
+
+enum class IoPriorityLevel : unsigned char
+{
+    Default,
+    VeryLow,
+    Low,
+    Normal,
+};
+
+struct ProcessControls
+{
+    PriorityLevel       priority = PriorityLevel::Default;
+    IoPriorityLevel     io_priority = IoPriorityLevel::Default;
+    unsigned long long  affinity = 0;       // Mask of CPUs, or 0 for any.
+    unsigned long long  max_memory = 0;     // Bytes, or 0 for no limit.
+    unsigned            cpu_rate = 0;       // Hundredths of a percent of all CPUs, or 0 for no cap.
+
+    bool                Any() const;
+};
+
+// Each returns false if the text is malformed or out of range.
+bool ParsePriority(const wchar_t* text, PriorityLevel& level);          // idle, below-normal, ...
+bool ParseIoPriority(const wchar_t* text, IoPriorityLevel& level);      // very-low, low, normal
+bool ParseAffinity(const wchar_t* text, unsigned long long& mask);      // 0x0f, or 0,2-3
+bool ParseMemorySize(const wchar_t* text, unsigned long long& bytes);   // 1048576, 512K, 64M, 2G
+bool ParseCpuRate(const wchar_t* text, unsigned& rate);                 // 25, 12.5, or 12.5%
+
+// The unelevated sudo forwards the controls to the elevated sudo as a
+// single (hidden) --controls argument.  FormatControls writes at most
+// c_controls_spec_max characters, including the terminator.
+enum : size_t { c_controls_spec_max = 160 };
+void FormatControls(const ProcessControls& controls, wchar_t* out);
+bool ParseControls(const wchar_t* spec, ProcessControls& controls);
@@ -0,0 +1,204 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <string.h>
+#include <wchar.h>
+
+#include "handoff.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Image layout (all numbers are little endian u32 unless noted):
+//
+//  header      "SUDOREQ1", version, image size, char size, string count,
+//              u64 nonce, client pid, flags, jobs, broker timeout, strings
+//              offset, job, u64 job table, u64 trace file, u64 audit journal,
+//              u64 log output file
+//  strings     offset, length for each HandoffString
+//  chars       wchar_t code units; each string is followed by a terminator
+//
+// A string's offset is from the start of the image, or 0 if the string is
+// absent, and its length doesn't include the terminator.  The environment's
+// length includes the terminators between its entries, so it ends with two.
+// The chars are native wchar_t (the image only ever passes between two sudo
+// processes built the same way), which lets a reader use them in place.
+
+static const char c_image_magic[8] = { 'S','U','D','O','R','E','Q','1' };
+static const unsigned c_image_version = 5;
+
+enum
+{
+    c_header_size       = 88,
+    c_string_size       = 8,
+    c_chars_offset      = c_header_size + HANDOFF_STRING_COUNT * c_string_size,
+};
+
+static_assert(c_chars_offset % sizeof(wchar_t) == 0, "Strings must be aligned.");
+
+static void
+PutU32(unsigned char* p, unsigned v)
+{
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void
+PutU64(unsigned char* p, unsigned long long v)
+{
+    PutU32(p, unsigned(v));
+    PutU32(p + 4, unsigned(v >> 32));
+}
+
+static unsigned
+GetU32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (unsigned(p[3]) << 24);
+}
+
+static unsigned long long
+GetU64(const unsigned char* p)
+{
+    return GetU32(p) | ((unsigned long long)GetU32(p + 4) << 32);
+}
+
+// The length of a string in the image, not counting its final terminator.
+static size_t
+StringLength(HandoffString index, const wchar_t* s)
+{
+    if (index != HANDOFF_ENVIRONMENT)
+        return wcslen(s);
+
+    const wchar_t* p = s;
+    while (*p)
+        p += wcslen(p) + 1;
+    return (p > s) ? size_t(p - s) : 1;
+}
+
+size_t
+HandoffImageSize(const HandoffRequest& request)
+{
+    unsigned long long size = c_chars_offset;
+    for (unsigned i = 0; i < HANDOFF_STRING_COUNT; ++i)
+    {
+        const wchar_t* s = request.strings[i];
+        if (s)
+            size += (StringLength(HandoffString(i), s) + 1) * sizeof(wchar_t);
+        if (size > c_handoff_max_size)
+            return 0;
+    }
+    return size_t(size);
+}
+
+void
+WriteHandoff(const HandoffRequest& request, void* p)
+{
+    unsigned char* const image = static_cast<unsigned char*>(p);
+    memset(image, 0, c_chars_offset);
+    memcpy(image, c_image_magic, sizeof(c_image_magic));
+    PutU32(image + 8, c_image_version);
+    PutU32(image + 16, unsigned(sizeof(wchar_t)));
+    PutU32(image + 20, HANDOFF_STRING_COUNT);
+    PutU64(image + 24, request.nonce);
+    PutU32(image + 32, request.client_pid);
+    PutU32(image + 36, request.flags);
+    PutU32(image + 40, request.jobs);
+    PutU32(image + 44, request.broker_timeout);
+    PutU32(image + 48, c_header_size);
+    PutU32(image + 52, request.job);
+    PutU64(image + 56, request.job_table);
+    PutU64(image + 64, request.trace);
+    PutU64(image + 72, request.audit_log);
+    PutU64(image + 80, request.log_output);
+
+    size_t offset = c_chars_offset;
+    for (unsigned i = 0; i < HANDOFF_STRING_COUNT; ++i)
+    {
+        const wchar_t* s = request.strings[i];
+        if (!s)
+            continue;
+        const size_t len = StringLength(HandoffString(i), s);
+        PutU32(image + c_header_size + i * c_string_size, unsigned(offset));
+        PutU32(image + c_header_size + i * c_string_size + 4, unsigned(len));
+        wchar_t* const out = reinterpret_cast<wchar_t*>(image + offset);
+        memcpy(out, s, len * sizeof(wchar_t));
+        out[len] = '\0';
+        offset += (len + 1) * sizeof(wchar_t);
+    }
+
+    // The size goes last; until then the image can't be valid.
+    PutU32(image + 12, unsigned(offset));
+}
+
+bool
+ReadHandoff(const void* p, size_t cb, HandoffRequest& request)
+{
+    memset(&request, 0, sizeof(request));
+    const unsigned char* const image = static_cast<const unsigned char*>(p);
+    if (cb < c_chars_offset || memcmp(image, c_image_magic, sizeof(c_image_magic)) ||
+        GetU32(image + 8) != c_image_version || GetU32(image + 16) != sizeof(wchar_t) ||
+        GetU32(image + 20) != HANDOFF_STRING_COUNT || GetU32(image + 48) != c_header_size)
+        return false;
+
+    const size_t size = GetU32(image + 12);
+    if (size < c_chars_offset || size > cb || size > c_handoff_max_size)
+        return false;
+
+    const unsigned flags = GetU32(image + 36);
+    if ((flags & ~unsigned(HANDOFF_FLAG_ALL)) ||
+        ((flags & HANDOFF_FLAG_DIRECT) && (flags & HANDOFF_FLAG_SHELL)))
+        return false;
+
+    for (unsigned i = 0; i < HANDOFF_STRING_COUNT; ++i)
+    {
+        const unsigned offset = GetU32(image + c_header_size + i * c_string_size);
+        const unsigned len = GetU32(image + c_header_size + i * c_string_size + 4);
+        if (!offset)
+        {
+            if (len)
+                return false;
+            continue;
+        }
+
+        // The string and its terminator must be inside the chars, aligned,
+        // and without any other terminators (except between the entries of
+        // the environment).
+        if (offset < c_chars_offset || offset % sizeof(wchar_t) ||
+            (unsigned long long)offset + ((unsigned long long)len + 1) * sizeof(wchar_t) > size)
+            return false;
+        const wchar_t* const s = reinterpret_cast<const wchar_t*>(image + offset);
+        if (s[len])
+            return false;
+        if (i == HANDOFF_ENVIRONMENT)
+        {
+            if (!len || s[len - 1])
+                return false;
+        }
+        else if (wcslen(s) != len)
+        {
+            return false;
+        }
+        request.strings[i] = s;
+    }
+
+    // Without a batch file (and its text) there must be a command, and there
+    // is always a directory.
+    const wchar_t* const dir = request.strings[HANDOFF_DIR];
+    const wchar_t* const line = request.strings[HANDOFF_LINE];
+    if (!dir || !*dir || !line ||
+        (!*line && (!request.strings[HANDOFF_BATCH] || !request.strings[HANDOFF_BATCH_TEXT])))
+        return false;
+
+    request.nonce = GetU64(image + 24);
+    request.client_pid = GetU32(image + 32);
+    request.flags = flags;
+    request.jobs = GetU32(image + 40);
+    request.broker_timeout = GetU32(image + 44);
+    request.job = GetU32(image + 52);
+    request.job_table = GetU64(image + 56);
+    request.trace = GetU64(image + 64);
+    request.audit_log = GetU64(image + 72);
+    request.log_output = GetU64(image + 80);
+    return true;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// The request the unelevated sudo hands to the elevated sudo.  It is written
+// once into a flat image (in a named shared memory section), so only a nonce
+// goes on the elevated sudo's command line, and nothing is quoted, parsed,
+// or made into a full path a second time.  The image also carries what a
+// command line can't:  the caller's environment, and requests longer than
+// the command line length limit.
+//
+// The image comes from a less trusted process, so ReadHandoff() validates
+// everything before any of it is used.  The strings in a request that was
+// read point into the image.
+
+enum : unsigned
+{
+    HANDOFF_FLAG_BACKGROUND     = 0x0001,
+    HANDOFF_FLAG_DEBUG          = 0x0002,
+    HANDOFF_FLAG_DIRECT         = 0x0004,
+    HANDOFF_FLAG_SHELL          = 0x0008,
+    HANDOFF_FLAG_STATS          = 0x0010,
+    HANDOFF_FLAG_STATS_JSON     = 0x0020,
+    HANDOFF_FLAG_PRESERVE_ENV   = 0x0040,
+    HANDOFF_FLAG_ALL            = 0x007f,
+};
+
+enum HandoffString : unsigned
+{
+    HANDOFF_DIR,                // Absolute directory for the command.
+    HANDOFF_LINE,               // Command line to run (empty with --batch).
+    HANDOFF_ENVIRONMENT,        // NAME=value\0...\0\0, with -E.
+    HANDOFF_BATCH,              // Full path of the batch file, or "-" for stdin.
+    HANDOFF_BATCH_TEXT,         // The batch file's text, read by the client.
+    HANDOFF_CONTROLS,           // As for --controls.
+    HANDOFF_TIMEOUT,            // As typed, for --timeout and --kill-after.
+    HANDOFF_KILL_AFTER,
+    HANDOFF_STRING_COUNT
+};
+
+// Images larger than this are rejected.
+enum : size_t { c_handoff_max_size = 16 * 1024 * 1024 };
+
+struct HandoffRequest
+{
+    unsigned long long  nonce;          // Must match the elevated sudo's command line.
+    unsigned            client_pid;     // The unelevated sudo.
+    unsigned            flags;          // HANDOFF_FLAG_* values.
+    unsigned            jobs;
+    unsigned            broker_timeout;
+    unsigned            job;            // The -b job's ID (see jobrecord.h), or 0.
+    unsigned long long  job_table;      // The client's handle to the job table.
+    unsigned long long  trace;          // The client's handle to the --trace file, or 0.
+    unsigned long long  audit_log;      // The client's handle to the audit journal, or 0.
+    unsigned long long  log_output;     // The client's handle to the --log-output file, or 0.
+    const wchar_t*      strings[HANDOFF_STRING_COUNT];  // nullptr if absent.
+};
+
+// Returns the size of the image for the request, or 0 if it would be larger
+// than c_handoff_max_size.
+size_t HandoffImageSize(const HandoffRequest& request);
+
+// Writes the image, which must have room for HandoffImageSize() bytes.
+void WriteHandoff(const HandoffRequest& request, void* image);
+
+// Validates an image of up to size bytes (a mapped view may be rounded up
+// to a whole page), and fills in the request.  Returns false if the image
+// is malformed, including a missing directory or command.
+bool ReadHandoff(const void* image, size_t size, HandoffRequest& request);
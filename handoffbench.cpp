@@ -0,0 +1,346 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark and fuzzer for the request handoff to the elevated sudo.
+//
+// The benchmark compares handing off a request through an image (writing
+// it, copying it as the elevated sudo copies the shared view, and reading
+// it) with quoting the same request into a command line and parsing it back
+// with the option parser.  The fuzzer round trips random requests, and then
+// feeds truncated and damaged images to ReadHandoff() to check they are
+// rejected or handled safely.
+//
+//      g++ -std=c++17 -O2 handoffbench.cpp handoff.cpp options.cpp cmdline.cpp -o handoffbench
+//      ./handoffbench [-n iterations] [-e env vars] [-z iterations] [-s seed]
+//
+// Building with -DHANDOFF_FUZZER instead provides LLVMFuzzerTestOneInput():
+//
+//      clang++ -std=c++17 -g -fsanitize=fuzzer,address -DHANDOFF_FUZZER handoffbench.cpp handoff.cpp options.cpp cmdline.cpp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "cmdline.h"
+#include "handoff.h"
+#include "options.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Touches every string, so a string that runs past the image shows up under
+// the address sanitizer.
+static size_t
+WalkRequest(const HandoffRequest& request)
+{
+    size_t total = 0;
+    for (const wchar_t* s : request.strings)
+    {
+        if (s)
+            total += wcslen(s);
+    }
+    const wchar_t* env = request.strings[HANDOFF_ENVIRONMENT];
+    for (const wchar_t* p = env; p && *p; p += wcslen(p) + 1)
+        ++total;
+    return total;
+}
+
+#ifdef HANDOFF_FUZZER
+
+extern "C" int
+LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+    // Copied, so the image is aligned the way a mapped view is.
+    wchar_t* copy = static_cast<wchar_t*>(malloc(size + sizeof(wchar_t)));
+    memcpy(copy, data, size);
+    HandoffRequest request;
+    if (ReadHandoff(copy, size, request))
+        WalkRequest(request);
+    free(copy);
+    return 0;
+}
+
+#else // !HANDOFF_FUZZER
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static wchar_t*
+RandomString(unsigned max)
+{
+    static const wchar_t c_chars[] = L"abcXYZ019 \t\"\\=;:.-\x00e9\x4e2d";
+    const unsigned len = Random(max + 1);
+    wchar_t* s = static_cast<wchar_t*>(malloc((len + 1) * sizeof(*s)));
+    for (unsigned i = 0; i < len; ++i)
+        s[i] = c_chars[Random(sizeof(c_chars) / sizeof(*c_chars) - 1)];
+    s[len] = '\0';
+    return s;
+}
+
+static wchar_t*
+RandomEnvironment(unsigned count)
+{
+    size_t len = 0;
+    wchar_t* block = static_cast<wchar_t*>(malloc((count * 48 + 2) * sizeof(*block)));
+    for (unsigned i = 0; i < count; ++i)
+        len += swprintf(block + len, 48, L"VAR%u=%u", i, Random(1000000)) + 1;
+    block[len++] = '\0';
+    if (len == 1)
+        block[len++] = '\0';
+    return block;
+}
+
+static bool
+SameString(const wchar_t* a, const wchar_t* b, bool env)
+{
+    if (!a || !b)
+        return a == b;
+    if (!env)
+        return !wcscmp(a, b);
+    for (;;)
+    {
+        if (wcscmp(a, b))
+            return false;
+        if (!*a)
+            return true;
+        a += wcslen(a) + 1;
+        b += wcslen(b) + 1;
+    }
+}
+
+static bool
+FuzzRoundTrip(unsigned iterations)
+{
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        HandoffRequest request = {};
+        request.nonce = ((unsigned long long)Random(1u << 24) << 40) | Random(1u << 24);
+        request.client_pid = Random(65536);
+        request.flags = Random(HANDOFF_FLAG_ALL + 1) & ~unsigned(HANDOFF_FLAG_SHELL);
+        request.jobs = Random(64);
+        request.broker_timeout = Random(3600);
+        request.job = Random(1000);
+        request.job_table = ((unsigned long long)Random(1u << 24) << 32) | Random(1u << 24);
+        request.trace = Random(2) ? Random(1u << 16) * 4 : 0;
+        request.audit_log = Random(2) ? Random(1u << 16) * 4 : 0;
+        request.log_output = Random(2) ? Random(1u << 16) * 4 : 0;
+        for (unsigned i = 0; i < HANDOFF_STRING_COUNT; ++i)
+        {
+            if (i == HANDOFF_ENVIRONMENT)
+                request.strings[i] = Random(2) ? RandomEnvironment(Random(8)) : nullptr;
+            else if (i == HANDOFF_DIR || i == HANDOFF_LINE || Random(2))
+                request.strings[i] = RandomString(40);
+        }
+        if (!*request.strings[HANDOFF_DIR] || !*request.strings[HANDOFF_LINE])
+        {
+            for (const wchar_t* s : request.strings)
+                free(const_cast<wchar_t*>(s));
+            continue;
+        }
+
+        const size_t size = HandoffImageSize(request);
+        wchar_t* image = static_cast<wchar_t*>(malloc(size));
+        WriteHandoff(request, image);
+
+        HandoffRequest read;
+        if (!ReadHandoff(image, size, read) || read.nonce != request.nonce || read.client_pid != request.client_pid ||
+            read.flags != request.flags || read.jobs != request.jobs || read.broker_timeout != request.broker_timeout ||
+            read.job != request.job || read.job_table != request.job_table || read.trace != request.trace ||
+            read.audit_log != request.audit_log || read.log_output != request.log_output)
+        {
+            fprintf(stderr, "round trip failed for iteration %u.\n", n);
+            return false;
+        }
+        for (unsigned i = 0; i < HANDOFF_STRING_COUNT; ++i)
+        {
+            if (!SameString(request.strings[i], read.strings[i], i == HANDOFF_ENVIRONMENT))
+            {
+                fprintf(stderr, "string %u differs for iteration %u.\n", i, n);
+                return false;
+            }
+        }
+
+        // Truncate and damage the image; neither may crash, and a truncated
+        // image is never valid.
+        for (unsigned m = 0; m < 8; ++m)
+        {
+            const size_t short_size = Random(unsigned(size));
+            wchar_t* truncated = static_cast<wchar_t*>(malloc(short_size + sizeof(wchar_t)));
+            memcpy(truncated, image, short_size);
+            if (ReadHandoff(truncated, short_size, read))
+            {
+                fprintf(stderr, "truncated image accepted for iteration %u.\n", n);
+                return false;
+            }
+            free(truncated);
+
+            wchar_t* damaged = static_cast<wchar_t*>(malloc(size));
+            memcpy(damaged, image, size);
+            for (unsigned k = 1 + Random(4); k--;)
+                reinterpret_cast<unsigned char*>(damaged)[Random(unsigned(size))] = (unsigned char)Random(256);
+            if (ReadHandoff(damaged, size, read))
+                WalkRequest(read);
+            free(damaged);
+        }
+
+        free(image);
+        for (const wchar_t* s : request.strings)
+            free(const_cast<wchar_t*>(s));
+    }
+
+    printf("fuzz             %8u requests round tripped\n", iterations);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static const wchar_t* const c_dir = L"C:\\Users\\alice\\source\\repos\\project";
+static const wchar_t* const c_line = L"msbuild \"Project With Spaces.sln\" /t:Rebuild /p:Configuration=Release /m";
+static const wchar_t* const c_log = L"C:\\Users\\alice\\AppData\\Local\\Temp\\build session.log";
+static const wchar_t* const c_trace = L"C:\\Users\\alice\\trace.json";
+static const wchar_t* const c_controls = L"priority=below-normal;affinity=0xf";
+
+// The way the request crossed before:  quoted into the elevated sudo's
+// command line, and parsed back.
+static size_t
+ForwardByCommandLine()
+{
+    CommandLineBuilder args;
+    args.Arg(L"--elevated");
+    args.Arg(1234u);
+    args.Arg(L"--broker");
+    args.Arg(0u);
+    args.Arg(L"-j");
+    args.Arg(1u);
+    args.Arg(L"--log-output");
+    args.Arg(c_log);
+    args.Arg(L"--trace");
+    args.Arg(c_trace);
+    args.Arg(L"--controls");
+    args.Arg(c_controls);
+    args.Arg(L"-D");
+    args.Arg(c_dir);
+    args.Arg(L"--");
+    args.Raw(c_line);
+    wchar_t* line = args.Build();
+
+    wchar_t* storage = static_cast<wchar_t*>(malloc(OptionParser::StorageNeeded(line) * sizeof(wchar_t)));
+    OptionParser parser(line, storage);
+    size_t total = 0;
+    for (OptionId id; (id = parser.Next()) != OptionId::None;)
+        total += parser.Value() ? wcslen(parser.Value()) : 1;
+    total += wcslen(parser.Remaining());
+    free(storage);
+    free(line);
+    return total;
+}
+
+static size_t
+ForwardByHandoff(const wchar_t* env)
+{
+    HandoffRequest request = {};
+    request.nonce = 0x0123456789abcdefull;
+    request.client_pid = 1234;
+    request.jobs = 1;
+    request.strings[HANDOFF_DIR] = c_dir;
+    request.strings[HANDOFF_LINE] = c_line;
+    request.strings[HANDOFF_ENVIRONMENT] = env;
+    request.trace = 0x2c;
+    request.log_output = 0x30;
+    request.strings[HANDOFF_CONTROLS] = c_controls;
+
+    const size_t size = HandoffImageSize(request);
+    void* shared = malloc(size);
+    WriteHandoff(request, shared);
+
+    // The elevated sudo reads from a private copy of the shared view.
+    void* copy = malloc(size);
+    memcpy(copy, shared, size);
+    HandoffRequest read;
+    const size_t total = ReadHandoff(copy, size, read) ? WalkRequest(read) : 0;
+    free(copy);
+    free(shared);
+    return total;
+}
+
+static void
+RunBench(unsigned iterations, unsigned env_count)
+{
+    size_t sink = 0;
+    unsigned long long start = NowMicroseconds();
+    for (unsigned i = 0; i < iterations; ++i)
+        sink += ForwardByCommandLine();
+    const unsigned long long line_time = NowMicroseconds() - start;
+
+    start = NowMicroseconds();
+    for (unsigned i = 0; i < iterations; ++i)
+        sink += ForwardByHandoff(nullptr);
+    const unsigned long long handoff_time = NowMicroseconds() - start;
+
+    wchar_t* env = RandomEnvironment(env_count);
+    start = NowMicroseconds();
+    for (unsigned i = 0; i < iterations; ++i)
+        sink += ForwardByHandoff(env);
+    const unsigned long long env_time = NowMicroseconds() - start;
+    free(env);
+
+    printf("command line     %8u requests %8.1f ms  %10.3f us/request\n",
+           iterations, line_time / 1000.0, double(line_time) / iterations);
+    printf("handoff          %8u requests %8.1f ms  %10.3f us/request\n",
+           iterations, handoff_time / 1000.0, double(handoff_time) / iterations);
+    printf("handoff with env %8u requests %8.1f ms  %10.3f us/request  (%u variables)\n",
+           iterations, env_time / 1000.0, double(env_time) / iterations, env_count);
+    if (!sink)
+        printf("\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned iterations = 200000;
+    unsigned env_count = 60;
+    unsigned fuzz = 2000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            env_count = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+            fuzz = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: handoffbench [-n iterations] [-e env vars] [-z iterations] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!iterations)
+        return 1;
+
+    if (!FuzzRoundTrip(fuzz))
+        return 1;
+    RunBench(iterations, env_count);
+    return 0;
+}
+
+#endif // !HANDOFF_FUZZER
@@ -0,0 +1,799 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "iolog.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// File layout (see iolog.h):
+//
+//  header      "SUDOIOLG", u32 version, u32 reserved, u64 start_time,
+//              u64 reserved
+//  chunk...    u32 "CHNK", u16 flags, u16 reserved, u32 raw_size,
+//              u32 stored_size, u64 first_time, u64 last_time, and then
+//              stored_size bytes of data
+//  index       u32 "INDX", u32 count, and count entries of u64 offset,
+//              u64 first_time, u64 last_time
+//  footer      u32 "IEND", u32 count, u64 index offset
+//
+// The data in a chunk is a series of events:  a varint time delta from the
+// previous event (or from first_time), a stream byte, a varint length, and
+// the bytes.
+
+static const char c_file_magic[8] = { 'S','U','D','O','I','O','L','G' };
+static const unsigned c_file_version = 1;
+static const unsigned c_chunk_magic = 0x4b4e4843;   // "CHNK"
+static const unsigned c_index_magic = 0x58444e49;   // "INDX"
+static const unsigned c_footer_magic = 0x444e4549;  // "IEND"
+
+enum
+{
+    c_file_header_size = 32,
+    c_chunk_header_size = 32,
+    c_index_entry_size = 24,
+    c_footer_size = 16,
+    c_chunk_size = 64 * 1024,
+    c_packed_size = c_chunk_size + c_chunk_size / 255 + 64,
+    c_max_event_header = 10 + 1 + 10,
+    c_ring_size = 1024 * 1024,
+    c_flush_interval = 1000000,     // Microseconds.
+};
+
+enum
+{
+    CHUNK_FLAG_COMPRESSED       = 0x0001,
+};
+
+//------------------------------------------------------------------------------
+static void
+PutU16(unsigned char* p, unsigned v)
+{
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void
+PutU32(unsigned char* p, unsigned v)
+{
+    PutU16(p, v & 0xffff);
+    PutU16(p + 2, v >> 16);
+}
+
+static void
+PutU64(unsigned char* p, unsigned long long v)
+{
+    PutU32(p, unsigned(v));
+    PutU32(p + 4, unsigned(v >> 32));
+}
+
+static unsigned
+GetU16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned
+GetU32(const unsigned char* p)
+{
+    return GetU16(p) | (GetU16(p + 2) << 16);
+}
+
+static unsigned long long
+GetU64(const unsigned char* p)
+{
+    return GetU32(p) | ((unsigned long long)GetU32(p + 4) << 32);
+}
+
+static unsigned char*
+PutVarint(unsigned char* p, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        *(p++) = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *(p++) = (unsigned char)v;
+    return p;
+}
+
+static bool
+GetVarint(const unsigned char*& p, const unsigned char* end, unsigned long long& v)
+{
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (p >= end)
+            return false;
+        const unsigned char c = *(p++);
+        v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Each sequence is a token byte (high nibble is the literal length, low
+// nibble is the match length minus 4; 15 means more length bytes follow,
+// each adding up to 255), the literals, a u16 match offset, and any more
+// match length bytes.  The last sequence has only literals.
+
+enum
+{
+    c_min_match = 4,
+    c_hash_bits = 12,
+    c_max_offset = 0xffff,
+};
+
+static unsigned
+Read32(const unsigned char* p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned
+Hash(unsigned v)
+{
+    return (v * 2654435761u) >> (32 - c_hash_bits);
+}
+
+static unsigned char*
+PutLength(unsigned char* out, unsigned char* end, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (out >= end)
+            return nullptr;
+        *(out++) = 255;
+    }
+    if (out >= end)
+        return nullptr;
+    *(out++) = (unsigned char)len;
+    return out;
+}
+
+static unsigned char*
+PutSequence(unsigned char* out, unsigned char* end, const unsigned char* lit, size_t cb_lit, size_t offset, size_t match)
+{
+    if (out >= end)
+        return nullptr;
+
+    const size_t ml = match ? match - c_min_match : 0;
+    unsigned char* token = out++;
+    *token = (unsigned char)(((cb_lit < 15 ? cb_lit : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (cb_lit >= 15 && !(out = PutLength(out, end, cb_lit - 15)))
+        return nullptr;
+    if (size_t(end - out) < cb_lit)
+        return nullptr;
+    memcpy(out, lit, cb_lit);
+    out += cb_lit;
+
+    if (match)
+    {
+        if (end - out < 2)
+            return nullptr;
+        PutU16(out, unsigned(offset));
+        out += 2;
+        if (ml >= 15 && !(out = PutLength(out, end, ml - 15)))
+            return nullptr;
+    }
+    return out;
+}
+
+size_t
+IoLogCompress(const unsigned char* src, size_t cb_src, unsigned char* dst, size_t cb_dst)
+{
+    unsigned table[1 << c_hash_bits];       // Position + 1; 0 means none.
+    memset(table, 0, sizeof(table));
+
+    unsigned char* out = dst;
+    unsigned char* const end = dst + cb_dst;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    while (i + c_min_match <= cb_src)
+    {
+        const unsigned h = Hash(Read32(src + i));
+        const size_t candidate = table[h];
+        table[h] = unsigned(i + 1);
+
+        if (candidate && i - (candidate - 1) <= c_max_offset &&
+            Read32(src + candidate - 1) == Read32(src + i))
+        {
+            const size_t from = candidate - 1;
+            size_t len = c_min_match;
+            while (i + len < cb_src && src[from + len] == src[i + len])
+                ++len;
+
+            out = PutSequence(out, end, src + anchor, i - anchor, i - from, len);
+            if (!out)
+                return 0;
+
+            i += len;
+            anchor = i;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    out = PutSequence(out, end, src + anchor, cb_src - anchor, 0, 0);
+    return out ? size_t(out - dst) : 0;
+}
+
+static bool
+GetLength(const unsigned char*& p, const unsigned char* end, size_t& len)
+{
+    unsigned char c;
+    do
+    {
+        if (p >= end)
+            return false;
+        c = *(p++);
+        len += c;
+    }
+    while (c == 255);
+    return true;
+}
+
+bool
+IoLogDecompress(const unsigned char* src, size_t cb_src, unsigned char* dst, size_t cb_dst)
+{
+    const unsigned char* p = src;
+    const unsigned char* const end = src + cb_src;
+    size_t out = 0;
+
+    while (p < end)
+    {
+        const unsigned token = *(p++);
+
+        size_t cb_lit = token >> 4;
+        if (cb_lit == 15 && !GetLength(p, end, cb_lit))
+            return false;
+        if (size_t(end - p) < cb_lit || cb_dst - out < cb_lit)
+            return false;
+        memcpy(dst + out, p, cb_lit);
+        p += cb_lit;
+        out += cb_lit;
+
+        if (p >= end)
+            break;
+
+        if (end - p < 2)
+            return false;
+        const size_t offset = GetU16(p);
+        p += 2;
+        size_t match = token & 0x0f;
+        if (match == 15 && !GetLength(p, end, match))
+            return false;
+        match += c_min_match;
+        if (!offset || offset > out || cb_dst - out < match)
+            return false;
+
+        // The match can overlap what it produces, so copy forward one byte
+        // at a time.
+        const unsigned char* from = dst + out - offset;
+        for (size_t j = 0; j < match; ++j)
+            dst[out + j] = from[j];
+        out += match;
+    }
+
+    return out == cb_dst;
+}
+
+//------------------------------------------------------------------------------
+IoLogRing::~IoLogRing()
+{
+    free(m_buffer);
+    free(m_scratch);
+}
+
+bool
+IoLogRing::Init(size_t capacity)
+{
+    size_t size = 64;
+    while (size < capacity)
+        size *= 2;
+
+    m_buffer = static_cast<unsigned char*>(malloc(size));
+    m_scratch = static_cast<unsigned char*>(malloc(size));
+    if (!m_buffer || !m_scratch)
+        return false;
+
+    m_capacity = size;
+    return true;
+}
+
+void
+IoLogRing::CopyIn(size_t pos, const void* p, size_t cb)
+{
+    const size_t at = pos & (m_capacity - 1);
+    const size_t first = (cb < m_capacity - at) ? cb : m_capacity - at;
+    memcpy(m_buffer + at, p, first);
+    memcpy(m_buffer, static_cast<const unsigned char*>(p) + first, cb - first);
+}
+
+void
+IoLogRing::CopyOut(size_t pos, void* p, size_t cb) const
+{
+    const size_t at = pos & (m_capacity - 1);
+    const size_t first = (cb < m_capacity - at) ? cb : m_capacity - at;
+    memcpy(p, m_buffer + at, first);
+    memcpy(static_cast<unsigned char*>(p) + first, m_buffer, cb - first);
+}
+
+bool
+IoLogRing::Push(IoLogTime time, const void* p, size_t cb)
+{
+    const size_t need = sizeof(Record) + cb;
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    if (!m_buffer || m_capacity - (head - tail) < need)
+    {
+        m_dropped.fetch_add(cb, std::memory_order_relaxed);
+        return false;
+    }
+
+    const Record record = { time, cb };
+    CopyIn(head, &record, sizeof(record));
+    CopyIn(head + sizeof(record), p, cb);
+    m_head.store(head + need, std::memory_order_release);
+    return true;
+}
+
+bool
+IoLogRing::Front(IoLogTime& time, const unsigned char*& p, size_t& cb)
+{
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    if (head == tail)
+        return false;
+
+    Record record;
+    CopyOut(tail, &record, sizeof(record));
+
+    // Hand out a pointer into the ring when the data is contiguous, and
+    // otherwise a copy.
+    const size_t at = (tail + sizeof(record)) & (m_capacity - 1);
+    if (record.cb <= m_capacity - at)
+    {
+        p = m_buffer + at;
+    }
+    else
+    {
+        CopyOut(tail + sizeof(record), m_scratch, record.cb);
+        p = m_scratch;
+    }
+
+    time = record.time;
+    cb = record.cb;
+    m_front = sizeof(record) + record.cb;
+    return true;
+}
+
+void
+IoLogRing::Pop()
+{
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    m_tail.store(tail + m_front, std::memory_order_release);
+    m_front = 0;
+}
+
+//------------------------------------------------------------------------------
+IoLogWriter::~IoLogWriter()
+{
+    free(m_raw);
+    free(m_packed);
+    free(m_index);
+}
+
+bool
+IoLogWriter::Write(const void* p, size_t cb)
+{
+    if (m_failed || !m_write(p, cb, m_context))
+    {
+        m_failed = true;
+        return false;
+    }
+    m_offset += cb;
+    return true;
+}
+
+bool
+IoLogWriter::Begin(unsigned long long start_time, IoLogWriteProc write, void* context)
+{
+    m_write = write;
+    m_context = context;
+    m_raw = static_cast<unsigned char*>(malloc(c_chunk_size));
+    m_packed = static_cast<unsigned char*>(malloc(c_packed_size));
+    if (!m_raw || !m_packed)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    unsigned char header[c_file_header_size] = {};
+    memcpy(header, c_file_magic, sizeof(c_file_magic));
+    PutU32(header + 8, c_file_version);
+    PutU64(header + 16, start_time);
+    return Write(header, sizeof(header));
+}
+
+bool
+IoLogWriter::Add(IoLogStream stream, IoLogTime time, const void* p, size_t cb)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(p);
+
+    // Events are pieces of a byte stream, so an event that doesn't fit in
+    // the chunk can simply be split.
+    do
+    {
+        if (m_failed)
+            return false;
+
+        if (c_chunk_size - m_raw_size <= c_max_event_header && !Flush())
+            return false;
+
+        if (!m_raw_size)
+            m_first_time = m_last_time = time;
+        if (time < m_last_time)
+            time = m_last_time;
+
+        const size_t room = c_chunk_size - m_raw_size - c_max_event_header;
+        const size_t take = (cb < room) ? cb : room;
+
+        unsigned char* out = m_raw + m_raw_size;
+        out = PutVarint(out, time - m_last_time);
+        *(out++) = (unsigned char)stream;
+        out = PutVarint(out, take);
+        memcpy(out, bytes, take);
+        out += take;
+
+        m_raw_size = size_t(out - m_raw);
+        m_last_time = time;
+        bytes += take;
+        cb -= take;
+    }
+    while (cb);
+
+    return true;
+}
+
+bool
+IoLogWriter::Flush()
+{
+    if (!m_raw_size)
+        return !m_failed;
+
+    if (m_index_count >= m_index_capacity)
+    {
+        const unsigned capacity = m_index_capacity ? m_index_capacity * 2 : 64;
+        IndexEntry* index = static_cast<IndexEntry*>(realloc(m_index, capacity * sizeof(*index)));
+        if (!index)
+        {
+            m_failed = true;
+            return false;
+        }
+        m_index = index;
+        m_index_capacity = capacity;
+    }
+    m_index[m_index_count++] = { m_offset, m_first_time, m_last_time };
+
+    size_t stored = IoLogCompress(m_raw, m_raw_size, m_packed, m_raw_size - 1);
+    const bool compressed = (stored != 0);
+    if (!compressed)
+        stored = m_raw_size;
+
+    unsigned char header[c_chunk_header_size] = {};
+    PutU32(header + 0, c_chunk_magic);
+    PutU16(header + 4, compressed ? CHUNK_FLAG_COMPRESSED : 0);
+    PutU32(header + 8, unsigned(m_raw_size));
+    PutU32(header + 12, unsigned(stored));
+    PutU64(header + 16, m_first_time);
+    PutU64(header + 24, m_last_time);
+
+    m_raw_size = 0;
+    return Write(header, sizeof(header)) && Write(compressed ? m_packed : m_raw, stored);
+}
+
+bool
+IoLogWriter::Finish()
+{
+    if (!Flush())
+        return false;
+
+    const unsigned long long index_offset = m_offset;
+
+    unsigned char header[8];
+    PutU32(header + 0, c_index_magic);
+    PutU32(header + 4, m_index_count);
+    if (!Write(header, sizeof(header)))
+        return false;
+
+    for (unsigned i = 0; i < m_index_count; ++i)
+    {
+        unsigned char entry[c_index_entry_size];
+        PutU64(entry + 0, m_index[i].offset);
+        PutU64(entry + 8, m_index[i].first_time);
+        PutU64(entry + 16, m_index[i].last_time);
+        if (!Write(entry, sizeof(entry)))
+            return false;
+    }
+
+    unsigned char footer[c_footer_size];
+    PutU32(footer + 0, c_footer_magic);
+    PutU32(footer + 4, m_index_count);
+    PutU64(footer + 8, index_offset);
+    return Write(footer, sizeof(footer));
+}
+
+//------------------------------------------------------------------------------
+bool
+IoLogRecorder::Begin(unsigned long long start_time, IoLogWriteProc write, void* context)
+{
+    for (IoLogRing& ring : m_rings)
+    {
+        if (!ring.Init(c_ring_size))
+            return false;
+    }
+    return m_writer.Begin(start_time, write, context);
+}
+
+bool
+IoLogRecorder::Record(IoLogStream stream, IoLogTime time, const void* p, size_t cb)
+{
+    return m_rings[unsigned(stream)].Push(time, p, cb);
+}
+
+bool
+IoLogRecorder::Drain(IoLogTime now)
+{
+    bool ok = true;
+
+    // Merge the streams in time order.
+    for (;;)
+    {
+        unsigned which = c_streams;
+        IoLogTime time = 0;
+        const unsigned char* p = nullptr;
+        size_t cb = 0;
+        for (unsigned i = 0; i < c_streams; ++i)
+        {
+            IoLogTime t;
+            const unsigned char* pp;
+            size_t cbcb;
+            if (m_rings[i].Front(t, pp, cbcb) && (which == c_streams || t < time))
+            {
+                which = i;
+                time = t;
+                p = pp;
+                cb = cbcb;
+            }
+        }
+        if (which == c_streams)
+            break;
+
+        if (!m_writer.Add(IoLogStream(which), time, p, cb))
+            ok = false;
+        m_rings[which].Pop();
+    }
+
+    for (IoLogRing& ring : m_rings)
+    {
+        const unsigned long long dropped = ring.TakeDropped();
+        if (dropped)
+        {
+            unsigned char count[10];
+            const size_t len = size_t(PutVarint(count, dropped) - count);
+            if (!m_writer.Add(IoLogStream::Dropped, now, count, len))
+                ok = false;
+        }
+    }
+
+    // Write out a partial chunk once it gets old enough, so that a
+    // recording that gets cut off loses at most about a second.
+    if (m_writer.HasPending() && now - m_writer.PendingSince() >= c_flush_interval)
+        ok = m_writer.Flush() && ok;
+
+    return ok;
+}
+
+bool
+IoLogRecorder::Finish(IoLogTime now)
+{
+    const bool ok = Drain(now);
+    return m_writer.Finish() && ok;
+}
+
+//------------------------------------------------------------------------------
+IoLogReader::~IoLogReader()
+{
+    free(m_chunks);
+}
+
+bool
+IoLogReader::AddChunk(const IoLogChunkInfo& info)
+{
+    if (m_count >= m_capacity)
+    {
+        const unsigned capacity = m_capacity ? m_capacity * 2 : 64;
+        IoLogChunkInfo* chunks = static_cast<IoLogChunkInfo*>(realloc(m_chunks, capacity * sizeof(*chunks)));
+        if (!chunks)
+            return false;
+        m_chunks = chunks;
+        m_capacity = capacity;
+    }
+    m_chunks[m_count++] = info;
+    return true;
+}
+
+bool
+IoLogReader::Open(unsigned long long size, IoLogReadProc read, void* context)
+{
+    m_read = read;
+    m_context = context;
+    m_size = size;
+
+    unsigned char header[c_file_header_size];
+    if (size < sizeof(header) || !read(0, header, sizeof(header), context))
+        return false;
+    if (memcmp(header, c_file_magic, sizeof(c_file_magic)) || GetU32(header + 8) != c_file_version)
+        return false;
+    m_start_time = GetU64(header + 16);
+
+    m_has_index = LoadIndex();
+    if (!m_has_index)
+    {
+        m_count = 0;
+        return ScanChunks();
+    }
+    return true;
+}
+
+bool
+IoLogReader::LoadIndex()
+{
+    if (m_size < c_file_header_size + 8 + c_footer_size)
+        return false;
+
+    unsigned char footer[c_footer_size];
+    if (!m_read(m_size - sizeof(footer), footer, sizeof(footer), m_context))
+        return false;
+    if (GetU32(footer) != c_footer_magic)
+        return false;
+
+    const unsigned count = GetU32(footer + 4);
+    const unsigned long long offset = GetU64(footer + 8);
+    if (offset < c_file_header_size ||
+        offset + 8 + (unsigned long long)count * c_index_entry_size + c_footer_size != m_size)
+        return false;
+
+    unsigned char header[8];
+    if (!m_read(offset, header, sizeof(header), m_context))
+        return false;
+    if (GetU32(header) != c_index_magic || GetU32(header + 4) != count)
+        return false;
+
+    unsigned long long pos = offset + sizeof(header);
+    for (unsigned i = 0; i < count; ++i, pos += c_index_entry_size)
+    {
+        unsigned char entry[c_index_entry_size];
+        if (!m_read(pos, entry, sizeof(entry), m_context))
+            return false;
+        const IoLogChunkInfo info = { GetU64(entry), GetU64(entry + 8), GetU64(entry + 16) };
+        if (info.offset < c_file_header_size || info.offset >= offset)
+            return false;
+        if (!AddChunk(info))
+            return false;
+    }
+    return true;
+}
+
+bool
+IoLogReader::ScanChunks()
+{
+    // Skip from chunk header to chunk header, stopping at the index or at a
+    // chunk that was cut off.
+    unsigned long long pos = c_file_header_size;
+    while (pos + c_chunk_header_size <= m_size)
+    {
+        unsigned char header[c_chunk_header_size];
+        if (!m_read(pos, header, sizeof(header), m_context))
+            return false;
+        if (GetU32(header) != c_chunk_magic)
+            break;
+
+        const unsigned long long next = pos + sizeof(header) + GetU32(header + 12);
+        if (next > m_size)
+            break;
+
+        const IoLogChunkInfo info = { pos, GetU64(header + 16), GetU64(header + 24) };
+        if (!AddChunk(info))
+            return false;
+        pos = next;
+    }
+    return true;
+}
+
+unsigned
+IoLogReader::FindChunk(IoLogTime time) const
+{
+    unsigned lo = 0;
+    unsigned hi = m_count;
+    while (lo < hi)
+    {
+        const unsigned mid = lo + (hi - lo) / 2;
+        if (m_chunks[mid].last_time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool
+IoLogReader::ReadChunk(unsigned index, IoLogEventProc proc, void* context)
+{
+    if (index >= m_count)
+        return false;
+
+    const IoLogChunkInfo& info = m_chunks[index];
+    unsigned char header[c_chunk_header_size];
+    if (!m_read(info.offset, header, sizeof(header), m_context) || GetU32(header) != c_chunk_magic)
+        return false;
+
+    const unsigned flags = GetU16(header + 4);
+    const size_t raw_size = GetU32(header + 8);
+    const size_t stored = GetU32(header + 12);
+    if (raw_size > c_chunk_size || stored > c_packed_size)
+        return false;
+
+    unsigned char* const raw = static_cast<unsigned char*>(malloc(raw_size + 1));
+    unsigned char* const packed = static_cast<unsigned char*>(malloc(stored + 1));
+    bool ok = (raw && packed && m_read(info.offset + sizeof(header), packed, stored, m_context));
+    if (ok)
+    {
+        if (flags & CHUNK_FLAG_COMPRESSED)
+            ok = IoLogDecompress(packed, stored, raw, raw_size);
+        else if (stored == raw_size)
+            memcpy(raw, packed, raw_size);
+        else
+            ok = false;
+    }
+
+    const unsigned char* p = raw;
+    const unsigned char* const end = raw + raw_size;
+    IoLogTime time = info.first_time;
+    while (ok && p < end)
+    {
+        unsigned long long delta;
+        unsigned long long cb;
+        if (!GetVarint(p, end, delta) || p >= end)
+        {
+            ok = false;
+            break;
+        }
+        const unsigned stream = *(p++);
+        if (!GetVarint(p, end, cb) || cb > (unsigned long long)(end - p) || stream >= unsigned(IoLogStream::Count))
+        {
+            ok = false;
+            break;
+        }
+
+        time += delta;
+        if (!proc(IoLogStream(stream), time, p, size_t(cb), context))
+            ok = false;
+        p += cb;
+    }
+
+    free(raw);
+    free(packed);
+    return ok;
+}
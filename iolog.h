@@ -0,0 +1,197 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+// Records a command's stdin, stdout, and stderr for --log-output, and reads
+// the recording back for sudoreplay.
+//
+// The file starts with a header, followed by chunks.  Each chunk holds the
+// events from a span of time, compressed together, and its header says what
+// span of time it covers and how large it is.  So a reader can find any time
+// offset by skipping from chunk header to chunk header, and only needs to
+// decompress the chunk it lands in.  When the recording finishes normally,
+// an index of the chunks is appended at the end, so a reader doesn't even
+// need to skip through the chunk headers.  A recording that was cut off
+// (e.g. by a crash) is still readable up to its last complete chunk.
+//
+// Times are in microseconds since the recording started.  All numbers in the
+// file are little endian.
+
+typedef unsigned long long IoLogTime;
+
+enum class IoLogStream : unsigned char
+{
+    Stdin,
+    Stdout,
+    Stderr,
+    Dropped,                    // The data is a count of bytes not recorded.
+    Count
+};
+
+// Single producer, single consumer byte queue.  Push() never blocks and
+// never allocates; if the queue is full, the data is dropped and counted
+// instead, so that recording never slows down the command.
+class IoLogRing
+{
+public:
+                    IoLogRing() = default;
+                    ~IoLogRing();
+
+    bool            Init(size_t capacity);  // Rounded up to a power of 2.
+
+    // Producer.
+    bool            Push(IoLogTime time, const void* p, size_t cb);
+
+    // Consumer.  Front() returns false if the queue is empty; otherwise the
+    // record is valid until Pop().
+    bool            Front(IoLogTime& time, const unsigned char*& p, size_t& cb);
+    void            Pop();
+    unsigned long long TakeDropped() { return m_dropped.exchange(0); }
+
+private:
+    struct Record
+    {
+        IoLogTime       time;
+        size_t          cb;
+    };
+
+    void            CopyIn(size_t pos, const void* p, size_t cb);
+    void            CopyOut(size_t pos, void* p, size_t cb) const;
+
+    unsigned char*  m_buffer = nullptr;
+    size_t          m_capacity = 0;
+    unsigned char*  m_scratch = nullptr;    // For records that wrap around.
+    size_t          m_front = 0;            // Size of the record at Front().
+    std::atomic<size_t> m_head { 0 };       // Written by the producer.
+    std::atomic<size_t> m_tail { 0 };       // Written by the consumer.
+    std::atomic<unsigned long long> m_dropped { 0 };
+
+                    IoLogRing(const IoLogRing&) = delete;
+    IoLogRing&      operator=(const IoLogRing&) = delete;
+};
+
+// Appends to the file.  Returns false on error.
+typedef bool (*IoLogWriteProc)(const void* p, size_t cb, void* context);
+
+// Formats events into chunks, and writes the chunks and the index.
+class IoLogWriter
+{
+public:
+                    IoLogWriter() = default;
+                    ~IoLogWriter();
+
+    // start_time is the wall clock time when recording started, in
+    // microseconds since 1970-01-01 UTC.
+    bool            Begin(unsigned long long start_time, IoLogWriteProc write, void* context);
+    bool            Add(IoLogStream stream, IoLogTime time, const void* p, size_t cb);
+    bool            Flush();                // Writes any partial chunk.
+    bool            Finish();               // Flushes and writes the index.
+
+    bool            HasPending() const { return m_raw_size > 0; }
+    IoLogTime       PendingSince() const { return m_first_time; }
+
+private:
+    struct IndexEntry
+    {
+        unsigned long long offset;
+        IoLogTime       first_time;
+        IoLogTime       last_time;
+    };
+
+    bool            Write(const void* p, size_t cb);
+
+    IoLogWriteProc  m_write = nullptr;
+    void*           m_context = nullptr;
+    unsigned long long m_offset = 0;
+    unsigned char*  m_raw = nullptr;
+    unsigned char*  m_packed = nullptr;
+    size_t          m_raw_size = 0;
+    IoLogTime       m_first_time = 0;
+    IoLogTime       m_last_time = 0;
+    IndexEntry*     m_index = nullptr;
+    unsigned        m_index_count = 0;
+    unsigned        m_index_capacity = 0;
+    bool            m_failed = false;
+
+                    IoLogWriter(const IoLogWriter&) = delete;
+    IoLogWriter&    operator=(const IoLogWriter&) = delete;
+};
+
+// Lets several producer threads (one per stream) record into one file
+// without locks.  A consumer thread calls Drain() periodically, which merges
+// the streams in time order and hands them to the writer.
+class IoLogRecorder
+{
+public:
+    bool            Begin(unsigned long long start_time, IoLogWriteProc write, void* context);
+    bool            Record(IoLogStream stream, IoLogTime time, const void* p, size_t cb);
+    bool            Drain(IoLogTime now);
+    bool            Finish(IoLogTime now);
+
+private:
+    enum { c_streams = unsigned(IoLogStream::Dropped) };
+    IoLogRing       m_rings[c_streams];
+    IoLogWriter     m_writer;
+};
+
+// Reads from the file.  Returns false on error or if fewer than cb bytes
+// could be read.
+typedef bool (*IoLogReadProc)(unsigned long long offset, void* p, size_t cb, void* context);
+
+struct IoLogChunkInfo
+{
+    unsigned long long offset;
+    IoLogTime       first_time;
+    IoLogTime       last_time;
+};
+
+// Receives one event.  Return false to stop.
+typedef bool (*IoLogEventProc)(IoLogStream stream, IoLogTime time, const unsigned char* p, size_t cb, void* context);
+
+class IoLogReader
+{
+public:
+                    IoLogReader() = default;
+                    ~IoLogReader();
+
+    bool            Open(unsigned long long size, IoLogReadProc read, void* context);
+
+    unsigned long long StartTime() const { return m_start_time; }
+    bool            HasIndex() const { return m_has_index; }
+    unsigned        ChunkCount() const { return m_count; }
+    const IoLogChunkInfo& Chunk(unsigned index) const { return m_chunks[index]; }
+
+    // Returns the first chunk with events at or after time, or ChunkCount().
+    unsigned        FindChunk(IoLogTime time) const;
+
+    // Decompresses a chunk and passes each of its events to proc.  Returns
+    // false if the chunk is damaged or proc returned false.
+    bool            ReadChunk(unsigned index, IoLogEventProc proc, void* context);
+
+private:
+    bool            LoadIndex();
+    bool            ScanChunks();
+    bool            AddChunk(const IoLogChunkInfo& info);
+
+    IoLogReadProc   m_read = nullptr;
+    void*           m_context = nullptr;
+    unsigned long long m_size = 0;
+    unsigned long long m_start_time = 0;
+    IoLogChunkInfo* m_chunks = nullptr;
+    unsigned        m_count = 0;
+    unsigned        m_capacity = 0;
+    bool            m_has_index = false;
+
+                    IoLogReader(const IoLogReader&) = delete;
+    IoLogReader&    operator=(const IoLogReader&) = delete;
+};
+
+// Block compression used for the chunks (LZ77, with a format similar to
+// LZ4).  Compress returns 0 if the result wouldn't fit.  Decompress returns
+// false unless it produced exactly cb_dst bytes.
+size_t IoLogCompress(const unsigned char* src, size_t cb_src, unsigned char* dst, size_t cb_dst);
+bool IoLogDecompress(const unsigned char* src, size_t cb_src, unsigned char* dst, size_t cb_dst);
@@ -0,0 +1,199 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+
+#include "controls.h"
+#include "job.h"
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+ProcessTreeJob::~ProcessTreeJob()
+{
+    if (m_hPort)
+        CloseHandle(m_hPort);
+    if (m_hJob)
+        CloseHandle(m_hJob);
+}
+
+bool
+ProcessTreeJob::Create()
+{
+    m_hJob = CreateJobObjectW(nullptr, nullptr);
+    if (!m_hJob)
+        return false;
+
+    // The completion port reports when the last process in the job exits,
+    // which is the only way to wait for the whole tree.
+    m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (!m_hPort)
+        return false;
+
+    JOBOBJECT_ASSOCIATE_COMPLETION_PORT port = {};
+    port.CompletionKey = m_hJob;
+    port.CompletionPort = m_hPort;
+    return !!SetInformationJobObject(m_hJob, JobObjectAssociateCompletionPortInformation, &port, sizeof(port));
+}
+
+// Declared here, since the SDK only declares CPU rate control for Windows 8
+// and later.
+struct CpuRateControl
+{
+    DWORD           dwControlFlags;
+    DWORD           dwCpuRate;          // Cycles per 10000, i.e. hundredths of a percent.
+};
+static const JOBOBJECTINFOCLASS c_jobCpuRateControl = JOBOBJECTINFOCLASS(15);
+static const DWORD c_dwCpuRateEnable = 0x1;
+static const DWORD c_dwCpuRateHardCap = 0x4;
+
+bool
+ProcessTreeJob::SetControls(const ProcessControls& controls)
+{
+    static const DWORD c_priorityClasses[] =
+    {
+        0,
+        IDLE_PRIORITY_CLASS,
+        BELOW_NORMAL_PRIORITY_CLASS,
+        NORMAL_PRIORITY_CLASS,
+        ABOVE_NORMAL_PRIORITY_CLASS,
+        HIGH_PRIORITY_CLASS,
+    };
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    JOBOBJECT_BASIC_LIMIT_INFORMATION& basic = limits.BasicLimitInformation;
+    if (controls.priority != PriorityLevel::Default)
+    {
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_PRIORITY_CLASS;
+        basic.PriorityClass = c_priorityClasses[unsigned(controls.priority)];
+    }
+    if (controls.affinity)
+    {
+        // The job rejects CPUs that the system doesn't have.
+        if (ULONG_PTR(controls.affinity) != controls.affinity)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return false;
+        }
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_AFFINITY;
+        basic.Affinity = ULONG_PTR(controls.affinity);
+    }
+    if (controls.max_memory)
+    {
+        if (SIZE_T(controls.max_memory) != controls.max_memory)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return false;
+        }
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limits.JobMemoryLimit = SIZE_T(controls.max_memory);
+    }
+    if (basic.LimitFlags && !SetInformationJobObject(m_hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits)))
+        return false;
+
+    if (controls.cpu_rate)
+    {
+        CpuRateControl rate = { c_dwCpuRateEnable|c_dwCpuRateHardCap, controls.cpu_rate };
+        if (!SetInformationJobObject(m_hJob, c_jobCpuRateControl, &rate, sizeof(rate)))
+            return false;
+    }
+
+    // IoPriorityVeryLow is 0.
+    if (controls.io_priority != IoPriorityLevel::Default)
+        m_nIoPriority = int(controls.io_priority) - int(IoPriorityLevel::VeryLow);
+    return true;
+}
+
+// Windows only sets a process's I/O priority through ntdll.
+static bool
+SetIoPriority(HANDLE hProcess, int nIoPriority)
+{
+    typedef LONG (NTAPI* NtSetInformationProcessFn)(HANDLE, ULONG, PVOID, ULONG);
+    typedef ULONG (NTAPI* RtlNtStatusToDosErrorFn)(LONG);
+    const ULONG c_processIoPriority = 33;
+
+    HMODULE hNtdll = GetModuleHandleW(L"ntdll.dll");
+    const auto pfnSet = NtSetInformationProcessFn(GetProcAddress(hNtdll, "NtSetInformationProcess"));
+    const auto pfnToError = RtlNtStatusToDosErrorFn(GetProcAddress(hNtdll, "RtlNtStatusToDosError"));
+    if (!pfnSet || !pfnToError)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    ULONG ulPriority = ULONG(nIoPriority);
+    const LONG status = pfnSet(hProcess, c_processIoPriority, &ulPriority, sizeof(ulPriority));
+    if (status < 0)
+    {
+        SetLastError(pfnToError(status));
+        return false;
+    }
+    return true;
+}
+
+bool
+ProcessTreeJob::Assign(HANDLE hProcess)
+{
+    if (m_nIoPriority >= 0 && !SetIoPriority(hProcess, m_nIoPriority))
+        return false;
+    if (!m_cAssigned)
+        QueryPerformanceCounter(&m_liStart);
+    if (!AssignProcessToJobObject(m_hJob, hProcess))
+        return false;
+    ++m_cAssigned;
+    return true;
+}
+
+void
+ProcessTreeJob::Terminate(unsigned exit_code)
+{
+    if (m_hJob)
+        TerminateJobObject(m_hJob, exit_code);
+}
+
+void
+ProcessTreeJob::WaitForTree()
+{
+    if (m_cAssigned)
+    {
+        DWORD dwMessage;
+        ULONG_PTR key;
+        LPOVERLAPPED pov;
+        while (GetQueuedCompletionStatus(m_hPort, &dwMessage, &key, &pov, INFINITE))
+        {
+            if (key == ULONG_PTR(m_hJob) && dwMessage == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO)
+                break;
+        }
+    }
+    QueryPerformanceCounter(&m_liEnd);
+}
+
+bool
+ProcessTreeJob::Query(ProcessStats& stats) const
+{
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting = {};
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    if (!QueryInformationJobObject(m_hJob, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), nullptr) ||
+        !QueryInformationJobObject(m_hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr))
+        return false;
+
+    LARGE_INTEGER liFrequency;
+    QueryPerformanceFrequency(&liFrequency);
+    const ULONGLONG ticks = ULONGLONG(m_liEnd.QuadPart - m_liStart.QuadPart);
+    const ULONGLONG frequency = ULONGLONG(liFrequency.QuadPart);
+
+    stats.wall_us = (ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency;
+    // Job times are in 100 nanosecond units.
+    stats.user_us = ULONGLONG(accounting.BasicInfo.TotalUserTime.QuadPart) / 10;
+    stats.kernel_us = ULONGLONG(accounting.BasicInfo.TotalKernelTime.QuadPart) / 10;
+    stats.processes = accounting.BasicInfo.TotalProcesses;
+    stats.peak_job_memory = limits.PeakJobMemoryUsed;
+    stats.peak_process_memory = limits.PeakProcessMemoryUsed;
+    stats.read_ops = accounting.IoInfo.ReadOperationCount;
+    stats.read_bytes = accounting.IoInfo.ReadTransferCount;
+    stats.write_ops = accounting.IoInfo.WriteOperationCount;
+    stats.write_bytes = accounting.IoInfo.WriteTransferCount;
+    stats.other_ops = accounting.IoInfo.OtherOperationCount;
+    stats.other_bytes = accounting.IoInfo.OtherTransferCount;
+    return true;
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+struct ProcessControls;
+struct ProcessStats;
+
+// Groups a launched command and all of its descendants in a job object, so
+// sudo can wait for the whole process tree and account for what it used.
+class ProcessTreeJob
+{
+public:
+                    ProcessTreeJob() = default;
+                    ~ProcessTreeJob();
+
+    bool            Create();
+    HANDLE          Handle() const { return m_hJob; }
+
+    // Limits the scheduling and resources of every process in the job.  Set
+    // the controls before assigning any process, so that none runs without
+    // them.  The I/O priority has no job limit, so it is set on each process
+    // as it is assigned instead.
+    bool            SetControls(const ProcessControls& controls);
+
+    // Adds a process, which should have been created suspended so that any
+    // children it starts are in the job too.
+    bool            Assign(HANDLE hProcess);
+
+    // Terminates every process in the job.
+    void            Terminate(unsigned exit_code);
+
+    // Waits until every process in the job has exited.
+    void            WaitForTree();
+
+    // Fills in everything except the exit code.
+    bool            Query(ProcessStats& stats) const;
+
+private:
+    HANDLE          m_hJob = nullptr;
+    HANDLE          m_hPort = nullptr;
+    unsigned        m_cAssigned = 0;
+    int             m_nIoPriority = -1;
+    LARGE_INTEGER   m_liStart = {};
+    LARGE_INTEGER   m_liEnd = {};
+
+                    ProcessTreeJob(const ProcessTreeJob&) = delete;
+    ProcessTreeJob& operator=(const ProcessTreeJob&) = delete;
+};
@@ -0,0 +1,237 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <strsafe.h>
+
+#include "jobrecord.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// A process's creation time tells it apart from a later process that got
+// the same ID.
+static unsigned long long
+GetProcessToken(HANDLE hProcess)
+{
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    if (!GetProcessTimes(hProcess, &ftCreate, &ftExit, &ftKernel, &ftUser))
+        return 0;
+    return (static_cast<unsigned long long>(ftCreate.dwHighDateTime) << 32) | ftCreate.dwLowDateTime;
+}
+
+// Opens a job's process, if it is still the one the token identifies.  An
+// elevated process grants the unelevated user these rights.
+static HANDLE
+OpenJobProcess(unsigned pid, unsigned long long token)
+{
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION|SYNCHRONIZE, false, pid);
+    if (hProcess && token && GetProcessToken(hProcess) != token)
+    {
+        CloseHandle(hProcess);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+    return hProcess;
+}
+
+static bool
+IsJobProcessAlive(unsigned pid, unsigned long long token, void* /*context*/)
+{
+    HANDLE hProcess = OpenJobProcess(pid, token);
+    if (!hProcess)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    const bool fAlive = (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT);
+    CloseHandle(hProcess);
+    return fAlive;
+}
+
+static void
+WaitJobProcess(unsigned pid, unsigned long long token, unsigned timeout_ms, void* /*context*/)
+{
+    HANDLE hProcess = OpenJobProcess(pid, token);
+    if (!hProcess)
+    {
+        Sleep(timeout_ms);
+        return;
+    }
+
+    WaitForSingleObject(hProcess, timeout_ms);
+    CloseHandle(hProcess);
+}
+
+static void
+SleepJob(unsigned ms, void* /*context*/)
+{
+    Sleep(ms);
+}
+
+unsigned long long
+GetJobClock()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    const unsigned long long ull = (static_cast<unsigned long long>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return (ull - c_unix_epoch) / 10000;
+}
+
+static unsigned long long
+JobClock(void* /*context*/)
+{
+    return GetJobClock();
+}
+
+static const JobTableOps c_jobOps = { IsJobProcessAlive, WaitJobProcess, SleepJob, JobClock, nullptr };
+
+// Opens the table's file (%LOCALAPPDATA%\sudo\jobs.bin), and returns a
+// section for it, which keeps the file open.  Creating the section makes the
+// file as large as the table, zero filled.
+static HANDLE
+CreateJobTableSection(bool fCreate)
+{
+    WCHAR szPath[MAX_PATH + 32];
+    const DWORD len = GetEnvironmentVariableW(L"LOCALAPPDATA", szPath, MAX_PATH);
+    if (!len || len >= MAX_PATH)
+    {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return nullptr;
+    }
+    if (FAILED(StringCchCatW(szPath, _countof(szPath), L"\\sudo")))
+    {
+        SetLastError(ERROR_BUFFER_OVERFLOW);
+        return nullptr;
+    }
+    if (fCreate && !CreateDirectoryW(szPath, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return nullptr;
+    StringCchCatW(szPath, _countof(szPath), L"\\jobs.bin");
+
+    const DWORD dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE;
+    HANDLE hFile = CreateFileW(szPath, GENERIC_READ|GENERIC_WRITE, dwShare, nullptr,
+                               fCreate ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    HANDLE hSection = CreateFileMappingW(hFile, nullptr, PAGE_READWRITE, 0, DWORD(JobTable::ImageSize()), nullptr);
+    const DWORD err = GetLastError();
+    CloseHandle(hFile);
+    SetLastError(err);
+    return hSection;
+}
+
+JobTable*
+OpenJobTable()
+{
+    static JobTable s_table(c_jobOps, GetCurrentProcessId());
+
+    // The table and its section stay open until the process exits.  Only a
+    // sudo that adds a job clears a table left by an incompatible sudo.
+    HANDLE hSection = CreateJobTableSection(false);
+    if (!hSection)
+        return nullptr;
+    void* pView = MapViewOfFile(hSection, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, JobTable::ImageSize());
+    CloseHandle(hSection);
+    if (!pView)
+        return nullptr;
+    if (!s_table.Attach(pView, JobTable::ImageSize(), false))
+    {
+        UnmapViewOfFile(pView);
+        SetLastError(ERROR_INVALID_DATA);
+        return nullptr;
+    }
+    return &s_table;
+}
+
+JobRecord::JobRecord()
+: m_table(c_jobOps, GetCurrentProcessId())
+{
+}
+
+JobRecord::~JobRecord()
+{
+    if (m_pView)
+        UnmapViewOfFile(m_pView);
+    if (m_hSection)
+        CloseHandle(m_hSection);
+}
+
+bool
+JobRecord::Map(HANDLE hSection)
+{
+    m_hSection = hSection;
+    m_pView = MapViewOfFile(hSection, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, JobTable::ImageSize());
+    if (!m_pView)
+        return false;
+    if (!m_table.Attach(m_pView, JobTable::ImageSize(), true))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+    return true;
+}
+
+bool
+JobRecord::Add(LPCWSTR pszLine)
+{
+    HANDLE hSection = CreateJobTableSection(true);
+    if (!hSection || !Map(hSection))
+        return false;
+
+    m_id = m_table.Add(pszLine, GetProcessToken(GetCurrentProcess()));
+    if (!m_id)
+    {
+        SetLastError(ERROR_NO_MORE_ITEMS);
+        return false;
+    }
+    return true;
+}
+
+bool
+JobRecord::Adopt(DWORD dwPID, ULONGLONG ullSection, unsigned id)
+{
+    if (!id || !ullSection)
+        return false;
+
+    // The handle comes from a less trusted process, so it only gets the
+    // access the client has.  A handle to anything but a section of the
+    // right size fails to map.
+    HANDLE hClient = OpenProcess(PROCESS_DUP_HANDLE, false, dwPID);
+    if (!hClient)
+        return false;
+    HANDLE hSection = nullptr;
+    const bool fDuplicated = !!DuplicateHandle(hClient, HANDLE(ULONG_PTR(ullSection)), GetCurrentProcess(), &hSection,
+                                               0, false, DUPLICATE_SAME_ACCESS);
+    CloseHandle(hClient);
+    if (!fDuplicated || !Map(hSection))
+        return false;
+
+    if (!m_table.Adopt(id, GetProcessToken(GetCurrentProcess())))
+        return false;
+    m_id = id;
+    return true;
+}
+
+void
+JobRecord::Launched(HANDLE hProcess)
+{
+    if (m_id)
+        m_table.Launched(m_id, GetProcessId(hProcess), GetProcessToken(hProcess));
+}
+
+void
+JobRecord::Failed(DWORD err)
+{
+    if (m_id)
+        m_table.Finish(m_id, JobState::Failed, err);
+}
+
+void
+JobRecord::WaitForExit(HANDLE hProcess)
+{
+    if (!m_id)
+        return;
+
+    DWORD dwExit = 0;
+    WaitForSingleObject(hProcess, INFINITE);
+    if (GetExitCodeProcess(hProcess, &dwExit))
+        m_table.Finish(m_id, JobState::Exited, dwExit);
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "jobtable.h"
+
+// The job table (see jobtable.h) is a file in the user's local application
+// data, so it outlives every sudo process.  Only unelevated sudo processes
+// open it by name.  An elevated sudo (or the broker) must not open a path
+// that the user controls, so instead it duplicates the section handle of the
+// unelevated sudo that added the job, while that sudo waits for it.
+
+// Opens this user's job table for --jobs, --wait, and --status.  Returns
+// nullptr (and ERROR_FILE_NOT_FOUND) if no job was ever added.
+JobTable* OpenJobTable();
+
+// The job table's clock:  milliseconds since 1970, which is c_unix_epoch as
+// a FILETIME.
+enum : unsigned long long { c_unix_epoch = 116444736000000000ull };
+unsigned long long GetJobClock();
+
+// One -b job, from adding it to recording how it ended.
+class JobRecord
+{
+public:
+                    JobRecord();
+                    ~JobRecord();
+
+    // Client side:  adds a job for the command line to this user's table.
+    // Without room in the table, the command still runs, without a job.
+    bool            Add(LPCWSTR pszLine);
+
+    // Elevated side:  maps the table through the handle hSection of the
+    // client dwPID (which must still be running), and takes over the job.
+    bool            Adopt(DWORD dwPID, ULONGLONG ullSection, unsigned id);
+
+    // The job's ID, or 0; and the client's handle to the table's section,
+    // to hand to the elevated side.
+    unsigned        Id() const { return m_id; }
+    ULONGLONG       Section() const { return ULONGLONG(ULONG_PTR(m_hSection)); }
+
+    void            Launched(HANDLE hProcess);
+    void            Failed(DWORD err);
+
+    // Waits for the command to exit, and records its exit code.
+    void            WaitForExit(HANDLE hProcess);
+
+private:
+    bool            Map(HANDLE hSection);
+
+    JobTable        m_table;
+    HANDLE          m_hSection = nullptr;
+    void*           m_pView = nullptr;
+    unsigned        m_id = 0;
+
+                    JobRecord(const JobRecord&) = delete;
+    JobRecord&      operator=(const JobRecord&) = delete;
+};
@@ -0,0 +1,484 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <string.h>
+#include <wchar.h>
+
+#include "jobtable.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// A slot's tag holds the job's ID and state, so a reader that finds a job's
+// process gone can mark it lost with one compare-and-swap that can't touch a
+// different job reusing the slot.  Everything else in the slot is written
+// under its sequence number, which a writer makes odd while it changes the
+// slot (and which is also how writers take turns, as in the program cache).
+
+enum : unsigned
+{
+    c_check_ms          = 250,          // How often to check on a job's process.
+    c_poll_ms           = 20,           // How often to look for a lost job's exit code.
+    c_lost_grace_ms     = 2000,         // How long a watcher may take to record an exit code.
+    c_lock_tries        = 1000,
+    c_read_tries        = 1000,
+};
+
+static const char c_magic[8] = { 'S', 'U', 'D', 'O', 'J', 'O', 'B', '1' };
+
+static_assert(std::atomic<unsigned long long>::is_always_lock_free,
+              "The table is shared between processes, so it must not use locks.");
+
+struct JobTable::Header
+{
+    char                    magic[8];
+    unsigned                slot_count;
+    unsigned                command_max;
+    std::atomic<unsigned>   next_id;
+    unsigned                reserved;
+};
+
+struct JobTable::Slot
+{
+    std::atomic<unsigned long long> tag;    // ID and state.
+    std::atomic<unsigned>   seq;            // Odd while being written.
+    unsigned                id;             // The job the rest belongs to.
+    unsigned                pid;
+    unsigned                exit_code;
+    unsigned long long      token;
+    unsigned long long      start_ms;
+    unsigned long long      end_ms;
+    unsigned short          command[c_job_command_max];
+};
+
+static unsigned long long
+MakeTag(unsigned id, JobState state)
+{
+    return (static_cast<unsigned long long>(id) << 32) | unsigned(state);
+}
+
+static unsigned
+TagId(unsigned long long tag)
+{
+    return unsigned(tag >> 32);
+}
+
+static JobState
+TagState(unsigned long long tag)
+{
+    const unsigned state = unsigned(tag) & 0xff;
+    return (state <= unsigned(JobState::Lost)) ? JobState(state) : JobState::Free;
+}
+
+static unsigned
+StateBit(JobState state)
+{
+    return 1u << unsigned(state);
+}
+
+// IDs wrap around, so compare them by distance.
+static bool
+OlderId(unsigned a, unsigned b)
+{
+    return int(a - b) < 0;
+}
+
+bool
+IsJobDone(JobState state)
+{
+    return state == JobState::Exited || state == JobState::Failed;
+}
+
+const char*
+JobStateName(JobState state)
+{
+    switch (state)
+    {
+    case JobState::Starting:    return "starting";
+    case JobState::Running:     return "running";
+    case JobState::Exited:      return "exited";
+    case JobState::Failed:      return "failed";
+    case JobState::Lost:        return "lost";
+    default:                    return "free";
+    }
+}
+
+JobTable::JobTable(const JobTableOps& ops, unsigned pid)
+: m_ops(ops)
+, m_pid(pid)
+{
+}
+
+size_t
+JobTable::ImageSize()
+{
+    return sizeof(Header) + c_job_slots * sizeof(Slot);
+}
+
+bool
+JobTable::Attach(void* image, size_t size, bool writable)
+{
+    m_header = nullptr;
+    m_slots = nullptr;
+    if (!image || size < ImageSize())
+        return false;
+
+    static_assert(sizeof(Header) % alignof(Slot) == 0, "Slots must be aligned.");
+    Header* header = static_cast<Header*>(image);
+    Slot* slots = reinterpret_cast<Slot*>(header + 1);
+    if (memcmp(header->magic, c_magic, sizeof(c_magic)) ||
+        header->slot_count != c_job_slots ||
+        header->command_max != c_job_command_max)
+    {
+        if (!writable)
+            return false;
+
+        // The magic goes last, so a reader never trusts a half initialized
+        // image.
+        memset(image, 0, ImageSize());
+        header->slot_count = c_job_slots;
+        header->command_max = c_job_command_max;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, c_magic, sizeof(c_magic));
+    }
+
+    m_header = header;
+    m_slots = slots;
+    return true;
+}
+
+// Takes the slot's write turn, if it still holds the job in one of the
+// states.  Another writer only holds it for a moment.
+bool
+JobTable::Lock(Slot& slot, unsigned id, unsigned states, unsigned long long& tag)
+{
+    for (unsigned tries = 0; tries < c_lock_tries; ++tries)
+    {
+        unsigned seq = slot.seq.load(std::memory_order_relaxed);
+        if (!(seq & 1) && slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        {
+            std::atomic_thread_fence(std::memory_order_release);
+            tag = slot.tag.load(std::memory_order_acquire);
+            if (TagId(tag) == id && (StateBit(TagState(tag)) & states))
+                return true;
+            slot.seq.store(seq + 2, std::memory_order_release);
+            return false;
+        }
+        m_ops.sleep(0, m_ops.context);
+    }
+    return false;
+}
+
+void
+JobTable::Unlock(Slot& slot, unsigned id, JobState state)
+{
+    slot.tag.store(MakeTag(id, state), std::memory_order_release);
+    slot.seq.fetch_add(1, std::memory_order_release);
+}
+
+// Copies the slot, and then makes sure no writer changed it meanwhile.
+bool
+JobTable::Read(Slot& slot, JobInfo& info)
+{
+    for (unsigned tries = 0; tries < c_read_tries; ++tries)
+    {
+        const unsigned seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+        {
+            m_ops.sleep(0, m_ops.context);
+            continue;
+        }
+
+        const unsigned long long tag = slot.tag.load(std::memory_order_acquire);
+        info.id = slot.id;
+        info.pid = slot.pid;
+        info.exit_code = slot.exit_code;
+        info.token = slot.token;
+        info.start_ms = slot.start_ms;
+        info.end_ms = slot.end_ms;
+        for (unsigned i = 0; i < c_job_command_max; ++i)
+            info.command[i] = wchar_t(slot.command[i]);
+        info.command[c_job_command_max - 1] = '\0';
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            continue;
+
+        info.state = TagState(tag);
+        return info.state != JobState::Free && info.id == TagId(tag);
+    }
+    return false;
+}
+
+unsigned
+JobTable::Add(const wchar_t* command, unsigned long long token)
+{
+    if (!m_header)
+        return 0;
+
+    unsigned id;
+    do
+        id = m_header->next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+    while (!id);
+
+    // Take a free slot, else the one of the oldest job that has ended.  If
+    // there is none, jobs whose processes are gone are marked lost, and then
+    // their slots can be taken.  A slot that another sudo is writing is
+    // skipped.
+    bool checked = false;
+    for (unsigned tries = 0; tries < c_job_slots; ++tries)
+    {
+        Slot* victim = nullptr;
+        unsigned long long victim_tag = 0;
+        for (unsigned i = 0; i < c_job_slots; ++i)
+        {
+            Slot& slot = m_slots[i];
+            if (slot.seq.load(std::memory_order_acquire) & 1)
+                continue;
+            const unsigned long long tag = slot.tag.load(std::memory_order_acquire);
+            const JobState state = TagState(tag);
+            if (state == JobState::Free)
+            {
+                victim = &slot;
+                victim_tag = tag;
+                break;
+            }
+            if ((IsJobDone(state) || state == JobState::Lost) &&
+                (!victim || OlderId(TagId(tag), TagId(victim_tag))))
+            {
+                victim = &slot;
+                victim_tag = tag;
+            }
+        }
+
+        if (!victim)
+        {
+            if (checked)
+                break;
+            checked = true;
+            JobInfo info;
+            for (unsigned i = 0; i < c_job_slots; ++i)
+            {
+                const unsigned long long tag = m_slots[i].tag.load(std::memory_order_acquire);
+                if (TagState(tag) != JobState::Free)
+                    Find(TagId(tag), info);
+            }
+            continue;
+        }
+
+        // If another sudo took the slot first, look again.
+        unsigned long long tag;
+        if (!Lock(*victim, TagId(victim_tag), StateBit(TagState(victim_tag)), tag))
+            continue;
+
+        size_t len = wcslen(command);
+        const bool truncated = (len >= c_job_command_max);
+        if (truncated)
+            len = c_job_command_max - 4;
+        victim->id = id;
+        victim->pid = m_pid;
+        victim->exit_code = 0;
+        victim->token = token;
+        victim->start_ms = m_ops.now_ms(m_ops.context);
+        victim->end_ms = 0;
+        for (size_t i = 0; i < len; ++i)
+            victim->command[i] = static_cast<unsigned short>(command[i]);
+        if (truncated)
+        {
+            for (unsigned i = 0; i < 3; ++i)
+                victim->command[len++] = '.';
+        }
+        memset(victim->command + len, 0, (c_job_command_max - len) * sizeof(victim->command[0]));
+
+        Unlock(*victim, id, JobState::Starting);
+        return id;
+    }
+    return 0;
+}
+
+bool
+JobTable::Update(unsigned id, unsigned states, JobState state, unsigned pid, unsigned long long token,
+                 unsigned exit_code)
+{
+    if (!m_header || !id)
+        return false;
+
+    for (unsigned i = 0; i < c_job_slots; ++i)
+    {
+        Slot& slot = m_slots[i];
+        if (TagId(slot.tag.load(std::memory_order_acquire)) != id)
+            continue;
+
+        unsigned long long tag;
+        if (!Lock(slot, id, states, tag))
+            return false;
+
+        if (IsJobDone(state))
+        {
+            slot.exit_code = exit_code;
+            slot.end_ms = m_ops.now_ms(m_ops.context);
+        }
+        else
+        {
+            slot.pid = pid;
+            slot.token = token;
+        }
+
+        Unlock(slot, id, state);
+        return true;
+    }
+    return false;
+}
+
+bool
+JobTable::Adopt(unsigned id, unsigned long long token)
+{
+    return Update(id, StateBit(JobState::Starting) | StateBit(JobState::Lost), JobState::Starting, m_pid, token, 0);
+}
+
+bool
+JobTable::Launched(unsigned id, unsigned pid, unsigned long long token)
+{
+    return Update(id, StateBit(JobState::Starting) | StateBit(JobState::Lost), JobState::Running, pid, token, 0);
+}
+
+bool
+JobTable::Finish(unsigned id, JobState state, unsigned exit_code)
+{
+    if (!IsJobDone(state))
+        return false;
+
+    // A job may have been taken for lost while its watcher was on its way to
+    // say how it ended.
+    const unsigned states = StateBit(JobState::Starting) | StateBit(JobState::Running) | StateBit(JobState::Lost);
+    return Update(id, states, state, 0, 0, exit_code);
+}
+
+// Gets the job in the slot, and marks it lost if its process is gone
+// without it having ended.
+bool
+JobTable::Get(Slot& slot, unsigned id, JobInfo& info)
+{
+    while (true)
+    {
+        if (!Read(slot, info) || info.id != id)
+            return false;
+        if ((info.state != JobState::Starting && info.state != JobState::Running) ||
+            m_ops.is_alive(info.pid, info.token, m_ops.context))
+            return true;
+
+        // If the job changed meanwhile, look again.
+        unsigned long long tag = MakeTag(id, info.state);
+        if (slot.tag.compare_exchange_strong(tag, MakeTag(id, JobState::Lost)) ||
+            tag == MakeTag(id, JobState::Lost))
+        {
+            info.state = JobState::Lost;
+            return true;
+        }
+    }
+}
+
+bool
+JobTable::Find(unsigned id, JobInfo& info)
+{
+    if (!m_header || !id)
+        return false;
+
+    for (unsigned i = 0; i < c_job_slots; ++i)
+    {
+        Slot& slot = m_slots[i];
+        if (TagId(slot.tag.load(std::memory_order_acquire)) == id)
+            return Get(slot, id, info);
+    }
+    return false;
+}
+
+unsigned
+JobTable::List(JobInfo* out, unsigned max)
+{
+    if (!m_header)
+        return 0;
+
+    // Sort the slots by ID first (insertion sort; there are only a few
+    // hundred), so the jobs are only copied once.
+    struct Entry { unsigned id; unsigned slot; };
+    Entry entries[c_job_slots];
+    unsigned used = 0;
+    for (unsigned i = 0; i < c_job_slots; ++i)
+    {
+        const unsigned long long tag = m_slots[i].tag.load(std::memory_order_acquire);
+        if (TagState(tag) == JobState::Free)
+            continue;
+
+        unsigned j = used++;
+        for (; j && OlderId(TagId(tag), entries[j - 1].id); --j)
+            entries[j] = entries[j - 1];
+        entries[j] = { TagId(tag), i };
+    }
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < used && count < max; ++i)
+    {
+        if (Get(m_slots[entries[i].slot], entries[i].id, out[count]))
+            ++count;
+    }
+    return count;
+}
+
+unsigned
+JobTable::Wait(const unsigned* ids, unsigned count, JobInfo* infos)
+{
+    if (count > c_job_slots)
+        count = c_job_slots;
+
+    unsigned found = count;
+    bool done[c_job_slots] = {};
+    unsigned long long lost_ms[c_job_slots] = {};
+    while (true)
+    {
+        unsigned pending = 0;
+        const JobInfo* running = nullptr;
+        const unsigned long long now = m_ops.now_ms(m_ops.context);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            if (done[i])
+                continue;
+
+            JobInfo& info = infos[i];
+            if (!Find(ids[i], info))
+            {
+                info.id = 0;
+                done[i] = true;
+                --found;
+            }
+            else if (IsJobDone(info.state))
+            {
+                done[i] = true;
+            }
+            else if (info.state != JobState::Lost)
+            {
+                lost_ms[i] = 0;
+                if (!running)
+                    running = &info;
+                ++pending;
+            }
+            else
+            {
+                // Give the watcher a moment to record how the job ended.
+                if (!lost_ms[i])
+                    lost_ms[i] = now;
+                done[i] = (now - lost_ms[i] >= c_lost_grace_ms);
+                pending += !done[i];
+            }
+        }
+        if (!pending)
+            return found;
+
+        // Wait for one of the jobs that are still running; the others are
+        // checked on each time it returns.
+        if (running && pending == 1)
+            m_ops.wait(running->pid, running->token, c_check_ms, m_ops.context);
+        else if (running)
+            m_ops.wait(running->pid, running->token, c_poll_ms * 5, m_ops.context);
+        else
+            m_ops.sleep(c_poll_ms, m_ops.context);
+    }
+}
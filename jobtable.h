@@ -0,0 +1,135 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// The job table remembers commands launched with -b, so their exit codes
+// aren't lost:  a job's ID, process ID, start and end times, command line,
+// and how it ended.  The unelevated sudo adds the job and prints its ID, and
+// the elevated side that launches the command records its process ID and
+// then its exit code.  Later sudo invocations list the jobs and wait for
+// them.
+//
+// The image is a fixed size file shared by the user's sudo processes, which
+// can be created empty (all zeros).  Each slot has a tag word holding the
+// job's ID and state, and a sequence number that a writer makes odd while it
+// changes the slot:  writers take turns per slot, and readers copy a slot
+// and check that no writer changed it meanwhile, so they never block
+// writers.  When the table is full, the slot of the oldest job that ended is
+// reused.
+//
+// Checking on processes and waiting go through JobTableOps, so the same
+// logic runs between processes on Windows, on Linux, or between threads.
+
+enum : unsigned
+{
+    c_job_slots         = 256,
+    c_job_command_max   = 256,          // UTF-16 units, including the terminator.
+};
+
+enum class JobState : unsigned char
+{
+    Free,
+    Starting,                   // Added; pid is whoever will launch it.
+    Running,                    // pid is the command.
+    Exited,                     // exit_code is the command's exit code.
+    Failed,                     // exit_code is the error that kept it from starting.
+    Lost,                       // Its process and whoever watched it are gone.
+};
+
+struct JobTableOps
+{
+    // Returns false if the process has exited.  A token identifies the
+    // process beyond its ID (e.g. its creation time), or is 0.
+    bool                (*is_alive)(unsigned pid, unsigned long long token, void* context);
+
+    // Waits until the process exits, or until timeout_ms has passed.
+    // Returning early is harmless.
+    void                (*wait)(unsigned pid, unsigned long long token, unsigned timeout_ms, void* context);
+
+    void                (*sleep)(unsigned ms, void* context);
+
+    // Wall clock time, in milliseconds since 1970.
+    unsigned long long  (*now_ms)(void* context);
+
+    void*               context;
+};
+
+struct JobInfo
+{
+    unsigned            id;
+    JobState            state;
+    unsigned            pid;
+    unsigned long long  token;
+    unsigned long long  start_ms;
+    unsigned long long  end_ms;         // 0 until it ends.
+    unsigned            exit_code;
+    wchar_t             command[c_job_command_max];     // Truncated with "...".
+};
+
+class JobTable
+{
+public:
+                    JobTable(const JobTableOps& ops, unsigned pid);
+
+    // The size of the image, and attaching to it.  A writable image that was
+    // set up by an incompatible sudo is cleared.
+    static size_t   ImageSize();
+    bool            Attach(void* image, size_t size, bool writable);
+
+    // Adds a job that this process will launch or hand off.  Returns its ID,
+    // or 0 if every slot holds a job that hasn't ended.
+    unsigned        Add(const wchar_t* command, unsigned long long token);
+
+    // Takes over a job that another process added, before launching it, so
+    // the job isn't taken for lost once that process exits.
+    bool            Adopt(unsigned id, unsigned long long token);
+
+    // The job's command was launched as process pid.
+    bool            Launched(unsigned id, unsigned pid, unsigned long long token);
+
+    // The job ended:  Exited with the command's exit code, or Failed with
+    // the error that kept it from starting.
+    bool            Finish(unsigned id, JobState state, unsigned exit_code);
+
+    // Gets a job.  A job whose process is gone without having ended is
+    // marked Lost (whoever watches it can still say how it ended).
+    bool            Find(unsigned id, JobInfo& info);
+
+    // Gets up to max jobs, oldest first, and returns how many.
+    unsigned        List(JobInfo* out, unsigned max);
+
+    // Waits until each of the jobs has ended or is lost, and gets them (up
+    // to c_job_slots of them).  Returns how many of them there are; the
+    // info of a job that doesn't exist gets ID 0.
+    unsigned        Wait(const unsigned* ids, unsigned count, JobInfo* infos);
+
+    struct Header;
+    struct Slot;
+
+private:
+    bool            Lock(Slot& slot, unsigned id, unsigned states, unsigned long long& tag);
+    void            Unlock(Slot& slot, unsigned id, JobState state);
+    bool            Read(Slot& slot, JobInfo& info);
+    bool            Get(Slot& slot, unsigned id, JobInfo& info);
+    bool            Update(unsigned id, unsigned states, JobState state, unsigned pid, unsigned long long token,
+                           unsigned exit_code);
+
+    const JobTableOps m_ops;
+    const unsigned  m_pid;
+    Header*         m_header = nullptr;
+    Slot*           m_slots = nullptr;
+
+                    JobTable(const JobTable&) = delete;
+    JobTable&       operator=(const JobTable&) = delete;
+};
+
+// Returns true once the job has ended.  A lost job may still be finished by
+// whoever watched it.
+bool IsJobDone(JobState state);
+
+// Names a state for listings, e.g. "running".
+const char* JobStateName(JobState state);
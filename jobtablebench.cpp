@@ -0,0 +1,631 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark and checker for the job table of -b launches, with many
+// processes sharing one table in shared memory.
+//
+// Each job runs the way it does with sudo:  a launcher adds the job and
+// exits, a watcher adopts it, starts the command (a forked child that exits
+// with a code derived from the job's ID), records its process ID, and then
+// its exit code.  The checker verifies that a waiter gets every job's exit
+// code, that readers never see a slot torn by a writer, that a job whose
+// watcher was killed is reported lost (and that a slow watcher is not), and
+// that a full table reuses the slots of jobs that ended.  The benchmark
+// reports what adding, recording, and listing jobs cost under contention.
+//
+//      g++ -std=c++17 -O2 jobtablebench.cpp jobtable.cpp -o jobtablebench
+//      ./jobtablebench [-n processes] [-j jobs per process]
+
+#include <errno.h>
+#include <new>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "jobtable.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+enum : unsigned
+{
+    c_max_procs         = 64,
+    c_max_jobs          = 4096,
+};
+
+// What the processes share besides the table:  the IDs the launchers got,
+// and counts from the readers.
+struct Sim
+{
+    std::atomic<unsigned>   start;
+    std::atomic<unsigned>   added;
+    std::atomic<unsigned>   stop;
+    std::atomic<unsigned>   reads;
+    std::atomic<unsigned>   torn;
+    unsigned                ids[c_max_jobs];
+};
+
+static unsigned long long
+NowMicroseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+SleepMs(unsigned ms)
+{
+    timespec ts = { time_t(ms / 1000), long(ms % 1000) * 1000000 };
+    nanosleep(&ts, nullptr);
+}
+
+//------------------------------------------------------------------------------
+// Table operations between processes:  /proc to tell whether a process
+// exited (an unreaped child is a zombie), and a pidfd to wait for one that
+// isn't a child.
+
+static bool
+IsAliveProc(unsigned pid, unsigned long long /*token*/, void* /*context*/)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char buffer[256];
+    const size_t len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[len] = '\0';
+    const char* state = strrchr(buffer, ')');
+    return !(state && state[1] == ' ' && (state[2] == 'Z' || state[2] == 'X'));
+}
+
+static void
+WaitProc(unsigned pid, unsigned long long token, unsigned timeout_ms, void* context)
+{
+    const int fd = int(syscall(SYS_pidfd_open, pid, 0));
+    if (fd < 0)
+    {
+        SleepMs(timeout_ms < 10 ? timeout_ms : 10);
+        return;
+    }
+
+    // A zombie's pidfd is readable, so that returns at once; so does a
+    // process that isn't a zombie yet but has exited.
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (IsAliveProc(pid, token, context))
+        poll(&pfd, 1, int(timeout_ms));
+    else
+        SleepMs(timeout_ms < 10 ? timeout_ms : 10);
+    close(fd);
+}
+
+static void
+SleepProc(unsigned ms, void* /*context*/)
+{
+    if (ms)
+        SleepMs(ms);
+    else
+        sched_yield();
+}
+
+static unsigned long long
+NowProc(void* /*context*/)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const JobTableOps c_ops = { IsAliveProc, WaitProc, SleepProc, NowProc, nullptr };
+
+struct Shared
+{
+    Sim*                sim;
+    void*               table_image;
+    void*               image;
+    size_t              size;
+};
+
+static bool
+MapShared(Shared& shared)
+{
+    shared.size = sizeof(Sim) + JobTable::ImageSize();
+    shared.image = mmap(nullptr, shared.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (shared.image == MAP_FAILED)
+        return false;
+    shared.table_image = shared.image;
+    shared.sim = new (static_cast<char*>(shared.image) + JobTable::ImageSize()) Sim();
+    return true;
+}
+
+static void
+UnmapShared(Shared& shared)
+{
+    munmap(shared.image, shared.size);
+}
+
+// Every job has a nonce, which its command names, its token is, and its
+// exit code is derived from, so a reader can tell whether the parts of a
+// slot belong together.  (The token doesn't identify a process here.)
+// Commands are long, so that copying one takes a while.
+static void
+MakeCommand(unsigned nonce, wchar_t* out, size_t max)
+{
+    size_t len = size_t(swprintf(out, max, L"job %u --", nonce));
+    while (len + 16 < max)
+        len += size_t(swprintf(out + len, max - len, L" %u", nonce));
+}
+
+static unsigned
+ExitCodeFor(unsigned nonce)
+{
+    return nonce % 200;
+}
+
+static bool
+Consistent(const JobInfo& info)
+{
+    wchar_t expected[200];
+    MakeCommand(unsigned(info.token), expected, 200);
+    if (wcscmp(info.command, expected))
+        return false;
+    if (info.state == JobState::Exited && info.exit_code != ExitCodeFor(unsigned(info.token)))
+        return false;
+    return !(IsJobDone(info.state) && info.end_ms < info.start_ms);
+}
+
+//------------------------------------------------------------------------------
+// Jobs.
+
+enum : unsigned
+{
+    WATCH_NORMAL,
+    WATCH_KILLED,                       // The watcher is killed after launching.
+    WATCH_SLOW,                         // The watcher records the exit code late.
+};
+
+// The watcher:  adopts the job, runs the command, and records its exit code.
+// Its parent (the launcher) exits as soon as the watcher is forked.
+static void
+RunWatcher(void* table_image, unsigned id, unsigned nonce, unsigned how)
+{
+    JobTable table(c_ops, unsigned(getpid()));
+    if (!table.Attach(table_image, JobTable::ImageSize(), true) || !table.Adopt(id, nonce))
+        _exit(1);
+
+    const pid_t child = fork();
+    if (child == 0)
+    {
+        SleepMs(1 + (nonce * 7) % 20);
+        _exit(int(ExitCodeFor(nonce)));
+    }
+    table.Launched(id, unsigned(child), nonce);
+    if (how == WATCH_KILLED)
+        raise(SIGKILL);
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (how == WATCH_SLOW)
+        SleepMs(500);
+    table.Finish(id, JobState::Exited, WIFEXITED(status) ? unsigned(WEXITSTATUS(status)) : 255);
+    _exit(0);
+}
+
+// A launcher adds jobs and hands each to a watcher, like sudo -b.
+static void
+RunLauncher(Shared& shared, unsigned index, unsigned jobs, unsigned how)
+{
+    JobTable table(c_ops, unsigned(getpid()));
+    if (!table.Attach(shared.table_image, JobTable::ImageSize(), true))
+        _exit(1);
+    while (!shared.sim->start.load())
+        SleepMs(1);
+
+    for (unsigned j = 0; j < jobs; ++j)
+    {
+        wchar_t command[200];
+        const unsigned nonce = index * jobs + j + 1;
+        MakeCommand(nonce, command, 200);
+        const unsigned id = table.Add(command, nonce);
+        shared.sim->ids[nonce - 1] = id;
+        shared.sim->added.fetch_add(1);
+        if (!id)
+            continue;
+
+        const pid_t watcher = fork();
+        if (watcher == 0)
+            RunWatcher(shared.table_image, id, nonce, how);
+    }
+    _exit(0);
+}
+
+// A reader lists the table over and over, checking every job it sees.
+static void
+RunReader(Shared& shared)
+{
+    JobTable table(c_ops, unsigned(getpid()));
+    if (!table.Attach(shared.table_image, JobTable::ImageSize(), false))
+        _exit(1);
+
+    static JobInfo infos[c_job_slots];
+    while (!shared.sim->stop.load())
+    {
+        const unsigned count = table.List(infos, c_job_slots);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            if (!Consistent(infos[i]))
+                shared.sim->torn.fetch_add(1);
+        }
+        shared.sim->reads.fetch_add(count);
+    }
+    _exit(0);
+}
+
+struct Run
+{
+    unsigned            procs;
+    unsigned            jobs;
+    unsigned            how;
+    unsigned            readers;
+
+    unsigned            added;
+    unsigned            exited;
+    unsigned            lost;
+    unsigned            wrong;
+    unsigned            reads;
+    unsigned            torn;
+    unsigned long long  elapsed_us;
+};
+
+// Runs launchers that all start at once in a fresh table, and then waits
+// for every job they added.
+static bool
+RunJobs(Run& run)
+{
+    Shared shared;
+    if (!MapShared(shared))
+        return false;
+    Sim& sim = *shared.sim;
+    JobTable table(c_ops, unsigned(getpid()));
+    table.Attach(shared.table_image, JobTable::ImageSize(), true);
+
+    pid_t readers[c_max_procs];
+    for (unsigned i = 0; i < run.readers; ++i)
+    {
+        readers[i] = fork();
+        if (readers[i] == 0)
+            RunReader(shared);
+    }
+
+    pid_t launchers[c_max_procs];
+    for (unsigned i = 0; i < run.procs; ++i)
+    {
+        launchers[i] = fork();
+        if (launchers[i] == 0)
+        {
+            // A process that hangs is killed, instead of hanging the checker.
+            alarm(60);
+            RunLauncher(shared, i, run.jobs, run.how);
+        }
+    }
+
+    const unsigned long long start = NowMicroseconds();
+    sim.start.store(1);
+    for (unsigned i = 0; i < run.procs; ++i)
+        waitpid(launchers[i], nullptr, 0);
+
+    // The watchers are orphans now (like the elevated sudo), so the waiter
+    // can only go by the table.
+    unsigned ids[c_job_slots];
+    static JobInfo infos[c_job_slots];
+    run.added = 0;
+    for (unsigned i = 0; i < run.procs * run.jobs; ++i)
+    {
+        if (sim.ids[i])
+            ids[run.added++] = sim.ids[i];
+    }
+
+    const unsigned found = table.Wait(ids, run.added, infos);
+    run.elapsed_us = NowMicroseconds() - start;
+    run.exited = run.lost = 0;
+    run.wrong = run.added - found;
+    for (unsigned i = 0; i < run.added; ++i)
+    {
+        if (!infos[i].id)
+            continue;
+        if (infos[i].state == JobState::Lost)
+            ++run.lost;
+        else if (infos[i].state == JobState::Exited && Consistent(infos[i]))
+            ++run.exited;
+        else
+            ++run.wrong;
+    }
+
+    sim.stop.store(1);
+    for (unsigned i = 0; i < run.readers; ++i)
+        waitpid(readers[i], nullptr, 0);
+    run.reads = sim.reads.load();
+    run.torn = sim.torn.load();
+
+    // Reap the watchers' zombies (they were reparented to init, or to this
+    // process if it is a subreaper).
+    while (waitpid(-1, nullptr, WNOHANG) > 0)
+        ;
+    UnmapShared(shared);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Checker.
+
+static bool
+Expect(bool ok, const char* scenario, const char* what, const Run& run)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILED %s: %s (added %u, exited %u, lost %u, wrong %u, reads %u, torn %u)\n",
+                scenario, what, run.added, run.exited, run.lost, run.wrong, run.reads, run.torn);
+    }
+    return ok;
+}
+
+// A table full of running jobs refuses more, and reuses the slots of the
+// oldest jobs that ended, or whose processes are gone.
+static bool
+CheckFull()
+{
+    Shared shared;
+    if (!MapShared(shared))
+        return false;
+
+    Run run = {};
+    bool ok = true;
+    JobTable table(c_ops, unsigned(getpid()));
+    table.Attach(shared.table_image, JobTable::ImageSize(), true);
+    unsigned ids[c_job_slots + 8];
+    for (unsigned i = 0; i < c_job_slots + 8; ++i)
+        ids[i] = table.Add(L"full", 0);
+    run.added = 0;
+    for (unsigned i = 0; i < c_job_slots + 8; ++i)
+        run.added += !!ids[i];
+    ok &= Expect(run.added == c_job_slots, "full", "refuses jobs once every slot is running", run);
+
+    table.Finish(ids[5], JobState::Exited, 1);
+    table.Finish(ids[3], JobState::Exited, 1);
+    const unsigned reused = table.Add(L"reuse", 0);
+    JobInfo info;
+    ok &= Expect(reused && !table.Find(ids[3], info) && table.Find(ids[5], info),
+                 "full", "reuses the oldest job that ended", run);
+
+    // A job whose process is gone is taken for lost, and its slot reused.
+    const pid_t child = fork();
+    if (child == 0)
+        _exit(0);
+    waitpid(child, nullptr, 0);
+    table.Launched(ids[7], unsigned(child), 0);
+    table.Add(L"x", 0);
+    const unsigned after_lost = table.Add(L"after lost", 0);
+    ok &= Expect(after_lost && !table.Find(ids[7], info), "full", "reuses the slot of a lost job", run);
+
+    table.Launched(ids[9], unsigned(getpid()), 0);
+    ok &= Expect(table.Find(ids[9], info) && info.state == JobState::Running, "full", "a live job is running", run);
+    ok &= Expect(table.Finish(ids[9], JobState::Failed, 740) && table.Find(ids[9], info) &&
+                 info.state == JobState::Failed && info.exit_code == 740 && info.end_ms >= info.start_ms,
+                 "full", "a failed job keeps its error", run);
+
+    static JobInfo infos[c_job_slots];
+    const unsigned count = table.List(infos, c_job_slots);
+    bool sorted = true;
+    for (unsigned i = 1; i < count; ++i)
+        sorted = sorted && infos[i - 1].id < infos[i].id;
+    ok &= Expect(count == c_job_slots && sorted, "full", "lists every job, oldest first", run);
+
+    wchar_t long_command[c_job_command_max * 2];
+    wmemset(long_command, 'x', c_job_command_max * 2 - 1);
+    long_command[c_job_command_max * 2 - 1] = '\0';
+    table.Finish(ids[11], JobState::Exited, 0);
+    const unsigned long_id = table.Add(long_command, 0);
+    ok &= Expect(long_id && table.Find(long_id, info) && wcslen(info.command) == c_job_command_max - 1 &&
+                 !wcscmp(info.command + c_job_command_max - 4, L"..."), "full", "truncates a long command", run);
+
+    // A table left by an incompatible sudo is cleared, but only by a writer.
+    memset(shared.table_image, 0x5a, 8);
+    JobTable reader(c_ops, unsigned(getpid()));
+    ok &= Expect(!reader.Attach(shared.table_image, JobTable::ImageSize(), false), "full", "a reader rejects a bad table", run);
+    ok &= Expect(reader.Attach(shared.table_image, JobTable::ImageSize(), true) && !reader.List(infos, c_job_slots),
+                 "full", "a writer clears a bad table", run);
+
+    UnmapShared(shared);
+    return ok;
+}
+
+// Writers that add and finish jobs over and over while readers list them:
+// a reader must never get a job whose parts came from different writes.
+static bool
+CheckChurn(unsigned procs)
+{
+    Shared shared;
+    if (!MapShared(shared))
+        return false;
+    Sim& sim = *shared.sim;
+    JobTable table(c_ops, unsigned(getpid()));
+    table.Attach(shared.table_image, JobTable::ImageSize(), true);
+
+    pid_t readers[2];
+    for (pid_t& reader : readers)
+    {
+        reader = fork();
+        if (reader == 0)
+            RunReader(shared);
+    }
+
+    pid_t writers[c_max_procs];
+    for (unsigned i = 0; i < procs; ++i)
+    {
+        writers[i] = fork();
+        if (writers[i] == 0)
+        {
+            JobTable writer(c_ops, unsigned(getpid()));
+            writer.Attach(shared.table_image, JobTable::ImageSize(), true);
+            for (unsigned r = 0; r < 3000; ++r)
+            {
+                wchar_t command[200];
+                const unsigned nonce = (i << 16) | (r + 1);
+                MakeCommand(nonce, command, 200);
+                const unsigned id = writer.Add(command, nonce);
+                writer.Adopt(id, nonce);
+                writer.Launched(id, unsigned(getpid()), nonce);
+                writer.Finish(id, JobState::Exited, ExitCodeFor(nonce));
+            }
+            _exit(0);
+        }
+    }
+    for (unsigned i = 0; i < procs; ++i)
+        waitpid(writers[i], nullptr, 0);
+    sim.stop.store(1);
+    for (pid_t reader : readers)
+        waitpid(reader, nullptr, 0);
+
+    Run run = {};
+    run.reads = sim.reads.load();
+    run.torn = sim.torn.load();
+    UnmapShared(shared);
+    return Expect(run.torn == 0 && run.reads > 0, "churn", "readers never see a torn slot", run);
+}
+
+static bool
+CheckScenarios(unsigned procs, unsigned jobs)
+{
+    bool ok = true;
+    Run run = {};
+    run.procs = procs;
+    run.jobs = jobs;
+    run.readers = 2;
+
+    RunJobs(run);
+    const unsigned total = procs * jobs;
+    ok &= Expect(run.added == total, "jobs", "every job gets an ID", run);
+    ok &= Expect(run.exited == total, "jobs", "every exit code is recorded", run);
+    ok &= Expect(run.torn == 0 && run.reads > 0, "jobs", "readers never see a torn slot", run);
+
+    run.how = WATCH_SLOW;
+    run.jobs = 2;
+    RunJobs(run);
+    ok &= Expect(run.exited == run.added && !run.lost, "slow watcher", "waits for the exit code", run);
+
+    run.how = WATCH_KILLED;
+    RunJobs(run);
+    ok &= Expect(run.lost == run.added && !run.wrong, "killed watcher", "the jobs are lost", run);
+    ok &= Expect(run.elapsed_us < 10 * 1000000, "killed watcher", "the grace periods overlap", run);
+
+    ok &= CheckChurn(procs);
+    ok &= CheckFull();
+    if (ok)
+        printf("check            %8u processes, %u jobs each, 5 scenarios passed\n", procs, jobs);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+// Processes that add and finish jobs over and over (without running them),
+// to measure what recording a job costs when many processes contend for the
+// table.
+static void
+RunRecords(unsigned procs, unsigned rounds)
+{
+    Shared shared;
+    if (!MapShared(shared))
+        return;
+    Sim& sim = *shared.sim;
+
+    pid_t pids[c_max_procs];
+    for (unsigned i = 0; i < procs; ++i)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            JobTable table(c_ops, unsigned(getpid()));
+            table.Attach(shared.table_image, JobTable::ImageSize(), true);
+            while (!sim.start.load())
+                sched_yield();
+            for (unsigned r = 0; r < rounds; ++r)
+            {
+                const unsigned id = table.Add(L"cmd /c maintenance.cmd", 0);
+                table.Adopt(id, 0);
+                table.Launched(id, unsigned(getpid()), 0);
+                table.Finish(id, JobState::Exited, 0);
+                sim.added.fetch_add(!!id);
+            }
+            _exit(0);
+        }
+    }
+
+    const unsigned long long start = NowMicroseconds();
+    sim.start.store(1);
+    for (unsigned i = 0; i < procs; ++i)
+        waitpid(pids[i], nullptr, 0);
+    const unsigned long long elapsed = NowMicroseconds() - start;
+
+    const unsigned records = sim.added.load();
+    printf("record  %4u     %8u jobs     %8.1f ms  %10.2f us/job\n",
+           procs, records, elapsed / 1000.0, records ? double(elapsed) / records : 0.0);
+
+    // Listing a full table, as sudo --jobs does.
+    JobTable table(c_ops, unsigned(getpid()));
+    table.Attach(shared.table_image, JobTable::ImageSize(), false);
+    static JobInfo infos[c_job_slots];
+    const unsigned lists = 200;
+    unsigned count = 0;
+    const unsigned long long list_start = NowMicroseconds();
+    for (unsigned i = 0; i < lists; ++i)
+        count = table.List(infos, c_job_slots);
+    const unsigned long long list_elapsed = NowMicroseconds() - list_start;
+    printf("list    %4u     %8u jobs     %8.1f ms  %10.2f us/list\n",
+           procs, count, list_elapsed / 1000.0, double(list_elapsed) / lists);
+    UnmapShared(shared);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned procs = 8;
+    unsigned jobs = 16;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            procs = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            jobs = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: jobtablebench [-n processes] [-j jobs per process]\n");
+            return 1;
+        }
+    }
+    if (procs < 1 || procs > c_max_procs || jobs < 2 || procs * jobs > c_job_slots)
+    {
+        fprintf(stderr, "jobtablebench: processes must be 1 to %u, with 2 to %u jobs in all\n",
+                unsigned(c_max_procs), unsigned(c_job_slots));
+        return 1;
+    }
+
+    if (!CheckScenarios(procs, jobs))
+        return 1;
+
+    for (unsigned n = 1; n <= procs; n *= 2)
+        RunRecords(n, 2000);
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <wchar.h>
+
+#include "arena.h"
+#include "launch.h"
+#include "platform.h"
+#include "resolve.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static bool
+IsFile(const wchar_t* path, void* /*context*/)
+{
+    return PlatformIsFile(path);
+}
+
+static bool
+GetStamp(const wchar_t* path, FileStamp& stamp, void* /*context*/)
+{
+    return PlatformGetFileStamp(path, stamp);
+}
+
+wchar_t*
+LocateProgram(const wchar_t* name, const wchar_t* dir, ProgramCache& cache, Arena& arena)
+{
+    ProgramQuery query;
+    if (!PlatformProgramQuery(name, dir, arena, query))
+        return nullptr;
+
+    wchar_t* out = static_cast<wchar_t*>(arena.Alloc(ProgramPathLength(query) * sizeof(*out)));
+    if (!out)
+    {
+        PlatformSetError(PlatformError::OutOfMemory);
+        return nullptr;
+    }
+
+    ResolveOps ops = {};
+    ops.is_file = IsFile;
+    ops.stamp = GetStamp;
+    if (!cache.Resolve(query, ops, out))
+        return nullptr;
+
+    PlatformFixPath(out);
+    return out;
+}
+
+bool
+LocateDirectProgram(const wchar_t* line, const wchar_t* dir, ExecMode mode, ProgramCache& cache,
+                    Arena& arena, wchar_t*& program)
+{
+    program = nullptr;
+    if (mode == ExecMode::Shell || (mode == ExecMode::Auto && PlatformNeedsShell(line)))
+        return true;
+
+    wchar_t* name = static_cast<wchar_t*>(arena.Alloc((wcslen(line) + 1) * sizeof(*name)));
+    if (!name)
+    {
+        PlatformSetError(PlatformError::OutOfMemory);
+        return false;
+    }
+    wchar_t* out = name;
+    ScanProgramName(line, out);
+    *out = '\0';
+
+    program = *name ? LocateProgram(name, dir, cache, arena) : nullptr;
+
+    // Leave anything the platform can't run by itself to the shell, unless
+    // direct mode was forced.
+    if (mode == ExecMode::Auto && program && !PlatformIsDirectProgram(program))
+        program = nullptr;
+
+    if (!program && mode == ExecMode::Direct)
+    {
+        PlatformSetError(PlatformError::NotFound);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "cmdline.h"
+
+class Arena;
+class ProgramCache;
+
+// Deciding how to run a command line, shared by sudo and libsudo.  Both use
+// the platform layer (platform.h) for the file system and the shell.
+
+// Finds a program by name, the way the platform's shell does, through the
+// cache (which may be unattached, in which case it just searches).  dir is
+// the current directory for the command.  Returns the path, or nullptr.
+wchar_t* LocateProgram(const wchar_t* name, const wchar_t* dir, ProgramCache& cache, Arena& arena);
+
+// Decides whether to run a command line without the shell, and if so sets
+// program to the path of the program to run; otherwise sets it to nullptr,
+// meaning run the line in the shell.  Returns false (with the platform's
+// last error set) if the program was required (ExecMode::Direct) but not
+// found, or if out of memory.
+bool LocateDirectProgram(const wchar_t* line, const wchar_t* dir, ExecMode mode, ProgramCache& cache,
+                         Arena& arena, wchar_t*& program);
@@ -0,0 +1,439 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <new>
+
+#include "arena.h"
+#include "cmdline.h"
+#include "launch.h"
+#include "libsudo.h"
+#include "password.h"
+#include "platform.h"
+#include "resolve.h"
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+struct sudo_request
+{
+    Arena               arena;          // Owns the strings below.
+    const wchar_t*      line = nullptr;
+    const wchar_t*      dir = nullptr;
+    const wchar_t*      user = nullptr;
+    wchar_t*            environment = nullptr;
+    SecretBuffer        password;
+    bool                has_password = false;
+    ExecMode            mode = ExecMode::Auto;
+    bool                background = false;
+    bool                non_interactive = false;
+    sudo_backend        backend = {};
+};
+
+struct sudo_process
+{
+    sudo_backend        backend;
+    void*               process;
+    bool                exited;
+    int                 exit_code;
+};
+
+static int
+Fail(PlatformError error)
+{
+    PlatformSetError(error);
+    return int(PlatformGetError());
+}
+
+//------------------------------------------------------------------------------
+// The platform backend.
+
+static int
+PlatformLaunch(const sudo_launch_info* info, void** process, void* /*context*/)
+{
+    PlatformProcess* proc = static_cast<PlatformProcess*>(calloc(1, sizeof(*proc)));
+    if (!proc)
+        return Fail(PlatformError::OutOfMemory);
+
+    Arena arena;
+    SpawnOptions spawn = {};
+    spawn.program = info->program;
+    spawn.command_line = info->command_line;
+    spawn.dir = info->dir;
+    spawn.environment = info->environment;
+    spawn.background = !!info->background;
+    spawn.track_tree = true;
+
+    bool ok;
+    if (info->user)
+    {
+        ok = PlatformSpawnAsUser(spawn, info->user, info->domain, info->password, false, arena, *proc);
+    }
+    else if (info->elevate)
+    {
+        // The elevation hop can't pass an environment, and elevates the
+        // program itself, so it gets the arguments without the program name.
+        ok = false;
+        if (info->environment)
+        {
+            PlatformSetError(PlatformError::NotSupported);
+        }
+        else
+        {
+            wchar_t* none = nullptr;
+            const wchar_t* parameters = ScanProgramName(info->command_line, none);
+            while (*parameters == ' ' || *parameters == '\t')
+                ++parameters;
+            ok = PlatformElevate(info->program, parameters, info->dir, !!info->non_interactive, arena, *proc);
+        }
+    }
+    else
+    {
+        ok = PlatformSpawn(spawn, arena, *proc);
+    }
+
+    if (!ok)
+    {
+        const int err = int(PlatformGetError());
+        free(proc);
+        return err;
+    }
+    *process = proc;
+    return 0;
+}
+
+static int
+PlatformWaitProcess(void* process, unsigned timeout_ms, int* exit_code, void* /*context*/)
+{
+    unsigned code = 0;
+    if (!PlatformWait(*static_cast<PlatformProcess*>(process), code, timeout_ms))
+        return int(PlatformGetError());
+    *exit_code = int(code);
+    return 0;
+}
+
+static int
+PlatformQueryProcessStats(void* process, sudo_stats* stats, void* /*context*/)
+{
+    ProcessStats ps = {};
+    if (!PlatformQueryStats(*static_cast<PlatformProcess*>(process), ps))
+        return int(PlatformGetError());
+    stats->wall_us = ps.wall_us;
+    stats->user_us = ps.user_us;
+    stats->kernel_us = ps.kernel_us;
+    stats->peak_job_memory = ps.peak_job_memory;
+    stats->peak_process_memory = ps.peak_process_memory;
+    stats->read_ops = ps.read_ops;
+    stats->read_bytes = ps.read_bytes;
+    stats->write_ops = ps.write_ops;
+    stats->write_bytes = ps.write_bytes;
+    stats->other_ops = ps.other_ops;
+    stats->other_bytes = ps.other_bytes;
+    stats->processes = ps.processes;
+    return 0;
+}
+
+static void*
+PlatformProcessHandle(void* process, void* /*context*/)
+{
+    return static_cast<PlatformProcess*>(process)->handle;
+}
+
+static void
+PlatformCloseProcess(void* process, void* /*context*/)
+{
+    PlatformClose(*static_cast<PlatformProcess*>(process));
+    free(process);
+}
+
+const sudo_backend*
+sudo_platform_backend(void)
+{
+    static const sudo_backend s_backend =
+    {
+        PlatformLaunch,
+        PlatformWaitProcess,
+        PlatformQueryProcessStats,
+        PlatformProcessHandle,
+        PlatformCloseProcess,
+        nullptr,
+    };
+    return &s_backend;
+}
+
+//------------------------------------------------------------------------------
+// Requests.
+
+sudo_request*
+sudo_request_create(void)
+{
+    void* p = malloc(sizeof(sudo_request));
+    if (!p)
+    {
+        PlatformSetError(PlatformError::OutOfMemory);
+        return nullptr;
+    }
+    sudo_request* request = new (p) sudo_request;
+    request->backend = *sudo_platform_backend();
+    return request;
+}
+
+void
+sudo_request_free(sudo_request* request)
+{
+    if (request)
+    {
+        request->~sudo_request();
+        free(request);
+    }
+}
+
+static int
+CopyString(sudo_request* request, const wchar_t* sudo_request::* field, const wchar_t* s)
+{
+    if (!request)
+        return Fail(PlatformError::InvalidArgument);
+    request->*field = nullptr;
+    if (s && !(request->*field = request->arena.Copy(s)))
+        return Fail(PlatformError::OutOfMemory);
+    return 0;
+}
+
+int
+sudo_request_set_command_line(sudo_request* request, const wchar_t* line)
+{
+    return CopyString(request, &sudo_request::line, line);
+}
+
+int
+sudo_request_set_argv(sudo_request* request, int argc, const wchar_t* const* argv)
+{
+    if (!request || argc < 1 || !argv || !argv[0])
+        return Fail(PlatformError::InvalidArgument);
+
+    // The program name has its own quoting rules.
+    CommandLineBuilder program;
+    program.Program(argv[0]);
+    size_t len = program.Length();
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!argv[i])
+            return Fail(PlatformError::InvalidArgument);
+        len += 1 + CommandLineBuilder::QuotedLength(argv[i]);
+    }
+
+    wchar_t* line = static_cast<wchar_t*>(request->arena.Alloc((len + 1) * sizeof(*line)));
+    if (!line || !program.Emit(line))
+        return Fail(PlatformError::OutOfMemory);
+    wchar_t* p = line + wcslen(line);
+    for (int i = 1; i < argc; ++i)
+    {
+        *(p++) = ' ';
+        p = CommandLineBuilder::AppendQuoted(p, argv[i]);
+    }
+    *p = '\0';
+    request->line = line;
+    return 0;
+}
+
+int
+sudo_request_set_dir(sudo_request* request, const wchar_t* dir)
+{
+    return CopyString(request, &sudo_request::dir, dir);
+}
+
+int
+sudo_request_set_user(sudo_request* request, const wchar_t* user, const wchar_t* password)
+{
+    const int err = CopyString(request, &sudo_request::user, user);
+    if (err)
+        return err;
+    request->password.Clear();
+    request->has_password = (user && password);
+    if (request->has_password && !request->password.Append(password, wcslen(password) * sizeof(*password)))
+        return Fail(PlatformError::OutOfMemory);
+    return 0;
+}
+
+int
+sudo_request_set_env(sudo_request* request, const wchar_t* const* env)
+{
+    if (!request)
+        return Fail(PlatformError::InvalidArgument);
+    request->environment = nullptr;
+    if (!env)
+        return 0;
+
+    // NAME=value\0...\0\0; an empty environment is just \0\0.
+    size_t len = 1;
+    for (const wchar_t* const* p = env; *p; ++p)
+        len += wcslen(*p) + 1;
+    wchar_t* block = static_cast<wchar_t*>(request->arena.Alloc((len + 1) * sizeof(*block)));
+    if (!block)
+        return Fail(PlatformError::OutOfMemory);
+    wchar_t* out = block;
+    for (const wchar_t* const* p = env; *p; ++p)
+    {
+        const size_t cch = wcslen(*p);
+        if (!cch || !wcschr(*p + 1, '='))
+            return Fail(PlatformError::InvalidArgument);
+        wmemcpy(out, *p, cch + 1);
+        out += cch + 1;
+    }
+    *(out++) = '\0';
+    *out = '\0';
+    request->environment = block;
+    return 0;
+}
+
+void
+sudo_request_set_mode(sudo_request* request, int mode)
+{
+    if (request)
+        request->mode = (mode == SUDO_MODE_DIRECT) ? ExecMode::Direct : (mode == SUDO_MODE_SHELL) ? ExecMode::Shell : ExecMode::Auto;
+}
+
+void
+sudo_request_set_background(sudo_request* request, int background)
+{
+    if (request)
+        request->background = !!background;
+}
+
+void
+sudo_request_set_non_interactive(sudo_request* request, int non_interactive)
+{
+    if (request)
+        request->non_interactive = !!non_interactive;
+}
+
+void
+sudo_request_set_backend(sudo_request* request, const sudo_backend* backend)
+{
+    if (request)
+        request->backend = backend ? *backend : *sudo_platform_backend();
+}
+
+//------------------------------------------------------------------------------
+// Launching.
+
+int
+sudo_launch(const sudo_request* request, sudo_process** process)
+{
+    if (!process)
+        return Fail(PlatformError::InvalidArgument);
+    *process = nullptr;
+    if (!request || !request->line || !*request->line || !request->backend.launch)
+        return Fail(PlatformError::InvalidArgument);
+    if (request->user && !request->has_password)
+        return Fail(PlatformError::InvalidArgument);
+
+    // There is no cache file, so the cache just searches.
+    Arena arena;
+    ProgramCache cache;
+    wchar_t* program;
+    if (!LocateDirectProgram(request->line, request->dir, request->mode, cache, arena, program))
+        return int(PlatformGetError());
+
+    sudo_launch_info info = {};
+    info.program = program;
+    info.command_line = request->line;
+    if (!program)
+    {
+        info.command_line = PlatformShellCommandLine(request->line, arena, info.program);
+        if (!info.command_line)
+            return int(PlatformGetError());
+    }
+    info.dir = request->dir;
+    info.environment = request->environment;
+    info.background = request->background;
+    info.non_interactive = request->non_interactive;
+
+    if (request->user)
+    {
+        wchar_t* user = arena.Copy(request->user);
+        if (!user)
+            return Fail(PlatformError::OutOfMemory);
+        wchar_t* sep = wcschr(user, '\\');
+        if (sep)
+        {
+            info.domain = user;
+            *(sep++) = '\0';
+            while (*sep == '\\')
+                ++sep;
+            user = sep;
+        }
+        info.user = user;
+        info.password = request->password.Size() ? request->password.Wide() : L"";
+    }
+    else
+    {
+        info.elevate = !PlatformIsElevated();
+    }
+
+    sudo_process* proc = static_cast<sudo_process*>(calloc(1, sizeof(*proc)));
+    if (!proc)
+        return Fail(PlatformError::OutOfMemory);
+    proc->backend = request->backend;
+
+    const int err = proc->backend.launch(&info, &proc->process, proc->backend.context);
+    if (err)
+    {
+        free(proc);
+        return err;
+    }
+    *process = proc;
+    return 0;
+}
+
+void*
+sudo_process_handle(const sudo_process* process)
+{
+    if (!process || !process->backend.handle)
+        return nullptr;
+    return process->backend.handle(process->process, process->backend.context);
+}
+
+int
+sudo_wait(sudo_process* process, unsigned timeout_ms, int* exit_code)
+{
+    if (!process || !exit_code)
+        return Fail(PlatformError::InvalidArgument);
+    if (!process->exited)
+    {
+        const int err = process->backend.wait(process->process, timeout_ms, &process->exit_code, process->backend.context);
+        if (err)
+            return err;
+        process->exited = true;
+    }
+    *exit_code = process->exit_code;
+    return 0;
+}
+
+int
+sudo_get_stats(const sudo_process* process, sudo_stats* stats)
+{
+    if (!process || !stats)
+        return Fail(PlatformError::InvalidArgument);
+    if (!process->exited || !process->backend.query_stats)
+        return Fail(PlatformError::NotSupported);
+    memset(stats, 0, sizeof(*stats));
+    const int err = process->backend.query_stats(process->process, stats, process->backend.context);
+    if (err)
+        return err;
+    stats->exit_code = process->exit_code;
+    return 0;
+}
+
+void
+sudo_process_close(sudo_process* process)
+{
+    if (process)
+    {
+        if (process->backend.close)
+            process->backend.close(process->process, process->backend.context);
+        free(process);
+    }
+}
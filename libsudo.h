@@ -0,0 +1,165 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <wchar.h>
+
+// libsudo launches a command line the way sudo does, from inside another
+// program (e.g. a long lived service), instead of by starting sudo.exe and
+// reading its exit code.  It is a C API:
+//
+//      sudo_request* req = sudo_request_create();
+//      const wchar_t* argv[] = { L"net", L"stop", L"spooler" };
+//      sudo_request_set_argv(req, 3, argv);
+//      sudo_process* proc;
+//      int err = sudo_launch(req, &proc);
+//      sudo_request_free(req);
+//      if (!err)
+//      {
+//          int exit_code;
+//          sudo_stats stats;
+//          err = sudo_wait(proc, SUDO_WAIT_FOREVER, &exit_code);
+//          if (!err && !sudo_get_stats(proc, &stats))
+//              ...
+//          sudo_process_close(proc);
+//      }
+//
+// Functions that can fail return 0 on success, or else the platform's error
+// code (a Win32 error, or an errno value).  Nothing is global:  requests and
+// processes are independent, and separate ones may be used on separate
+// threads at once.
+//
+// The command runs directly if the program can run without the shell, else
+// through the shell (CMD, or /bin/sh), the same as sudo.  If the calling
+// process isn't elevated, the command itself is elevated (on Windows with
+// the consent UI, unless non_interactive).  An elevated command has its own
+// (hidden) console, and the directory may not apply to it, since Windows
+// starts elevated programs in the system directory.  Commands run as
+// another user need the password; libsudo never prompts.
+//
+// How commands are started is pluggable:  a backend receives the decided
+// program, command line, and options.  The default backend uses the
+// platform layer (Win32, or posix_spawn on Linux), and tests can supply one
+// that records launches instead.
+//
+// This is not sudo.exe behind a C API, and sudo.exe doesn't call it.  They
+// share the library's internals (the direct or shell decision, the command
+// line quoting, the stats, and the platform layer), but the hop through a
+// second, elevated sudo.exe, the handoff section, the broker, the sudoers
+// policy, the audit journal, recordings, and the password prompt are only
+// in sudo.exe.  A command launched with libsudo gets none of them.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define SUDO_ERROR_TIMEOUT      258         // WAIT_TIMEOUT
+#else
+#include <errno.h>
+#define SUDO_ERROR_TIMEOUT      ETIMEDOUT
+#endif
+
+#define SUDO_WAIT_FOREVER       (~0u)
+
+enum
+{
+    SUDO_MODE_AUTO,             // Direct, unless the command needs the shell.
+    SUDO_MODE_DIRECT,           // Never use the shell.
+    SUDO_MODE_SHELL,            // Always use the shell.
+};
+
+typedef struct sudo_request sudo_request;
+typedef struct sudo_process sudo_process;
+
+// Resources used by the command's whole process tree.  Times are in
+// microseconds and sizes are in bytes.
+typedef struct sudo_stats
+{
+    unsigned long long  wall_us;
+    unsigned long long  user_us;
+    unsigned long long  kernel_us;
+    unsigned long long  peak_job_memory;
+    unsigned long long  peak_process_memory;
+    unsigned long long  read_ops;
+    unsigned long long  read_bytes;
+    unsigned long long  write_ops;
+    unsigned long long  write_bytes;
+    unsigned long long  other_ops;
+    unsigned long long  other_bytes;
+    unsigned            processes;
+    int                 exit_code;
+} sudo_stats;
+
+// What a backend is asked to start.  The strings are only valid during the
+// call.
+typedef struct sudo_launch_info
+{
+    const wchar_t*      program;        // Full path of the program (or the shell).
+    const wchar_t*      command_line;   // Includes the program name.
+    const wchar_t*      dir;            // NULL for the current directory.
+    const wchar_t*      environment;    // NAME=value\0...\0\0, or NULL to inherit.
+    const wchar_t*      user;           // NULL unless running as another user.
+    const wchar_t*      domain;
+    const wchar_t*      password;
+    int                 elevate;        // The caller isn't elevated.
+    int                 background;
+    int                 non_interactive;
+} sudo_launch_info;
+
+typedef struct sudo_backend
+{
+    // Starts the command and returns an opaque process.
+    int                 (*launch)(const sudo_launch_info* info, void** process, void* context);
+    // Waits for the command (and its tree) to exit, for up to timeout_ms.
+    int                 (*wait)(void* process, unsigned timeout_ms, int* exit_code, void* context);
+    // Fills in the stats, except the exit code.
+    int                 (*query_stats)(void* process, sudo_stats* stats, void* context);
+    // A handle to wait on (a process HANDLE, or a pid), or NULL.
+    void*               (*handle)(void* process, void* context);
+    void                (*close)(void* process, void* context);
+    void*               context;
+} sudo_backend;
+
+// The backend that starts commands with the platform layer.
+const sudo_backend* sudo_platform_backend(void);
+
+sudo_request* sudo_request_create(void);
+void sudo_request_free(sudo_request* request);
+
+// The command, either as arguments (quoted into a command line the same way
+// the C runtime will unquote it) or as a command line.
+int sudo_request_set_argv(sudo_request* request, int argc, const wchar_t* const* argv);
+int sudo_request_set_command_line(sudo_request* request, const wchar_t* line);
+
+int sudo_request_set_dir(sudo_request* request, const wchar_t* dir);
+// user is name or DOMAIN\name.  The password is wiped when the request is
+// freed.
+int sudo_request_set_user(sudo_request* request, const wchar_t* user, const wchar_t* password);
+// The complete environment for the command, as a NULL terminated array of
+// NAME=value strings; NULL (the default) inherits the caller's.
+int sudo_request_set_env(sudo_request* request, const wchar_t* const* env);
+void sudo_request_set_mode(sudo_request* request, int mode);
+void sudo_request_set_background(sudo_request* request, int background);
+void sudo_request_set_non_interactive(sudo_request* request, int non_interactive);
+// NULL uses sudo_platform_backend().  The backend is copied, but its
+// context must outlive the processes launched with it.
+void sudo_request_set_backend(sudo_request* request, const sudo_backend* backend);
+
+// Launches the command.  The request can be freed or reused afterwards.
+int sudo_launch(const sudo_request* request, sudo_process** process);
+
+void* sudo_process_handle(const sudo_process* process);
+// Returns SUDO_ERROR_TIMEOUT if the command is still running.  Once it has
+// returned 0, later calls return the same exit code again.
+int sudo_wait(sudo_process* process, unsigned timeout_ms, int* exit_code);
+// Only after sudo_wait() has returned 0.
+int sudo_get_stats(const sudo_process* process, sudo_stats* stats);
+// Does not stop the command.
+void sudo_process_close(sudo_process* process);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,766 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <strsafe.h>
+#include <stdlib.h>
+
+#include "logonagent.h"
+#include "logoncache.h"
+#include "password.h"
+#include "pipe.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// The wire protocol is a fixed header followed by the account, password,
+// directory, and parameters as UTF-16 (without terminators), answered by a
+// fixed reply.  The agent and its hosts speak the same protocol; a host only
+// gets launch requests (without an account or password) and logoffs.
+
+enum : DWORD
+{
+    LOGON_MAGIC                 = 0x4e474c53,  // 'SLGN'
+    LOGON_VERSION               = 1,
+};
+
+enum : DWORD
+{
+    LOGON_OP_LAUNCH,
+    LOGON_OP_INVALIDATE,        // -k
+    LOGON_OP_STOP,              // --remove-timestamp
+    LOGON_OP_LOGOFF,            // Agent to host.
+    LOGON_OP_MAX = LOGON_OP_LOGOFF
+};
+
+struct LogonMessage
+{
+    DWORD       dwMagic;
+    DWORD       dwVersion;
+    DWORD       dwOp;
+    DWORD       dwPID;
+    DWORD       dwFlags;
+    DWORD       cchAccount;
+    DWORD       cchPassword;
+    DWORD       cchDir;
+    DWORD       cchParameters;
+};
+
+struct LogonReply
+{
+    DWORD       dwMagic;
+    DWORD       dwResult;       // LogonAgentResult.
+    DWORD       dwError;
+    DWORD       dwExit;
+};
+
+// The strings of a request, read into one buffer which is wiped when freed,
+// since it holds the password.
+struct LogonStrings
+{
+    WCHAR*      buffer = nullptr;
+    size_t      cb = 0;
+    LPCWSTR     pszAccount = nullptr;
+    LPCWSTR     pszPassword = nullptr;
+    LPCWSTR     pszDir = nullptr;
+    LPCWSTR     pszParameters = nullptr;
+
+    ~LogonStrings()
+    {
+        if (buffer)
+        {
+            SecretBuffer::Wipe(buffer, cb);
+            free(buffer);
+        }
+    }
+};
+
+// A logon host, as the agent sees it.
+struct LogonHost
+{
+    HANDLE      hProcess;
+    DWORD       dwPID;
+    WCHAR       szPipe[256];
+};
+
+static LogonCache* s_pCache = nullptr;
+static CRITICAL_SECTION s_csCache;
+static LPWSTR s_pszSid = nullptr;
+static DWORD s_dwSession = 0;
+static DWORD s_dwTimeout = 0;
+static DWORD s_dwAgentPID = 0;             // In a host.
+static volatile bool s_fStop = false;
+
+// The agent's pipe name is scoped to the user and the console session, like
+// the broker's, so requests from other users or sessions never reach it.
+static bool
+GetAgentPipeName(WCHAR* pszName, size_t cchName, LPWSTR* ppszSid=nullptr)
+{
+    DWORD dwSession = 0;
+    if (!ProcessIdToSessionId(GetCurrentProcessId(), &dwSession))
+        return false;
+
+    LPWSTR pszSid = GetUserSidString();
+    if (!pszSid)
+        return false;
+
+    const bool ok = SUCCEEDED(StringCchPrintfW(pszName, cchName, L"\\\\.\\pipe\\sudo-logon-%u-%s", dwSession, pszSid));
+
+    if (ok && ppszSid)
+        *ppszSid = pszSid;
+    else
+        LocalFree(pszSid);
+    return ok;
+}
+
+static bool
+GetHostPipeName(WCHAR* pszName, size_t cchName, DWORD dwSession, LPCWSTR pszSid, unsigned long long nonce)
+{
+    return SUCCEEDED(StringCchPrintfW(pszName, cchName, L"\\\\.\\pipe\\sudo-logon-host-%u-%s-%016llx", dwSession, pszSid, nonce));
+}
+
+static bool
+IsSameSession(HANDLE hPipe, DWORD dwPID)
+{
+    ULONG ulClientPID = 0;
+    DWORD dwClientSession = 0;
+    return (GetNamedPipeClientProcessId(hPipe, &ulClientPID) &&
+            ulClientPID == dwPID &&
+            ProcessIdToSessionId(ulClientPID, &dwClientSession) &&
+            dwClientSession == s_dwSession);
+}
+
+static bool
+SendLogonMessage(HANDLE hPipe, DWORD dwOp, DWORD dwPID, DWORD dwFlags, LPCWSTR pszAccount, LPCWSTR pszPassword,
+                 LPCWSTR pszDir, LPCWSTR pszParameters)
+{
+    const size_t cchAccount = pszAccount ? wcslen(pszAccount) : 0;
+    const size_t cchPassword = pszPassword ? wcslen(pszPassword) : 0;
+    const size_t cchDir = pszDir ? wcslen(pszDir) : 0;
+    const size_t cchParameters = pszParameters ? wcslen(pszParameters) : 0;
+    if (cchAccount >= LOGON_MAX_STRING || cchPassword >= LOGON_MAX_PASSWORD ||
+        cchDir >= LOGON_MAX_STRING || cchParameters >= LOGON_MAX_STRING)
+    {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return false;
+    }
+
+    LogonMessage msg = { LOGON_MAGIC, LOGON_VERSION, dwOp, dwPID, dwFlags,
+                         DWORD(cchAccount), DWORD(cchPassword), DWORD(cchDir), DWORD(cchParameters) };
+    return (TransferExact(hPipe, &msg, sizeof(msg), true) &&
+            TransferExact(hPipe, const_cast<LPWSTR>(pszAccount), DWORD(cchAccount * sizeof(WCHAR)), true) &&
+            TransferExact(hPipe, const_cast<LPWSTR>(pszPassword), DWORD(cchPassword * sizeof(WCHAR)), true) &&
+            TransferExact(hPipe, const_cast<LPWSTR>(pszDir), DWORD(cchDir * sizeof(WCHAR)), true) &&
+            TransferExact(hPipe, const_cast<LPWSTR>(pszParameters), DWORD(cchParameters * sizeof(WCHAR)), true));
+}
+
+// Reads the rest of a request, after its header was validated.
+static bool
+ReceiveStrings(HANDLE hPipe, const LogonMessage& msg, LogonStrings& strings)
+{
+    const size_t cch = msg.cchAccount + 1 + msg.cchPassword + 1 + msg.cchDir + 1 + msg.cchParameters + 1;
+    strings.cb = cch * sizeof(WCHAR);
+    strings.buffer = static_cast<WCHAR*>(calloc(cch, sizeof(WCHAR)));
+    if (!strings.buffer)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    WCHAR* p = strings.buffer;
+    const DWORD ach[] = { msg.cchAccount, msg.cchPassword, msg.cchDir, msg.cchParameters };
+    LPCWSTR* const appsz[] = { &strings.pszAccount, &strings.pszPassword, &strings.pszDir, &strings.pszParameters };
+    for (unsigned i = 0; i < _countof(ach); ++i)
+    {
+        if (!TransferExact(hPipe, p, ach[i] * sizeof(WCHAR), false))
+            return false;
+        *appsz[i] = ach[i] ? p : nullptr;
+        p += ach[i] + 1;
+    }
+    return true;
+}
+
+static bool
+ReceiveLogonMessage(HANDLE hPipe, LogonMessage& msg)
+{
+    if (!TransferExact(hPipe, &msg, sizeof(msg), false))
+        return false;
+    if (msg.dwMagic != LOGON_MAGIC ||
+        msg.dwVersion != LOGON_VERSION ||
+        msg.dwOp > LOGON_OP_MAX ||
+        msg.cchAccount >= LOGON_MAX_STRING ||
+        msg.cchPassword >= LOGON_MAX_PASSWORD ||
+        msg.cchDir >= LOGON_MAX_STRING ||
+        msg.cchParameters >= LOGON_MAX_STRING)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+    return true;
+}
+
+// Sends a message and waits for the reply.  Returns false if the message
+// couldn't be sent or there was no reply.
+static bool
+CallPipe(HANDLE hPipe, DWORD dwOp, const LogonAgentRequest& req, LogonReply& reply)
+{
+    if (!SendLogonMessage(hPipe, dwOp, req.dwPID, req.dwFlags, req.pszAccount, req.pszPassword, req.pszDir, req.pszParameters) ||
+        !TransferExact(hPipe, &reply, sizeof(reply), false))
+        return false;
+    if (reply.dwMagic != LOGON_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Client side.
+
+// Only talk to an agent that is this same sudo.exe running as this user.
+static bool
+IsTrustedAgent(HANDLE hPipe)
+{
+    ULONG ulServerPID = 0;
+    if (!GetNamedPipeServerProcessId(hPipe, &ulServerPID))
+        return false;
+
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, ulServerPID);
+    if (!hProcess)
+        return false;
+
+    bool fTrusted = IsSudoProcess(hProcess);
+    if (fTrusted)
+    {
+        LPWSTR pszServerSid = GetUserSidString(hProcess);
+        LPWSTR pszSid = GetUserSidString();
+        fTrusted = (pszServerSid && pszSid && !wcscmp(pszServerSid, pszSid));
+        LocalFree(pszServerSid);
+        LocalFree(pszSid);
+    }
+
+    CloseHandle(hProcess);
+    return fTrusted;
+}
+
+static HANDLE
+ConnectAgent()
+{
+    WCHAR szPipe[256];
+    if (!GetAgentPipeName(szPipe, _countof(szPipe)))
+        return INVALID_HANDLE_VALUE;
+
+    HANDLE hPipe;
+    while (true)
+    {
+        hPipe = CreateFileW(szPipe, GENERIC_READ|FILE_WRITE_DATA, 0, nullptr, OPEN_EXISTING,
+                            SECURITY_SQOS_PRESENT|SECURITY_IDENTIFICATION, nullptr);
+        if (hPipe != INVALID_HANDLE_VALUE)
+            break;
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(szPipe, 2000))
+            return INVALID_HANDLE_VALUE;
+    }
+
+    if (!IsTrustedAgent(hPipe))
+    {
+        CloseHandle(hPipe);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hPipe;
+}
+
+LogonAgentResult
+LogonAgentSendRequest(const LogonAgentRequest& req, DWORD& dwExit)
+{
+    HANDLE hPipe = ConnectAgent();
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return LogonAgentResult::Unavailable;
+
+    // Until the whole request is written, the agent cannot have launched
+    // anything, so it is still safe to log on the normal way.
+
+    if (!SendLogonMessage(hPipe, LOGON_OP_LAUNCH, req.dwPID, req.dwFlags, req.pszAccount, req.pszPassword,
+                     req.pszDir, req.pszParameters))
+    {
+        CloseHandle(hPipe);
+        return LogonAgentResult::Unavailable;
+    }
+
+    LogonReply reply = {};
+    const bool ok = TransferExact(hPipe, &reply, sizeof(reply), false);
+    const DWORD err = GetLastError();
+    CloseHandle(hPipe);
+
+    if (!ok)
+    {
+        SetLastError(err);
+        return LogonAgentResult::Failed;
+    }
+    if (reply.dwMagic != LOGON_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return LogonAgentResult::Failed;
+    }
+    if (reply.dwError)
+    {
+        SetLastError(reply.dwError);
+        return LogonAgentResult::Failed;
+    }
+
+    dwExit = reply.dwExit;
+    return (reply.dwResult == DWORD(LogonAgentResult::NeedsPassword)) ? LogonAgentResult::NeedsPassword : LogonAgentResult::Launched;
+}
+
+bool
+LogonAgentSpawn(LPCWSTR pszModule, DWORD dwTimeoutSeconds)
+{
+    WCHAR szPipe[256];
+    if (!GetAgentPipeName(szPipe, _countof(szPipe)))
+        return false;
+
+    const size_t cch = wcslen(pszModule) + 64;
+    LPWSTR pszCmdLine = LPWSTR(malloc(cch * sizeof(*pszCmdLine)));
+    if (!pszCmdLine)
+        return false;
+
+    StringCchPrintfW(pszCmdLine, cch, L"\"%s\" --logon-serve %u", pszModule, dwTimeoutSeconds);
+
+    // Run from the system directory so the agent doesn't keep the caller's
+    // current directory in use.
+    WCHAR szSysDir[MAX_PATH];
+    const UINT cchSysDir = GetSystemDirectoryW(szSysDir, _countof(szSysDir));
+
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = {};
+    bool ok = !!CreateProcessW(pszModule, pszCmdLine, nullptr, nullptr, false,
+                               DETACHED_PROCESS|CREATE_NEW_PROCESS_GROUP, nullptr,
+                               (cchSysDir && cchSysDir < _countof(szSysDir)) ? szSysDir : nullptr,
+                               &si, &pi);
+    free(pszCmdLine);
+    if (!ok)
+        return false;
+
+    // Wait for the pipe.  If the agent exits first, another agent may have
+    // won the race to own the name.
+    ok = false;
+    for (unsigned cTries = 0; !ok && cTries < 50; ++cTries)
+    {
+        ok = !!WaitNamedPipeW(szPipe, 100);
+        if (!ok && WaitForSingleObject(pi.hProcess, 40) == WAIT_OBJECT_0)
+        {
+            ok = !!WaitNamedPipeW(szPipe, 100);
+            break;
+        }
+    }
+
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return ok;
+}
+
+bool
+LogonAgentInvalidate(bool fStop)
+{
+    HANDLE hPipe = ConnectAgent();
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return true;
+
+    LogonAgentRequest req = {};
+    req.dwPID = GetCurrentProcessId();
+    LogonReply reply = {};
+    bool ok = CallPipe(hPipe, fStop ? LOGON_OP_STOP : LOGON_OP_INVALIDATE, req, reply);
+    if (ok && reply.dwError)
+    {
+        SetLastError(reply.dwError);
+        ok = false;
+    }
+    const DWORD err = GetLastError();
+    CloseHandle(hPipe);
+    SetLastError(err);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Agent.
+
+// Logs on by starting a logon host as the account, with its profile loaded.
+static void*
+AgentLogon(const LogonKey& key, const wchar_t* password, void* /*context*/)
+{
+    // The account is DOMAIN\name or name, as for -u.
+    const size_t cchAccount = wcslen(key.account);
+    LPWSTR pszDomain = static_cast<LPWSTR>(malloc((cchAccount + 1) * sizeof(WCHAR)));
+    LogonHost* pHost = static_cast<LogonHost*>(calloc(1, sizeof(LogonHost)));
+    LPWSTR pszModule = (pszDomain && pHost) ? GetModulePath() : nullptr;
+    if (!pszModule)
+    {
+        const DWORD err = (pszDomain && pHost) ? GetLastError() : ERROR_OUTOFMEMORY;
+        free(pszDomain);
+        free(pHost);
+        SetLastError(err);
+        return nullptr;
+    }
+    memcpy(pszDomain, key.account, (cchAccount + 1) * sizeof(WCHAR));
+    LPWSTR pszUser = wcschr(pszDomain, '\\');
+    if (pszUser)
+    {
+        *(pszUser++) = '\0';
+        while (*pszUser == '\\')
+            ++pszUser;
+    }
+    else
+    {
+        pszUser = pszDomain;
+        pszDomain = nullptr;
+    }
+
+    LARGE_INTEGER liNonce;
+    QueryPerformanceCounter(&liNonce);
+    const size_t cchCmdLine = wcslen(pszModule) + wcslen(s_pszSid) + 64;
+    LPWSTR pszCmdLine = static_cast<LPWSTR>(malloc(cchCmdLine * sizeof(*pszCmdLine)));
+    const bool fNames = (pszCmdLine &&
+                         GetHostPipeName(pHost->szPipe, _countof(pHost->szPipe), s_dwSession, s_pszSid, liNonce.QuadPart) &&
+                         SUCCEEDED(StringCchPrintfW(pszCmdLine, cchCmdLine, L"\"%s\" --logon-host %u,%u,%s,%016llx",
+                                                    pszModule, s_dwTimeout, GetCurrentProcessId(), s_pszSid, liNonce.QuadPart)));
+
+    WCHAR szSysDir[MAX_PATH];
+    const UINT cchSysDir = GetSystemDirectoryW(szSysDir, _countof(szSysDir));
+
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = {};
+    const bool ok = (fNames &&
+                     CreateProcessWithLogonW(pszUser, pszDomain, password, LOGON_WITH_PROFILE, pszModule, pszCmdLine,
+                                             CREATE_NO_WINDOW|CREATE_NEW_PROCESS_GROUP, nullptr,
+                                             (cchSysDir && cchSysDir < _countof(szSysDir)) ? szSysDir : nullptr,
+                                             &si, &pi));
+    DWORD err = fNames ? GetLastError() : pszCmdLine ? ERROR_FILENAME_EXCED_RANGE : ERROR_OUTOFMEMORY;
+    free(pszCmdLine);
+    free(pszModule);
+    free(pszDomain ? pszDomain : pszUser);
+    if (!ok)
+    {
+        free(pHost);
+        SetLastError(err);
+        return nullptr;
+    }
+    CloseHandle(pi.hThread);
+    pHost->hProcess = pi.hProcess;
+    pHost->dwPID = pi.dwProcessId;
+
+    // Loading the profile can take a while; wait for the host's pipe.
+    for (unsigned cTries = 0; cTries < 600; ++cTries)
+    {
+        if (WaitNamedPipeW(pHost->szPipe, 100))
+            return pHost;
+        const DWORD errWait = GetLastError();
+        if ((errWait != ERROR_FILE_NOT_FOUND && errWait != ERROR_SEM_TIMEOUT) ||
+            WaitForSingleObject(pHost->hProcess, 100) == WAIT_OBJECT_0)
+            break;
+    }
+
+    err = (WaitForSingleObject(pHost->hProcess, 0) == WAIT_OBJECT_0) ? ERROR_PROCESS_ABORTED : ERROR_TIMEOUT;
+    TerminateProcess(pHost->hProcess, DWORD(-1));
+    CloseHandle(pHost->hProcess);
+    free(pHost);
+    SetLastError(err);
+    return nullptr;
+}
+
+static HANDLE
+ConnectHost(const LogonHost* pHost)
+{
+    HANDLE hPipe = CreateFileW(pHost->szPipe, GENERIC_READ|FILE_WRITE_DATA, 0, nullptr, OPEN_EXISTING,
+                               SECURITY_SQOS_PRESENT|SECURITY_IDENTIFICATION, nullptr);
+    if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeW(pHost->szPipe, 2000))
+        hPipe = CreateFileW(pHost->szPipe, GENERIC_READ|FILE_WRITE_DATA, 0, nullptr, OPEN_EXISTING,
+                            SECURITY_SQOS_PRESENT|SECURITY_IDENTIFICATION, nullptr);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return hPipe;
+
+    // Only talk to the host that the agent started.
+    ULONG ulServerPID = 0;
+    if (!GetNamedPipeServerProcessId(hPipe, &ulServerPID) || ulServerPID != pHost->dwPID)
+    {
+        CloseHandle(hPipe);
+        SetLastError(ERROR_ACCESS_DENIED);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hPipe;
+}
+
+// Asks the host to exit, which unloads its profile.
+static void
+AgentLogoff(void* logon, void* /*context*/)
+{
+    LogonHost* const pHost = static_cast<LogonHost*>(logon);
+    HANDLE hPipe = ConnectHost(pHost);
+    if (hPipe != INVALID_HANDLE_VALUE)
+    {
+        LogonAgentRequest req = {};
+        req.dwPID = GetCurrentProcessId();
+        LogonReply reply;
+        CallPipe(hPipe, LOGON_OP_LOGOFF, req, reply);
+        CloseHandle(hPipe);
+    }
+    if (WaitForSingleObject(pHost->hProcess, 5000) != WAIT_OBJECT_0)
+        TerminateProcess(pHost->hProcess, DWORD(-1));
+    CloseHandle(pHost->hProcess);
+    free(pHost);
+}
+
+static unsigned long long
+AgentNow(void* /*context*/)
+{
+    return GetTickCount64();
+}
+
+static DWORD
+AgentLaunch(const LogonMessage& msg, const LogonStrings& strings, LogonReply& reply)
+{
+    if (!strings.pszAccount || !strings.pszParameters)
+        return ERROR_INVALID_DATA;
+
+    const LogonKey key = { s_pszSid, s_dwSession, strings.pszAccount };
+    void* logon;
+    EnterCriticalSection(&s_csCache);
+    const LogonLookup lookup = s_pCache->Acquire(key, strings.pszPassword, logon);
+    const DWORD errLogon = GetLastError();
+    LeaveCriticalSection(&s_csCache);
+
+    switch (lookup)
+    {
+    case LogonLookup::NeedsPassword:
+        reply.dwResult = DWORD(LogonAgentResult::NeedsPassword);
+        return NOERROR;
+    case LogonLookup::Failed:
+        return errLogon ? errLogon : ERROR_LOGON_FAILURE;
+    default:
+        break;
+    }
+
+    // The host replies once the command exits (or at once with -b).
+    HANDLE hHost = ConnectHost(static_cast<const LogonHost*>(logon));
+    LogonAgentRequest req = {};
+    req.dwPID = msg.dwPID;
+    req.dwFlags = msg.dwFlags;
+    req.pszDir = strings.pszDir;
+    req.pszParameters = strings.pszParameters;
+    LogonReply hostReply = {};
+    const bool fReached = (hHost != INVALID_HANDLE_VALUE && CallPipe(hHost, LOGON_OP_LAUNCH, req, hostReply));
+    if (hHost != INVALID_HANDLE_VALUE)
+        CloseHandle(hHost);
+
+    // A host that can't be reached is gone (e.g. the account logged off);
+    // the client asks for the password again.
+    EnterCriticalSection(&s_csCache);
+    s_pCache->Release(logon, !fReached);
+    LeaveCriticalSection(&s_csCache);
+
+    if (!fReached)
+    {
+        if (lookup != LogonLookup::Cached)
+            return ERROR_PROCESS_ABORTED;
+        reply.dwResult = DWORD(LogonAgentResult::NeedsPassword);
+        return NOERROR;
+    }
+
+    reply.dwResult = DWORD(LogonAgentResult::Launched);
+    reply.dwExit = hostReply.dwExit;
+    return hostReply.dwError;
+}
+
+static DWORD
+AgentHandleRequest(HANDLE hPipe, LogonReply& reply)
+{
+    LogonMessage msg;
+    if (!ReceiveLogonMessage(hPipe, msg))
+        return GetLastError();
+
+    // Only the agent's own user can open the pipe, and only clients in its
+    // session may use the logons.
+    if (!IsSameSession(hPipe, msg.dwPID))
+        return ERROR_ACCESS_DENIED;
+
+    LogonStrings strings;
+    if (!ReceiveStrings(hPipe, msg, strings))
+        return GetLastError();
+
+    switch (msg.dwOp)
+    {
+    case LOGON_OP_LAUNCH:
+        return AgentLaunch(msg, strings, reply);
+    case LOGON_OP_INVALIDATE:
+    case LOGON_OP_STOP:
+        EnterCriticalSection(&s_csCache);
+        s_pCache->Invalidate(s_pszSid, s_dwSession);
+        LeaveCriticalSection(&s_csCache);
+        if (msg.dwOp == LOGON_OP_STOP)
+            s_fStop = true;
+        return NOERROR;
+    default:
+        return ERROR_INVALID_DATA;
+    }
+}
+
+static void
+AgentServeClient(HANDLE hPipe, void* /*context*/)
+{
+    LogonReply reply = { LOGON_MAGIC };
+    reply.dwError = AgentHandleRequest(hPipe, reply);
+
+    if (TransferExact(hPipe, &reply, sizeof(reply), true))
+        FlushFileBuffers(hPipe);
+}
+
+// The agent exits once nothing is cached and no client has come for a
+// little while (the first client connects right after spawning it).
+static bool
+IsAgentIdle(ULONGLONG ullIdleMs, void* /*context*/)
+{
+    EnterCriticalSection(&s_csCache);
+    const unsigned cLogons = s_pCache->Expire();
+    LeaveCriticalSection(&s_csCache);
+    return s_fStop || (!cLogons && ullIdleMs >= 10 * 1000);
+}
+
+int
+LogonAgentServe(DWORD dwTimeoutSeconds)
+{
+    WCHAR szPipe[256];
+    if (!GetAgentPipeName(szPipe, _countof(szPipe), &s_pszSid) ||
+        !ProcessIdToSessionId(GetCurrentProcessId(), &s_dwSession))
+        return 1;
+
+    // Only the invoking user (and SYSTEM) may connect, with read and
+    // write-data access but not FILE_CREATE_PIPE_INSTANCE.
+    WCHAR szSddl[256];
+    if (FAILED(StringCchPrintfW(szSddl, _countof(szSddl), L"D:P(A;;GA;;;SY)(A;;0x0012019b;;;%s)", s_pszSid)))
+        return 1;
+
+    s_dwTimeout = dwTimeoutSeconds;
+    InitializeCriticalSection(&s_csCache);
+    const LogonCacheOps cacheOps = { AgentLogon, AgentLogoff, AgentNow, nullptr };
+    const ULONGLONG ullTimeoutMs = ULONGLONG(dwTimeoutSeconds) * 1000;
+    LogonCache cache(cacheOps, unsigned((ullTimeoutMs < ~0u) ? ullTimeoutMs : ~0u));
+    s_pCache = &cache;
+
+    const PipeServerOps ops = { AgentServeClient, IsAgentIdle, nullptr };
+    const bool ok = ServePipe(szPipe, szSddl, ops);
+
+    // The cache logs off whatever is left.
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+// Logon host.
+
+static DWORD
+HostLaunch(const LogonMessage& msg, const LogonStrings& strings, DWORD& dwExit)
+{
+    if (!strings.pszParameters)
+        return ERROR_INVALID_DATA;
+
+    // Only ever runs sudo.exe itself, which then attaches to the client's
+    // console and launches the command the way it would after -u.
+    LPWSTR pszModule = GetModulePath();
+    if (!pszModule)
+        return GetLastError();
+
+    const size_t cch = wcslen(pszModule) + 3 + wcslen(strings.pszParameters) + 1;
+    LPWSTR pszCmdLine = static_cast<LPWSTR>(malloc(cch * sizeof(WCHAR)));
+    if (!pszCmdLine)
+    {
+        free(pszModule);
+        return ERROR_OUTOFMEMORY;
+    }
+    StringCchPrintfW(pszCmdLine, cch, L"\"%s\" %s", pszModule, strings.pszParameters);
+
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = {};
+    const bool ok = !!CreateProcessW(pszModule, pszCmdLine, nullptr, nullptr, false, CREATE_NO_WINDOW,
+                                     nullptr, strings.pszDir, &si, &pi);
+    const DWORD err = ok ? NOERROR : GetLastError();
+    free(pszCmdLine);
+    free(pszModule);
+    if (!ok)
+        return err;
+
+    CloseHandle(pi.hThread);
+    if (!(msg.dwFlags & LOGON_FLAG_BACKGROUND))
+    {
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        GetExitCodeProcess(pi.hProcess, &dwExit);
+    }
+    CloseHandle(pi.hProcess);
+    return NOERROR;
+}
+
+static void
+HostServeClient(HANDLE hPipe, void* /*context*/)
+{
+    LogonReply reply = { LOGON_MAGIC };
+    LogonMessage msg;
+    LogonStrings strings;
+    if (!ReceiveLogonMessage(hPipe, msg))
+        reply.dwError = GetLastError();
+    else if (!IsSameSession(hPipe, s_dwAgentPID) || msg.cchAccount || msg.cchPassword)
+        reply.dwError = ERROR_ACCESS_DENIED;
+    else if (!ReceiveStrings(hPipe, msg, strings))
+        reply.dwError = GetLastError();
+    else if (msg.dwOp == LOGON_OP_LOGOFF)
+        s_fStop = true;
+    else if (msg.dwOp == LOGON_OP_LAUNCH)
+        reply.dwError = HostLaunch(msg, strings, reply.dwExit);
+    else
+        reply.dwError = ERROR_INVALID_DATA;
+
+    if (TransferExact(hPipe, &reply, sizeof(reply), true))
+        FlushFileBuffers(hPipe);
+}
+
+// The agent logs the host off, but if the agent went away, the host still
+// exits a little after the logon would have expired.
+static bool
+IsHostIdle(ULONGLONG ullIdleMs, void* /*context*/)
+{
+    return s_fStop || ullIdleMs >= (ULONGLONG(s_dwTimeout) + 60) * 1000;
+}
+
+int
+LogonHostServe(LPCWSTR pszSpec)
+{
+    // The spec is "timeout,agent pid,caller SID,nonce".
+    WCHAR* pszEnd;
+    s_dwTimeout = wcstoul(pszSpec, &pszEnd, 10);
+    if (*pszEnd != ',')
+        return 1;
+    s_dwAgentPID = wcstoul(pszEnd + 1, &pszEnd, 10);
+    if (*pszEnd != ',')
+        return 1;
+    LPCWSTR pszCallerSid = pszEnd + 1;
+    LPCWSTR pszComma = wcschr(pszCallerSid, ',');
+    if (!pszComma)
+        return 1;
+    const unsigned long long nonce = wcstoull(pszComma + 1, &pszEnd, 16);
+    if (*pszEnd)
+        return 1;
+
+    WCHAR szCallerSid[256];
+    if (FAILED(StringCchCopyNW(szCallerSid, _countof(szCallerSid), pszCallerSid, pszComma - pszCallerSid)) ||
+        !ProcessIdToSessionId(GetCurrentProcessId(), &s_dwSession))
+        return 1;
+
+    WCHAR szPipe[256];
+    LPWSTR pszSid = GetUserSidString();
+    WCHAR szSddl[512];
+    const bool ok = (pszSid &&
+                     GetHostPipeName(szPipe, _countof(szPipe), s_dwSession, szCallerSid, nonce) &&
+                     SUCCEEDED(StringCchPrintfW(szSddl, _countof(szSddl), L"D:P(A;;GA;;;SY)(A;;GA;;;%s)(A;;0x0012019b;;;%s)",
+                                                pszSid, szCallerSid)));
+    LocalFree(pszSid);
+    if (!ok)
+        return 1;
+
+    const PipeServerOps ops = { HostServeClient, IsHostIdle, nullptr };
+    return ServePipe(szPipe, szSddl, ops) ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// The logon agent keeps -u logons for a while (see logoncache.h), so that
+// running as the same account again skips the password and the profile
+// load.  It is an opt-in helper process that runs as the invoking user, one
+// per user and console session, and serves later sudo invocations over a
+// named pipe, like the broker does.
+//
+// For each cached logon the agent keeps a logon host:  a sudo process that
+// runs as the account, started with its profile loaded.  The host starts
+// each command's sudo as itself, so nothing needs the password again until
+// the agent logs the host off.  Only the agent may send requests to a host.
+
+enum { LOGON_MAX_STRING = 32768, LOGON_MAX_PASSWORD = 1024 };
+
+enum : DWORD
+{
+    LOGON_FLAG_BACKGROUND       = 0x0001,
+};
+
+struct LogonAgentRequest
+{
+    DWORD       dwPID;          // Client process.
+    DWORD       dwFlags;        // LOGON_FLAG_* values.
+    LPCWSTR     pszAccount;     // As typed for -u.
+    LPCWSTR     pszPassword;    // nullptr to only use a cached logon.
+    LPCWSTR     pszDir;         // Absolute directory for the command.
+    LPCWSTR     pszParameters;  // Arguments for the sudo that runs as the account.
+};
+
+enum class LogonAgentResult
+{
+    Unavailable,                // No agent; log on the normal way.
+    Launched,                   // The agent ran the command.
+    NeedsPassword,              // Nothing cached; send the password.
+    Failed,                     // The agent failed; see GetLastError().
+};
+
+// Client side:  sends the request to a running agent and waits for the exit
+// code (unless LOGON_FLAG_BACKGROUND is set).
+LogonAgentResult LogonAgentSendRequest(const LogonAgentRequest& req, DWORD& dwExit);
+
+// Client side:  starts a detached agent, unless one is already running for
+// this user and session, and waits until it accepts requests.
+bool LogonAgentSpawn(LPCWSTR pszModule, DWORD dwTimeoutSeconds);
+
+// Client side:  forgets the logons cached for this user and session (-k),
+// and with fStop also stops the agent (--remove-timestamp).  Succeeds if
+// there is no agent.
+bool LogonAgentInvalidate(bool fStop);
+
+// Agent process:  serves requests while anything is cached, keeping each
+// logon until it has been unused for dwTimeoutSeconds.
+int LogonAgentServe(DWORD dwTimeoutSeconds);
+
+// Logon host process:  runs commands for the agent until logged off.
+int LogonHostServe(LPCWSTR pszSpec);
@@ -0,0 +1,173 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "logoncache.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Account names and SID strings don't depend on case.
+static bool
+SameName(const wchar_t* a, const wchar_t* b)
+{
+    for (; *a && towlower(*a) == towlower(*b); ++a, ++b)
+    {
+    }
+    return towlower(*a) == towlower(*b);
+}
+
+static wchar_t*
+CopyName(const wchar_t* s)
+{
+    const size_t len = wcslen(s);
+    wchar_t* copy = static_cast<wchar_t*>(malloc((len + 1) * sizeof(*copy)));
+    if (copy)
+        memcpy(copy, s, (len + 1) * sizeof(*copy));
+    return copy;
+}
+
+LogonCache::LogonCache(const LogonCacheOps& ops, unsigned timeout_ms, unsigned max_entries)
+: m_ops(ops)
+, m_timeout_ms(timeout_ms)
+, m_max_entries((max_entries < c_logon_cache_max_entries) ? max_entries : c_logon_cache_max_entries)
+{
+}
+
+LogonCache::~LogonCache()
+{
+    while (m_count)
+        Remove(m_count - 1);
+}
+
+bool
+LogonCache::IsExpired(const Entry& entry, unsigned long long now) const
+{
+    return (!entry.in_use && (entry.stale || now - entry.last_used >= m_timeout_ms));
+}
+
+// Logs off the entry's logon and forgets it.
+void
+LogonCache::Remove(unsigned index)
+{
+    Entry& entry = m_entries[index];
+    m_ops.logoff(entry.logon, m_ops.context);
+    free(entry.caller);
+    free(entry.account);
+    entry = m_entries[--m_count];
+}
+
+LogonLookup
+LogonCache::Acquire(const LogonKey& key, const wchar_t* password, void*& logon)
+{
+    logon = nullptr;
+    const unsigned long long now = m_ops.now(m_ops.context);
+    Expire();
+
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        Entry& entry = m_entries[i];
+        if (!entry.stale && entry.session == key.session &&
+            SameName(entry.caller, key.caller) && SameName(entry.account, key.account))
+        {
+            ++entry.in_use;
+            entry.last_used = now;
+            logon = entry.logon;
+            return LogonLookup::Cached;
+        }
+    }
+
+    if (!password)
+        return LogonLookup::NeedsPassword;
+
+    logon = m_ops.logon(key, password, m_ops.context);
+    if (!logon)
+        return LogonLookup::Failed;
+    if (!m_timeout_ms)
+        return LogonLookup::LoggedOn;
+
+    // Make room by evicting the least recently used logon that isn't in
+    // use.  If every logon is in use, this one isn't kept.
+    if (m_count >= m_max_entries)
+    {
+        unsigned oldest = m_count;
+        for (unsigned i = 0; i < m_count; ++i)
+        {
+            if (!m_entries[i].in_use && (oldest == m_count || m_entries[i].last_used < m_entries[oldest].last_used))
+                oldest = i;
+        }
+        if (oldest == m_count)
+            return LogonLookup::LoggedOn;
+        Remove(oldest);
+    }
+
+    Entry& entry = m_entries[m_count];
+    entry.caller = CopyName(key.caller);
+    entry.account = CopyName(key.account);
+    if (!entry.caller || !entry.account)
+    {
+        free(entry.caller);
+        free(entry.account);
+        return LogonLookup::LoggedOn;
+    }
+    entry.session = key.session;
+    entry.in_use = 1;
+    entry.stale = false;
+    entry.logon = logon;
+    entry.last_used = now;
+    ++m_count;
+    return LogonLookup::LoggedOn;
+}
+
+void
+LogonCache::Release(void* logon, bool discard)
+{
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        Entry& entry = m_entries[i];
+        if (entry.logon == logon && entry.in_use)
+        {
+            --entry.in_use;
+            entry.last_used = m_ops.now(m_ops.context);
+            entry.stale |= discard;
+            if (!entry.in_use && entry.stale)
+                Remove(i);
+            return;
+        }
+    }
+
+    // A logon that wasn't kept only lasts for its one use.
+    m_ops.logoff(logon, m_ops.context);
+}
+
+unsigned
+LogonCache::Invalidate(const wchar_t* caller, unsigned session)
+{
+    unsigned count = 0;
+    for (unsigned i = m_count; i--;)
+    {
+        Entry& entry = m_entries[i];
+        if (entry.stale || entry.session != session || !SameName(entry.caller, caller))
+            continue;
+        ++count;
+        entry.stale = true;
+        if (!entry.in_use)
+            Remove(i);
+    }
+    return count;
+}
+
+unsigned
+LogonCache::Expire()
+{
+    const unsigned long long now = m_ops.now(m_ops.context);
+    for (unsigned i = m_count; i--;)
+    {
+        if (IsExpired(m_entries[i], now))
+            Remove(i);
+    }
+    return m_count;
+}
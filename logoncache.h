@@ -0,0 +1,100 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// The -u logon cache, like sudo's timestamp_timeout.  After a user has
+// given the password for an account, the logon is kept for a while, so
+// later commands run as that account without asking for the password again
+// or loading the account's profile again.  A logon is only reused for the
+// same invoking user, console session, and account, and each use restarts
+// its timeout.  When the cache is full, the least recently used logon that
+// isn't running a command is logged off.
+//
+// The cache only decides which logon to reuse, when one expires, and which
+// one to evict.  Logging on and off go through LogonCacheOps, so the same
+// policy runs against real logons in the logon agent, or against a fake
+// authenticator and clock.  The cache isn't thread safe; the agent
+// serializes calls to it.
+
+enum : unsigned { c_logon_cache_max_entries = 8 };
+
+struct LogonKey
+{
+    const wchar_t*      caller;         // The invoking user (a SID string on Windows).
+    unsigned            session;        // The invoking user's console session.
+    const wchar_t*      account;        // The account to run as, as typed for -u.
+};
+
+struct LogonCacheOps
+{
+    // Logs on to the account.  Returns the logon, or nullptr (with the
+    // platform's last error set) if the password is wrong or logging on
+    // failed.
+    void*               (*logon)(const LogonKey& key, const wchar_t* password, void* context);
+
+    // Ends a logon returned by logon().
+    void                (*logoff)(void* logon, void* context);
+
+    // A monotonic clock, in milliseconds.
+    unsigned long long  (*now)(void* context);
+
+    void*               context;
+};
+
+enum class LogonLookup : unsigned char
+{
+    Cached,                     // Reused a logon.
+    LoggedOn,                   // Logged on with the password.
+    NeedsPassword,              // Nothing cached, and no password was given.
+    Failed,                     // Logging on failed.
+};
+
+class LogonCache
+{
+public:
+                    LogonCache(const LogonCacheOps& ops, unsigned timeout_ms,
+                               unsigned max_entries=c_logon_cache_max_entries);
+                    ~LogonCache();
+
+    // Finds a logon for the key that hasn't expired, or logs on with the
+    // password (which may be nullptr to only look).  The logon stays in use,
+    // so it can't expire or be evicted, until it is released.  With a 0
+    // timeout nothing is kept, and a logon lasts only until it is released.
+    LogonLookup     Acquire(const LogonKey& key, const wchar_t* password, void*& logon);
+
+    // Ends a use of a logon, which restarts its timeout.  With discard (for
+    // a logon that stopped working), it is logged off once no longer in use.
+    void            Release(void* logon, bool discard=false);
+
+    // Forgets every logon for the caller in the session (sudo -k); those in
+    // use are logged off when released.  Returns how many were forgotten.
+    unsigned        Invalidate(const wchar_t* caller, unsigned session);
+
+    // Logs off logons that have expired.  Returns how many logons remain.
+    unsigned        Expire();
+
+private:
+    struct Entry
+    {
+        wchar_t*            caller;
+        wchar_t*            account;
+        unsigned            session;
+        unsigned            in_use;
+        bool                stale;      // Invalidated while in use.
+        void*               logon;
+        unsigned long long  last_used;
+    };
+
+    bool            IsExpired(const Entry& entry, unsigned long long now) const;
+    void            Remove(unsigned index);
+
+    const LogonCacheOps m_ops;
+    const unsigned  m_timeout_ms;
+    const unsigned  m_max_entries;
+    unsigned        m_count = 0;
+    Entry           m_entries[c_logon_cache_max_entries];
+
+                    LogonCache(const LogonCache&) = delete;
+    LogonCache&     operator=(const LogonCache&) = delete;
+};
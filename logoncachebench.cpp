@@ -0,0 +1,431 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark and checker for the -u logon cache, with a fake authenticator
+// and a fake clock.
+//
+// The checker runs random sequences of lookups, logons (with right and
+// wrong passwords), releases, sudo -k, and the passing of time, and checks
+// each result against what the policy promises:  a logon is only reused for
+// the same caller, session, and account, never after it expired or was
+// invalidated, never after it was logged off, and nothing is left logged on
+// at the end.  The benchmark replays a pipeline of sudo -u commands where
+// each logon (with its profile load) costs seconds, and reports how much
+// of that time the cache saves.
+//
+//      g++ -std=c++17 -O2 logoncachebench.cpp logoncache.cpp -o logoncachebench
+//      ./logoncachebench [-n commands] [-t timeout secs] [-z iterations] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "logoncache.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//------------------------------------------------------------------------------
+// Fake authenticator.  The password for an account is the account name
+// reversed, and each logon records who it was for.
+
+struct FakeLogon
+{
+    wchar_t             caller[16];
+    wchar_t             account[16];
+    unsigned            session;
+    bool                live;
+    FakeLogon*          next;
+};
+
+// Logged off logons are kept until the end, so a later use is caught.
+struct FakeAuth
+{
+                        ~FakeAuth();
+    unsigned long long  now_ms = 0;
+    unsigned            logon_ms = 0;       // What each logon costs.
+    unsigned            logons = 0;
+    unsigned            logoffs = 0;
+    unsigned            live = 0;
+    bool                failed = false;
+    FakeLogon*          all = nullptr;
+};
+
+FakeAuth::~FakeAuth()
+{
+    while (all)
+    {
+        FakeLogon* const next = all->next;
+        free(all);
+        all = next;
+    }
+}
+
+static void
+ReverseName(const wchar_t* s, wchar_t* out)
+{
+    const size_t len = wcslen(s);
+    for (size_t i = 0; i < len; ++i)
+        out[i] = s[len - 1 - i];
+    out[len] = '\0';
+}
+
+static void*
+FakeLogonProc(const LogonKey& key, const wchar_t* password, void* context)
+{
+    FakeAuth* const auth = static_cast<FakeAuth*>(context);
+    wchar_t expected[16];
+    ReverseName(key.account, expected);
+    auth->now_ms += auth->logon_ms;
+    if (wcscmp(password, expected))
+        return nullptr;
+
+    FakeLogon* const logon = static_cast<FakeLogon*>(calloc(1, sizeof(FakeLogon)));
+    wcscpy(logon->caller, key.caller);
+    wcscpy(logon->account, key.account);
+    logon->session = key.session;
+    logon->live = true;
+    logon->next = auth->all;
+    auth->all = logon;
+    ++auth->logons;
+    ++auth->live;
+    return logon;
+}
+
+static void
+FakeLogoffProc(void* p, void* context)
+{
+    FakeAuth* const auth = static_cast<FakeAuth*>(context);
+    FakeLogon* const logon = static_cast<FakeLogon*>(p);
+    if (!logon->live)
+    {
+        fprintf(stderr, "logon logged off twice.\n");
+        auth->failed = true;
+        return;
+    }
+    logon->live = false;
+    --auth->live;
+    ++auth->logoffs;
+}
+
+static unsigned long long
+FakeNowProc(void* context)
+{
+    return static_cast<FakeAuth*>(context)->now_ms;
+}
+
+//------------------------------------------------------------------------------
+// Checker.
+
+static const wchar_t* const c_callers[] = { L"S-1-5-21-1", L"S-1-5-21-2" };
+static const wchar_t* const c_accounts[] = { L"svc_deploy", L"SVC_DEPLOY", L"svc_build", L"alice", L"bob", L"carol" };
+
+enum { c_key_count = 2 * 2 * 5 };   // Callers, sessions, accounts (ignoring case).
+
+static unsigned
+KeyIndex(unsigned caller, unsigned session, unsigned account)
+{
+    return (caller * 2 + session) * 5 + (account ? account - 1 : 0);
+}
+
+// What the checker knows about each key.
+struct ModelKey
+{
+    unsigned long long  last_used;
+    unsigned            in_use;
+    unsigned            kept_in_use;        // Uses of a logon that stays cached while in use.
+    bool                cached;             // Could be cached (might be evicted).
+};
+
+struct Held
+{
+    void*               logon;
+    unsigned            key;
+    bool                kept;
+};
+
+// Forgets that held logons are cached, for sudo -k and for a discarded logon.
+static void
+ForgetKept(Held* held, unsigned count, ModelKey* model, unsigned key, const void* logon)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (held[i].kept && held[i].key == key && (!logon || held[i].logon == logon))
+        {
+            held[i].kept = false;
+            --model[key].kept_in_use;
+        }
+    }
+}
+
+static bool
+CheckPolicy(unsigned iterations)
+{
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        FakeAuth auth;
+        const LogonCacheOps ops = { FakeLogonProc, FakeLogoffProc, FakeNowProc, &auth };
+        const unsigned timeout_ms = Random(4) ? 1000 * (1 + Random(300)) : 0;
+        const unsigned max_entries = 1 + Random(c_logon_cache_max_entries);
+        ModelKey model[c_key_count] = {};
+        Held held[16];
+        unsigned held_count = 0;
+
+        {
+            LogonCache cache(ops, timeout_ms, max_entries);
+            for (unsigned step = 0; step < 200 && !auth.failed; ++step)
+            {
+                const unsigned caller = Random(2);
+                const unsigned session = Random(2);
+                const unsigned account = Random(6);
+                const unsigned k = KeyIndex(caller, session, account);
+                const LogonKey key = { c_callers[caller], session, c_accounts[account] };
+
+                switch (Random(6))
+                {
+                case 0:
+                case 1:
+                    {
+                        if (held_count >= sizeof(held) / sizeof(*held))
+                            break;
+                        wchar_t password[16];
+                        ReverseName(key.account, password);
+                        const unsigned which = Random(3);
+                        if (which == 2)
+                            password[0] = '!';
+                        void* logon;
+                        const unsigned before = cache.Expire();
+                        const unsigned logoffs = auth.logoffs;
+                        const LogonLookup result = cache.Acquire(key, which ? password : nullptr, logon);
+
+                        // Whether a cached logon may (or must) exist.
+                        ModelKey& m = model[k];
+                        const bool fresh = m.cached && (m.in_use || auth.now_ms - m.last_used < timeout_ms);
+                        if (result == LogonLookup::Cached)
+                        {
+                            const FakeLogon* const fake = static_cast<const FakeLogon*>(logon);
+                            if (!fresh || !fake->live || fake->session != session ||
+                                wcscmp(fake->caller, key.caller) || wcscasecmp(fake->account, key.account))
+                            {
+                                fprintf(stderr, "iteration %u step %u:  reused a logon that isn't valid.\n", n, step);
+                                return false;
+                            }
+                        }
+                        else if (m.kept_in_use)
+                        {
+                            // A logon in use can't be evicted or expire.
+                            fprintf(stderr, "iteration %u step %u:  a logon in use was not reused.\n", n, step);
+                            return false;
+                        }
+                        if ((result == LogonLookup::NeedsPassword) != (!which && result != LogonLookup::Cached) ||
+                            (result == LogonLookup::Failed) != (which == 2 && result != LogonLookup::Cached))
+                        {
+                            fprintf(stderr, "iteration %u step %u:  wrong result %u.\n", n, step, unsigned(result));
+                            return false;
+                        }
+                        if (result == LogonLookup::Cached || result == LogonLookup::LoggedOn)
+                        {
+                            // When full, a new logon is only kept if another
+                            // was evicted.
+                            bool kept = true;
+                            if (result == LogonLookup::LoggedOn)
+                            {
+                                kept = (timeout_ms && (before < max_entries || auth.logoffs != logoffs));
+                                m.cached |= kept;
+                            }
+                            ++m.in_use;
+                            m.kept_in_use += kept;
+                            m.last_used = auth.now_ms;
+                            held[held_count++] = { logon, k, kept };
+                        }
+                    }
+                    break;
+                case 2:
+                    if (held_count)
+                    {
+                        const unsigned i = Random(held_count);
+                        const bool discard = !Random(8);
+                        ModelKey& m = model[held[i].key];
+                        if (!static_cast<const FakeLogon*>(held[i].logon)->live)
+                        {
+                            fprintf(stderr, "iteration %u step %u:  logon in use was logged off.\n", n, step);
+                            return false;
+                        }
+                        const Held released = held[i];
+                        cache.Release(released.logon, discard);
+                        --m.in_use;
+                        m.kept_in_use -= released.kept;
+                        m.last_used = auth.now_ms;
+                        held[i] = held[--held_count];
+                        if (discard && released.kept)
+                        {
+                            m.cached = false;
+                            ForgetKept(held, held_count, model, released.key, released.logon);
+                        }
+                    }
+                    break;
+                case 3:
+                    if (!Random(4))
+                    {
+                        cache.Invalidate(key.caller, session);
+                        for (unsigned a = 1; a < 6; ++a)
+                        {
+                            model[KeyIndex(caller, session, a)].cached = false;
+                            ForgetKept(held, held_count, model, KeyIndex(caller, session, a), nullptr);
+                        }
+                        void* logon;
+                        for (unsigned a = 0; a < 6; ++a)
+                        {
+                            const LogonKey other = { key.caller, session, c_accounts[a] };
+                            if (cache.Acquire(other, nullptr, logon) != LogonLookup::NeedsPassword)
+                            {
+                                fprintf(stderr, "iteration %u step %u:  reused a logon after sudo -k.\n", n, step);
+                                return false;
+                            }
+                        }
+                    }
+                    break;
+                default:
+                    auth.now_ms += Random(2) ? Random(1000) : Random(timeout_ms + 1000);
+                    cache.Expire();
+                    break;
+                }
+            }
+
+            // Once everything is released and the timeout has passed,
+            // nothing is logged on.
+            while (held_count)
+            {
+                --held_count;
+                cache.Release(held[held_count].logon);
+            }
+            auth.now_ms += timeout_ms;
+            if (cache.Expire() || auth.live)
+            {
+                fprintf(stderr, "iteration %u:  %u logons outlived the timeout.\n", n, auth.live);
+                return false;
+            }
+        }
+        if (auth.failed || auth.live)
+            return false;
+    }
+
+    printf("check            %8u sequences passed\n", iterations);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+// Replays a pipeline of sudo -u commands that each take command_ms, with a
+// random pause before each one.  Returns the simulated time.
+static unsigned long long
+RunPipeline(unsigned commands, unsigned timeout_ms, unsigned& logons)
+{
+    FakeAuth auth;
+    auth.logon_ms = 3000;
+    const LogonCacheOps ops = { FakeLogonProc, FakeLogoffProc, FakeNowProc, &auth };
+    LogonCache cache(ops, timeout_ms);
+    const LogonKey key = { c_callers[0], 1, L"svc_deploy" };
+    wchar_t password[16];
+    ReverseName(key.account, password);
+
+    for (unsigned i = 0; i < commands; ++i)
+    {
+        auth.now_ms += Random(20000);
+        void* logon;
+        if (cache.Acquire(key, nullptr, logon) == LogonLookup::NeedsPassword)
+            cache.Acquire(key, password, logon);
+        auth.now_ms += 500 + Random(5000);
+        cache.Release(logon);
+    }
+    logons = auth.logons;
+    return auth.now_ms;
+}
+
+static void
+RunBench(unsigned commands, unsigned timeout_secs)
+{
+    const unsigned seed = s_seed;
+    unsigned uncached_logons;
+    const unsigned long long uncached = RunPipeline(commands, 0, uncached_logons);
+    s_seed = seed;
+    unsigned cached_logons;
+    const unsigned long long cached = RunPipeline(commands, timeout_secs * 1000, cached_logons);
+
+    printf("no cache         %8u commands %8u logons  %10.1f s simulated\n", commands, uncached_logons, uncached / 1000.0);
+    printf("cache %4us      %8u commands %8u logons  %10.1f s simulated\n", timeout_secs, commands, cached_logons, cached / 1000.0);
+
+    // The cost of a lookup that hits, for the agent's critical section.
+    FakeAuth auth;
+    const LogonCacheOps ops = { FakeLogonProc, FakeLogoffProc, FakeNowProc, &auth };
+    LogonCache cache(ops, 300000);
+    void* logon;
+    wchar_t password[16];
+    for (unsigned a = 1; a < 6; ++a)
+    {
+        const LogonKey key = { c_callers[0], 1, c_accounts[a] };
+        ReverseName(key.account, password);
+        cache.Acquire(key, password, logon);
+        cache.Release(logon);
+    }
+    const LogonKey key = { c_callers[0], 1, L"CAROL" };
+    const unsigned iterations = 1000000;
+    const unsigned long long start = NowMicroseconds();
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        cache.Acquire(key, nullptr, logon);
+        cache.Release(logon);
+    }
+    const unsigned long long elapsed = NowMicroseconds() - start;
+    printf("lookup           %8u lookups  %8.1f ms  %10.3f us/lookup\n",
+           iterations, elapsed / 1000.0, double(elapsed) / iterations);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned commands = 48;
+    unsigned timeout_secs = 300;
+    unsigned checks = 2000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            commands = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            timeout_secs = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+            checks = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: logoncachebench [-n commands] [-t timeout secs] [-z iterations] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!CheckPolicy(checks))
+        return 1;
+    RunBench(commands, timeout_secs);
+    return 0;
+}
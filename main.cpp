@@ -1,9 +1,6 @@
 // sudo - "Super User Do" - Launches the command line as admin (elevated).
 
 #include <windows.h>
-#include <objbase.h>
-#include <shellapi.h>
-#include <shlwapi.h>
 
 #include <tchar.h>
 #include <strsafe.h>
@@ -11,36 +8,49 @@
 
 #include "commit_file.h"
 #include "version.h"
+#include "arena.h"
+#include "broker.h"
+#include "cmdline.h"
+#include "coalesce.h"
+#include "controls.h"
+#include "handoff.h"
+#include "job.h"
+#include "jobrecord.h"
+#include "launch.h"
+#include "logonagent.h"
+#include "audit.h"
+#include "batch.h"
+#include "options.h"
+#include "password.h"
+#include "platform.h"
+#include "policy.h"
+#include "prompt.h"
+#include "resolve.h"
+#include "session.h"
+#include "stats.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "writer.h"
 
 // vim: set et ts=4 sw=4 cino={0s:
 
-static const char* const usage =
+// The list of options between the header and footer is generated from the
+// option table in options.cpp.
+static const char* const usage_header =
 "Runs the specified command line with elevation (as super user).\r\n"
 "\r\n"
 "SUDO [options] {command line}\r\n"
 "\r\n"
-"  -?, -h, --help            Display a short help message and exit.\r\n"
-"  -b, --background          Run the command in the background.  Interactive\r\n"
-"                            commands will likely fail to work properly when\r\n"
-"                            run in the background.\r\n"
-"  -D dir, --chdir=dir       Run the command in the specified directory.\r\n"
-"  -n, --non-interactive     Avoid showing any UI.\r\n"
-"  -p text, --prompt=text    Use a custom password prompt.\r\n"
-"  -S, --stdin               Write the prompt to stderr and read the password\r\n"
-"                            from stdin instead of using the console.\r\n"
-"  -u user, --user=user      Run the command as the specified user.\r\n"
-"  -V, --version             Print the sudo version string.\r\n"
-#ifdef INCLUDE_NET_ONLY
-"  --net-only                Use the credentials only on the network.\r\n"
-#endif
-#ifdef DEBUG // Only advertised in debug builds, but always present.
-"  --debug                   Display debugging info.\r\n"
-#endif
-"  --                        Stop processing options in the command line.\r\n"
+;
+
+static const char* const usage_footer =
 "\r\n"
 "Redirection and pipes work if the symbols are used inside quotes; otherwise\r\n"
 "the symbols are interpreted by CMD before they reach sudo.\r\n"
 "\r\n"
+"Commands run directly, without CMD, unless they use redirection, pipes,\r\n"
+"variables, or other CMD syntax, or a CMD built-in command, or a script.\r\n"
+"\r\n"
 "If you get into an endless loop of spawning sudo.exe, you can hold\r\n"
 "Alt+Ctrl+Shift at the same time to cancel.\r\n"
 "\r\n"
@@ -56,87 +66,106 @@ static const char* const usage =
 "The password prompt uses the custom prompt string, if provided.  Otherwise it\r\n"
 "uses the %SUDO_PROMPT% or a default prompt string.\r\n"
 "\r\n"
+"The broker idle timeout uses --broker, if provided.  Otherwise it uses the\r\n"
+"%SUDO_BROKER_TIMEOUT% or 0 (no broker).\r\n"
+"\r\n"
+"The -u logon cache timeout uses --logon-cache, if provided.  Otherwise it\r\n"
+"uses the %SUDO_LOGON_CACHE% or 0 (no logon cache).\r\n"
+"\r\n"
+"If %SUDO_AUDIT_LOG% names a file, each sudo process appends a JSON line to\r\n"
+"it saying who ran what command, as whom, where, and how it ended.\r\n"
+"\r\n"
+"If there is a sudoers file next to sudo.exe, only the commands its rules\r\n"
+"allow can run.  See the README for the rule syntax.\r\n"
+"\r\n"
 "Options that specify a value only take effect the first time they are\r\n"
 "specified, to help guard against problems if a poorly written script or\r\n"
 "program invokes sudo with user-controlled input."
 ;
 
-inline BYTE ForceUnsigned(char ch) { return BYTE(ch); }
-inline WORD ForceUnsigned(WCHAR ch) { return ch; }
+// The strings and buffers for this invocation all come from one arena,
+// which is released when the process exits.
+static Arena s_arena;
+
+// Output goes through one buffered writer per stream, so a line built from
+// several pieces is one write.  Whether a stream is a console is detected
+// the first time it is written to, and again after ResetOutput().
+struct OutputStream
+{
+    HANDLE h;
+    UINT cp;
+    TextWriter writer;
+};
 
-#define PACKVERSION(major,minor)    MAKELONG(minor,major)
+static OutputStream s_streams[2];
 
-static WCHAR*
-CopyString(const WCHAR* in)
+static bool
+WriteFileBytes(const char* bytes, size_t len, void* context)
 {
-    unsigned int len = (unsigned int)wcslen(in);
-    const size_t bytes = (len + 1) * sizeof(*in);
-    WCHAR* out = (WCHAR*)malloc(bytes);
-    if (out)
-        memcpy(out, in, bytes);
-    return out;
+    return PlatformWrite(static_cast<OutputStream*>(context)->h, bytes, len);
 }
 
-static HANDLE
-__GetStdHandle(int std_handle, bool fStd=true)
+static bool
+WriteConsoleText(const WCHAR* text, size_t len, void* context)
+{
+    return PlatformWriteConsole(static_cast<OutputStream*>(context)->h, text, len);
+}
+
+static size_t
+EncodeCodePage(const WCHAR* text, size_t len, char* out, size_t max, void* context)
+{
+    const UINT cp = static_cast<OutputStream*>(context)->cp;
+    const int cb = WideCharToMultiByte(cp, 0, text, int(len), out, int(max), 0, 0);
+    return (cb > 0) ? size_t(cb) : size_t(-1);
+}
+
+static TextWriter&
+GetWriter(int std_handle)
 {
-    if (!fStd)
+    OutputStream& stream = s_streams[std_handle == STD_ERROR_HANDLE];
+    if (!stream.writer.IsAttached())
     {
-        static HANDLE s_hcon[2] = {};
-        const bool fIn = (std_handle == STD_INPUT_HANDLE);
-        if (!s_hcon[fIn])
+        stream.h = PlatformGetStdHandle((std_handle == STD_ERROR_HANDLE) ? StdStream::Err : StdStream::Out);
+        if (PlatformIsConsole(stream.h))
+        {
+            stream.writer.AttachWide(WriteConsoleText, &stream);
+        }
+        else
         {
-            // IMPORTANT: CONIN$ requires both read and write access so that
-            // SetConsoleMode() can change the mode, e.g. to disable echo to
-            // hide password input.
-            const DWORD dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE;
-            s_hcon[fIn] = (fIn ?
-                CreateFileW(L"CONIN$", GENERIC_READ|GENERIC_WRITE, dwShare, 0, OPEN_EXISTING, 0, 0) :
-                CreateFileW(L"CONOUT$", GENERIC_WRITE, dwShare, 0, OPEN_EXISTING, 0, 0));
+            // Redirected output uses the console's code page, like CMD.
+            stream.cp = GetConsoleOutputCP();
+            if (!stream.cp)
+                stream.cp = GetACP();
+            stream.writer.AttachBytes(WriteFileBytes, (stream.cp == CP_UTF8) ? nullptr : EncodeCodePage, &stream);
         }
-        if (s_hcon[fIn])
-            return s_hcon[fIn];
     }
+    return stream.writer;
+}
 
-    return GetStdHandle(std_handle);
+// Writes anything buffered, e.g. before waiting for input or exiting.
+static void
+FlushOutput()
+{
+    for (OutputStream& stream : s_streams)
+        stream.writer.Flush();
 }
 
+// Flushes and then detects the streams again, e.g. after attaching to a
+// different console.
 static void
-__OutText(const char* text, int std_handle, bool fStd=true)
+ResetOutput()
 {
-    DWORD dummy;
-    HANDLE hout = GetStdHandle(std_handle);
-    const bool is_redir = !GetConsoleMode(hout, &dummy);
-    const DWORD len = DWORD(strlen(text));
-    if (is_redir)
-        WriteFile(hout, text, len, &dummy, nullptr);
-    else
-        WriteConsoleA(hout, text, len, &dummy, 0);
+    for (OutputStream& stream : s_streams)
+        stream.writer.Detach();
 }
 
+template <class T>
 static void
-__OutText(const WCHAR* text, int std_handle, bool fStd=true)
+__OutText(const T* text, int std_handle, bool fStd=true)
 {
-    DWORD dummy;
-    HANDLE hout = GetStdHandle(std_handle);
-    const bool is_redir = !GetConsoleMode(hout, &dummy);
-    const DWORD len = DWORD(wcslen(text));
-    if (is_redir)
-    {
-        const ULONG need = WideCharToMultiByte(CP_ACP, 0, text, -1, 0, 0, 0, 0);
-	    if (!need)
-	        return;
-        char* tmp = static_cast<char*>(HeapAlloc(GetProcessHeap(), 0, need * sizeof(*tmp)));
-	    if (!tmp)
-		    return;
-	    const ULONG used = WideCharToMultiByte(CP_ACP, 0, text, -1, tmp, need, 0, 0);
-        WriteFile(hout, tmp, used - 1, &dummy, nullptr);
-        HeapFree(GetProcessHeap(), 0, tmp);
-    }
-    else
-    {
-        WriteConsoleW(hout, text, len, &dummy, 0);
-    }
+    // Keep stdout and stderr in order when both go to the same place.
+    s_streams[std_handle != STD_ERROR_HANDLE].writer.Flush();
+    GetWriter(std_handle).Write(text);
 }
 
 inline void OutText(const char* text, bool fStd=true) { __OutText(text, STD_OUTPUT_HANDLE, fStd); }
@@ -149,7 +178,7 @@ class NoEcho
 public:
     NoEcho(bool fStd)
         : m_std(fStd)
-        , m_h(__GetStdHandle(STD_INPUT_HANDLE, fStd))
+        , m_h(PlatformGetStdHandle(StdStream::In, !fStd))
     {
         s_this = this;
         GetConsoleMode(m_h, &m_mode);
@@ -193,133 +222,289 @@ private:
 
 NoEcho* NoEcho::s_this = nullptr;
 
-static void
-AppendTo(WCHAR*& out, unsigned int& max_len, const WCHAR* append)
+static LPWSTR
+AllocString(size_t cch)
+{
+    LPWSTR psz = LPWSTR(s_arena.Alloc(cch * sizeof(*psz)));
+    if (!psz)
+        SetLastError(ERROR_OUTOFMEMORY);
+    return psz;
+}
+
+// The value can change between asking its length and reading it, so this
+// retries with the new length.
+static LPWSTR
+GetEnvironmentString(LPCWSTR pszName)
 {
-    while (max_len && *append)
+    DWORD cch = GetEnvironmentVariableW(pszName, nullptr, 0);
+    while (cch)
     {
-        *(out++) = *(append++);
-        --max_len;
+        LPWSTR psz = AllocString(cch);
+        if (!psz)
+            return nullptr;
+        const DWORD len = GetEnvironmentVariableW(pszName, psz, cch);
+        if (len < cch)
+            return len ? psz : nullptr;
+        cch = len;
     }
+    return nullptr;
 }
 
-static void
-PrintPrompt(const WCHAR* prompt, const WCHAR* pszUser, bool fStd)
+// Returns the full path, or nullptr (and sets the last error).
+static LPWSTR
+GetFullPathString(LPCWSTR pszPath)
 {
-    WCHAR szTmp[1024];
-    WCHAR* out = szTmp;
-    unsigned int remaining = _countof(szTmp) - 1;
+    const DWORD cch = GetFullPathNameW(pszPath, 0, nullptr, nullptr);
+    if (!cch)
+        return nullptr;
 
-    for (const WCHAR* walk = prompt; *walk && remaining; ++walk)
+    LPWSTR psz = AllocString(cch);
+    if (!psz)
+        return nullptr;
+
+    const DWORD len = GetFullPathNameW(pszPath, cch, psz, nullptr);
+    if (!len || len >= cch)
     {
-        if (*walk == '%')
-        {
-            ++walk;
-            switch (*walk)
-            {
-            case '%':
-                *(out++) = *walk;
-                break;
-            case 'H':
-            case 'h':
-                {
-                    WCHAR szComp[1024];
-                    const COMPUTER_NAME_FORMAT format = ((*walk == 'H') ?
-                        ComputerNameDnsFullyQualified : ComputerNameDnsHostname);
+        const DWORD err = GetLastError();
+        SetLastError(err ? err : ERROR_BUFFER_OVERFLOW);
+        return nullptr;
+    }
+    return psz;
+}
 
-                    DWORD dwSize = _countof(szComp);
-                    if (GetComputerNameExW(format, szComp, &dwSize))
-                        AppendTo(out, remaining, szComp);
-                }
-                break;
-            case 'p':
-            case 'U':
-                {
-                    // TODO: How is "name of user whose password is requested"
-                    // meant to differ from "user the command will be run as"?
-                    if (pszUser)
-                        AppendTo(out, remaining, pszUser);
-                }
-                break;
-            case 'u':
-                {
-                    WCHAR szUser[1024];
-                    DWORD dwSize = _countof(szUser);
-                    if (GetUserNameW(szUser, &dwSize))
-                        AppendTo(out, remaining, szUser);
-                }
-                break;
-            default:
-                break;
-            }
-        }
-        else
+// GetModuleFileName doesn't report the length needed, so this grows the
+// buffer until the path fits (long paths can be up to 32767 characters).
+static LPWSTR
+GetModuleFileNameString()
+{
+    for (DWORD cch = MAX_PATH; cch <= 32768; cch *= 2)
+    {
+        LPWSTR psz = AllocString(cch);
+        if (!psz)
+            return nullptr;
+        const DWORD len = GetModuleFileNameW(0, psz, cch);
+        if (!len)
+            return nullptr;
+        if (len < cch)
+            return psz;
+    }
+    SetLastError(ERROR_BUFFER_OVERFLOW);
+    return nullptr;
+}
+
+// Resolves the identities used by the password prompt.  The host name lookup
+// can stall on domain-joined machines, so it runs on a background thread
+// while sudo finishes starting up, and each lookup happens only once.
+class PromptIdentities
+{
+public:
+    PromptIdentities(LPCWSTR pszTargetUser)
+        : m_pszTargetUser(pszTargetUser)
+    {
+    }
+
+    ~PromptIdentities()
+    {
+        Wait();
+    }
+
+    void Start(unsigned needs)
+    {
+        m_needs = needs;
+        m_hThread = CreateThread(nullptr, 0, Resolve, this, 0, nullptr);
+        if (!m_hThread)
+            Resolve(this);
+    }
+
+    static LPCWSTR Lookup(PromptField field, void* context)
+    {
+        PromptIdentities* const self = static_cast<PromptIdentities*>(context);
+        if (field == PromptField::TargetUser)
+            return self->m_pszTargetUser;
+        self->Wait();
+        return self->m_values[unsigned(field)];
+    }
+
+private:
+    void Wait()
+    {
+        if (m_hThread)
         {
-            *(out++) = *walk;
-            --remaining;
+            WaitForSingleObject(m_hThread, INFINITE);
+            CloseHandle(m_hThread);
+            m_hThread = nullptr;
         }
     }
 
-    *out = '\0';
+    static DWORD WINAPI Resolve(void* param)
+    {
+        PromptIdentities* const self = static_cast<PromptIdentities*>(param);
+        if (self->m_needs & (1 << unsigned(PromptField::FullHost)))
+            self->m_values[unsigned(PromptField::FullHost)] = PlatformGetHostName(s_arena, true/*fully_qualified*/);
+        if (self->m_needs & (1 << unsigned(PromptField::ShortHost)))
+            self->m_values[unsigned(PromptField::ShortHost)] = PlatformGetHostName(s_arena, false/*fully_qualified*/);
+        if (self->m_needs & (1 << unsigned(PromptField::InvokingUser)))
+            self->m_values[unsigned(PromptField::InvokingUser)] = PlatformGetUserName(s_arena);
+        return 0;
+    }
+
+    LPCWSTR m_pszTargetUser;
+    unsigned m_needs = 0;
+    HANDLE m_hThread = nullptr;
+    LPWSTR m_values[unsigned(PromptField::Count)] = {};
+};
+
+static void
+PrintPrompt(const CompiledPrompt& prompt, PromptIdentities& identities, bool fStd)
+{
+    LPWSTR pszPrompt = prompt.Expand(PromptIdentities::Lookup, &identities);
+    if (pszPrompt)
+    {
+        OutText(pszPrompt, fStd);
+        FlushOutput();
+        free(pszPrompt);
+    }
+}
+
+static size_t
+ReadPasswordInput(void* p, size_t cb, void* context)
+{
+    // A closed pipe is the end of input, the same as a zero byte read.
+    DWORD dw = 0;
+    if (!ReadFile(HANDLE(context), p, DWORD(cb), &dw, nullptr))
+    {
+        if (GetLastError() == ERROR_BROKEN_PIPE)
+            SetLastError(ERROR_HANDLE_EOF);
+        return 0;
+    }
+    if (!dw)
+        SetLastError(ERROR_HANDLE_EOF);
+    return dw;
+}
+
+static size_t
+PeekPasswordInput(void* p, size_t cb, void* context)
+{
+    DWORD dw = 0;
+    if (!PeekNamedPipe(HANDLE(context), p, DWORD(cb), &dw, nullptr, nullptr))
+        return 0;
+    return dw;
+}
+
+static bool
+UnreadPasswordInput(size_t cb, void* context)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = -LONGLONG(cb);
+    return !!SetFilePointerEx(HANDLE(context), li, nullptr, FILE_CURRENT);
+}
+
+static bool
+DecodePassword(const SecretBuffer& line, UINT cp, SecretBuffer& out)
+{
+    out.Clear();
+    if (!line.Size())
+        return out.Reserve(0);
+
+    DWORD dwFlags = (cp == CP_UTF8) ? MB_ERR_INVALID_CHARS : 0;
+    int cch = MultiByteToWideChar(cp, dwFlags, line.Bytes(), int(line.Size()), nullptr, 0);
+    if (!cch && cp == CP_UTF8)
+    {
+        // Not valid UTF-8, so it's presumably ANSI.
+        cp = CP_ACP;
+        dwFlags = 0;
+        cch = MultiByteToWideChar(cp, dwFlags, line.Bytes(), int(line.Size()), nullptr, 0);
+    }
+
+    if (!cch || !out.Resize(cch * sizeof(WCHAR)))
+        return false;
 
-    OutText(szTmp, fStd);
+    MultiByteToWideChar(cp, dwFlags, line.Bytes(), int(line.Size()), out.Wide(), cch);
+    return true;
 }
 
 static bool
-InputPassword(WCHAR* out, DWORD len, bool fStd)
+InputPassword(SecretBuffer& out, bool fStd)
 {
     bool ok;
     DWORD err;
 
-    assert(len > 0);
-
     {
-        DWORD dummy;
         NoEcho noecho(fStd);
+        HANDLE h = noecho.GetHandle();
 
         if (fStd)
         {
-            char buffer[1024];
-            char* p = buffer;
-            DWORD remaining = _countof(buffer) - 1;
+            // Read blocks without consuming any of stdin past the password
+            // line, since the rest is input for the command.  Pipes can be
+            // peeked, files can seek back, and the console returns a line
+            // per read.  Anything else is read a byte at a time.
+            LineSource source = { ReadPasswordInput, nullptr, nullptr, false, h };
+            UINT cp = CP_UTF8;
+            DWORD dummy;
+            switch (GetFileType(h))
+            {
+            case FILE_TYPE_PIPE:
+                source.peek = PeekPasswordInput;
+                break;
+            case FILE_TYPE_DISK:
+                source.unread = UnreadPasswordInput;
+                break;
+            case FILE_TYPE_CHAR:
+                if (GetConsoleMode(h, &dummy))
+                {
+                    source.line_oriented = true;
+                    cp = GetConsoleCP();
+                }
+                break;
+            }
 
-            do
+            // ReadSecretLine fails at end of input (or on a read error)
+            // with nothing read, which must not become an empty password.
+            // An empty line is still an empty password.
+            SecretBuffer line;
+            SetLastError(NOERROR);
+            if (!ReadSecretLine(source, line))
             {
-                char c;
-                ok = !!ReadFile(noecho.GetHandle(), &c, sizeof(c), &dummy, nullptr);
+                ok = false;
                 err = GetLastError();
-                if (!ok)
-                    break;
-                if (c == '\r')
-                    continue;
-                if (c == '\n')
-                    break;
-                *(p++) = c;
-                --remaining;
+                if (!err)
+                    err = ERROR_OUTOFMEMORY;
             }
-            while (remaining);
-
-            *p = '\0';
-
-            if (ok)
+            else
             {
-                if (buffer == p)
-                {
-                    ok = true;
-                    err = NOERROR;
-                    *out = '\0';
-                }
-                else
-                {
-                    ok = !!MultiByteToWideChar(CP_ACP, 0, buffer, -1, out, len);
-                    err = GetLastError();
-                }
+                ok = DecodePassword(line, cp, out);
+                err = ok ? NOERROR : ERROR_NO_UNICODE_TRANSLATION;
             }
         }
         else
         {
-            ok = !!ReadConsoleW(noecho.GetHandle(), out, len, &dummy, nullptr);
-            err = GetLastError();
+            // With line input, ReadConsoleW leaves the rest of a long line
+            // queued for the next read.
+            WCHAR buffer[256];
+            DWORD cch = 0;
+            out.Clear();
+            do
+            {
+                ok = !!ReadConsoleW(h, buffer, _countof(buffer), &cch, nullptr);
+                err = GetLastError();
+                if (ok && !out.Append(buffer, cch * sizeof(*buffer)))
+                {
+                    ok = false;
+                    err = ERROR_OUTOFMEMORY;
+                }
+            }
+            while (ok && cch && buffer[cch - 1] != '\n');
+            SecretBuffer::Wipe(buffer, sizeof(buffer));
+
+            size_t len = out.WideLength();
+            while (len && (out.Wide()[len - 1] == '\r' || out.Wide()[len - 1] == '\n'))
+                --len;
+            if (!out.Resize(len * sizeof(WCHAR)))
+            {
+                ok = false;
+                err = ERROR_OUTOFMEMORY;
+            }
         }
     }
 
@@ -341,226 +526,1411 @@ TrimString(wchar_t* psz, bool spaces)
         psz[len] = '\0';
 }
 
-static void
-ExitFailure(DWORD err)
-{
-    WCHAR sz[1024];
-    const DWORD dwFlags = FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS;
-    const DWORD cch = FormatMessageW(dwFlags, 0, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), sz, _countof(sz), 0);
-
-    if (cch)
-    {
-        TrimString(sz, true/*spaces*/);
-    }
-    else
-    {
-        if (err < 65536)
-            swprintf_s(sz, _countof(sz), L"Error %u.", err);
-        else
-            swprintf_s(sz, _countof(sz), L"Error 0x%08X.", err);
-    }
-
-    ErrText(sz);
-    ErrText("\r\nsudo failed.\r\n");
+// The unelevated sudo creates the trace file, and the elevated sudo appends
+// to it through a duplicate of the unelevated sudo's handle (see
+// ReceiveRequest).  The path is only kept for -u, whose sudo opens it.
+static LPWSTR s_pszTraceFile = nullptr;
+static HANDLE s_hTraceFile = nullptr;
 
-    ExitProcess(-1);
+static TraceTicks
+QueryTraceClock()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return TraceTicks(li.QuadPart);
 }
 
-static bool s_more_flags = false;
+struct TraceText
+{
+    char*       p = nullptr;
+    size_t      len = 0;
+    size_t      capacity = 0;
+    bool        ok = true;
+};
 
-static bool
-TestFlag(LPCWSTR& pszLine, LPCWSTR pszFlag, bool fHasArg=false)
+static void
+AppendTraceText(const char* text, size_t len, void* context)
 {
-    size_t len = wcslen(pszFlag);
-    if (s_more_flags && len == 2 && pszFlag[0] == '-' && pszFlag[1] != '-')
+    TraceText* const buffer = static_cast<TraceText*>(context);
+    if (!buffer->ok)
+        return;
+    if (buffer->len + len > buffer->capacity)
     {
-        ++pszFlag;
-        --len;
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->len + len)
+            capacity *= 2;
+        char* p = static_cast<char*>(realloc(buffer->p, capacity));
+        if (!p)
+        {
+            buffer->ok = false;
+            return;
+        }
+        buffer->p = p;
+        buffer->capacity = capacity;
     }
+    memcpy(buffer->p + buffer->len, text, len);
+    buffer->len += len;
+}
 
-    if (_wcsnicmp(pszLine, pszFlag, len))
-        return false;
+// Starts a new trace file, and returns a handle that can only append to it,
+// which is what the elevated sudo gets a copy of.
+static HANDLE
+CreateTraceFile(LPCWSTR pszFile)
+{
+    HANDLE h = CreateFileW(pszFile, GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        return nullptr;
 
-    if (!pszLine[len] ||
-        pszLine[len] == ' ' ||
-        pszLine[len] == '\t' ||
-        (fHasArg && pszLine[len] == '='))
-    {
-        s_more_flags = false;
-        pszLine += len;
-        if (fHasArg && *pszLine == '=')
-            ++pszLine;
-        while (*pszLine == ' ' || *pszLine == '\t')
-            ++pszLine;
-        return true;
-    }
+    TraceText text;
+    TraceWriteHeader(AppendTraceText, &text);
+    DWORD dummy;
+    HANDLE hAppend = nullptr;
+    const bool ok = (text.ok && WriteFile(h, text.p, DWORD(text.len), &dummy, nullptr) &&
+                     DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &hAppend,
+                                     FILE_APPEND_DATA|SYNCHRONIZE, false, 0));
+    const DWORD err = GetLastError();
+    CloseHandle(h);
+    free(text.p);
+    SetLastError(err);
+    return ok ? hAppend : nullptr;
+}
 
-    if (fHasArg)
-    {
-        s_more_flags = false;
-        pszLine += len;
-        return (pszFlag[1] != '-');
-    }
+// Appends this process's events to the trace file with a single write, so
+// they cannot interleave with events from the other sudo process.
+static void
+FlushTrace()
+{
+    if (!g_trace_enabled || !s_hTraceFile)
+        return;
 
-    if (!fHasArg && len == 2 && pszLine[len] != '-')
+    // How much of the arena this process used, for the bench action.
+    const ArenaStats& stats = s_arena.Stats();
+    TraceCounterEvent("arena", "allocations", stats.allocations);
+    TraceCounterEvent("arena", "peak_bytes", stats.peak);
+
+    TraceText text;
+    TraceWriteEvents(AppendTraceText, &text);
+    if (text.ok && text.len)
     {
-        s_more_flags = true;
-        pszLine += len;
-        return true;
+        OVERLAPPED ov = {};
+        ov.Offset = 0xffffffff;
+        ov.OffsetHigh = 0xffffffff;
+        DWORD dummy;
+        WriteFile(s_hTraceFile, text.p, DWORD(text.len), &dummy, &ov);
     }
-
-    return false;
+    free(text.p);
+    CloseHandle(s_hTraceFile);
+    s_hTraceFile = nullptr;
 }
 
-static bool
-GetArg(LPCWSTR& pszLine, LPWSTR pszOut, DWORD maxlen)
+class FlushTraceAtExit
 {
-    bool fHasArg = false;
-    bool fTooLong = false;
-
-    s_more_flags = false;
+public:
+    ~FlushTraceAtExit() { FlushTrace(); }
+};
 
-    // FUTURE:  Does this need to handle "\"" quotation escaping?
+// With --debug, reports how much the arena was used.
+class ReportArenaAtExit
+{
+public:
+    ReportArenaAtExit(bool fDebug) : m_fDebug(fDebug) {}
 
-    bool fQuote = false;
-    for (; *pszLine; ++pszLine)
+    ~ReportArenaAtExit()
     {
-        if (*pszLine == '"')
-        {
-            fQuote = !(fQuote && _istspace(ForceUnsigned(pszLine[1])));
-        }
-        else if (!fQuote && _istspace(ForceUnsigned(*pszLine)))
-        {
-            break;
-        }
-        else
+        if (m_fDebug)
         {
-            if (maxlen <= 1)
-            {
-                fTooLong = true;
-                if (maxlen)
-                    *pszOut = '\0';
-                maxlen = 0;
-            }
-            else
-            {
-                fHasArg = true;
-                *pszOut = *pszLine;
-                ++pszOut;
-            }
+            const ArenaStats& stats = s_arena.Stats();
+            char sz[160];
+            sprintf(sz, "ARENA: %llu allocations, %llu bytes peak, %llu bytes in %u blocks\r\n",
+                    stats.allocations, (unsigned long long)stats.peak,
+                    (unsigned long long)stats.reserved, stats.blocks);
+            OutText(sz);
         }
     }
 
-    if (maxlen)
-        *pszOut = '\0';
+private:
+    const bool m_fDebug;
+};
 
-    while (*pszLine && _istspace(ForceUnsigned(*pszLine)))
-        ++pszLine;
+// The audit journal is opened, appended to, and closed once per process, so
+// the same journal can be shared by any number of sudo processes.  Like the
+// trace file, the unelevated sudo opens it (without write access to what is
+// already there), and the elevated sudo appends through a duplicate of that
+// handle.  The path is only kept for -u, whose sudo opens it.
+static LPWSTR s_pszAuditLog = nullptr;
+static HANDLE s_hAuditLog = nullptr;
+static AuditRecord s_audit = {};
 
-    SetLastError(fTooLong ? ERROR_BUFFER_OVERFLOW : ERROR_SUCCESS);
-    return fHasArg && !fTooLong;
+static HANDLE
+OpenAuditLog(LPCWSTR pszFile)
+{
+    HANDLE h = CreateFileW(pszFile, FILE_READ_ATTRIBUTES|FILE_APPEND_DATA|SYNCHRONIZE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+                           nullptr, OPEN_ALWAYS, 0, nullptr);
+    return (h != INVALID_HANDLE_VALUE) ? h : nullptr;
 }
 
-static DWORD
-GetDllVersion(LPCWSTR lpszDllName)
+// Duplicates a file handle from the unelevated sudo, so the elevated sudo
+// never opens a path that the user chose.  The handle comes from a less
+// trusted process, so it only gets the access the client has, and it must
+// be a file.
+static HANDLE
+AdoptClientFile(DWORD dwPID, ULONGLONG ullHandle)
 {
-    DWORD dwVersion = 0;
-    HINSTANCE hinstDll = LoadLibrary(lpszDllName);
-
-    if (hinstDll)
+    HANDLE hClient = OpenProcess(PROCESS_DUP_HANDLE, false, dwPID);
+    if (!hClient)
+        return nullptr;
+    HANDLE h = nullptr;
+    const bool fDuplicated = !!DuplicateHandle(hClient, HANDLE(ULONG_PTR(ullHandle)), GetCurrentProcess(), &h,
+                                               0, false, DUPLICATE_SAME_ACCESS);
+    const DWORD err = GetLastError();
+    CloseHandle(hClient);
+    if (!fDuplicated)
     {
-        DLLGETVERSIONPROC pDllGetVersion = DLLGETVERSIONPROC(GetProcAddress(hinstDll, "DllGetVersion"));
-
-        // Because some DLLs might not implement this function, you must test
-        // for it explicitly.  Depending on the particular DLL, the lack of a
-        // DllGetVersion function can be a useful indicator of the version.
-        if (pDllGetVersion)
-        {
-            DLLVERSIONINFO dvi = { sizeof(dvi) };
-            HRESULT hr = (*pDllGetVersion)(&dvi);
-            if (SUCCEEDED(hr))
-                dwVersion = PACKVERSION(dvi.dwMajorVersion, dvi.dwMinorVersion);
-        }
-
-        FreeLibrary(hinstDll);
+        SetLastError(err);
+        return nullptr;
     }
-
-    return dwVersion;
+    if (GetFileType(h) != FILE_TYPE_DISK)
+    {
+        CloseHandle(h);
+        SetLastError(ERROR_INVALID_HANDLE);
+        return nullptr;
+    }
+    return h;
 }
 
-static bool
-IsElevationNeeded()
+// The --log-output file.  Like the trace file, the unelevated sudo creates
+// it, and the elevated sudo records through a duplicate of that handle; only
+// the sudo that -u starts opens the path itself.
+static HANDLE s_hLogOutput = nullptr;
+
+static HANDLE
+CreateLogOutput(LPCWSTR pszFile)
 {
-    if (GetDllVersion(L"shell32.dll") < PACKVERSION(5,0))
-        return false; // Elevation is not supported.
+    HANDLE h = CreateFileW(pszFile, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, 0, nullptr);
+    return (h != INVALID_HANDLE_VALUE) ? h : nullptr;
+}
 
-    HMODULE const hLib = LoadLibrary(L"shell32.dll");
-    if (!hLib)
-        return false;
+// With -b, the command's job in the job table:  added by the unelevated sudo,
+// and taken over by whichever elevated process launches the command.
+static JobRecord s_job;
 
-    union
+// Prints the -b job's ID, for --wait and --status.
+static void
+WriteJobId()
+{
+    if (s_job.Id())
     {
-        FARPROC proc[1];
-        struct
-        {
-            BOOL (WINAPI* IsUserAnAdmin)();
-        };
-    } shell32;
-
-    shell32.proc[0] = GetProcAddress(hLib, "IsUserAnAdmin");
-    bool const fElevationNeeded = shell32.proc[0] && !shell32.IsUserAnAdmin();
-    FreeLibrary(hLib);
-    return fElevationNeeded;
+        char sz[32];
+        sprintf_s(sz, _countof(sz), "%u\r\n", s_job.Id());
+        OutText(sz);
+    }
 }
 
-static LPWSTR
-BuildParameters(LPCWSTR pszFile, LPCWSTR pszDir, LPCWSTR pszLine, bool fElevated)
+static bool
+AppendAuditLine(const char* line, size_t len, void* context)
 {
-    WCHAR szDirFlag[1024 + 16] = {};
-    if (pszDir)
-        StringCchPrintfW(szDirFlag, _countof(szDirFlag), L"-D \"%s\"", pszDir);
-
-    const size_t file_len = pszFile ? wcslen(pszFile) : 0;
-    const size_t dir_len = wcslen(szDirFlag);
-    const size_t line_len = wcslen(pszLine);
-
-    const size_t cch = 3 + file_len + 64 + dir_len + line_len + 1;
-    LPWSTR pszArgs = LPWSTR(malloc(cch * sizeof(*pszArgs)));
+    // An offset of all 1s writes at the end of the file as one atomic step.
+    OVERLAPPED ov = {};
+    ov.Offset = 0xffffffff;
+    ov.OffsetHigh = 0xffffffff;
+    DWORD dw;
+    return WriteFile(HANDLE(context), line, DWORD(len), &dw, &ov) && dw == len;
+}
 
-    WCHAR szInsert[1024 + 64] = {};
-    if (!fElevated)
-        StringCchPrintfW(szInsert, _countof(szInsert), L"--elevated %u %s", GetCurrentProcessId(), szDirFlag);
-    else
-        StringCchPrintfW(szInsert, _countof(szInsert), L"%s /c", szDirFlag);
+static bool
+FlushAuditLog(void* context)
+{
+    return !!FlushFileBuffers(HANDLE(context));
+}
 
-    if (pszFile)
-        StringCchPrintfW(pszArgs, cch, L"\"%s\" %s %s", pszFile, szInsert, pszLine);
+static void
+PauseAudit(unsigned attempt, void*)
+{
+    if (attempt < 100)
+        SwitchToThread();
     else
-        StringCchPrintfW(pszArgs, cch, L"%s %s", szInsert, pszLine);
-
-    return pszArgs;
+        Sleep(1);
 }
 
-static void
-ShowHelp()
+// Opens the group commit state shared by the sudo processes that write to
+// the same journal, which is named after the file's ID.  Processes that
+// can't share it (e.g. an unelevated sudo after an elevated one created it)
+// just flush on their own.
+static AuditCommitState*
+OpenAuditCommitState(HANDLE hFile, HANDLE& hMapping)
 {
-    OutText(usage);
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(hFile, &info))
+        return nullptr;
+
+    WCHAR szName[64];
+    swprintf_s(szName, _countof(szName), L"Local\\sudo-audit-%08x-%08x%08x",
+               info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow);
+    hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(AuditCommitState), szName);
+    if (!hMapping)
+        return nullptr;
+    return static_cast<AuditCommitState*>(MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(AuditCommitState)));
 }
 
-static LPWSTR
-CopyCommandLineW()
+static void
+WriteAuditRecord(DWORD dwExit, DWORD err)
 {
-    LPCWSTR pszCmdLine = GetCommandLineW();
-    const size_t len = wcslen(pszCmdLine) + 1;
+    if (!s_hAuditLog)
+        return;
 
-    LPWSTR psz = (LPWSTR)calloc(len, sizeof(*psz));
-    if (!psz)
-        ExitFailure(ERROR_OUTOFMEMORY);
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    const unsigned long long ft64 = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    s_audit.time = (ft64 - 116444736000000000ull) / 10;
+    s_audit.exit_code = dwExit;
+    s_audit.error = err;
 
-    wcscpy_s(psz, len, pszCmdLine);
+    // Only one record per process.
+    HANDLE h = s_hAuditLog;
+    s_hAuditLog = nullptr;
+
+    size_t len;
+    char* line = FormatAuditRecord(s_audit, len);
+    if (line)
+    {
+        TraceSpan span("write audit record");
+        HANDLE hMapping = nullptr;
+        AuditJournalOps ops = {};
+        ops.append = AppendAuditLine;
+        ops.flush = FlushAuditLog;
+        ops.pause = PauseAudit;
+        ops.shared = OpenAuditCommitState(h, hMapping);
+        ops.max_pauses = 1000;
+        ops.context = h;
+        if (!AuditAppend(ops, line, len))
+            ErrText("sudo: unable to write to the audit journal.\r\n");
+        if (ops.shared)
+            UnmapViewOfFile(ops.shared);
+        if (hMapping)
+            CloseHandle(hMapping);
+        free(line);
+    }
+    CloseHandle(h);
+}
+
+static void
+ExitFailure(DWORD err)
+{
+    // Messages can be up to 64KB; most fit in the first try.
+    const DWORD dwFlags = FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS;
+    LPWSTR psz = nullptr;
+    for (DWORD cchBuffer = 256; !psz && cchBuffer <= 32768; cchBuffer *= 2)
+    {
+        psz = AllocString(cchBuffer);
+        if (!psz)
+            break;
+        if (!FormatMessageW(dwFlags, 0, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), psz, cchBuffer, 0))
+        {
+            const bool fRetry = (GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+            psz = nullptr;
+            if (!fRetry)
+                break;
+        }
+    }
+
+    WCHAR sz[32];
+    if (psz)
+    {
+        TrimString(psz, true/*spaces*/);
+    }
+    else
+    {
+        if (err < 65536)
+            swprintf_s(sz, _countof(sz), L"Error %u.", err);
+        else
+            swprintf_s(sz, _countof(sz), L"Error 0x%08X.", err);
+        psz = sz;
+    }
+
+    ErrText(psz);
+    ErrText("\r\nsudo failed.\r\n");
+
+    s_job.Failed(err);
+    WriteAuditRecord(DWORD(-1), err);
+    FlushTrace();
+    FlushOutput();
+    ExitProcess(-1);
+}
+
+// Builds the arguments for the elevated sudo (or for COMSPEC, when already
+// elevated).  Returns nullptr if out of memory.
+static LPWSTR
+BuildParameters(LPCWSTR pszFile, LPCWSTR pszDir, LPCWSTR pszLine, bool fElevated, const CommandLineBuilder* pForward=nullptr)
+{
+    CommandLineBuilder args;
+
+    if (pszFile)
+        args.Program(pszFile);
+
+    if (!fElevated)
+    {
+        args.Arg(L"--elevated");
+        args.Arg(unsigned(GetCurrentProcessId()));
+        if (pForward)
+            args.Append(*pForward);
+    }
+
+    if (pszDir)
+    {
+        args.Arg(L"-D");
+        args.Arg(pszDir);
+    }
+
+    args.Arg(fElevated ? L"/c" : L"--");
+    args.Raw(pszLine);
+
+    LPWSTR pszArgs = AllocString(args.Length() + 1);
+    if (pszArgs && !args.Emit(pszArgs))
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return nullptr;
+    }
+    return pszArgs;
+}
+
+// The unelevated sudo hands its request to the elevated sudo in a named
+// section (see handoff.h), and only the nonce goes on the command line.  The
+// nonce keeps the names unique and ties the image to the command line; it
+// isn't a secret, since the user's other processes can read the command line
+// anyway.  The elevated sudo signals an event once it has its own copy, so
+// the unelevated sudo knows when it can let go of the section (with -b it
+// doesn't wait for the command).
+static void
+GetRequestObjectName(WCHAR* pszName, size_t cchName, DWORD dwPID, unsigned long long nonce, LPCWSTR pszKind)
+{
+    swprintf_s(pszName, cchName, L"Local\\sudo-request-%u-%016llx-%ls", dwPID, nonce, pszKind);
+}
+
+class RequestHandoff
+{
+public:
+    ~RequestHandoff()
+    {
+        if (m_hSection)
+            CloseHandle(m_hSection);
+        if (m_hAccepted)
+            CloseHandle(m_hAccepted);
+    }
+
+    // Writes the request into a new section, choosing its nonce.
+    bool Publish(HandoffRequest& req)
+    {
+        const size_t cb = HandoffImageSize(req);
+        if (!cb)
+        {
+            SetLastError(ERROR_BUFFER_OVERFLOW);
+            return false;
+        }
+
+        LARGE_INTEGER liNonce;
+        QueryPerformanceCounter(&liNonce);
+        req.nonce = liNonce.QuadPart;
+        req.client_pid = GetCurrentProcessId();
+
+        WCHAR szName[96];
+        for (unsigned cTries = 0; !m_hSection; ++cTries, ++req.nonce)
+        {
+            GetRequestObjectName(szName, _countof(szName), req.client_pid, req.nonce, L"image");
+            m_hSection = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD(cb), szName);
+            if (!m_hSection)
+                return false;
+            if (GetLastError() == ERROR_ALREADY_EXISTS)
+            {
+                CloseHandle(m_hSection);
+                m_hSection = nullptr;
+                if (cTries >= 3)
+                {
+                    SetLastError(ERROR_ALREADY_EXISTS);
+                    return false;
+                }
+            }
+        }
+        --req.nonce;
+
+        GetRequestObjectName(szName, _countof(szName), req.client_pid, req.nonce, L"accepted");
+        m_hAccepted = CreateEventW(nullptr, true, false, szName);
+        if (!m_hAccepted)
+            return false;
+
+        void* pView = MapViewOfFile(m_hSection, FILE_MAP_WRITE, 0, 0, cb);
+        if (!pView)
+            return false;
+        WriteHandoff(req, pView);
+        UnmapViewOfFile(pView);
+        return true;
+    }
+
+    // Waits until the elevated sudo has copied the request, or has exited.
+    void WaitUntilAccepted(HANDLE hProcess)
+    {
+        if (hProcess && m_hAccepted)
+        {
+            const HANDLE ah[] = { m_hAccepted, hProcess };
+            WaitForMultipleObjects(_countof(ah), ah, false, INFINITE);
+        }
+    }
+
+private:
+    HANDLE m_hSection = nullptr;
+    HANDLE m_hAccepted = nullptr;
+};
+
+// Elevated side:  reads the request published by the unelevated sudo dwPID.
+// The strings in the request point into a private copy, which lives until
+// exit.
+static bool
+ReceiveRequest(DWORD dwPID, LPCWSTR pszNonce, HandoffRequest& req)
+{
+    WCHAR* pszEnd;
+    const unsigned long long nonce = wcstoull(pszNonce, &pszEnd, 16);
+    if (!*pszNonce || *pszEnd)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    WCHAR szName[96];
+    GetRequestObjectName(szName, _countof(szName), dwPID, nonce, L"image");
+    HANDLE hSection = OpenFileMappingW(FILE_MAP_READ, false, szName);
+    if (!hSection)
+        return false;
+    const void* pView = MapViewOfFile(hSection, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hSection);
+    if (!pView)
+        return false;
+
+    // The unelevated sudo can still write to the section, so everything is
+    // validated and used from a copy that can't change underneath it.
+    MEMORY_BASIC_INFORMATION mbi;
+    size_t cb = VirtualQuery(pView, &mbi, sizeof(mbi)) ? mbi.RegionSize : 0;
+    if (cb > c_handoff_max_size)
+        cb = c_handoff_max_size;
+    void* pCopy = cb ? s_arena.Alloc(cb) : nullptr;
+    if (pCopy)
+        memcpy(pCopy, pView, cb);
+    UnmapViewOfFile(pView);
+    if (!pCopy)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    if (!ReadHandoff(pCopy, cb, req) || req.nonce != nonce || req.client_pid != dwPID)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+
+    // Until the event is set, the unelevated sudo waits, so its handles to
+    // the job table, the trace file, the audit journal, and the --log-output
+    // file are still open.  A journal or recording that can't be adopted
+    // fails the request, rather than run the command without a record.
+    if (req.job && (req.flags & HANDOFF_FLAG_BACKGROUND))
+        s_job.Adopt(dwPID, req.job_table, req.job);
+    if (req.trace)
+        s_hTraceFile = AdoptClientFile(dwPID, req.trace);
+    if (req.audit_log && !(s_hAuditLog = AdoptClientFile(dwPID, req.audit_log)))
+        return false;
+    if (req.log_output && !(s_hLogOutput = AdoptClientFile(dwPID, req.log_output)))
+        return false;
+
+    GetRequestObjectName(szName, _countof(szName), dwPID, nonce, L"accepted");
+    HANDLE hAccepted = OpenEventW(EVENT_MODIFY_STATE, false, szName);
+    if (hAccepted)
+    {
+        SetEvent(hAccepted);
+        CloseHandle(hAccepted);
+    }
+    return true;
+}
+
+// The request lives in this process's own copy of the image, so its strings
+// can be used where the options' values would have been.
+static LPWSTR
+RequestString(const HandoffRequest& req, HandoffString index)
+{
+    return const_cast<LPWSTR>(req.strings[index]);
+}
+
+// With -E, the elevated sudo takes on the caller's environment itself, so
+// that finding programs, %COMSPEC%, and CMD all see the variables that the
+// command will.
+static bool
+AdoptEnvironment(LPCWSTR pszBlock)
+{
+    ArenaScope scope(s_arena);
+
+    // Names are found from the second character, since CMD keeps the
+    // current directory of each drive in variables such as =C:.
+    LPWCH pCurrent = GetEnvironmentStringsW();
+    if (!pCurrent)
+        return false;
+    for (LPCWSTR p = pCurrent; *p; p += wcslen(p) + 1)
+    {
+        LPCWSTR pszEq = wcschr(p + 1, '=');
+        const size_t cchName = pszEq ? size_t(pszEq - p) : wcslen(p);
+        LPWSTR pszName = AllocString(cchName + 1);
+        if (!pszName)
+            break;
+        wmemcpy(pszName, p, cchName);
+        pszName[cchName] = '\0';
+        SetEnvironmentVariableW(pszName, nullptr);
+    }
+    FreeEnvironmentStringsW(pCurrent);
+
+    bool ok = true;
+    for (LPCWSTR p = pszBlock; *p; p += wcslen(p) + 1)
+    {
+        LPCWSTR pszEq = wcschr(p + 1, '=');
+        if (!pszEq)
+            continue;
+        LPWSTR pszName = AllocString(size_t(pszEq - p) + 1);
+        if (!pszName)
+            return false;
+        wmemcpy(pszName, p, size_t(pszEq - p));
+        pszName[pszEq - p] = '\0';
+        ok = !!SetEnvironmentVariableW(pszName, pszEq + 1) && ok;
+    }
+    return ok;
+}
+
+// Programs found by FindProgram() are remembered in a cache file next to
+// sudo.exe, shared by every sudo process.  Only a process that can write to
+// sudo's directory (e.g. the elevated sudo) adds to it; others only read.
+static ProgramCache s_programCache;
+static bool s_fProgramCacheTried = false;
+
+static void
+MapProgramCache()
+{
+    if (s_fProgramCacheTried)
+        return;
+    s_fProgramCacheTried = true;
+
+    LPCWSTR pszCache = GetSudoersPath(L"sudoprogs.bin");
+    if (!pszCache)
+        return;
+
+    const DWORD cbImage = DWORD(ProgramCache::ImageSize());
+    const DWORD dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE;
+    bool fWritable = true;
+    HANDLE hFile = CreateFileW(pszCache, GENERIC_READ|GENERIC_WRITE, dwShare, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        fWritable = false;
+        hFile = CreateFileW(pszCache, GENERIC_READ, dwShare, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return;
+    }
+
+    // A writable mapping grows a new (empty) file to the full size, which
+    // reads as zeros.
+    void* pView = nullptr;
+    LARGE_INTEGER liSize;
+    if (fWritable || (GetFileSizeEx(hFile, &liSize) && liSize.QuadPart >= cbImage))
+    {
+        HANDLE hMapping = CreateFileMappingW(hFile, nullptr, fWritable ? PAGE_READWRITE : PAGE_READONLY, 0, cbImage, nullptr);
+        if (hMapping)
+        {
+            pView = MapViewOfFile(hMapping, fWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, cbImage);
+            CloseHandle(hMapping);
+        }
+    }
+    CloseHandle(hFile);
+
+    // The view stays mapped until the process exits.
+    if (pView && !s_programCache.Attach(pView, cbImage, fWritable))
+        UnmapViewOfFile(pView);
+}
+
+// Finds a program the way CMD does:  in the current directory and then in
+// each directory in %PATH%, trying each extension in %PATHEXT% unless the
+// name already has an extension.  The current directory is pszDir, since
+// the broker runs in a different directory than its clients.  Returns the
+// path, or nullptr.
+static LPWSTR
+FindProgram(LPCWSTR pszName, LPCWSTR pszDir)
+{
+    TraceSpan span("find program");
+    MapProgramCache();
+    return LocateProgram(pszName, pszDir, s_programCache, s_arena);
+}
+
+// Decides whether to run the command line directly, and if so returns the
+// path of the program to run.  Otherwise returns nullptr, and sets
+// the last error only if the program was required but not found.
+static LPWSTR
+GetDirectProgram(LPCWSTR pszLine, LPCWSTR pszDir, ExecMode mode)
+{
+    SetLastError(NOERROR);
+    if (mode == ExecMode::Shell || (mode == ExecMode::Auto && NeedsShell(pszLine)))
+        return nullptr;
+
+    TraceSpan span("find program");
+    MapProgramCache();
+    LPWSTR pszProgram;
+    if (!LocateDirectProgram(pszLine, pszDir, mode, s_programCache, s_arena, pszProgram))
+        return nullptr;
+    SetLastError(NOERROR);
+    return pszProgram;
+}
+
+// Returns the DOMAIN\name of the user a process runs as, or nullptr.
+static LPWSTR
+GetProcessUserString(DWORD dwPID)
+{
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, dwPID);
+    if (!hProcess)
+        return nullptr;
+    HANDLE hToken = nullptr;
+    const bool fToken = !!OpenProcessToken(hProcess, TOKEN_QUERY, &hToken);
+    CloseHandle(hProcess);
+    if (!fToken)
+        return nullptr;
+
+    union
+    {
+        TOKEN_USER  user;
+        BYTE        buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    } info;
+    DWORD cb;
+    LPWSTR psz = nullptr;
+    if (GetTokenInformation(hToken, TokenUser, &info, sizeof(info), &cb))
+    {
+        // The first call gets the lengths (including terminators), and the
+        // second puts the domain and name next to each other.
+        DWORD cchName = 0;
+        DWORD cchDomain = 0;
+        SID_NAME_USE use;
+        LookupAccountSidW(nullptr, info.user.User.Sid, nullptr, &cchName, nullptr, &cchDomain, &use);
+        LPWSTR pszDomain = (cchName && cchDomain) ? AllocString(cchDomain + cchName) : nullptr;
+        if (pszDomain && LookupAccountSidW(nullptr, info.user.User.Sid, pszDomain + cchDomain, &cchName, pszDomain, &cchDomain, &use))
+        {
+            pszDomain[cchDomain] = '\\';
+            psz = pszDomain;
+        }
+    }
+    CloseHandle(hToken);
     return psz;
 }
 
+// The sudoers policy applies if there is a sudoers file next to sudo.exe.
+// The compiled rules are cached in sudoers.bin next to it, which later
+// invocations map and query directly instead of compiling the rules again.
+// Only an elevated sudo writes the cache.
+static PolicyImage s_policy;
+static bool s_fPolicy = false;
+static void* s_pPolicyView = nullptr;
+static unsigned char* s_pPolicyImage = nullptr;
+
+static void
+ReleasePolicy()
+{
+    if (s_pPolicyView)
+        UnmapViewOfFile(s_pPolicyView);
+    free(s_pPolicyImage);
+    s_pPolicyView = nullptr;
+    s_pPolicyImage = nullptr;
+    s_policy = PolicyImage();
+    s_fPolicy = false;
+}
+
+// Returns the path of a file in the same directory as sudo.exe.
+static LPWSTR
+GetSudoersPath(LPCWSTR pszName)
+{
+    LPCWSTR pszModule = GetModuleFileNameString();
+    if (!pszModule)
+        return nullptr;
+
+    size_t cchDir = 0;
+    for (size_t i = 0; pszModule[i]; ++i)
+    {
+        if (pszModule[i] == '\\' || pszModule[i] == '/' || pszModule[i] == ':')
+            cchDir = i + 1;
+    }
+
+    const size_t cchName = wcslen(pszName);
+    LPWSTR pszPath = AllocString(cchDir + cchName + 1);
+    if (pszPath)
+    {
+        memcpy(pszPath, pszModule, cchDir * sizeof(*pszPath));
+        memcpy(pszPath + cchDir, pszName, (cchName + 1) * sizeof(*pszPath));
+    }
+    return pszPath;
+}
+
+static PolicyStamp
+MakePolicyStamp(DWORD nSizeHigh, DWORD nSizeLow, const FILETIME& ftWrite)
+{
+    PolicyStamp stamp;
+    stamp.size = ((unsigned long long)nSizeHigh << 32) | nSizeLow;
+    stamp.mtime = ((unsigned long long)ftWrite.dwHighDateTime << 32) | ftWrite.dwLowDateTime;
+    return stamp;
+}
+
+static bool
+MapPolicyCache(LPCWSTR pszCache, const PolicyStamp& stamp)
+{
+    HANDLE hFile = CreateFileW(pszCache, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER liSize;
+    void* pView = nullptr;
+    if (GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > 0 && !liSize.HighPart)
+    {
+        HANDLE hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (hMapping)
+        {
+            pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(hMapping);
+        }
+    }
+    CloseHandle(hFile);
+    if (!pView)
+        return false;
+
+    PolicyImage image;
+    if (!image.Attach(pView, size_t(liSize.QuadPart)) || !image.IsFrom(stamp))
+    {
+        UnmapViewOfFile(pView);
+        return false;
+    }
+
+    s_policy = image;
+    s_pPolicyView = pView;
+    return true;
+}
+
+// Writes the cache to a temporary file and then renames it, so that other
+// sudo processes never see a partly written cache.  Failure doesn't matter;
+// the next sudo just compiles the rules again.
+static void
+SavePolicyCache(LPCWSTR pszCache, const unsigned char* pImage, size_t cbImage)
+{
+    const size_t cchTemp = wcslen(pszCache) + 16;
+    LPWSTR pszTemp = AllocString(cchTemp);
+    if (!pszTemp || FAILED(StringCchPrintfW(pszTemp, cchTemp, L"%s.%u.tmp", pszCache, GetCurrentProcessId())))
+        return;
+
+    HANDLE hFile = CreateFileW(pszTemp, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    DWORD dw;
+    const bool ok = WriteFile(hFile, pImage, DWORD(cbImage), &dw, nullptr) && dw == cbImage;
+    CloseHandle(hFile);
+
+    if (!ok || !MoveFileExW(pszTemp, pszCache, MOVEFILE_REPLACE_EXISTING))
+        DeleteFileW(pszTemp);
+}
+
+static bool
+CompilePolicyFile(LPCWSTR pszRules, LPCWSTR pszCache, bool fSaveCache)
+{
+    HANDLE hFile = CreateFileW(pszRules, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    // The stamp comes from the open file, so it matches what gets read.
+    BY_HANDLE_FILE_INFORMATION info;
+    char* pText = nullptr;
+    DWORD cbText = 0;
+    bool ok = !!GetFileInformationByHandle(hFile, &info);
+    if (ok && (info.nFileSizeHigh || info.nFileSizeLow > 64 * 1024 * 1024))
+    {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        ok = false;
+    }
+    if (ok)
+    {
+        pText = static_cast<char*>(malloc(info.nFileSizeLow + 1));
+        if (!pText)
+            SetLastError(ERROR_OUTOFMEMORY);
+        ok = pText && ReadFile(hFile, pText, info.nFileSizeLow, &cbText, nullptr);
+    }
+    const DWORD err = GetLastError();
+    CloseHandle(hFile);
+    if (!ok)
+    {
+        free(pText);
+        SetLastError(err);
+        return false;
+    }
+
+    const PolicyStamp stamp = MakePolicyStamp(info.nFileSizeHigh, info.nFileSizeLow, info.ftLastWriteTime);
+    size_t cbImage;
+    unsigned uErrorLine;
+    unsigned char* pImage = CompilePolicy(pText, cbText, stamp, cbImage, uErrorLine);
+    free(pText);
+    if (!pImage)
+    {
+        if (uErrorLine)
+        {
+            char sz[80];
+            sprintf(sz, "sudo: syntax error in sudoers line %u.\r\n", uErrorLine);
+            ErrText(sz);
+        }
+        SetLastError(uErrorLine ? ERROR_INVALID_DATA : ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    if (!s_policy.Attach(pImage, cbImage))
+    {
+        free(pImage);
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+    s_pPolicyImage = pImage;
+
+    if (fSaveCache)
+        SavePolicyCache(pszCache, pImage, cbImage);
+    return true;
+}
+
+// Loads the sudoers policy, or reloads it if the rule file has changed
+// (the broker runs for a long time).  Returns false and sets the last error
+// if the rule file exists but can't be used, which denies every command.
+static bool
+RefreshPolicy(bool fSaveCache)
+{
+    LPCWSTR pszRules = GetSudoersPath(L"sudoers");
+    LPCWSTR pszCache = GetSudoersPath(L"sudoers.bin");
+    if (!pszRules || !pszCache)
+        return false;
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(pszRules, GetFileExInfoStandard, &data))
+    {
+        const DWORD err = GetLastError();
+        if (err != ERROR_FILE_NOT_FOUND)
+            return false;
+        ReleasePolicy();
+        return true;
+    }
+
+    const PolicyStamp stamp = MakePolicyStamp(data.nFileSizeHigh, data.nFileSizeLow, data.ftLastWriteTime);
+    if (s_fPolicy && s_policy.IsFrom(stamp))
+        return true;
+
+    TraceSpan span("load sudoers");
+    ReleasePolicy();
+    if (!MapPolicyCache(pszCache, stamp) && !CompilePolicyFile(pszRules, pszCache, fSaveCache))
+        return false;
+    s_fPolicy = true;
+    return true;
+}
+
+// Checks a command line against the sudoers policy, if there is one, for
+// the user that dwClientPID runs as.  The options are the POLICY_OPT_* values
+// for what was asked for; running through CMD is added here.  Returns false
+// (after saying why, and setting the last error) if the command is not
+// allowed.
+static bool
+IsAllowedByPolicy(DWORD dwClientPID, LPCWSTR pszLine, LPCWSTR pszProgram, LPCWSTR pszDir, ExecMode mode, unsigned options, bool fSaveCache)
+{
+    if (!RefreshPolicy(fSaveCache))
+        return false;
+    if (!s_fPolicy)
+        return true;
+
+    TraceSpan span("check sudoers");
+
+    // Match the program that will actually run, so a rule for a full path
+    // can't be satisfied by a different program with the same name.
+    if (!pszProgram)
+    {
+        LPWSTR pszName = AllocString(wcslen(pszLine) + 1);
+        if (!pszName)
+            return false;
+        WCHAR* out = pszName;
+        ScanProgramName(pszLine, out);
+        *out = '\0';
+        pszProgram = *pszName ? FindProgram(pszName, pszDir) : nullptr;
+    }
+
+    // Scripts and CMD syntax both run through CMD.
+    if (mode != ExecMode::Direct)
+    {
+        LPCWSTR pszExt = pszProgram ? FindExtension(pszProgram) : nullptr;
+        if (NeedsShell(pszLine) || (pszExt && (!_wcsicmp(pszExt, L".bat") || !_wcsicmp(pszExt, L".cmd"))))
+            options |= POLICY_OPT_SHELL;
+    }
+
+    LPCWSTR pszUser = GetProcessUserString(dwClientPID);
+    if (!pszUser)
+        pszUser = GetProcessUserString(GetCurrentProcessId());
+    const PolicyVerdict verdict = s_policy.CheckCommandLine(pszUser ? pszUser : L"", pszLine, pszProgram, options);
+
+    char sz[128];
+    switch (verdict.decision)
+    {
+    case PolicyDecision::Allow:
+        return true;
+    case PolicyDecision::Deny:
+        sprintf(sz, "sudo: sudoers line %u denies this command.\r\n", verdict.line);
+        break;
+    case PolicyDecision::NeedsOption:
+    {
+        // Lists what is missing, such as "-b, or -E".  The names are in
+        // the order of their bits.
+        static const struct { unsigned option; const char* name; } c_names[] =
+        {
+            { POLICY_OPT_BACKGROUND, "-b" },
+            { POLICY_OPT_SHELL, "running this command through CMD" },
+            { POLICY_OPT_SETENV, "-E" },
+        };
+        char szMissing[80] = "";
+        for (const auto& name : c_names)
+        {
+            if (!(verdict.missing & name.option))
+                continue;
+            if (*szMissing)
+                strcat(szMissing, (verdict.missing & ~((name.option << 1) - 1)) ? ", " : ", or ");
+            strcat(szMissing, name.name);
+        }
+        sprintf(sz, "sudo: sudoers line %u does not allow %s.\r\n", verdict.line, szMissing);
+        break;
+    }
+    default:
+        strcpy(sz, "sudo: no sudoers rule allows this command.\r\n");
+        break;
+    }
+    ErrText(sz);
+    SetLastError(ERROR_ACCESS_DENIED);
+    return false;
+}
+
+struct LaunchOptions
+{
+    LPCWSTR     pszDir;
+    bool        fBackground;
+    bool        fDebug;
+    ExecMode    mode;
+    ProcessTreeJob* pJob;           // If not null, the command and everything it starts run in the job.
+    DWORD       dwClientPID;        // The unelevated sudo, whose user the sudoers policy checks.
+    bool        fNewGroup;          // Start the command in its own process group, for --timeout.
+    bool        fPreserveEnv;       // The caller's environment was adopted (-E).
+};
+
+// Once the broker has launched a queued request, the next one may go.
+static void
+LeaveQueue(void* context)
+{
+    static_cast<ElevationQueue*>(context)->Leave();
+}
+
+static unsigned
+GetPolicyOptions(bool fBackground, bool fPreserveEnv)
+{
+    return ((fBackground ? POLICY_OPT_BACKGROUND : 0) |
+            (fPreserveEnv ? POLICY_OPT_SETENV : 0));
+}
+
+static HANDLE
+LaunchCommand(LPCWSTR pszLine, const LaunchOptions& opts)
+{
+    // The broker and --batch launch many commands, so each launch frees
+    // what it allocated.
+    ArenaScope scope(s_arena);
+
+    // Run the program directly when CMD isn't needed, which saves starting
+    // a CMD process for each command.
+    LPCWSTR pszCmdLine = nullptr;
+    LPCWSTR pszDirect = GetDirectProgram(pszLine, opts.pszDir, opts.mode);
+    if (pszDirect)
+        pszCmdLine = pszLine;
+    else if (GetLastError() != NOERROR)
+        return nullptr;
+
+    if (!IsAllowedByPolicy(opts.dwClientPID, pszLine, pszDirect, opts.pszDir, opts.mode,
+                           GetPolicyOptions(opts.fBackground, opts.fPreserveEnv), true/*fSaveCache*/))
+        return nullptr;
+
+    LPCWSTR pszFile = pszDirect;
+    if (!pszDirect)
+    {
+        pszFile = GetEnvironmentString(L"COMSPEC");
+        if (!pszFile)
+            pszFile = L"cmd.exe";
+        pszCmdLine = BuildParameters(pszFile, opts.pszDir, pszLine, true/*fElevated*/);
+    }
+    if (!pszCmdLine)
+        return nullptr;
+
+    if (opts.fDebug)
+    {
+        OutText("\r\n---- CreateProcessW ----\r\n");
+        OutText("FILE='"); OutText(pszFile); OutText("'\r\n");
+        OutText("CMDLINE='"); OutText(pszCmdLine); OutText("'\r\n");
+        if (opts.pszDir)
+        {
+            OutText("DIR='"); OutText(opts.pszDir); OutText("'\r\n");
+        }
+    }
+
+    SpawnOptions spawn = {};
+    spawn.program = pszFile;
+    spawn.command_line = pszCmdLine;
+    spawn.dir = opts.pszDir;
+    spawn.background = opts.fBackground;
+    spawn.suspended = !!opts.pJob;
+    spawn.new_group = opts.fNewGroup;
+
+    PlatformProcess process = {};
+    TraceSpan span("CreateProcessW");
+    const bool ok = PlatformSpawn(spawn, s_arena, process);
+    const DWORD err = GetLastError();
+    span.End();
+
+    if (!ok)
+    {
+        SetLastError(err);
+        return nullptr;
+    }
+
+    if (opts.pJob)
+    {
+        if (!opts.pJob->Assign(process.handle))
+        {
+            const DWORD errAssign = GetLastError();
+            PlatformTerminate(process, DWORD(-1));
+            PlatformClose(process);
+            SetLastError(errAssign);
+            return nullptr;
+        }
+        PlatformResume(process);
+    }
+
+    return process.handle;
+}
+
+static HANDLE
+BrokerLaunch(const BrokerRequest& req)
+{
+    LaunchOptions opts = {};
+    opts.pszDir = req.pszDir;
+    opts.fBackground = !!(req.dwFlags & BROKER_FLAG_BACKGROUND);
+    opts.fDebug = !!(req.dwFlags & BROKER_FLAG_DEBUG);
+    opts.mode = ((req.dwFlags & BROKER_FLAG_DIRECT) ? ExecMode::Direct :
+                 (req.dwFlags & BROKER_FLAG_SHELL) ? ExecMode::Shell : ExecMode::Auto);
+    opts.dwClientPID = req.dwPID;
+    return LaunchCommand(req.pszLine, opts);
+}
+
+static HANDLE
+BatchLaunch(LPCWSTR pszLine, void* context)
+{
+    return LaunchCommand(pszLine, *static_cast<const LaunchOptions*>(context));
+}
+
+static void
+BatchReport(unsigned index, unsigned count, LPCWSTR pszLine, DWORD dwExit, DWORD err, void* context)
+{
+    WCHAR sz[128];
+    if (err)
+        swprintf_s(sz, _countof(sz), L"sudo: [%u/%u] failed to start (error %u): ", index + 1, count, err);
+    else
+        swprintf_s(sz, _countof(sz), L"sudo: [%u/%u] exit code %d: ", index + 1, count, int(dwExit));
+    ErrText(sz);
+    ErrText(pszLine);
+    ErrText("\r\n");
+}
+
+static void
+WriteStatsLine(const char* line, void*)
+{
+    ErrText(line);
+}
+
+static void
+ReportStats(const ProcessTreeJob& job, StatsFormat format, DWORD dwExit)
+{
+    ProcessStats stats = {};
+    if (!job.Query(stats))
+        return;
+
+    stats.exit_code = int(dwExit);
+    if (format == StatsFormat::Text)
+        ErrText("sudo: resources used by the command and every process it started:\r\n");
+    WriteProcessStats(stats, format, WriteStatsLine, nullptr);
+}
+
+// With --timeout, the elevated sudo watches the command it launched.  Its
+// job (if any) holds the command's whole tree, so killing the job kills
+// everything the command started.
+struct WatchedCommand
+{
+    PlatformProcess process;
+    ProcessTreeJob* pJob;
+};
+
+static WatchdogWait
+WatchdogWaitCommand(unsigned timeout_ms, unsigned& exit_code, void* context)
+{
+    WatchedCommand* command = static_cast<WatchedCommand*>(context);
+    if (PlatformWait(command->process, exit_code, timeout_ms))
+        return WatchdogWait::Exited;
+    return (GetLastError() == WAIT_TIMEOUT) ? WatchdogWait::Running : WatchdogWait::Failed;
+}
+
+static void
+WatchdogInterruptCommand(void* context)
+{
+    PlatformInterrupt(static_cast<WatchedCommand*>(context)->process);
+}
+
+static void
+WatchdogKillCommand(void* context)
+{
+    WatchedCommand* command = static_cast<WatchedCommand*>(context);
+    if (command->pJob)
+        command->pJob->Terminate(c_exit_killed);
+    PlatformTerminate(command->process, c_exit_killed);
+}
+
+// The command's own process group ignores Ctrl+C, and Ctrl+C can't be sent
+// to just one group.  So while the watchdog waits, the elevated sudo turns
+// Ctrl+C into Ctrl-Break for the command's group, and the unelevated sudo
+// (with no process) ignores Ctrl+C so that it still reports the exit code.
+// Ctrl+Break from the keyboard reaches every group without help.
+class ForwardCtrlC
+{
+public:
+    ForwardCtrlC(PlatformProcess* process)
+    {
+        s_process = process;
+        SetConsoleCtrlHandler(Handler, true);
+    }
+
+    ~ForwardCtrlC()
+    {
+        SetConsoleCtrlHandler(Handler, false);
+        s_process = nullptr;
+    }
+
+private:
+    static BOOL WINAPI Handler(DWORD dwCtrlType)
+    {
+        if (dwCtrlType != CTRL_C_EVENT)
+            return false;
+        if (s_process)
+            PlatformInterrupt(*s_process);
+        return true;
+    }
+
+    static PlatformProcess* s_process;
+};
+
+PlatformProcess* ForwardCtrlC::s_process = nullptr;
+
+// Formats how a job ended (an exit code or an error), for --jobs and
+// --status.
+static void
+FormatJobExit(const JobInfo& info, char* psz, size_t cch)
+{
+    if (!IsJobDone(info.state))
+        strcpy_s(psz, cch, "-");
+    else if (info.exit_code < 65536)
+        sprintf_s(psz, cch, "%u", info.exit_code);
+    else
+        sprintf_s(psz, cch, "0x%08X", info.exit_code);
+}
+
+// Formats a time from the job table's clock as local time.
+static void
+FormatJobStart(unsigned long long ms, char* psz, size_t cch)
+{
+    const unsigned long long ull = ms * 10000 + c_unix_epoch;
+    FILETIME ft = { DWORD(ull), DWORD(ull >> 32) };
+    SYSTEMTIME stUTC, st;
+    if (!FileTimeToSystemTime(&ft, &stUTC) || !SystemTimeToTzSpecificLocalTime(nullptr, &stUTC, &st))
+    {
+        strcpy_s(psz, cch, "-");
+        return;
+    }
+    sprintf_s(psz, cch, "%04u-%02u-%02u %02u:%02u:%02u", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+}
+
+static void
+WriteJobHeader()
+{
+    char sz[128];
+    sprintf_s(sz, _countof(sz), "%6s  %-8s  %6s  %10s  %-19s  %10s  COMMAND\r\n",
+              "ID", "STATE", "PID", "EXIT", "STARTED", "TIME");
+    OutText(sz);
+}
+
+// Writes one row of the listing.  TIME is how long the job ran, or has run
+// so far.
+static void
+WriteJobRow(const JobInfo& info, unsigned long long now_ms)
+{
+    char szPID[16];
+    char szExit[16];
+    char szStart[32];
+    char szTime[32];
+    if (info.state == JobState::Starting)
+        strcpy_s(szPID, _countof(szPID), "-");
+    else
+        sprintf_s(szPID, _countof(szPID), "%u", info.pid);
+    FormatJobExit(info, szExit, _countof(szExit));
+    FormatJobStart(info.start_ms, szStart, _countof(szStart));
+
+    const unsigned long long end_ms = info.end_ms ? info.end_ms : now_ms;
+    const unsigned long long ms = (end_ms > info.start_ms) ? end_ms - info.start_ms : 0;
+    const unsigned long long s = ms / 1000;
+    if (s < 60)
+        sprintf_s(szTime, _countof(szTime), "%llu.%01llus", s, (ms % 1000) / 100);
+    else
+        sprintf_s(szTime, _countof(szTime), "%llu:%02llu:%02llu", s / 3600, (s / 60) % 60, s % 60);
+
+    char sz[128];
+    sprintf_s(sz, _countof(sz), "%6u  %-8s  %6s  %10s  %-19s  %10s  ",
+              info.id, JobStateName(info.state), szPID, szExit, szStart, szTime);
+    OutText(sz);
+    OutText(info.command);
+    OutText("\r\n");
+}
+
+// Opens the job table for a query.  Returns nullptr if no job was ever
+// added, and fails if the table can't be opened.
+static JobTable*
+OpenJobTableForQuery()
+{
+    JobTable* const pTable = OpenJobTable();
+    const DWORD err = GetLastError();
+    if (!pTable && err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+        ExitFailure(err);
+    return pTable;
+}
+
+// Parses a job ID, e.g. for --status.
+static bool
+ParseJobId(LPCWSTR pszValue, unsigned& id)
+{
+    WCHAR* pszEnd;
+    const unsigned long ul = wcstoul(pszValue, &pszEnd, 10);
+    if (!*pszValue || *pszEnd || !ul)
+        return false;
+    id = unsigned(ul);
+    return true;
+}
+
+// --jobs:  lists the jobs, oldest first.
+static int
+ListJobs()
+{
+    JobTable* const pTable = OpenJobTableForQuery();
+    if (!pTable)
+        return 0;
+
+    JobInfo* const infos = static_cast<JobInfo*>(s_arena.Alloc(c_job_slots * sizeof(JobInfo)));
+    if (!infos)
+        ExitFailure(ERROR_OUTOFMEMORY);
+    const unsigned count = pTable->List(infos, c_job_slots);
+    const unsigned long long now_ms = GetJobClock();
+    if (count)
+        WriteJobHeader();
+    for (unsigned i = 0; i < count; ++i)
+        WriteJobRow(infos[i], now_ms);
+    return 0;
+}
+
+// --status:  shows one job.
+static int
+ShowJobStatus(LPCWSTR pszValue)
+{
+    unsigned id;
+    if (!ParseJobId(pszValue, id))
+    {
+        ErrText("--status must be a job id.\r\n");
+        return 1;
+    }
+
+    JobTable* const pTable = OpenJobTableForQuery();
+    JobInfo info;
+    if (!pTable || !pTable->Find(id, info))
+    {
+        ErrText("sudo: there is no job "); ErrText(pszValue); ErrText(".\r\n");
+        return 1;
+    }
+
+    WriteJobHeader();
+    WriteJobRow(info, GetJobClock());
+    return 0;
+}
+
+// --wait:  waits for one job, or for every job, and returns its exit code
+// (or the first nonzero one, by ID).  A job that failed to start returns
+// its error, and a lost job returns -1, as sudo does when it fails.
+static int
+WaitForJobs(LPCWSTR pszValue)
+{
+    const bool fAll = !_wcsicmp(pszValue, L"all");
+    unsigned id = 0;
+    if (!fAll && !ParseJobId(pszValue, id))
+    {
+        ErrText("--wait must be a job id, or all.\r\n");
+        return 1;
+    }
+
+    JobTable* const pTable = OpenJobTableForQuery();
+    if (!pTable && fAll)
+        return 0;
+
+    JobInfo* const infos = static_cast<JobInfo*>(s_arena.Alloc(c_job_slots * sizeof(JobInfo)));
+    unsigned* const ids = static_cast<unsigned*>(s_arena.Alloc(c_job_slots * sizeof(unsigned)));
+    if (!infos || !ids)
+        ExitFailure(ERROR_OUTOFMEMORY);
+
+    unsigned count = 1;
+    ids[0] = id;
+    if (fAll)
+    {
+        count = pTable->List(infos, c_job_slots);
+        for (unsigned i = 0; i < count; ++i)
+            ids[i] = infos[i].id;
+    }
+    if (pTable)
+        count = pTable->Wait(ids, count, infos);
+    if (!pTable || (!fAll && !infos[0].id))
+    {
+        ErrText("sudo: there is no job "); ErrText(pszValue); ErrText(".\r\n");
+        return 1;
+    }
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const JobInfo& info = infos[i];
+        if (!info.id)
+            continue;
+        const DWORD dwExit = (info.state == JobState::Lost) ? DWORD(-1) : info.exit_code;
+        if (dwExit)
+            return dwExit;
+    }
+    return 0;
+}
+
+static void
+WriteUsageLine(const char* line, void*)
+{
+    OutText(line);
+}
+
+static void
+ShowHelp()
+{
+    OutText(usage_header);
+    GenerateOptionsUsage(WriteUsageLine, nullptr);
+    OutText(usage_footer);
+}
+
 #ifdef GUI_SUDO
 int PASCAL
 wWinMain(HINSTANCE hinstCurrent, HINSTANCE hinstPrevious, LPWSTR lpszCmdLine, int nCmdShow)
@@ -574,134 +1944,366 @@ main(int argc, const char** argv)
     hinstPrevious = 0;
     nCmdShow = 0;
 #else
-    LPCWSTR pszLine = CopyCommandLineW();
-    GetArg(pszLine, nullptr, 0);
+    LPCWSTR pszLine = OptionParser::SkipArg(GetCommandLineW());
 #endif
 
-    WCHAR szFile[1024];
-    WCHAR szDir[1024];
-    WCHAR szUser[1024];
-    WCHAR szPrompt[1024];
-    LPWSTR pszArgs = nullptr;
+    const TraceTicks ticksStart = QueryTraceClock();
+
+    // Size the arena from the command line:  the parsed options, the full
+    // paths derived from them, and the command line forwarded to the
+    // elevated sudo are each about as long as the command line.
+    s_arena.Reserve((wcslen(GetCommandLineW()) * 8 + 4096) * sizeof(WCHAR));
+
+    LPWSTR pszFile = nullptr;
     LPCWSTR pszDir = nullptr;
     LPWSTR pszUser = nullptr;
     LPCWSTR pszPrompt = nullptr;
+    LPCWSTR pszBatch = nullptr;
+    LPCWSTR pszBatchText = nullptr;
+    LPWSTR pszTrace = nullptr;
+    LPWSTR pszLogOutput = nullptr;
+    LPWSTR pszAuditLog = nullptr;
+    DWORD cJobs = 1;
+    bool fHaveJobs = false;
     bool fDebug = false;
     bool fBackground = false;
     bool fNOUI = false;
-    bool fHavePID = false;
     bool fNetOnly = false;
     bool fStd = false;
+    bool fStats = false;
+    bool fListJobs = false;
+    LPCWSTR pszJobStatus = nullptr;
+    LPCWSTR pszWaitJobs = nullptr;
+    ExecMode execMode = ExecMode::Auto;
+    StatsFormat statsFormat = StatsFormat::Text;
+    ProcessControls controls;
+    LPCWSTR pszTimeout = nullptr;
+    LPCWSTR pszKillAfter = nullptr;
+    unsigned msTimeout = 0;
+    unsigned msKillAfter = 0;
+    bool fPreserveEnv = false;
+    LPCWSTR pszEnvironment = nullptr;
+    LPWSTR pszControls = nullptr;
 
     DWORD dwPID = 0;
-    const bool fElevated = TestFlag(pszLine, L"--elevated");
-    LPCWSTR pszSavedLine = pszLine;
-    if (fElevated)
-    {
-        WCHAR szPID[64];
-        if (!GetArg(pszLine, szPID, _countof(szPID)))
-        {
-            ShowHelp();
-            return 1;
-        }
-        dwPID = _wtoi(szPID);
-    }
+    DWORD dwBrokerTimeout = 0;
+    bool fHaveBrokerTimeout = false;
+    DWORD dwLogonCache = 0;
+    bool fHaveLogonCache = false;
+    bool fResetTimestamp = false;
+    bool fRemoveTimestamp = false;
+    bool fElevated = false;
+    LPCWSTR pszRequest = nullptr;
+
+    // Options that specify a value only take effect the first time.  The
+    // parser copies values into one allocation, which lives until exit.
+    LPWSTR pszStorage = AllocString(OptionParser::StorageNeeded(pszLine));
+    if (!pszStorage)
+        ExitFailure(ERROR_OUTOFMEMORY);
 
-    while (true)
+    OptionParser parser(pszLine, pszStorage);
+    for (bool fMore = true; fMore;)
     {
-        LPCWSTR pszFlag = pszLine;
-
-        if (TestFlag(pszLine, L"-?") || TestFlag(pszLine, L"-h") || TestFlag(pszLine, L"--help"))
+        const OptionId id = parser.Next();
+        LPWSTR pszValue = parser.Value();
+        switch (id)
         {
+        case OptionId::None:
+            fMore = false;
+            break;
+        case OptionId::Help:
             ShowHelp();
             return 0;
-        }
-        else if (TestFlag(pszLine, L"-V") || TestFlag(pszLine, L"--version"))
-        {
+        case OptionId::Version:
             OutText("SUDO " SUDO_VERSION_STR "; " SUDO_COPYRIGHT_STR "; MIT License.\r\n");
             return 0;
-        }
-        else if (TestFlag(pszLine, L"-b") || TestFlag(pszLine, L"--background"))
-        {
-            fBackground = true;
-        }
-        else if (TestFlag(pszLine, L"-n") || TestFlag(pszLine, L"--non-interactive"))
-        {
+        case OptionId::Background:
+            fBackground = true;
+            break;
+        case OptionId::NonInteractive:
             fNOUI = true;
-        }
-        else if (TestFlag(pszLine, L"-p", true) || TestFlag(pszLine, L"--prompt", true))
-        {
-            if (pszPrompt)
+            break;
+        case OptionId::Prompt:
+            if (!pszPrompt)
+                pszPrompt = pszValue;
+            break;
+        case OptionId::User:
+            if (!pszUser)
+                pszUser = pszValue;
+            break;
+        case OptionId::ChDir:
+            if (!pszDir)
+                pszDir = pszValue;
+            break;
+        case OptionId::PreserveEnv:
+            fPreserveEnv = true;
+            break;
+        case OptionId::Stdin:
+            fStd = true;
+            break;
+        case OptionId::Jobs:
+            if (!fHaveJobs)
             {
-                GetArg(pszLine, nullptr, 0);
+                cJobs = _wtoi(pszValue);
+                if (cJobs < 1 || cJobs > BATCH_MAX_JOBS)
+                {
+                    ErrText("-j must be between 1 and 64.\r\n");
+                    return 1;
+                }
+                fHaveJobs = true;
             }
-            else
+            break;
+        case OptionId::Batch:
+            if (!pszBatch)
+                pszBatch = pszValue;
+            break;
+        case OptionId::Broker:
+            if (!fHaveBrokerTimeout)
             {
-                szPrompt[0] = 0;
-                GetArg(pszLine, szPrompt, _countof(szPrompt));
-                pszPrompt = szPrompt;
+                dwBrokerTimeout = _wtoi(pszValue);
+                fHaveBrokerTimeout = true;
             }
-        }
-        else if (TestFlag(pszLine, L"-u", true) || TestFlag(pszLine, L"--user", true))
-        {
-            if (pszUser)
+            break;
+        case OptionId::BrokerServe:
+            return BrokerServe(_wtoi(pszValue), BrokerLaunch);
+        case OptionId::LogonCache:
+            if (!fHaveLogonCache)
             {
-                GetArg(pszLine, nullptr, 0);
+                dwLogonCache = _wtoi(pszValue);
+                fHaveLogonCache = true;
             }
-            else
+            break;
+        case OptionId::ResetTimestamp:
+            fResetTimestamp = true;
+            break;
+        case OptionId::RemoveTimestamp:
+            fRemoveTimestamp = true;
+            break;
+        case OptionId::LogonServe:
+            return LogonAgentServe(_wtoi(pszValue));
+        case OptionId::LogonHost:
+            return LogonHostServe(pszValue);
+        case OptionId::Elevated:
+            if (!*pszValue)
             {
-                szUser[0] = 0;
-                GetArg(pszLine, szUser, _countof(szUser));
-                pszUser = szUser;
+                ShowHelp();
+                return 1;
             }
-        }
-        else if (TestFlag(pszLine, L"-D", true) || TestFlag(pszLine, L"--chdir", true))
-        {
-            if (pszDir)
+            if (!fElevated)
             {
-                GetArg(pszLine, nullptr, 0);
+                dwPID = _wtoi(pszValue);
+                fElevated = true;
             }
-            else
+            break;
+        case OptionId::Request:
+            if (!pszRequest)
+                pszRequest = pszValue;
+            break;
+        case OptionId::NetOnly:
+            fNetOnly = true;
+            break;
+        case OptionId::Direct:
+        case OptionId::Shell:
+            if (execMode == ExecMode::Auto)
+                execMode = (id == OptionId::Direct) ? ExecMode::Direct : ExecMode::Shell;
+            break;
+        case OptionId::Stats:
+        case OptionId::StatsJson:
+            if (!fStats)
             {
-                szDir[0] = 0;
-                GetArg(pszLine, szDir, _countof(szDir));
-                pszDir = szDir;
+                statsFormat = (id == OptionId::StatsJson) ? StatsFormat::Json : StatsFormat::Text;
+                fStats = true;
             }
-
-            LPCWSTR pszKeep = pszLine;
-            pszLine = pszFlag;
-            wcscpy_s(const_cast<LPWSTR>(pszFlag), wcslen(pszFlag) + 1, pszKeep);
-        }
-        else if (TestFlag(pszLine, L"-S") || TestFlag(pszLine, L"--stdin"))
-        {
-            fStd = true;
+            break;
+        case OptionId::LogOutput:
+            if (!pszLogOutput)
+                pszLogOutput = pszValue;
+            break;
+        case OptionId::Trace:
+            if (!pszTrace)
+                pszTrace = pszValue;
+            break;
+        case OptionId::AuditLog:
+            if (!pszAuditLog)
+                pszAuditLog = pszValue;
+            break;
+        case OptionId::Priority:
+            if (controls.priority == PriorityLevel::Default && !ParsePriority(pszValue, controls.priority))
+            {
+                ErrText("--priority must be idle, below-normal, normal, above-normal, or high.\r\n");
+                return 1;
+            }
+            break;
+        case OptionId::IoPriority:
+            if (controls.io_priority == IoPriorityLevel::Default && !ParseIoPriority(pszValue, controls.io_priority))
+            {
+                ErrText("--io-priority must be very-low, low, or normal.\r\n");
+                return 1;
+            }
+            break;
+        case OptionId::Affinity:
+            if (!controls.affinity && !ParseAffinity(pszValue, controls.affinity))
+            {
+                ErrText("--affinity must be a mask (such as 0x0f) or a list of CPUs (such as 0,2-3).\r\n");
+                return 1;
+            }
+            break;
+        case OptionId::MaxMemory:
+            if (!controls.max_memory && !ParseMemorySize(pszValue, controls.max_memory))
+            {
+                ErrText("--max-memory must be a size in bytes, or with a K, M, or G suffix.\r\n");
+                return 1;
+            }
+            break;
+        case OptionId::CpuRate:
+            if (!controls.cpu_rate && !ParseCpuRate(pszValue, controls.cpu_rate))
+            {
+                ErrText("--cpu-rate must be a percent between 0.01 and 100.\r\n");
+                return 1;
+            }
+            break;
+        case OptionId::Timeout:
+            if (!pszTimeout)
+            {
+                if (!ParseDuration(pszValue, msTimeout))
+                {
+                    ErrText("--timeout must be a duration, such as 90, 1.5m, or 2h.\r\n");
+                    return 1;
+                }
+                pszTimeout = pszValue;
+            }
+            break;
+        case OptionId::KillAfter:
+            if (!pszKillAfter)
+            {
+                if (!ParseDuration(pszValue, msKillAfter))
+                {
+                    ErrText("--kill-after must be a duration, such as 10, 1.5m, or 2h.\r\n");
+                    return 1;
+                }
+                pszKillAfter = pszValue;
+            }
+            break;
+        case OptionId::Controls:
+            if (!ParseControls(pszValue, controls))
+            {
+                ShowHelp();
+                return 1;
+            }
+            break;
+        case OptionId::ListJobs:
+            fListJobs = true;
+            break;
+        case OptionId::JobStatus:
+            if (!pszJobStatus)
+                pszJobStatus = pszValue;
+            break;
+        case OptionId::WaitJobs:
+            if (!pszWaitJobs)
+                pszWaitJobs = pszValue;
+            break;
+        case OptionId::Debug:
+            fDebug = true;
+            break;
+        default:
+            ShowHelp();
+            return 1;
         }
-#ifdef INCLUDE_NET_ONLY
-        else if (TestFlag(pszLine, L"--net-only"))
+    }
+
+    pszLine = parser.Remaining();
+
+    // The elevated sudo takes everything from the request that the
+    // unelevated sudo handed off; options on its command line are ignored.
+    if (pszRequest)
+    {
+        HandoffRequest req;
+        if (!fElevated)
         {
-            fNetOnly = true;
+            ShowHelp();
+            return 1;
         }
-#endif
-        else if (TestFlag(pszLine, L"--debug"))
+        if (!ReceiveRequest(dwPID, pszRequest, req))
+            ExitFailure(GetLastError());
+
+        pszDir = req.strings[HANDOFF_DIR];
+        pszLine = req.strings[HANDOFF_LINE];
+        fBackground = !!(req.flags & HANDOFF_FLAG_BACKGROUND);
+        fDebug = !!(req.flags & HANDOFF_FLAG_DEBUG);
+        execMode = ((req.flags & HANDOFF_FLAG_DIRECT) ? ExecMode::Direct :
+                    (req.flags & HANDOFF_FLAG_SHELL) ? ExecMode::Shell : ExecMode::Auto);
+        fStats = !!(req.flags & (HANDOFF_FLAG_STATS|HANDOFF_FLAG_STATS_JSON));
+        statsFormat = (req.flags & HANDOFF_FLAG_STATS_JSON) ? StatsFormat::Json : StatsFormat::Text;
+        fPreserveEnv = !!(req.flags & HANDOFF_FLAG_PRESERVE_ENV);
+        cJobs = req.jobs;
+        dwBrokerTimeout = req.broker_timeout;
+        fHaveBrokerTimeout = true;
+        pszLogOutput = nullptr;     // Handles instead; see ReceiveRequest.
+        pszTrace = nullptr;
+        pszAuditLog = nullptr;
+        pszBatch = req.strings[HANDOFF_BATCH];
+        pszBatchText = req.strings[HANDOFF_BATCH_TEXT];
+        pszEnvironment = req.strings[HANDOFF_ENVIRONMENT];
+
+        controls = ProcessControls();
+        pszTimeout = req.strings[HANDOFF_TIMEOUT];
+        pszKillAfter = req.strings[HANDOFF_KILL_AFTER];
+        msTimeout = msKillAfter = 0;
+        if (cJobs < 1 || cJobs > BATCH_MAX_JOBS ||
+            (req.strings[HANDOFF_CONTROLS] && !ParseControls(req.strings[HANDOFF_CONTROLS], controls)) ||
+            (pszTimeout && !ParseDuration(pszTimeout, msTimeout)) ||
+            (pszKillAfter && !ParseDuration(pszKillAfter, msKillAfter)))
+            ExitFailure(ERROR_INVALID_DATA);
+    }
+
+    // Without a command, -k and --remove-timestamp only tell the logon agent
+    // to forget its logons.  With a command, -k just bypasses the agent.
+    if (fRemoveTimestamp && (*pszLine || pszBatch))
+    {
+        ErrText("A command line cannot be used with --remove-timestamp.\r\n");
+        return 1;
+    }
+    if ((fResetTimestamp || fRemoveTimestamp) && !*pszLine && !pszBatch && !fElevated)
+    {
+        if (!LogonAgentInvalidate(fRemoveTimestamp))
+            ExitFailure(GetLastError());
+        return 0;
+    }
+
+    // --jobs, --status, and --wait only look at the job table.
+    if ((fListJobs || pszJobStatus || pszWaitJobs) && !fElevated)
+    {
+        if (*pszLine || pszBatch)
         {
-            fDebug = true;
+            ErrText("A command line cannot be used with --jobs, --status, or --wait.\r\n");
+            return 1;
         }
-        else if (TestFlag(pszLine, L"--"))
+        if (int(fListJobs) + !!pszJobStatus + !!pszWaitJobs > 1)
         {
-            break;
+            ErrText("Only one of --jobs, --status, and --wait can be used.\r\n");
+            return 1;
         }
-        else if (*pszLine == '-')
+        if (pszJobStatus)
+            return ShowJobStatus(pszJobStatus);
+        if (pszWaitJobs)
+            return WaitForJobs(pszWaitJobs);
+        return ListJobs();
+    }
+
+    if (pszBatch)
+    {
+        if (*pszLine)
         {
-            ShowHelp();
+            ErrText("A command line cannot be used with --batch.\r\n");
             return 1;
         }
-        else
+        if (pszUser)
         {
-            break;
+            ErrText("--batch cannot be used with --user.\r\n");
+            return 1;
         }
     }
-
-    if (!*pszLine)
+    else if (!*pszLine)
     {
         ErrText("Missing command to execute.\r\n");
         OutText("\r\nUsage:\r\n\r\n");
@@ -709,6 +2311,96 @@ main(int argc, const char** argv)
         return 1;
     }
 
+    // The watchdog waits for the command, so it can't watch a command that
+    // runs in the background, or the many commands in a batch.
+    if (msTimeout && (fBackground || pszBatch))
+    {
+        ErrText("--timeout cannot be used with -b or --batch.\r\n");
+        return 1;
+    }
+
+    // Tracing starts after parsing the options, but includes the parsing.
+    // The unelevated sudo creates the trace file, and both sudo processes
+    // append their own events to it when they exit.
+    FlushTraceAtExit flush_trace;
+    ReportArenaAtExit report_arena(fDebug);
+    if (pszTrace || s_hTraceFile)
+    {
+        static char s_szProcessName[64];
+        if (fElevated)
+        {
+            // Only the sudo that -u starts gets a path, and it runs as the
+            // user, not elevated.
+            sprintf(s_szProcessName, "sudo --elevated (for %u)", dwPID);
+            if (!s_hTraceFile)
+            {
+                s_hTraceFile = CreateFileW(pszTrace, FILE_APPEND_DATA|SYNCHRONIZE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+                                           nullptr, OPEN_EXISTING, 0, nullptr);
+                if (s_hTraceFile == INVALID_HANDLE_VALUE)
+                    s_hTraceFile = nullptr;
+            }
+        }
+        else
+        {
+            strcpy(s_szProcessName, "sudo");
+            s_pszTraceFile = GetFullPathString(pszTrace);
+            if (!s_pszTraceFile || !(s_hTraceFile = CreateTraceFile(s_pszTraceFile)))
+                ExitFailure(GetLastError());
+        }
+
+        LARGE_INTEGER liFrequency;
+        QueryPerformanceFrequency(&liFrequency);
+        TraceStart(GetCurrentProcessId(), s_szProcessName, QueryTraceClock, TraceTicks(liFrequency.QuadPart));
+        TraceSpanEvent("parse options", ticksStart, TraceNow());
+    }
+
+    // Each sudo process appends one record to the audit journal, if there is
+    // one.  The unelevated sudo finds and opens the journal, and hands the
+    // elevated sudo its handle; only the sudo that -u starts (which runs as
+    // the user) gets the path instead.  A journal that can't be opened
+    // fails sudo, rather than run the command without a record.
+    if (!fElevated && !pszAuditLog)
+        pszAuditLog = GetEnvironmentString(L"SUDO_AUDIT_LOG");
+    if (pszAuditLog && *pszAuditLog && !s_hAuditLog)
+    {
+        if (!fElevated)
+            pszAuditLog = GetFullPathString(pszAuditLog);
+        if (!pszAuditLog || !(s_hAuditLog = OpenAuditLog(pszAuditLog)))
+            ExitFailure(GetLastError());
+    }
+    if (s_hAuditLog)
+    {
+        s_pszAuditLog = pszAuditLog;
+        s_audit.side = fElevated ? "elevated" : "sudo";
+        s_audit.pid = GetCurrentProcessId();
+        s_audit.parent_pid = fElevated ? dwPID : 0;
+        s_audit.user = PlatformGetUserName(s_arena);
+        s_audit.run_as = pszUser ? s_arena.Copy(pszUser) : nullptr;
+        s_audit.dir = pszDir;
+        s_audit.command = *pszLine ? pszLine : nullptr;
+        s_audit.batch = pszBatch;
+        s_audit.background = fBackground;
+    }
+
+    // Compile the password prompt now, so its identity lookups can run while
+    // the rest of startup proceeds.
+    CompiledPrompt prompt;
+    PromptIdentities identities(pszUser);
+    if (pszUser && !fElevated)
+    {
+        if (!pszPrompt)
+            pszPrompt = GetEnvironmentString(L"SUDO_PROMPT");
+        if (!pszPrompt)
+            pszPrompt = L"[sudo] Enter password for %p: ";
+
+        if (!prompt.Compile(pszPrompt))
+            ExitFailure(ERROR_OUTOFMEMORY);
+
+        identities.Start(prompt.Needs());
+    }
+
+    CommandLineBuilder forward;
+
     if (fElevated)
     {
         if (fDebug)
@@ -718,22 +2410,142 @@ main(int argc, const char** argv)
             OutText("FREECONSOLE, ATTACH TO "); OutText(szPID);
         }
 
-        FreeConsole();
-        AttachConsole(dwPID);
+        {
+            TraceSpan span("AttachConsole");
+            FlushOutput();
+            PlatformAttachConsole(dwPID);
+            ResetOutput();
+        }
+
+        if (dwBrokerTimeout)
+        {
+            TraceSpan span("start broker");
+            pszFile = GetModuleFileNameString();
+            const bool fSpawned = (pszFile && BrokerSpawn(pszFile, dwBrokerTimeout));
+            if (fDebug)
+                OutText(fSpawned ? "BROKER STARTED\r\n" : "BROKER FAILED TO START\r\n");
+        }
+
+        if (fPreserveEnv && pszEnvironment)
+        {
+            TraceSpan span("adopt environment");
+            if (!AdoptEnvironment(pszEnvironment))
+                ExitFailure(GetLastError());
+        }
     }
     else
     {
-        const DWORD cch = GetModuleFileName(0, szFile, _countof(szFile));
-        if (!cch)
-            ExitFailure(ERROR_FILE_NOT_FOUND);
-        if (cch >= _countof(szFile))
-            ExitFailure(ERROR_BUFFER_OVERFLOW);
+        pszFile = GetModuleFileNameString();
+        if (!pszFile)
+            ExitFailure(GetLastError());
+
+        // The broker only helps with elevation; -u runs the command as a
+        // different user instead.
+        if (pszUser)
+        {
+            dwBrokerTimeout = 0;
+        }
+        else if (!fHaveBrokerTimeout)
+        {
+            WCHAR szTimeout[64];
+            const DWORD len = GetEnvironmentVariableW(L"SUDO_BROKER_TIMEOUT", szTimeout, _countof(szTimeout));
+            if (len && len < _countof(szTimeout))
+                dwBrokerTimeout = _wtoi(szTimeout);
+        }
+
+        // Likewise the logon agent only helps with -u.
+        if (pszUser && !fHaveLogonCache)
+        {
+            WCHAR szTimeout[64];
+            const DWORD len = GetEnvironmentVariableW(L"SUDO_LOGON_CACHE", szTimeout, _countof(szTimeout));
+            if (len && len < _countof(szTimeout))
+                dwLogonCache = _wtoi(szTimeout);
+        }
+
+        // Read the batch file (relative to the current directory, not the -D
+        // directory) or stdin here, and hand its text to the elevated sudo,
+        // so the elevated sudo never reads a file the user named.
+        if (pszBatch)
+        {
+            if (wcscmp(pszBatch, L"-") != 0)
+            {
+                pszBatch = GetFullPathString(pszBatch);
+                if (!pszBatch)
+                    ExitFailure(GetLastError());
+            }
+            TraceSpan span("read batch file");
+            pszBatchText = ReadBatchText(pszBatch);
+            if (!pszBatchText)
+                ExitFailure(GetLastError());
+            s_audit.batch = pszBatch;
+        }
 
-        pszLine = pszSavedLine;
+        // Create the --log-output file here, so the elevated sudo never opens
+        // a path the user chose; only -u passes the full path instead.
+        if (pszLogOutput)
+        {
+            pszLogOutput = GetFullPathString(pszLogOutput);
+            if (!pszLogOutput)
+                ExitFailure(GetLastError());
+            if (!pszUser && !fBackground && !(s_hLogOutput = CreateLogOutput(pszLogOutput)))
+                ExitFailure(GetLastError());
+        }
+
+        // Forward the options that the elevated sudo needs; the rest only
+        // matter in this process.  Elevation hands them off in a request
+        // instead (see RequestHandoff), but -u still needs them.
+        forward.Arg(L"--broker");
+        forward.Arg(unsigned(dwBrokerTimeout));
+        forward.Arg(L"-j");
+        forward.Arg(unsigned(cJobs));
+        if (fBackground)
+            forward.Arg(L"-b");
+        if (fDebug)
+            forward.Arg(L"--debug");
+        if (execMode != ExecMode::Auto)
+            forward.Arg(execMode == ExecMode::Direct ? L"--direct" : L"--shell");
+        if (fStats)
+            forward.Arg(statsFormat == StatsFormat::Json ? L"--stats-json" : L"--stats");
+        if (fPreserveEnv)
+            forward.Arg(L"-E");
+        if (pszLogOutput)
+        {
+            forward.Arg(L"--log-output");
+            forward.Arg(pszLogOutput);
+        }
+        if (s_pszTraceFile)
+        {
+            forward.Arg(L"--trace");
+            forward.Arg(s_pszTraceFile);
+        }
+        if (s_pszAuditLog)
+        {
+            forward.Arg(L"--audit-log");
+            forward.Arg(s_pszAuditLog);
+        }
+        if (controls.Any())
+        {
+            pszControls = AllocString(c_controls_spec_max);
+            if (!pszControls)
+                ExitFailure(ERROR_OUTOFMEMORY);
+            FormatControls(controls, pszControls);
+            forward.Arg(L"--controls");
+            forward.Arg(pszControls);
+        }
+        if (pszTimeout)
+        {
+            forward.Arg(L"--timeout");
+            forward.Arg(pszTimeout);
+        }
+        if (pszKillAfter)
+        {
+            forward.Arg(L"--kill-after");
+            forward.Arg(pszKillAfter);
+        }
 
         if (fDebug)
         {
-            OutText("MODULE='"); OutText(szFile); OutText("'\r\n");
+            OutText("MODULE='"); OutText(pszFile); OutText("'\r\n");
             OutText("ARGUMENTS='"); OutText(pszLine); OutText("'\r\n");
         }
     }
@@ -749,19 +2561,30 @@ main(int argc, const char** argv)
 
     // Expand whatever directory was specified (or . by default) to solve two
     // problems:  (1) avoid double-processing of relative paths and (2) ensure
-    // CreateProcessWithLogonW doesn't default to %SYSTEMROOT%.
-    WCHAR szAbsDir[1024];
+    // CreateProcessWithLogonW doesn't default to %SYSTEMROOT%.  A request's
+    // directory is already a full path.
+    if (!pszRequest)
     {
-        const DWORD len = GetFullPathNameW(pszDir ? pszDir : L".", _countof(szAbsDir), szAbsDir, nullptr);
-        if (!(len > 0 && len < _countof(szAbsDir)))
+        LPCWSTR pszAbsDir = GetFullPathString(pszDir ? pszDir : L".");
+        if (!pszAbsDir)
             ExitFailure(GetLastError());
 
         if (fDebug)
         {
-            OutText("ABSDIR='"); OutText(pszDir ? pszDir : L"."); OutText(L"' -> '"); OutText(szAbsDir); OutText("'\r\n");
+            OutText("ABSDIR='"); OutText(pszDir ? pszDir : L"."); OutText(L"' -> '"); OutText(pszAbsDir); OutText("'\r\n");
         }
 
-        pszDir = szAbsDir;
+        pszDir = pszAbsDir;
+        s_audit.dir = pszDir;
+    }
+
+    // The elevated sudo enforces the sudoers policy.  Checking here too
+    // just fails sooner, before asking for consent or a password.
+    if (!fElevated && !pszBatch)
+    {
+        if (!IsAllowedByPolicy(GetCurrentProcessId(), pszLine, nullptr, pszDir, execMode,
+                               GetPolicyOptions(fBackground, fPreserveEnv), false/*fSaveCache*/))
+            ExitFailure(GetLastError());
     }
 
     // Spawn the process.  First use ShellExecuteEx() with "runas" to spawn a
@@ -769,89 +2592,189 @@ main(int argc, const char** argv)
     // Once that is running as an Administrator it attaches to the original
     // console and spawns the specified process.
 
-    HANDLE hProcess = 0;
-    if (fElevated)
+    // With --stats, the elevated sudo runs the command in a job, so it can
+    // wait for the whole process tree and report what the tree used.  The
+    // scheduling and resource controls are limits on the job, set before
+    // the command is assigned to it (while still suspended).  With
+    // --timeout, the job is how the watchdog kills the whole tree.
+    ProcessTreeJob job;
+    ProcessTreeJob* pJob = nullptr;
+    const bool fReportStats = (fElevated && fStats && !fBackground);
+    if (fReportStats || (fElevated && (controls.Any() || msTimeout)))
     {
-        DWORD dw = GetEnvironmentVariableW(L"COMSPEC", szFile, _countof(szFile));
-        if (dw <= 0 || dw >= _countof(szFile))
-            wcscpy(szFile, L"cmd.exe");
+        if (!job.Create() || !job.SetControls(controls))
+            ExitFailure(GetLastError());
+        pJob = &job;
+    }
 
-        STARTUPINFO si = { sizeof(si) };
-        si.dwFlags = STARTF_USESTDHANDLES;
-        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-        si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    LaunchOptions launch = { pszDir, fBackground, fDebug, execMode, pJob, dwPID, !!msTimeout, fPreserveEnv };
 
-        PROCESS_INFORMATION pi = {};
-        LPWSTR pszCmdLine = BuildParameters(szFile, pszDir, pszLine, fElevated);
+    // With --log-output, the elevated sudo records the command's input and
+    // output until the command exits.
+    SessionRecorder recorder;
+    if (fElevated && pszLogOutput && !fBackground && !(s_hLogOutput = CreateLogOutput(pszLogOutput)))
+        ExitFailure(GetLastError());
+
+    if (fElevated && pszBatch)
+    {
+        BatchList list;
+        TraceSpan spanLoad("load batch file");
+        if (!pszBatchText)
+            ExitFailure(ERROR_INVALID_DATA);
+        if (!LoadBatchText(pszBatchText, list))
+            ExitFailure(GetLastError());
+        spanLoad.End();
+
+        if (s_hLogOutput && !fBackground)
+        {
+            TraceSpan span("start recording");
+            const HANDLE hLogOutput = s_hLogOutput;
+            s_hLogOutput = nullptr;
+            if (!recorder.Start(hLogOutput))
+                ExitFailure(GetLastError());
+        }
 
         if (fDebug)
         {
-            OutText("\r\n---- CreateProcessW ----\r\n");
-            OutText("FILE='"); OutText(szFile); OutText("'\r\n");
-            OutText("CMDLINE='"); OutText(pszCmdLine); OutText("'\r\n");
-            if (pszDir)
-            {
-                OutText("DIR='"); OutText(pszDir); OutText("'\r\n");
-            }
+            char szCount[64];
+            sprintf(szCount, "%u COMMANDS, %u AT A TIME\r\n", list.count, cJobs);
+            OutText("BATCH='"); OutText(pszBatch); OutText("'\r\n");
+            OutText(szCount);
         }
 
-        const DWORD dwFlags = fBackground ? CREATE_NEW_PROCESS_GROUP|CREATE_NO_WINDOW : 0;
+        TraceSpan spanRun("run batch");
+        const DWORD dwExit = RunBatch(list, cJobs, BatchLaunch, BatchReport, &launch);
+        FreeBatchList(list);
+        if (fReportStats)
+            job.WaitForTree();
+        spanRun.End();
+        recorder.Stop();
+        if (fReportStats)
+            ReportStats(job, statsFormat, dwExit);
+        WriteAuditRecord(dwExit, 0);
+        return dwExit;
+    }
 
-        if (!CreateProcessW(szFile, pszCmdLine, nullptr, nullptr, true, dwFlags,
-                            nullptr, pszDir, &si, &pi))
+    HANDLE hProcess = 0;
+    if (fElevated)
+    {
+        if (s_hLogOutput && !fBackground)
         {
-            ExitFailure(GetLastError());
-            return -1;
+            TraceSpan span("start recording");
+            const HANDLE hLogOutput = s_hLogOutput;
+            s_hLogOutput = nullptr;
+            if (!recorder.Start(hLogOutput))
+                ExitFailure(GetLastError());
         }
 
-        hProcess = pi.hProcess;
+        hProcess = LaunchCommand(pszLine, launch);
+        if (!hProcess)
+        {
+            const DWORD err = GetLastError();
+            recorder.Stop();
+            ExitFailure(err);
+            return -1;
+        }
+        s_job.Launched(hProcess);
     }
     else if (pszUser)
     {
-        WCHAR szPassword[1024] = {};
+        SecretBuffer password;
         const WCHAR* pszDomain = nullptr;
-
-        if (pszUser)
+        bool fHavePassword = false;
+
+        // Use the logon agent for this user and session, if there is one or
+        // one can be started.  It asks for the password only if it has no
+        // logon for the account yet.  The agent can't run the command with
+        // the caller's environment, and a --net-only logon isn't worth
+        // keeping, so those always log on normally, as does -k.
+        if (dwLogonCache && !fResetTimestamp && !fPreserveEnv && !fNetOnly)
         {
-            WCHAR szPrompt[1024];
-            szPrompt[0] = '\0';
+            LPWSTR pszParameters = BuildParameters(nullptr, pszDir, pszLine, fElevated, &forward);
+            if (!pszParameters)
+                ExitFailure(GetLastError());
+
+            LogonAgentRequest req = {};
+            req.dwPID = GetCurrentProcessId();
+            req.dwFlags = fBackground ? LOGON_FLAG_BACKGROUND : 0;
+            req.pszAccount = pszUser;
+            req.pszDir = pszDir;
+            req.pszParameters = pszParameters;
+
+            DWORD dwExit = 0;
+            TraceSpan span("logon agent request");
+            LogonAgentResult result = LogonAgentSendRequest(req, dwExit);
+            if (result == LogonAgentResult::Unavailable)
+            {
+                const bool fSpawned = LogonAgentSpawn(pszFile, dwLogonCache);
+                if (fDebug)
+                    OutText(fSpawned ? "LOGON AGENT STARTED\r\n" : "LOGON AGENT FAILED TO START\r\n");
+                if (fSpawned)
+                    result = LogonAgentSendRequest(req, dwExit);
+            }
+            span.End();
 
-            if (!pszPrompt)
+            if (result == LogonAgentResult::NeedsPassword)
             {
-                const DWORD len = GetEnvironmentVariableW(L"SUDO_PROMPT", szPrompt, _countof(szPrompt));
-                if (len && len < _countof(szPrompt))
-                    pszPrompt = szPrompt;
+                if (fDebug)
+                    OutText("LOGON AGENT NEEDS PASSWORD\r\n");
+
+                TraceSpan spanPrompt("password prompt");
+                PrintPrompt(prompt, identities, fStd);
+                if (!InputPassword(password, fStd))
+                    ExitFailure(GetLastError());
+                OutText("\r\n", fStd);
+                fHavePassword = true;
+                spanPrompt.End();
+
+                TraceSpan spanLogon("logon agent logon");
+                req.pszPassword = password.Wide();
+                result = LogonAgentSendRequest(req, dwExit);
+                req.pszPassword = nullptr;
             }
 
-            if (!pszPrompt)
-                pszPrompt = L"[sudo] Enter password for %p: ";
+            switch (result)
+            {
+            case LogonAgentResult::Launched:
+                if (fDebug)
+                    OutText("LOGON AGENT LAUNCHED COMMAND\r\n");
+                password.Clear();
+                s_audit.via = "logon-cache";
+                WriteAuditRecord(dwExit, 0);
+                return dwExit;
+            case LogonAgentResult::Failed:
+                ExitFailure(GetLastError());
+                return -1;
+            default:
+                if (fDebug)
+                    OutText("LOGON AGENT UNAVAILABLE\r\n");
+                break;
+            }
+        }
 
-            PrintPrompt(pszPrompt, pszUser, fStd);
+        if (!fHavePassword)
+        {
+            TraceSpan span("password prompt");
+            PrintPrompt(prompt, identities, fStd);
 
-            InputPassword(szPassword, _countof(szPassword), fStd);
+            if (!InputPassword(password, fStd))
+                ExitFailure(GetLastError());
             OutText("\r\n", fStd);
-            TrimString(szPassword, false/*spaces*/);
-
-            WCHAR* pszSep = wcschr(pszUser, '\\');
-            if (pszSep)
-            {
-                pszDomain = pszUser;
-                *(pszSep++) = '\0';
-                pszUser = pszSep;
-                while (*pszUser == '\\')
-                    ++pszUser;
-            }
         }
 
-        STARTUPINFO si = { sizeof(si) };
-        si.dwFlags = STARTF_USESTDHANDLES;
-        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-        si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        WCHAR* pszSep = wcschr(pszUser, '\\');
+        if (pszSep)
+        {
+            pszDomain = pszUser;
+            *(pszSep++) = '\0';
+            pszUser = pszSep;
+            while (*pszUser == '\\')
+                ++pszUser;
+        }
 
-        PROCESS_INFORMATION pi = {};
-        LPWSTR pszCmdLine = BuildParameters(szFile, pszDir, pszLine, fElevated);
+        LPWSTR pszCmdLine = BuildParameters(pszFile, pszDir, pszLine, fElevated, &forward);
+        if (!pszCmdLine)
+            ExitFailure(GetLastError());
 
         if (fDebug)
         {
@@ -862,7 +2785,7 @@ main(int argc, const char** argv)
                 OutText("DOMAIN='"); OutText(pszDomain); OutText("'\r\n");
             }
             OutText("PASSWORD='*****'\r\n");
-            OutText("FILE='"); OutText(szFile); OutText("'\r\n");
+            OutText("FILE='"); OutText(pszFile); OutText("'\r\n");
             OutText("CMDLINE='"); OutText(pszCmdLine); OutText("'\r\n");
             if (pszDir)
             {
@@ -870,50 +2793,223 @@ main(int argc, const char** argv)
             }
         }
 
-        const DWORD dwLogon = fNetOnly ? LOGON_NETCREDENTIALS_ONLY : LOGON_WITH_PROFILE;
-        if (!CreateProcessWithLogonW(pszUser, pszDomain, szPassword, dwLogon,
-                                     szFile, pszCmdLine, CREATE_NO_WINDOW,
-                                     nullptr, pszDir, &si, &pi))
+        s_audit.via = "logon";
+        SpawnOptions spawn = {};
+        spawn.program = pszFile;
+        spawn.command_line = pszCmdLine;
+        spawn.dir = pszDir;
+
+        // With -E the sudo that runs as the user starts with the caller's
+        // environment, and the command inherits it from there.
+        LPWCH pEnvironment = fPreserveEnv ? GetEnvironmentStringsW() : nullptr;
+        spawn.environment = pEnvironment;
+
+        PlatformProcess process = {};
+        TraceSpan span("CreateProcessWithLogonW");
+        const bool ok = PlatformSpawnAsUser(spawn, pszUser, pszDomain, password.Wide(), fNetOnly,
+                                            s_arena, process);
+        const DWORD err = GetLastError();
+        password.Clear();
+        if (pEnvironment)
+            FreeEnvironmentStringsW(pEnvironment);
+        span.End();
+        if (!ok)
         {
-            ExitFailure(GetLastError());
+            ExitFailure(err);
             return -1;
         }
 
-        hProcess = pi.hProcess;
+        hProcess = process.handle;
     }
     else
     {
-        CoInitializeEx(NULL, COINIT_APARTMENTTHREADED|COINIT_DISABLE_OLE1DDE);
+        // With -b, the command gets a job first, so that its exit code can be
+        // collected later.  A batch's commands don't get jobs.
+        if (fBackground && !pszBatch)
+            s_job.Add(pszLine);
+
+        // Use an elevated broker if one is already running for this session.
+        // Otherwise elevate normally, and the elevated sudo starts a broker
+        // for later invocations if a broker timeout was requested.  The
+        // broker cannot report --stats, record --log-output, apply the
+        // scheduling and resource controls, enforce --timeout, or run with
+        // the caller's environment, so those always elevate normally.
+        ElevationQueue* pQueue = nullptr;
+        if (dwBrokerTimeout && !pszBatch && !fStats && !pszLogOutput && !controls.Any() && !msTimeout && !fPreserveEnv)
+        {
+            DWORD dwFlags = 0;
+            if (fBackground)
+                dwFlags |= BROKER_FLAG_BACKGROUND;
+            if (fDebug)
+                dwFlags |= BROKER_FLAG_DEBUG;
+            if (execMode == ExecMode::Direct)
+                dwFlags |= BROKER_FLAG_DIRECT;
+            if (execMode == ExecMode::Shell)
+                dwFlags |= BROKER_FLAG_SHELL;
+
+            const BrokerRequest req = { GetCurrentProcessId(), dwFlags, pszDir, pszLine, s_job.Id(), s_job.Section() };
+            DWORD dwExit = 0;
+            TraceSpan span("broker request");
+            BrokerResult result = BrokerSendRequest(req, dwExit);
+            span.End();
+
+            // Without a broker yet, sudo invocations that start at about the
+            // same time line up:  the first one elevates (and starts the
+            // broker), and the rest wait for it and then send their requests
+            // in the order they arrived.  If the broker turns out to be gone,
+            // line up once more.
+            if (result == BrokerResult::Unavailable)
+                pQueue = BrokerOpenQueue();
+            bool fLeader = false;
+            for (unsigned cTries = 0; cTries < 2 && pQueue && result == BrokerResult::Unavailable; ++cTries)
+            {
+                TraceSpan spanQueue("wait for elevation in progress");
+                unsigned error = 0;
+                const QueueOutcome outcome = ((pQueue->Join() == QueueRole::Leader) ?
+                                              QueueOutcome::Leader : pQueue->WaitForLeader(error));
+                if (outcome == QueueOutcome::Leader)
+                {
+                    fLeader = true;
+                    break;
+                }
+                if (outcome == QueueOutcome::Failed)
+                {
+                    pQueue->Leave();
+                    if (error)
+                        ExitFailure(error);
+                    pQueue = nullptr;
+                    break;
+                }
+
+                if (fDebug)
+                    OutText("QUEUED BEHIND ANOTHER ELEVATION\r\n");
+                pQueue->WaitTurn();
+                result = BrokerSendRequest(req, dwExit, LeaveQueue, pQueue);
+                if (result == BrokerResult::Unavailable)
+                    pQueue->Stale();
+                pQueue->Leave();
+            }
+            if (!fLeader)
+                pQueue = nullptr;
+
+            switch (result)
+            {
+            case BrokerResult::Launched:
+                if (fDebug)
+                    OutText("BROKER LAUNCHED COMMAND\r\n");
+                s_audit.via = "broker";
+                WriteJobId();
+                WriteAuditRecord(dwExit, 0);
+                return dwExit;
+            case BrokerResult::Failed:
+                ExitFailure(GetLastError());
+                return -1;
+            default:
+                if (fDebug)
+                    OutText("BROKER UNAVAILABLE\r\n");
+                break;
+            }
+        }
 
-        // Must use SW_HIDE so that FreeConsole() and AttachConsole() can work.
-        SHELLEXECUTEINFO sei = {};
-        sei.cbSize = sizeof(sei);
-        sei.hwnd = NULL;
-        sei.fMask = SEE_MASK_NOASYNC|SEE_MASK_NOCLOSEPROCESS|(fNOUI ? SEE_MASK_FLAG_NO_UI : 0);
-        sei.lpVerb = L"runas";
-        sei.lpFile = szFile;
-        sei.lpParameters = BuildParameters(nullptr, pszDir, pszLine, fElevated);
-        sei.lpDirectory = pszDir;
-        sei.nShow = SW_HIDE;
+        // Hand the request off in a section, so the elevated sudo's command
+        // line only says where to find it.
+        HandoffRequest req = {};
+        req.flags = ((fBackground ? HANDOFF_FLAG_BACKGROUND : 0) |
+                     (fDebug ? HANDOFF_FLAG_DEBUG : 0) |
+                     (execMode == ExecMode::Direct ? HANDOFF_FLAG_DIRECT : 0) |
+                     (execMode == ExecMode::Shell ? HANDOFF_FLAG_SHELL : 0) |
+                     (fStats ? (statsFormat == StatsFormat::Json ? HANDOFF_FLAG_STATS_JSON : HANDOFF_FLAG_STATS) : 0) |
+                     (fPreserveEnv ? HANDOFF_FLAG_PRESERVE_ENV : 0));
+        req.jobs = cJobs;
+        req.broker_timeout = dwBrokerTimeout;
+        req.job = s_job.Id();
+        req.job_table = s_job.Section();
+        req.strings[HANDOFF_DIR] = pszDir;
+        req.strings[HANDOFF_LINE] = pszLine;
+        req.trace = ULONGLONG(ULONG_PTR(s_hTraceFile));
+        req.audit_log = ULONGLONG(ULONG_PTR(s_hAuditLog));
+        req.log_output = ULONGLONG(ULONG_PTR(s_hLogOutput));
+        req.strings[HANDOFF_BATCH] = pszBatch;
+        req.strings[HANDOFF_BATCH_TEXT] = pszBatchText;
+        req.strings[HANDOFF_CONTROLS] = pszControls;
+        req.strings[HANDOFF_TIMEOUT] = pszTimeout;
+        req.strings[HANDOFF_KILL_AFTER] = pszKillAfter;
+
+        RequestHandoff handoff;
+        LPWCH pEnvironment = fPreserveEnv ? GetEnvironmentStringsW() : nullptr;
+        req.strings[HANDOFF_ENVIRONMENT] = pEnvironment;
+        TraceSpan spanHandoff("publish request");
+        const bool fPublished = handoff.Publish(req);
+        const DWORD errPublish = GetLastError();
+        const size_t cbRequest = HandoffImageSize(req);
+        req.strings[HANDOFF_ENVIRONMENT] = nullptr;
+        if (pEnvironment)
+            FreeEnvironmentStringsW(pEnvironment);
+        spanHandoff.End();
+        if (!fPublished)
+            ExitFailure(errPublish);
+
+        WCHAR szNonce[32];
+        swprintf_s(szNonce, _countof(szNonce), L"%016llx", req.nonce);
+        CommandLineBuilder args;
+        args.Arg(L"--elevated");
+        args.Arg(unsigned(GetCurrentProcessId()));
+        args.Arg(L"--request");
+        args.Arg(szNonce);
+        LPWSTR pszParameters = AllocString(args.Length() + 1);
+        if (!pszParameters || !args.Emit(pszParameters))
+            ExitFailure(ERROR_OUTOFMEMORY);
 
         if (fDebug)
         {
+            char szSize[64];
+            sprintf(szSize, "%u BYTES\r\n", unsigned(cbRequest));
+            OutText("REQUEST="); OutText(szSize);
             OutText("ShellExecuteEx:\r\n");
-            OutText("FILE='"); OutText(szFile); OutText("'\r\n");
-            OutText("PARAMETERS='"); OutText(sei.lpParameters); OutText("'\r\n");
+            OutText("FILE='"); OutText(pszFile); OutText("'\r\n");
+            OutText("PARAMETERS='"); OutText(pszParameters); OutText("'\r\n");
             if (pszDir)
             {
                 OutText("DIR='"); OutText(pszDir); OutText("'\r\n");
             }
         }
 
-        if (!ShellExecuteEx(&sei))
+        s_audit.via = "runas";
+        TraceSpan span("ShellExecuteEx (includes consent UI)");
+        PlatformProcess process = {};
+        const bool ok = PlatformElevate(pszFile, pszParameters, pszDir, fNOUI, s_arena, process);
+        const DWORD errElevate = GetLastError();
+        span.End();
+        if (!ok)
         {
-            ExitFailure(GetLastError());
+            // If consent was declined, the queued sudo invocations fail the
+            // same way instead of asking again.
+            if (pQueue)
+            {
+                pQueue->Publish(false, errElevate);
+                pQueue->Leave();
+            }
+            ExitFailure(errElevate);
             return -1;
         }
 
-        hProcess = sei.hProcess;
+        // The section has to outlive this process until the elevated sudo
+        // has its copy, even with -b.
+        handoff.WaitUntilAccepted(process.handle);
+        hProcess = process.handle;
+        WriteJobId();
+
+        // Let the queued sudo invocations use the broker the elevated sudo
+        // starts; if it doesn't come up, they elevate on their own.
+        if (pQueue)
+        {
+            TraceSpan spanBroker("wait for broker");
+            const bool fReady = BrokerWaitReady(process.handle, 10 * 1000);
+            if (fDebug)
+                OutText(fReady ? "BROKER READY FOR QUEUED REQUESTS\r\n" : "BROKER NOT READY FOR QUEUED REQUESTS\r\n");
+            pQueue->Publish(fReady, 0);
+            pQueue->Leave();
+        }
     }
 
     // Return the exit code.
@@ -925,8 +3021,49 @@ main(int argc, const char** argv)
     }
     else
     {
-        WaitForSingleObject(hProcess, INFINITE);
-        GetExitCodeProcess(hProcess, &dwExit);
+        TraceSpan span("wait for command");
+        PlatformProcess process = { hProcess };
+        unsigned exit_code = 0;
+        if (fElevated && msTimeout)
+        {
+            process.pid = int(GetProcessId(hProcess));
+            WatchedCommand command = { process, pJob };
+            ForwardCtrlC forward(&command.process);
+            const WatchdogOps ops = { WatchdogWaitCommand, WatchdogInterruptCommand, WatchdogKillCommand, &command };
+            const WatchdogResult result = RunWatchdog(ops, msTimeout, msKillAfter, exit_code);
+            if (result != WatchdogResult::Failed)
+                dwExit = exit_code;
+            if (fDebug && result == WatchdogResult::TimedOut)
+                OutText("TIMED OUT; the command stopped after Ctrl-Break.\r\n");
+            else if (fDebug && result == WatchdogResult::Killed)
+                OutText("TIMED OUT; terminated the command and its tree.\r\n");
+        }
+        else if (msTimeout)
+        {
+            ForwardCtrlC forward(nullptr);
+            if (PlatformWait(process, exit_code))
+                dwExit = exit_code;
+        }
+        else if (PlatformWait(process, exit_code))
+        {
+            dwExit = exit_code;
+        }
+        if (fReportStats)
+            job.WaitForTree();
+    }
+
+    recorder.Stop();
+    if (fReportStats)
+        ReportStats(job, statsFormat, dwExit);
+    WriteAuditRecord(dwExit, 0);
+
+    // With -b, the elevated sudo stays to record how the command ends, once
+    // it's done with the console.
+    if (fElevated && s_job.Id())
+    {
+        FlushOutput();
+        FreeConsole();
+        s_job.WaitForExit(hProcess);
     }
     return dwExit;
 }
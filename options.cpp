@@ -0,0 +1,458 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "options.h"
+#include "cmdline.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+enum : unsigned
+{
+    OPT_HIDDEN          = 0x01,     // Not listed in the usage text.
+    OPT_DEBUGHELP       = 0x02,     // Only listed in debug builds.
+};
+
+struct OptionDef
+{
+    OptionId            id;
+    const char*         shorts;     // Short flags (matched case-insensitively).
+    const char*         name;       // Long name (lowercase), or nullptr.
+    const char*         arg;        // Value name, or nullptr if no value.
+    unsigned            flags;
+    const char*         help;       // Lines are separated by \n.
+};
+
+// The order here is the order in the usage text.
+static constexpr OptionDef c_options[] =
+{
+    { OptionId::Help,           "?h",   "help",             nullptr,    0,
+        "Display a short help message and exit." },
+    { OptionId::Background,     "b",    "background",       nullptr,    0,
+        "Run the command in the background.  Interactive\n"
+        "commands will likely fail to work properly when\n"
+        "run in the background." },
+    { OptionId::ChDir,          "D",    "chdir",            "dir",      0,
+        "Run the command in the specified directory." },
+    { OptionId::PreserveEnv,    "E",    "preserve-env",     nullptr,    0,
+        "Run the command with the caller's environment\n"
+        "variables, instead of the elevated environment." },
+    { OptionId::Jobs,           "j",    nullptr,            "n",        0,
+        "Run up to n batch commands at the same time." },
+    { OptionId::ResetTimestamp, "k",    "reset-timestamp",  nullptr,    0,
+        "Without a command, forget the cached -u logons.\n"
+        "With a command, ask for the password instead of\n"
+        "using the cache." },
+    { OptionId::NonInteractive, "n",    "non-interactive",  nullptr,    0,
+        "Avoid showing any UI." },
+    { OptionId::Prompt,         "p",    "prompt",           "text",     0,
+        "Use a custom password prompt." },
+    { OptionId::Stdin,          "S",    "stdin",            nullptr,    0,
+        "Write the prompt to stderr and read the password\n"
+        "from stdin instead of using the console." },
+    { OptionId::User,           "u",    "user",             "user",     0,
+        "Run the command as the specified user." },
+    { OptionId::Version,        "V",    "version",          nullptr,    0,
+        "Print the sudo version string." },
+    { OptionId::Affinity,       "",     "affinity",         "cpus",     0,
+        "Run the command and everything it starts only on\n"
+        "the given CPUs:  a mask (like 0x0f) or a list\n"
+        "(like 0,2-3)." },
+    { OptionId::Batch,          "",     "batch",            "file",     0,
+        "Run each line in file as a separate command, all\n"
+        "with a single elevation.  Use - to read the lines\n"
+        "from stdin.  Reports each command's exit code, and\n"
+        "exits with the first nonzero exit code, if any." },
+    { OptionId::Broker,         "",     "broker",           "secs",     0,
+        "Keep an elevated broker running until it has been\n"
+        "idle for secs seconds, so later sudo commands in\n"
+        "the same console session can run without another\n"
+        "elevation prompt." },
+#ifdef INCLUDE_NET_ONLY
+    { OptionId::NetOnly,        "",     "net-only",         nullptr,    0,
+        "Use the credentials only on the network." },
+#endif
+    { OptionId::CpuRate,        "",     "cpu-rate",         "percent",  0,
+        "Cap the CPU time used by the command and\n"
+        "everything it starts at percent of all CPUs." },
+    { OptionId::Direct,         "",     "direct",           nullptr,    0,
+        "Run the program directly, without CMD, even if\n"
+        "the command line looks like it needs CMD." },
+    { OptionId::IoPriority,     "",     "io-priority",      "level",    0,
+        "Run the command at an I/O priority:  very-low,\n"
+        "low, or normal." },
+    { OptionId::ListJobs,       "",     "jobs",             nullptr,    0,
+        "List the commands run with -b:  whether each is\n"
+        "still running, or how it ended." },
+    { OptionId::KillAfter,      "",     "kill-after",       "duration", 0,
+        "With --timeout, terminate the command and\n"
+        "everything it started if it is still running\n"
+        "duration after it was asked to stop." },
+    { OptionId::LogOutput,      "",     "log-output",       "file",     0,
+        "Record the command's input and output to file,\n"
+        "for playback with sudoreplay.  The command's std\n"
+        "handles are pipes instead of the console while it\n"
+        "is recorded.  Ignored with -b." },
+    { OptionId::LogonCache,     "",     "logon-cache",      "secs",     0,
+        "With -u, keep the logon (and the user's loaded\n"
+        "profile) until it has been unused for secs\n"
+        "seconds, so later -u commands in the same console\n"
+        "session don't ask for the password again." },
+    { OptionId::MaxMemory,      "",     "max-memory",       "size",     0,
+        "Limit the memory committed by the command and\n"
+        "everything it starts, in bytes or with a K, M, or\n"
+        "G suffix." },
+    { OptionId::Priority,       "",     "priority",         "level",    0,
+        "Run the command and everything it starts at a\n"
+        "scheduling priority:  idle, below-normal, normal,\n"
+        "above-normal, or high." },
+    { OptionId::RemoveTimestamp, "",    "remove-timestamp", nullptr,    0,
+        "Forget the cached -u logons and stop the logon\n"
+        "agent.  Cannot be used with a command." },
+    { OptionId::Shell,          "",     "shell",            nullptr,    0,
+        "Always run the command line with CMD." },
+    { OptionId::Stats,          "",     "stats",            nullptr,    0,
+        "After the command exits, report the time, memory,\n"
+        "and I/O used by it and every process it started." },
+    { OptionId::StatsJson,      "",     "stats-json",       nullptr,    0,
+        "Like --stats, but report in JSON format." },
+    { OptionId::JobStatus,      "",     "status",           "id",       0,
+        "Show whether the -b job id is still running, or\n"
+        "how it ended." },
+    { OptionId::Timeout,        "",     "timeout",          "duration", 0,
+        "Ask the command to stop (with Ctrl-Break) if it\n"
+        "runs longer than duration, such as 90, 1.5m, or\n"
+        "2h, and then exit with 124." },
+    { OptionId::Trace,          "",     "trace",            "file",     0,
+        "Write the time spent in each phase of sudo to\n"
+        "file, as a Chrome trace (for chrome://tracing or\n"
+        "Perfetto)." },
+    { OptionId::WaitJobs,       "",     "wait",             "id",       0,
+        "Wait for the -b job id to end, or for every job\n"
+        "with all, and exit with its exit code (or the\n"
+        "first nonzero one)." },
+    { OptionId::Debug,          "",     "debug",            nullptr,    OPT_DEBUGHELP,
+        "Display debugging info." },
+    { OptionId::None,           "",     "",                 nullptr,    0,
+        "Stop processing options in the command line." },
+
+    { OptionId::Elevated,       "",     "elevated",         "pid",      OPT_HIDDEN, nullptr },
+    { OptionId::BrokerServe,    "",     "broker-serve",     "secs",     OPT_HIDDEN, nullptr },
+    { OptionId::AuditLog,       "",     "audit-log",        "file",     OPT_HIDDEN, nullptr },
+    { OptionId::Controls,       "",     "controls",         "spec",     OPT_HIDDEN, nullptr },
+    { OptionId::Request,        "",     "request",          "nonce",    OPT_HIDDEN, nullptr },
+    { OptionId::LogonServe,     "",     "logon-serve",      "secs",     OPT_HIDDEN, nullptr },
+    { OptionId::LogonHost,      "",     "logon-host",       "spec",     OPT_HIDDEN, nullptr },
+};
+
+static constexpr size_t c_num_options = sizeof(c_options) / sizeof(c_options[0]);
+
+// Long names are looked up through a perfect hash (FNV-1a over the lowercase
+// name).  If adding an option makes names collide, the static_assert below
+// fires; pick another seed.  Only the seed's low bits reach the index, so
+// if no seed works, double the size.
+static constexpr unsigned c_hash_seed = 2166136275u;
+static constexpr unsigned c_hash_size = 256;
+
+static constexpr unsigned
+ToLower(unsigned c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static constexpr unsigned
+ToUpper(unsigned c)
+{
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static constexpr unsigned
+HashStep(unsigned h, unsigned c)
+{
+    return (h ^ c) * 16777619u;
+}
+
+struct OptionIndex
+{
+    unsigned char       shorts[128] = {};
+    unsigned char       longs[c_hash_size] = {};
+    bool                ok = true;
+};
+
+static constexpr OptionIndex
+BuildOptionIndex()
+{
+    OptionIndex index {};
+    for (size_t i = 0; i < c_num_options; ++i)
+    {
+        const OptionDef& def = c_options[i];
+        for (const char* s = def.shorts; *s; ++s)
+        {
+            const unsigned lower = ToLower(*s);
+            const unsigned upper = ToUpper(*s);
+            if (lower >= 128 || index.shorts[lower] || index.shorts[upper])
+                index.ok = false;
+            else
+                index.shorts[lower] = index.shorts[upper] = static_cast<unsigned char>(i + 1);
+        }
+        if (def.name && *def.name)
+        {
+            unsigned h = c_hash_seed;
+            for (const char* s = def.name; *s; ++s)
+                h = HashStep(h, ToLower(*s));
+            h &= c_hash_size - 1;
+            if (index.longs[h])
+                index.ok = false;
+            else
+                index.longs[h] = static_cast<unsigned char>(i + 1);
+        }
+    }
+    return index;
+}
+
+static constexpr OptionIndex c_index = BuildOptionIndex();
+static_assert(c_num_options < 256, "Too many options for the index.");
+static_assert(c_index.ok, "Option names collide; pick another c_hash_seed.");
+
+static const OptionDef*
+FindLong(const wchar_t* name, const wchar_t* end)
+{
+    unsigned h = c_hash_seed;
+    for (const wchar_t* p = name; p < end; ++p)
+    {
+        if (unsigned(*p) >= 128)
+            return nullptr;
+        h = HashStep(h, ToLower(*p));
+    }
+
+    const unsigned i = c_index.longs[h & (c_hash_size - 1)];
+    if (!i)
+        return nullptr;
+
+    const OptionDef* def = &c_options[i - 1];
+    const char* s = def->name;
+    for (const wchar_t* p = name; p < end; ++p, ++s)
+    {
+        if (!*s || ToLower(*p) != unsigned(*s))
+            return nullptr;
+    }
+    return *s ? nullptr : def;
+}
+
+static bool
+IsSpace(wchar_t c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static const wchar_t*
+SkipSpace(const wchar_t* p)
+{
+    while (IsSpace(*p))
+        ++p;
+    return p;
+}
+
+// Scans one argument, copying it (unquoted) to out if out is not null.
+// Returns the start of the following argument.
+static const wchar_t*
+ScanArg(const wchar_t* p, wchar_t*& out)
+{
+    return SkipSpace(ScanCommandArg(p, out));
+}
+
+OptionParser::OptionParser(const wchar_t* line, wchar_t* storage)
+: m_line(line)
+, m_storage(storage)
+{
+}
+
+size_t
+OptionParser::StorageNeeded(const wchar_t* line)
+{
+    // Each value is no longer than the text it came from, and each value's
+    // terminator is paid for by the option name that precedes it.
+    size_t len = 0;
+    while (line[len])
+        ++len;
+    return len + 1;
+}
+
+const wchar_t*
+OptionParser::SkipArg(const wchar_t* line)
+{
+    wchar_t* out = nullptr;
+    return SkipSpace(ScanProgramName(line, out));
+}
+
+const wchar_t*
+OptionParser::ReadValue(const wchar_t* p)
+{
+    m_value = m_storage;
+    p = ScanArg(p, m_storage);
+    *(m_storage++) = '\0';
+    return p;
+}
+
+OptionId
+OptionParser::Next()
+{
+    m_value = nullptr;
+
+    if (m_cluster)
+        return NextShort();
+
+    if (m_line[0] != '-')
+        return OptionId::None;
+
+    if (m_line[1] == '-')
+    {
+        const wchar_t* const name = m_line + 2;
+        const wchar_t* end = name;
+        while (*end && !IsSpace(*end) && *end != '=')
+            ++end;
+
+        if (end == name)
+        {
+            if (*end == '=')
+                return OptionId::Unknown;
+            m_line = SkipSpace(end);
+            return OptionId::None;
+        }
+
+        const OptionDef* def = FindLong(name, end);
+        if (!def)
+            return OptionId::Unknown;
+
+        if (def->arg)
+        {
+            if (*end == '=')
+                ++end;
+            m_line = ReadValue(SkipSpace(end));
+        }
+        else
+        {
+            if (*end == '=')
+                return OptionId::Unknown;
+            m_line = SkipSpace(end);
+        }
+        return def->id;
+    }
+
+    m_cluster = m_line + 1;
+    if (!*m_cluster || IsSpace(*m_cluster))
+    {
+        m_cluster = nullptr;
+        return OptionId::Unknown;
+    }
+    return NextShort();
+}
+
+// Short flags can be combined, as in -bn.  A flag that takes a value ends the
+// cluster, and the value can follow immediately, after =, or after spaces.
+OptionId
+OptionParser::NextShort()
+{
+    const wchar_t c = *(m_cluster++);
+    const unsigned i = (unsigned(c) < 128) ? c_index.shorts[c] : 0;
+    if (!i)
+    {
+        m_cluster = nullptr;
+        return OptionId::Unknown;
+    }
+
+    const OptionDef& def = c_options[i - 1];
+    if (def.arg)
+    {
+        const wchar_t* p = m_cluster;
+        if (*p == '=')
+            ++p;
+        m_line = ReadValue(SkipSpace(p));
+        m_cluster = nullptr;
+    }
+    else if (!*m_cluster || IsSpace(*m_cluster))
+    {
+        m_line = SkipSpace(m_cluster);
+        m_cluster = nullptr;
+    }
+    return def.id;
+}
+
+static void
+Append(char* line, size_t& len, size_t max, const char* text)
+{
+    while (*text && len + 1 < max)
+        line[len++] = *(text++);
+    line[len] = '\0';
+}
+
+void
+GenerateOptionsUsage(UsageWriter write, void* context)
+{
+    static const char c_indent[] = "                            ";
+    const size_t column = sizeof(c_indent) - 1;
+
+    for (const OptionDef& def : c_options)
+    {
+        if (def.flags & OPT_HIDDEN)
+            continue;
+#ifndef DEBUG
+        if (def.flags & OPT_DEBUGHELP)
+            continue;
+#endif
+
+        char line[128];
+        size_t len = 0;
+        Append(line, len, sizeof(line), "  ");
+
+        for (const char* s = def.shorts; *s; ++s)
+        {
+            const char flag[] = { '-', *s, '\0' };
+            if (s != def.shorts)
+                Append(line, len, sizeof(line), ", ");
+            Append(line, len, sizeof(line), flag);
+            if (def.arg)
+            {
+                Append(line, len, sizeof(line), " ");
+                Append(line, len, sizeof(line), def.arg);
+            }
+        }
+
+        if (def.name)
+        {
+            if (*def.shorts)
+                Append(line, len, sizeof(line), ", ");
+            Append(line, len, sizeof(line), "--");
+            Append(line, len, sizeof(line), def.name);
+            if (def.arg)
+            {
+                Append(line, len, sizeof(line), "=");
+                Append(line, len, sizeof(line), def.arg);
+            }
+        }
+
+        for (const char* help = def.help; *help;)
+        {
+            if (len >= column)
+            {
+                Append(line, len, sizeof(line), "\r\n");
+                write(line, context);
+                len = 0;
+            }
+            while (len < column)
+                line[len++] = ' ';
+            line[len] = '\0';
+
+            const char* end = help;
+            while (*end && *end != '\n')
+                ++end;
+            while (help < end && len + 1 < sizeof(line))
+                line[len++] = *(help++);
+            line[len] = '\0';
+            if (*help == '\n')
+                ++help;
+        }
+
+        Append(line, len, sizeof(line), "\r\n");
+        write(line, context);
+    }
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// The options are described by a single compile-time table (see options.cpp),
+// which drives both the parser and the generated usage text.  The parser
+// makes one forward pass over the command line and never modifies it.
+
+enum class OptionId : unsigned char
+{
+    None,                       // End of options; the command line follows.
+    Unknown,                    // Unrecognized or malformed option.
+
+    Help,
+    Version,
+    Background,
+    ChDir,
+    PreserveEnv,
+    Jobs,
+    ResetTimestamp,
+    NonInteractive,
+    Prompt,
+    Stdin,
+    User,
+    Batch,
+    Broker,
+    NetOnly,
+    Direct,
+    LogOutput,
+    LogonCache,
+    Shell,
+    Stats,
+    StatsJson,
+    Trace,
+    Priority,
+    RemoveTimestamp,
+    IoPriority,
+    Affinity,
+    MaxMemory,
+    CpuRate,
+    Timeout,
+    KillAfter,
+    ListJobs,
+    JobStatus,
+    WaitJobs,
+    Debug,
+
+    // Internal options used between sudo processes; not listed in the help.
+    Elevated,
+    BrokerServe,
+    AuditLog,
+    Controls,
+    Request,
+    LogonServe,
+    LogonHost,
+};
+
+class OptionParser
+{
+public:
+    // The storage receives unquoted copies of option values, and must hold
+    // at least StorageNeeded(line) characters.
+                    OptionParser(const wchar_t* line, wchar_t* storage);
+
+    static size_t   StorageNeeded(const wchar_t* line);
+    static const wchar_t* SkipArg(const wchar_t* line);
+
+    // Returns the next option, with its value (if it takes one) available
+    // from Value() until the next call.  Returns OptionId::None when there
+    // are no more options; Remaining() then returns the command line.
+    OptionId        Next();
+    wchar_t*        Value() const { return m_value; }
+    const wchar_t*  Remaining() const { return m_line; }
+
+private:
+    OptionId        NextShort();
+    const wchar_t*  ReadValue(const wchar_t* p);
+
+    const wchar_t*  m_line;
+    const wchar_t*  m_cluster = nullptr;
+    wchar_t*        m_storage;
+    wchar_t*        m_value = nullptr;
+};
+
+// Generates the option list for the usage text, one line at a time (each
+// line ends with \r\n).
+typedef void (*UsageWriter)(const char* line, void* context);
+void GenerateOptionsUsage(UsageWriter write, void* context);
@@ -0,0 +1,522 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for the option parser and its perfect hash of long
+// option names.
+//
+// The checker parses a table of command lines (long and short options,
+// clusters, values after =, after spaces, or attached, quoted values, case,
+// --, and malformed options) and compares each option, value, and the
+// remaining command line.  It looks up every long name in any case, and
+// near misses of every name (one character changed, dropped, or added) and
+// made-up names that hash to the same slot as a real one, which must not
+// match.  It checks that the usage text lists no long option
+// this program doesn't know, and fuzzes the parser with random command lines,
+// checking that values stay within StorageNeeded().  The benchmark compares
+// the hash with a linear search over the names, and times parsing a typical
+// command line.
+//
+//      g++ -std=c++17 -O2 optionsbench.cpp options.cpp cmdline.cpp -o optionsbench
+//      ./optionsbench [-n iterations] [-z iterations] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "options.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct LongName
+{
+    const wchar_t*      name;
+    OptionId            id;
+    bool                value;
+};
+
+// Every long option, including the internal ones.
+static const LongName c_names[] =
+{
+    { L"help",              OptionId::Help,             false },
+    { L"background",        OptionId::Background,       false },
+    { L"chdir",             OptionId::ChDir,            true },
+    { L"preserve-env",      OptionId::PreserveEnv,      false },
+    { L"reset-timestamp",   OptionId::ResetTimestamp,   false },
+    { L"non-interactive",   OptionId::NonInteractive,   false },
+    { L"prompt",            OptionId::Prompt,           true },
+    { L"stdin",             OptionId::Stdin,            false },
+    { L"user",              OptionId::User,             true },
+    { L"version",           OptionId::Version,          false },
+    { L"affinity",          OptionId::Affinity,         true },
+    { L"batch",             OptionId::Batch,            true },
+    { L"broker",            OptionId::Broker,           true },
+#ifdef INCLUDE_NET_ONLY
+    { L"net-only",          OptionId::NetOnly,          false },
+#endif
+    { L"cpu-rate",          OptionId::CpuRate,          true },
+    { L"direct",            OptionId::Direct,           false },
+    { L"io-priority",       OptionId::IoPriority,       true },
+    { L"jobs",              OptionId::ListJobs,         false },
+    { L"kill-after",        OptionId::KillAfter,        true },
+    { L"log-output",        OptionId::LogOutput,        true },
+    { L"logon-cache",       OptionId::LogonCache,       true },
+    { L"max-memory",        OptionId::MaxMemory,        true },
+    { L"priority",          OptionId::Priority,         true },
+    { L"remove-timestamp",  OptionId::RemoveTimestamp,  false },
+    { L"shell",             OptionId::Shell,            false },
+    { L"stats",             OptionId::Stats,            false },
+    { L"stats-json",        OptionId::StatsJson,        false },
+    { L"status",            OptionId::JobStatus,        true },
+    { L"timeout",           OptionId::Timeout,          true },
+    { L"trace",             OptionId::Trace,            true },
+    { L"wait",              OptionId::WaitJobs,         true },
+    { L"debug",             OptionId::Debug,            false },
+    { L"elevated",          OptionId::Elevated,         true },
+    { L"broker-serve",      OptionId::BrokerServe,      true },
+    { L"audit-log",         OptionId::AuditLog,         true },
+    { L"controls",          OptionId::Controls,         true },
+    { L"request",           OptionId::Request,          true },
+    { L"logon-serve",       OptionId::LogonServe,       true },
+    { L"logon-host",        OptionId::LogonHost,        true },
+};
+
+//------------------------------------------------------------------------------
+// Table of command lines.
+
+struct Parsed
+{
+    OptionId            id;
+    const wchar_t*      value = nullptr;    // nullptr if the option takes none.
+};
+
+struct ParseCase
+{
+    const wchar_t*      line;
+    Parsed              options[5];
+    unsigned            count;      // Options before OptionId::None or Unknown.
+    bool                unknown;    // Ends with OptionId::Unknown.
+    const wchar_t*      remaining;  // Checked if it ends with OptionId::None.
+};
+
+static const ParseCase c_parse_cases[] =
+{
+    { L"cmd /c ver",                        {}, 0, false, L"cmd /c ver" },
+    { L"",                                  {}, 0, false, L"" },
+    { L"-b cmd",                            { { OptionId::Background } }, 1, false, L"cmd" },
+    { L"-B cmd",                            { { OptionId::Background } }, 1, false, L"cmd" },
+    { L"-bn  cmd",                          { { OptionId::Background }, { OptionId::NonInteractive } }, 2, false, L"cmd" },
+    { L"-bD C:\\x cmd",                     { { OptionId::Background }, { OptionId::ChDir, L"C:\\x" } }, 2, false, L"cmd" },
+    { L"-DC:\\x cmd",                       { { OptionId::ChDir, L"C:\\x" } }, 1, false, L"cmd" },
+    { L"-D=C:\\x cmd",                      { { OptionId::ChDir, L"C:\\x" } }, 1, false, L"cmd" },
+    { L"-D \"C:\\Program Files\" cmd",      { { OptionId::ChDir, L"C:\\Program Files" } }, 1, false, L"cmd" },
+    { L"-j4 --batch=list.txt",              { { OptionId::Jobs, L"4" }, { OptionId::Batch, L"list.txt" } }, 2, false, L"" },
+    { L"-? ",                               { { OptionId::Help } }, 1, false, L"" },
+    { L"-h",                                { { OptionId::Help } }, 1, false, L"" },
+    { L"--help",                            { { OptionId::Help } }, 1, false, L"" },
+    { L"--HELP",                            { { OptionId::Help } }, 1, false, L"" },
+    { L"--Stats-Json cmd",                  { { OptionId::StatsJson } }, 1, false, L"cmd" },
+    { L"--stats --stats-json cmd",          { { OptionId::Stats }, { OptionId::StatsJson } }, 2, false, L"cmd" },
+    { L"--user alice cmd",                  { { OptionId::User, L"alice" } }, 1, false, L"cmd" },
+    { L"--user=alice cmd",                  { { OptionId::User, L"alice" } }, 1, false, L"cmd" },
+    { L"--user= alice cmd",                 { { OptionId::User, L"alice" } }, 1, false, L"cmd" },
+    { L"--prompt=\"Password: \" cmd",       { { OptionId::Prompt, L"Password: " } }, 1, false, L"cmd" },
+    { L"--prompt \"a \\\"b\\\"\" cmd",      { { OptionId::Prompt, L"a \"b\"" } }, 1, false, L"cmd" },
+    { L"--timeout 90 --kill-after=5s x",    { { OptionId::Timeout, L"90" }, { OptionId::KillAfter, L"5s" } }, 2, false, L"x" },
+    { L"-- -b",                             {}, 0, false, L"-b" },
+    { L"-b -- --help",                      { { OptionId::Background } }, 1, false, L"--help" },
+    { L"--direct -- cmd",                   { { OptionId::Direct } }, 1, false, L"cmd" },
+    { L"cmd -b",                            {}, 0, false, L"cmd -b" },
+    { L"--bogus cmd",                       {}, 0, true, nullptr },
+    { L"--hel cmd",                         {}, 0, true, nullptr },
+    { L"--helpx cmd",                       {}, 0, true, nullptr },
+    { L"--help=yes cmd",                    {}, 0, true, nullptr },
+    { L"--=x cmd",                          {}, 0, true, nullptr },
+    { L"--h\u00e9lp cmd",                   {}, 0, true, nullptr },
+    { L"- cmd",                             {}, 0, true, nullptr },
+    { L"-",                                 {}, 0, true, nullptr },
+    { L"-x cmd",                            {}, 0, true, nullptr },
+    { L"-bx cmd",                           { { OptionId::Background } }, 1, true, nullptr },
+    { L"-b\u00e9 cmd",                      { { OptionId::Background } }, 1, true, nullptr },
+    { L"--jobs",                            { { OptionId::ListJobs } }, 1, false, L"" },
+    { L"--wait=all",                        { { OptionId::WaitJobs, L"all" } }, 1, false, L"" },
+    { L"-u",                                { { OptionId::User, L"" } }, 1, false, L"" },
+};
+
+static bool
+CheckParseCases()
+{
+    for (const ParseCase& c : c_parse_cases)
+    {
+        wchar_t* storage = static_cast<wchar_t*>(malloc(OptionParser::StorageNeeded(c.line) * sizeof(wchar_t)));
+        OptionParser parser(c.line, storage);
+        bool ok = true;
+        unsigned n = 0;
+        OptionId id;
+        while ((id = parser.Next()) != OptionId::None && id != OptionId::Unknown && ok)
+        {
+            const Parsed& want = c.options[n];
+            ok = (n < c.count && id == want.id &&
+                  (want.value ? (parser.Value() && !wcscmp(parser.Value(), want.value)) : !parser.Value()));
+            ++n;
+        }
+        ok = ok && n == c.count && (id == OptionId::Unknown) == c.unknown;
+        if (ok && !c.unknown)
+            ok = !wcscmp(parser.Remaining(), c.remaining);
+        if (!ok)
+            fprintf(stderr, "parsing \"%ls\" failed at option %u (remaining \"%ls\").\n", c.line, n, parser.Remaining());
+        free(storage);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Perfect hash.
+
+static OptionId
+ParseOne(const wchar_t* line, const wchar_t** value=nullptr)
+{
+    wchar_t storage[256];
+    OptionParser parser(line, storage);
+    const OptionId id = parser.Next();
+    if (value)
+        *value = parser.Value();
+    return id;
+}
+
+static bool
+CheckNames()
+{
+    wchar_t line[64];
+    for (const LongName& n : c_names)
+    {
+        // Exact, upper case, and mixed case.
+        for (unsigned variant = 0; variant < 3; ++variant)
+        {
+            wchar_t name[32];
+            wcscpy(name, n.name);
+            for (wchar_t* p = name; *p; ++p)
+            {
+                if (variant == 1 || (variant == 2 && (p - name) % 2))
+                    *p = wchar_t(towupper(*p));
+            }
+            swprintf(line, 64, n.value ? L"--%ls=v cmd" : L"--%ls cmd", name);
+            const wchar_t* value = nullptr;
+            if (ParseOne(line, &value) != n.id || (n.value != !!value))
+            {
+                fprintf(stderr, "\"%ls\" did not parse as its option.\n", line);
+                return false;
+            }
+        }
+
+        // Near misses never match:  each character changed, dropped, or
+        // doubled, and a character added at the end.
+        const size_t len = wcslen(n.name);
+        for (size_t i = 0; i <= len; ++i)
+        {
+            for (unsigned how = 0; how < 3; ++how)
+            {
+                if (i == len && how != 2)
+                    continue;
+                wchar_t miss[40];
+                size_t m = 0;
+                for (size_t j = 0; j < len; ++j)
+                {
+                    if (j == i && how == 0)
+                        miss[m++] = wchar_t(n.name[j] == 'z' ? 'y' : n.name[j] + 1);
+                    else if (j == i && how == 1)
+                        continue;
+                    else
+                        miss[m++] = n.name[j];
+                    if (j == i && how == 2)
+                        miss[m++] = n.name[j];
+                }
+                if (i == len && how == 2)
+                    miss[m++] = 'x';
+                miss[m] = '\0';
+
+                bool real = false;
+                for (const LongName& other : c_names)
+                    real = real || !wcscmp(other.name, miss);
+                if (real || !m)
+                    continue;
+
+                swprintf(line, 64, L"--%ls cmd", miss);
+                if (ParseOne(line) != OptionId::Unknown)
+                {
+                    fprintf(stderr, "\"%ls\" matched an option.\n", line);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Mirrors the hash in options.cpp, to make up names that land in the same
+// slot as a real one; only the check of the full name rejects those.
+static unsigned
+HashName(const wchar_t* name)
+{
+    unsigned h = 2166136275u;
+    for (const wchar_t* p = name; *p; ++p)
+        h = (h ^ unsigned(towlower(*p))) * 16777619u;
+    return h & 255;
+}
+
+static bool
+CheckCollisions()
+{
+    unsigned impostors = 0;
+    wchar_t line[64];
+    for (const LongName& n : c_names)
+    {
+        const unsigned slot = HashName(n.name);
+        const size_t len = wcslen(n.name);
+
+        // Two letters replacing the end of the name, or appended to it.
+        for (unsigned keep = 0; keep < 2; ++keep)
+        {
+            if (!keep && len < 3)
+                continue;
+            wchar_t impostor[40];
+            wcscpy(impostor, n.name);
+            const size_t at = keep ? len : len - 2;
+            impostor[at + 2] = '\0';
+            for (wchar_t a = 'a'; a <= 'z'; ++a)
+            {
+                for (wchar_t b = 'a'; b <= 'z'; ++b)
+                {
+                    impostor[at] = a;
+                    impostor[at + 1] = b;
+                    if (HashName(impostor) != slot || !wcscmp(impostor, n.name))
+                        continue;
+                    bool real = false;
+                    for (const LongName& other : c_names)
+                        real = real || !wcscmp(other.name, impostor);
+                    if (real)
+                        continue;
+
+                    ++impostors;
+                    swprintf(line, 64, L"--%ls cmd", impostor);
+                    if (ParseOne(line) != OptionId::Unknown)
+                    {
+                        fprintf(stderr, "\"%ls\" shares a slot with --%ls and matched an option.\n", line, n.name);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    if (!impostors)
+    {
+        fprintf(stderr, "found no names that collide with an option.\n");
+        return false;
+    }
+    return true;
+}
+
+static unsigned s_usage_unknown = 0;
+
+static void
+CheckUsageLine(const char* line, void* /*context*/)
+{
+    // Each listed long option must be one this program knows.
+    for (const char* p = strstr(line, "--"); p; p = strstr(p + 2, "--"))
+    {
+        const char* end = p + 2;
+        while ((*end >= 'a' && *end <= 'z') || *end == '-')
+            ++end;
+        if (end == p + 2)
+            continue;
+
+        bool known = false;
+        for (const LongName& n : c_names)
+        {
+            const size_t len = wcslen(n.name);
+            if (len != size_t(end - p - 2))
+                continue;
+            size_t i = 0;
+            while (i < len && wchar_t(p[2 + i]) == n.name[i])
+                ++i;
+            known = known || i == len;
+        }
+        if (!known)
+        {
+            fprintf(stderr, "the usage text lists %.*s, which this program doesn't know.\n", int(end - p), p);
+            ++s_usage_unknown;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Fuzzing.
+
+static bool
+Fuzz(unsigned iterations)
+{
+    static const wchar_t* const c_pieces[] =
+    {
+        L"-", L"--", L"=", L" ", L"\t", L"\"", L"\\", L"\\\"", L"b", L"D", L"u", L"x", L"?", L"\u00e9",
+        L"user", L"help", L"timeout", L"stats", L"--prompt", L"-bn", L"-D", L"cmd", L"a b",
+    };
+
+    wchar_t line[512];
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        size_t len = 0;
+        const unsigned pieces = Random(24);
+        for (unsigned i = 0; i < pieces; ++i)
+        {
+            const wchar_t* piece = c_pieces[Random(sizeof(c_pieces) / sizeof(c_pieces[0]))];
+            const size_t piece_len = wcslen(piece);
+            if (len + piece_len >= 511)
+                break;
+            wmemcpy(line + len, piece, piece_len);
+            len += piece_len;
+        }
+        line[len] = '\0';
+
+        // Values must fit in StorageNeeded(); a guard after it must survive.
+        const size_t need = OptionParser::StorageNeeded(line);
+        wchar_t* storage = static_cast<wchar_t*>(malloc((need + 8) * sizeof(wchar_t)));
+        wmemset(storage + need, 0xfffe, 8);
+        OptionParser parser(line, storage);
+        unsigned options = 0;
+        OptionId id;
+        while ((id = parser.Next()) != OptionId::None && id != OptionId::Unknown)
+        {
+            if (++options > len + 1)
+                break;
+        }
+
+        bool ok = options <= len + 1;
+        for (size_t i = 0; i < 8; ++i)
+            ok = ok && storage[need + i] == 0xfffe;
+        if (id == OptionId::None)
+            ok = ok && parser.Remaining() >= line && parser.Remaining() <= line + len;
+        free(storage);
+        if (!ok)
+        {
+            fprintf(stderr, "fuzzing \"%ls\" failed.\n", line);
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static OptionId
+FindLinear(const wchar_t* name, size_t len)
+{
+    for (const LongName& n : c_names)
+    {
+        if (wcslen(n.name) == len && !wcsncasecmp(n.name, name, len))
+            return n.id;
+    }
+    return OptionId::Unknown;
+}
+
+static void
+RunBench(unsigned iterations)
+{
+    // Look up each name, hashed through the parser and by a linear search.
+    wchar_t lines[sizeof(c_names) / sizeof(c_names[0])][40];
+    const unsigned count = sizeof(c_names) / sizeof(c_names[0]);
+    for (unsigned i = 0; i < count; ++i)
+        swprintf(lines[i], 40, L"--%ls", c_names[i].name);
+
+    unsigned matched = 0;
+    unsigned long long start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        for (unsigned i = 0; i < count; ++i)
+            matched += (ParseOne(lines[i]) != OptionId::Unknown);
+    }
+    const unsigned long long hash_us = NowMicroseconds() - start;
+
+    start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        for (unsigned i = 0; i < count; ++i)
+            matched += (FindLinear(lines[i] + 2, wcslen(lines[i] + 2)) != OptionId::Unknown);
+    }
+    const unsigned long long linear_us = NowMicroseconds() - start;
+
+    // A typical command line.
+    const wchar_t* const line = L"-b -D \"C:\\Users\\Me\\src\" --priority=below-normal --timeout 90 --stats cmd /c ver";
+    wchar_t storage[128];
+    unsigned options = 0;
+    start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        OptionParser parser(line, storage);
+        while (parser.Next() != OptionId::None)
+            ++options;
+    }
+    const unsigned long long parse_us = NowMicroseconds() - start;
+
+    const double lookups = double(iterations) * count;
+    printf("long name lookup:  hashed %.1f ns, linear %.1f ns (%u matched)\n",
+           hash_us * 1000.0 / lookups, linear_us * 1000.0 / lookups, matched);
+    printf("typical command line:  %.1f ns per parse (%u options)\n",
+           parse_us * 1000.0 / iterations, options / iterations);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned iterations = 200000;
+    unsigned fuzz = 100000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+            fuzz = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: optionsbench [-n iterations] [-z iterations] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!iterations)
+        return 1;
+
+    GenerateOptionsUsage(CheckUsageLine, nullptr);
+    if (s_usage_unknown || !CheckParseCases() || !CheckNames() || !CheckCollisions() || !Fuzz(fuzz))
+        return 1;
+    printf("checks passed (%zu parse cases, %zu long names, %u fuzzed lines).\n",
+           sizeof(c_parse_cases) / sizeof(c_parse_cases[0]), sizeof(c_names) / sizeof(c_names[0]), fuzz);
+
+    RunBench(iterations);
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "password.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const size_t c_block_size = 512;
+
+void
+SecretBuffer::Wipe(void* p, size_t cb)
+{
+    // The volatile pointer keeps the compiler from dropping the stores.
+    volatile char* v = static_cast<volatile char*>(p);
+    while (cb--)
+        *(v++) = 0;
+}
+
+bool
+SecretBuffer::Reserve(size_t cb)
+{
+    // Keep room for a wide terminator, so Wide() is always terminated.
+    const size_t need = cb + sizeof(wchar_t);
+    if (need <= m_capacity)
+        return true;
+
+    size_t capacity = m_capacity ? m_capacity : 64;
+    while (capacity < need)
+        capacity *= 2;
+
+    // Not realloc, because realloc could leave a copy behind unwiped.
+    char* p = static_cast<char*>(malloc(capacity));
+    if (!p)
+        return false;
+
+    memset(p, 0, capacity);
+    if (m_p)
+    {
+        memcpy(p, m_p, m_cb);
+        Wipe(m_p, m_capacity);
+        free(m_p);
+    }
+
+    m_p = p;
+    m_capacity = capacity;
+    return true;
+}
+
+bool
+SecretBuffer::Append(const void* p, size_t cb)
+{
+    if (!Reserve(m_cb + cb))
+        return false;
+    memcpy(m_p + m_cb, p, cb);
+    m_cb += cb;
+    return true;
+}
+
+bool
+SecretBuffer::Resize(size_t cb)
+{
+    // Bytes past the contents are always zero; that is what keeps Wide()
+    // terminated.
+    if (cb < m_cb)
+        Wipe(m_p + cb, m_cb - cb);
+    else if (!Reserve(cb))
+        return false;
+    m_cb = cb;
+    return true;
+}
+
+void
+SecretBuffer::Clear()
+{
+    if (m_p)
+    {
+        Wipe(m_p, m_capacity);
+        free(m_p);
+    }
+    m_p = nullptr;
+    m_cb = 0;
+    m_capacity = 0;
+}
+
+static size_t
+FindNewline(const char* p, size_t cb)
+{
+    const void* found = memchr(p, '\n', cb);
+    return found ? size_t(static_cast<const char*>(found) - p) : cb;
+}
+
+bool
+ReadSecretLine(const LineSource& source, SecretBuffer& line)
+{
+    line.Clear();
+
+    char block[c_block_size];
+    bool any = false;
+    bool done = false;
+    bool ok = true;
+
+    while (!done)
+    {
+        size_t cb = 0;
+        size_t take = 0;
+
+        if (source.peek && (cb = source.peek(block, sizeof(block), source.context)) > 0)
+        {
+            // Consume exactly through the newline, if the peeked bytes
+            // contain one.
+            take = FindNewline(block, cb);
+            done = (take < cb);
+            cb = source.read(block, take + done, source.context);
+            if (cb < take + done)
+            {
+                take = cb;
+                done = true;
+            }
+        }
+        else if (source.peek || (!source.unread && !source.line_oriented))
+        {
+            // Nothing to peek at yet (or no way to avoid reading too far),
+            // so block for a single byte.
+            cb = source.read(block, 1, source.context);
+            take = (cb && block[0] != '\n') ? cb : 0;
+            done = (take == 0);
+        }
+        else
+        {
+            cb = source.read(block, sizeof(block), source.context);
+            take = FindNewline(block, cb);
+            done = (take < cb || !cb);
+            if (take + 1 < cb && source.unread && !source.unread(cb - take - 1, source.context))
+                ok = false;
+        }
+
+        any = any || cb;
+        if (ok && !line.Append(block, take))
+            ok = false;
+        if (!ok)
+            break;
+    }
+
+    SecretBuffer::Wipe(block, sizeof(block));
+
+    if (!ok)
+    {
+        line.Clear();
+        return false;
+    }
+
+    // Drop the \r from a \r\n line ending.
+    if (line.Size() && line.Bytes()[line.Size() - 1] == '\r')
+        line.Resize(line.Size() - 1);
+
+    return any;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Holds a secret (e.g. a password).  The memory is wiped whenever it is
+// freed or reallocated, so no plaintext copies are left behind.
+class SecretBuffer
+{
+public:
+                    SecretBuffer() = default;
+                    ~SecretBuffer() { Clear(); }
+
+    bool            Append(const void* p, size_t cb);
+    bool            Reserve(size_t cb);
+    bool            Resize(size_t cb);      // New bytes are zero.
+    void            Clear();
+
+    char*           Bytes() const { return m_p; }
+    size_t          Size() const { return m_cb; }
+
+    // Views the contents as a wide string.  The buffer always keeps room for
+    // a wide terminator after the contents.
+    wchar_t*        Wide() const { return reinterpret_cast<wchar_t*>(m_p); }
+    size_t          WideLength() const { return m_cb / sizeof(wchar_t); }
+
+    static void     Wipe(void* p, size_t cb);
+
+private:
+    char*           m_p = nullptr;
+    size_t          m_cb = 0;
+    size_t          m_capacity = 0;
+
+                    SecretBuffer(const SecretBuffer&) = delete;
+    SecretBuffer&   operator=(const SecretBuffer&) = delete;
+};
+
+// Where a password line is read from.  Reading a block at a time must not
+// consume input past the end of the line, since the rest of stdin belongs to
+// the command being launched.  So a source either lets the reader look ahead
+// (peek), lets it give back what it read past the line (unread), or only
+// ever returns one line per read (line_oriented).  Otherwise the reader has
+// to read one byte at a time.
+struct LineSource
+{
+    // Reads up to cb bytes.  Returns the number of bytes read, or 0 at end of
+    // input or on error.
+    size_t          (*read)(void* p, size_t cb, void* context);
+
+    // Optional.  Copies up to cb bytes that are available without blocking,
+    // without consuming them.  Returns the number of bytes copied.
+    size_t          (*peek)(void* p, size_t cb, void* context);
+
+    // Optional.  Pushes back the last cb bytes read.  Returns false if that
+    // is not possible.
+    bool            (*unread)(size_t cb, void* context);
+
+    bool            line_oriented;
+    void*           context;
+};
+
+// Reads one line (without the line ending) from the source into line.
+// Returns false at end of input with nothing read, or if out of memory.
+bool ReadSecretLine(const LineSource& source, SecretBuffer& line);
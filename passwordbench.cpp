@@ -0,0 +1,406 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for reading a password line into a SecretBuffer.
+//
+// The checker feeds ReadSecretLine from each kind of source sudo uses (a
+// pipe that can be peeked, a file that can seek back, a console that returns
+// a line per read, and anything else, read a byte at a time).  It checks
+// that end of input is an error rather than an empty password, that an empty
+// line is an empty password, that \r\n is dropped, and that nothing past the
+// line is consumed.  It also checks that SecretBuffer keeps Wide()
+// terminated as it grows and shrinks, and that no block of memory that
+// held the secret is freed without being wiped:  free() is replaced here,
+// and it looks for the secret in every block before releasing it.  The
+// benchmark reports the reads per line and the time per line for each kind
+// of source.
+//
+//      g++ -std=c++17 -O2 passwordbench.cpp password.cpp -o passwordbench
+//      ./passwordbench [-n lines]
+//
+// The replacement allocator relies on glibc, so don't build it with ASan.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "password.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+//------------------------------------------------------------------------------
+// Allocator that checks secrets are wiped.  glibc lets a program replace
+// malloc, as long as it replaces all of the family.
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+
+static const char c_marker[] = "s3cr3t-passw0rd";
+
+static unsigned s_unwiped = 0;
+static unsigned s_frees = 0;
+
+static bool
+ContainsMarker(const void* p, size_t cb)
+{
+    const size_t len = sizeof(c_marker) - 1;
+    const char* bytes = static_cast<const char*>(p);
+    for (size_t i = 0; i + len <= cb; ++i)
+    {
+        if (bytes[i] == c_marker[0] && !memcmp(bytes + i, c_marker, len))
+            return true;
+    }
+    return false;
+}
+
+extern "C" void*
+malloc(size_t cb)
+{
+    return __libc_malloc(cb);
+}
+
+extern "C" void*
+calloc(size_t count, size_t cb)
+{
+    return __libc_calloc(count, cb);
+}
+
+extern "C" void*
+realloc(void* p, size_t cb)
+{
+    // SecretBuffer never reallocates, since that could leave a copy behind.
+    if (p && ContainsMarker(p, malloc_usable_size(p)))
+        ++s_unwiped;
+    return __libc_realloc(p, cb);
+}
+
+extern "C" void
+free(void* p)
+{
+    if (p)
+    {
+        ++s_frees;
+        if (ContainsMarker(p, malloc_usable_size(p)))
+            ++s_unwiped;
+    }
+    __libc_free(p);
+}
+
+//------------------------------------------------------------------------------
+// Sources.
+
+enum class SourceKind { Peek, Unread, LineOriented, Bytes, Count };
+
+static const char* const c_kind_names[] = { "pipe (peek)", "file (unread)", "console (line)", "other (bytes)" };
+
+struct Input
+{
+    const char*         data;
+    size_t              size;
+    size_t              pos;
+    unsigned            reads;
+    bool                fail;       // Reads fail instead of returning data.
+};
+
+static size_t
+ReadInput(void* p, size_t cb, void* context)
+{
+    Input* const in = static_cast<Input*>(context);
+    ++in->reads;
+    if (in->fail)
+        return 0;
+
+    size_t n = in->size - in->pos;
+    if (n > cb)
+        n = cb;
+    memcpy(p, in->data + in->pos, n);
+    in->pos += n;
+    return n;
+}
+
+// A console read returns at most one line.
+static size_t
+ReadLineInput(void* p, size_t cb, void* context)
+{
+    Input* const in = static_cast<Input*>(context);
+    const char* nl = static_cast<const char*>(memchr(in->data + in->pos, '\n', in->size - in->pos));
+    if (nl && size_t(nl + 1 - (in->data + in->pos)) < cb)
+        cb = size_t(nl + 1 - (in->data + in->pos));
+    return ReadInput(p, cb, context);
+}
+
+static size_t
+PeekInput(void* p, size_t cb, void* context)
+{
+    Input* const in = static_cast<Input*>(context);
+    size_t n = in->size - in->pos;
+    if (n > cb)
+        n = cb;
+    memcpy(p, in->data + in->pos, n);
+    return n;
+}
+
+static bool
+UnreadInput(size_t cb, void* context)
+{
+    Input* const in = static_cast<Input*>(context);
+    if (cb > in->pos)
+        return false;
+    in->pos -= cb;
+    return true;
+}
+
+static LineSource
+MakeSource(SourceKind kind, Input& in)
+{
+    LineSource source = { ReadInput, nullptr, nullptr, false, &in };
+    switch (kind)
+    {
+    case SourceKind::Peek:          source.peek = PeekInput; break;
+    case SourceKind::Unread:        source.unread = UnreadInput; break;
+    case SourceKind::LineOriented:  source.read = ReadLineInput; source.line_oriented = true; break;
+    default:                        break;
+    }
+    return source;
+}
+
+//------------------------------------------------------------------------------
+// Checks.
+
+struct LineCase
+{
+    const char*         name;
+    const char*         input;
+    bool                ok;         // What ReadSecretLine returns.
+    const char*         line;       // The line it reads.
+    const char*         rest;       // What is left unread.
+};
+
+static const LineCase c_cases[] =
+{
+    { "end of input",       "",                         false,  "",                 "" },
+    { "empty line",         "\n",                       true,   "",                 "" },
+    { "empty crlf line",    "\r\nrest",                 true,   "",                 "rest" },
+    { "line",               "hunter2\n",                true,   "hunter2",          "" },
+    { "crlf line",          "hunter2\r\ndir /s\r\n",    true,   "hunter2",          "dir /s\r\n" },
+    { "no line ending",     "hunter2",                  true,   "hunter2",          "" },
+    { "marker",             "s3cr3t-passw0rd\nmore",    true,   "s3cr3t-passw0rd",  "more" },
+    { "only cr",            "\r",                       true,   "",                 "" },
+};
+
+static bool
+CheckLines()
+{
+    for (unsigned k = 0; k < unsigned(SourceKind::Count); ++k)
+    {
+        for (const LineCase& c : c_cases)
+        {
+            Input in = { c.input, strlen(c.input), 0, 0, false };
+            const LineSource source = MakeSource(SourceKind(k), in);
+            SecretBuffer line;
+            const bool ok = ReadSecretLine(source, line);
+            const size_t len = strlen(c.line);
+            const char* const rest = c.input + in.pos;
+            if (ok != c.ok ||
+                line.Size() != len || (len && memcmp(line.Bytes(), c.line, len)) ||
+                strcmp(rest, c.rest))
+            {
+                fprintf(stderr, "%s, %s:  returned %d with %zu bytes, left \"%s\".\n",
+                        c_kind_names[k], c.name, ok, line.Size(), rest);
+                return false;
+            }
+        }
+
+        // A read error with nothing read is not an empty password either.
+        Input in = { "hunter2\n", 8, 0, 0, true };
+        const LineSource source = MakeSource(SourceKind(k), in);
+        SecretBuffer line;
+        if (ReadSecretLine(source, line))
+        {
+            fprintf(stderr, "%s:  a failed read returned a line.\n", c_kind_names[k]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+CheckLongLine()
+{
+    // Longer than a block, so it is read in pieces.
+    static char input[5000];
+    for (size_t i = 0; i < sizeof(input) - 8; ++i)
+        input[i] = char('a' + i % 26);
+    strcpy(input + sizeof(input) - 8, "\nnext\n");
+    const size_t len = sizeof(input) - 8;
+
+    for (unsigned k = 0; k < unsigned(SourceKind::Count); ++k)
+    {
+        Input in = { input, strlen(input), 0, 0, false };
+        const LineSource source = MakeSource(SourceKind(k), in);
+        SecretBuffer line;
+        if (!ReadSecretLine(source, line) || line.Size() != len || memcmp(line.Bytes(), input, len) ||
+            strcmp(input + in.pos, "next\n"))
+        {
+            fprintf(stderr, "%s:  long line read wrong.\n", c_kind_names[k]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The buffer keeps a wide terminator's worth of zeros after the contents.
+static bool
+IsWideTerminated(const SecretBuffer& buffer)
+{
+    for (size_t i = 0; i < sizeof(wchar_t); ++i)
+    {
+        if (buffer.Bytes()[buffer.Size() + i])
+            return false;
+    }
+    return true;
+}
+
+static bool
+CheckBuffer()
+{
+    const size_t marker_len = sizeof(c_marker) - 1;
+    const unsigned unwiped = s_unwiped;
+
+    {
+        // Grow one piece at a time, through several reallocations.
+        SecretBuffer buffer;
+        if (!buffer.Reserve(0) || !IsWideTerminated(buffer))
+        {
+            fprintf(stderr, "empty buffer is not terminated.\n");
+            return false;
+        }
+        for (unsigned i = 0; i < 200; ++i)
+        {
+            if (!buffer.Append(c_marker, marker_len) || buffer.Size() != (i + 1) * marker_len || !IsWideTerminated(buffer))
+            {
+                fprintf(stderr, "append %u failed.\n", i);
+                return false;
+            }
+        }
+
+        // Shrinking wipes what it drops, and growing again reads as zero.
+        buffer.Resize(3 * sizeof(wchar_t));
+        if (!IsWideTerminated(buffer) || ContainsMarker(buffer.Bytes() + buffer.Size(), 200 * marker_len - buffer.Size()))
+        {
+            fprintf(stderr, "shrinking left the secret behind.\n");
+            return false;
+        }
+        buffer.Resize(64);
+        for (size_t i = 3 * sizeof(wchar_t); i < 64; ++i)
+        {
+            if (buffer.Bytes()[i])
+            {
+                fprintf(stderr, "growing exposed old bytes.\n");
+                return false;
+            }
+        }
+    }
+
+    {
+        // Clear wipes, and the destructor wipes.
+        SecretBuffer buffer;
+        buffer.Append(c_marker, marker_len);
+        buffer.Clear();
+        buffer.Append(c_marker, marker_len);
+    }
+
+    char stack[64];
+    memcpy(stack, c_marker, marker_len);
+    SecretBuffer::Wipe(stack, sizeof(stack));
+    for (char c : stack)
+    {
+        if (c)
+        {
+            fprintf(stderr, "Wipe left bytes behind.\n");
+            return false;
+        }
+    }
+
+    if (s_unwiped != unwiped)
+    {
+        fprintf(stderr, "%u blocks holding the secret were freed without being wiped.\n", s_unwiped - unwiped);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+RunBench(unsigned lines)
+{
+    // A typical password line, followed by input for the command.
+    static const char c_line[] = "correct horse battery staple\r\n";
+    const size_t line_len = sizeof(c_line) - 1;
+    char* const input = static_cast<char*>(malloc(line_len * lines + 1));
+    for (unsigned i = 0; i < lines; ++i)
+        memcpy(input + i * line_len, c_line, line_len);
+    input[line_len * lines] = '\0';
+
+    printf("%-16s %12s %12s\n", "source", "reads/line", "ns/line");
+    for (unsigned k = 0; k < unsigned(SourceKind::Count); ++k)
+    {
+        Input in = { input, line_len * lines, 0, 0, false };
+        const LineSource source = MakeSource(SourceKind(k), in);
+        SecretBuffer line;
+        const unsigned long long start = NowMicroseconds();
+        for (unsigned i = 0; i < lines; ++i)
+            ReadSecretLine(source, line);
+        const unsigned long long elapsed = NowMicroseconds() - start;
+        printf("%-16s %12.1f %12.1f\n", c_kind_names[k], double(in.reads) / lines, elapsed * 1000.0 / lines);
+    }
+
+    free(input);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned lines = 200000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            lines = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: passwordbench [-n lines]\n");
+            return 1;
+        }
+    }
+
+    if (!lines)
+        return 1;
+
+    if (!CheckLines() || !CheckLongLine() || !CheckBuffer())
+        return 1;
+    if (s_unwiped)
+    {
+        fprintf(stderr, "%u blocks holding a password were freed without being wiped.\n", s_unwiped);
+        return 1;
+    }
+    printf("checks passed (%u frees checked for unwiped secrets).\n", s_frees);
+
+    RunBench(lines);
+    return 0;
+}
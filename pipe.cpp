@@ -0,0 +1,244 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <sddl.h>
+#include <stdlib.h>
+
+#include "pipe.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static volatile LONG s_cActive = 0;
+
+struct PipeClient
+{
+    HANDLE              hPipe;
+    const PipeServerOps* pOps;
+};
+
+LPWSTR
+GetUserSidString(HANDLE hProcess)
+{
+    HANDLE hToken;
+    if (!OpenProcessToken(hProcess, TOKEN_QUERY, &hToken))
+        return nullptr;
+
+    union
+    {
+        TOKEN_USER tu;
+        BYTE buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    } info;
+
+    DWORD dummy;
+    LPWSTR pszSid = nullptr;
+    if (GetTokenInformation(hToken, TokenUser, &info, sizeof(info), &dummy))
+        ConvertSidToStringSidW(info.tu.User.Sid, &pszSid);
+
+    CloseHandle(hToken);
+    return pszSid;
+}
+
+// Long paths can be up to 32767 characters.
+enum : DWORD { c_max_path = 32768 };
+
+LPWSTR
+GetModulePath()
+{
+    // GetModuleFileName doesn't report the length needed, so this grows the
+    // buffer until the path fits.
+    for (DWORD cch = 256; cch <= c_max_path; cch *= 2)
+    {
+        LPWSTR psz = static_cast<LPWSTR>(malloc(cch * sizeof(*psz)));
+        if (!psz)
+        {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return nullptr;
+        }
+        const DWORD len = GetModuleFileNameW(0, psz, cch);
+        if (len && len < cch)
+            return psz;
+        const DWORD err = GetLastError();
+        free(psz);
+        if (!len)
+        {
+            SetLastError(err);
+            return nullptr;
+        }
+    }
+    SetLastError(ERROR_FILENAME_EXCED_RANGE);
+    return nullptr;
+}
+
+bool
+IsSudoProcess(HANDLE hProcess)
+{
+    LPWSTR pszModule = GetModulePath();
+    DWORD cchOther = c_max_path;
+    LPWSTR pszOther = static_cast<LPWSTR>(malloc(cchOther * sizeof(*pszOther)));
+    const bool fSame = (pszModule && pszOther &&
+                        QueryFullProcessImageNameW(hProcess, 0, pszOther, &cchOther) &&
+                        CompareStringOrdinal(pszModule, -1, pszOther, -1, true) == CSTR_EQUAL);
+    free(pszModule);
+    free(pszOther);
+    return fSame;
+}
+
+bool
+TransferExact(HANDLE h, void* p, DWORD cb, bool fWrite)
+{
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEventW(nullptr, true, false, nullptr);
+    if (!ov.hEvent)
+        return false;
+
+    bool ok = true;
+    BYTE* pb = static_cast<BYTE*>(p);
+    while (ok && cb)
+    {
+        DWORD dw = 0;
+        ResetEvent(ov.hEvent);
+        ok = (fWrite ?
+              !!WriteFile(h, pb, cb, &dw, &ov) :
+              !!ReadFile(h, pb, cb, &dw, &ov));
+        if (!ok && GetLastError() == ERROR_IO_PENDING)
+            ok = !!GetOverlappedResult(h, &ov, &dw, true);
+        if (ok && !dw)
+        {
+            SetLastError(ERROR_BROKEN_PIPE);
+            ok = false;
+        }
+        pb += dw;
+        cb -= dw;
+    }
+
+    const DWORD err = GetLastError();
+    CloseHandle(ov.hEvent);
+    SetLastError(err);
+    return ok;
+}
+
+static DWORD WINAPI
+ServeClient(void* param)
+{
+    PipeClient* const pClient = static_cast<PipeClient*>(param);
+    pClient->pOps->serve(pClient->hPipe, pClient->pOps->context);
+
+    DisconnectNamedPipe(pClient->hPipe);
+    CloseHandle(pClient->hPipe);
+    free(pClient);
+
+    InterlockedDecrement(&s_cActive);
+    return 0;
+}
+
+bool
+ServePipe(LPCWSTR pszPipe, LPCWSTR pszSddl, const PipeServerOps& ops)
+{
+    PSECURITY_DESCRIPTOR psd = nullptr;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(pszSddl, SDDL_REVISION_1, &psd, nullptr))
+        return false;
+
+    HANDLE hEvent = CreateEventW(nullptr, true, false, nullptr);
+    if (!hEvent)
+    {
+        LocalFree(psd);
+        return false;
+    }
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), psd, false };
+    ULONGLONG ullIdleSince = GetTickCount64();
+    DWORD dwOpenMode = PIPE_ACCESS_DUPLEX|FILE_FLAG_OVERLAPPED|FILE_FLAG_FIRST_PIPE_INSTANCE;
+
+    while (true)
+    {
+        // If another server already owns the name, the first instance fails
+        // and this server simply exits.
+        HANDLE hPipe = CreateNamedPipeW(pszPipe, dwOpenMode,
+                                        PIPE_TYPE_BYTE|PIPE_READMODE_BYTE|PIPE_WAIT|PIPE_REJECT_REMOTE_CLIENTS,
+                                        PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, &sa);
+        if (hPipe == INVALID_HANDLE_VALUE)
+            break;
+        dwOpenMode &= ~FILE_FLAG_FIRST_PIPE_INSTANCE;
+
+        OVERLAPPED ov = {};
+        ov.hEvent = hEvent;
+        ResetEvent(hEvent);
+
+        bool fConnected = !!ConnectNamedPipe(hPipe, &ov);
+        bool fExpired = false;
+        if (!fConnected)
+        {
+            const DWORD err = GetLastError();
+            if (err == ERROR_PIPE_CONNECTED)
+            {
+                fConnected = true;
+            }
+            else if (err == ERROR_IO_PENDING)
+            {
+                while (true)
+                {
+                    DWORD dummy;
+                    if (WaitForSingleObject(hEvent, 1000) == WAIT_OBJECT_0)
+                    {
+                        fConnected = !!GetOverlappedResult(hPipe, &ov, &dummy, false);
+                        break;
+                    }
+
+                    if (s_cActive)
+                    {
+                        ullIdleSince = GetTickCount64();
+                    }
+                    else if (ops.idle(GetTickCount64() - ullIdleSince, ops.context))
+                    {
+                        CancelIo(hPipe);
+                        GetOverlappedResult(hPipe, &ov, &dummy, true);
+                        fExpired = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (fExpired)
+        {
+            CloseHandle(hPipe);
+            break;
+        }
+
+        if (!fConnected)
+        {
+            CloseHandle(hPipe);
+            continue;
+        }
+
+        PipeClient* pClient = static_cast<PipeClient*>(malloc(sizeof(*pClient)));
+        HANDLE hThread = nullptr;
+        InterlockedIncrement(&s_cActive);
+        if (pClient)
+        {
+            pClient->hPipe = hPipe;
+            pClient->pOps = &ops;
+            hThread = CreateThread(nullptr, 0, ServeClient, pClient, 0, nullptr);
+        }
+        if (hThread)
+        {
+            CloseHandle(hThread);
+        }
+        else
+        {
+            free(pClient);
+            CloseHandle(hPipe);
+            InterlockedDecrement(&s_cActive);
+        }
+        ullIdleSince = GetTickCount64();
+    }
+
+    // Let requests in progress finish before exiting.
+    while (s_cActive)
+        Sleep(100);
+
+    CloseHandle(hEvent);
+    LocalFree(psd);
+    return true;
+}
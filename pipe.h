@@ -0,0 +1,41 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// Named pipe plumbing shared by the broker and the logon agent.  Each is a
+// long lived sudo process that serves requests from later sudo processes,
+// one thread per client, until it decides it is idle.
+
+// Returns the user SID of a process as a string, or nullptr.  Free it with
+// LocalFree().
+LPWSTR GetUserSidString(HANDLE hProcess=GetCurrentProcess());
+
+// Returns the full path of this sudo.exe, however long it is, or nullptr
+// with the last error set.  Free it with free().
+LPWSTR GetModulePath();
+
+// Returns true if the process is running this same sudo.exe.
+bool IsSudoProcess(HANDLE hProcess);
+
+// Reads or writes exactly cb bytes on a pipe opened for overlapped I/O.
+bool TransferExact(HANDLE h, void* p, DWORD cb, bool fWrite);
+
+struct PipeServerOps
+{
+    // Serves one connected client, on its own thread.  The server
+    // disconnects and closes the pipe afterwards.
+    void                (*serve)(HANDLE hPipe, void* context);
+
+    // Called about once a second while no client is being served, with how
+    // long it has been since one was.  Returns true to stop serving.
+    bool                (*idle)(ULONGLONG ullIdleMs, void* context);
+
+    void*               context;
+};
+
+// Serves clients on the pipe, whose security is given as SDDL, until idle()
+// says to stop, and then waits for clients in progress.  If another server
+// already owns the name, returns at once.  Returns false if the pipe's
+// security can't be set up.
+bool ServePipe(LPCWSTR pszPipe, LPCWSTR pszSddl, const PipeServerOps& ops);
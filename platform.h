@@ -0,0 +1,153 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+class Arena;
+struct FileStamp;
+struct ProcessControls;
+struct ProcessStats;
+struct ProgramQuery;
+
+// The operating system services that launching a command needs:  standard
+// streams and the console, identities, spawning, the elevation hop, and
+// waiting.  platform_win.cpp implements them with Win32 for sudo.exe.
+// platform_posix.cpp implements them with posix_spawn, so that the parsing,
+// quoting, prompt, and launch logic can be built, profiled, and sanitized on
+// Linux; its elevation hop runs sudo again with SUDO_SIMULATED_ELEVATION=1
+// in the environment instead of actually gaining privileges.
+//
+// Functions that fail return false (or nullptr) and leave the reason in the
+// platform's last error (GetLastError() or errno).
+
+typedef void* PlatformHandle;       // A HANDLE, or a file descriptor.
+
+enum class PlatformError : unsigned char
+{
+    OutOfMemory,
+    NotFound,
+    NotSupported,
+    InvalidArgument,
+    Timeout,
+};
+
+// Sets the last error, for failures detected by portable code.
+void PlatformSetError(PlatformError error);
+unsigned PlatformGetError();
+
+enum class StdStream : unsigned char
+{
+    In,
+    Out,
+    Err,
+};
+
+// Returns a standard stream.  With console=true, returns the console (or
+// terminal) itself, even if the stream is redirected.
+PlatformHandle PlatformGetStdHandle(StdStream stream, bool console=false);
+
+// Returns whether the handle is a console (or terminal).
+bool PlatformIsConsole(PlatformHandle h);
+
+bool PlatformWrite(PlatformHandle h, const char* bytes, size_t len);
+
+// Writes UTF-16 text to a console.
+bool PlatformWriteConsole(PlatformHandle h, const wchar_t* text, size_t len);
+
+// Attaches to the console of another process (the unelevated sudo).
+bool PlatformAttachConsole(unsigned pid);
+
+unsigned PlatformGetPid();
+
+// Returns whether this process already has the privileges sudo grants.
+bool PlatformIsElevated();
+
+// Identities, allocated from the arena.
+wchar_t* PlatformGetUserName(Arena& arena);
+wchar_t* PlatformGetHostName(Arena& arena, bool fully_qualified);
+
+// Finding programs (see resolve.h).  Paths use the resolver's separator
+// (\), which platform_posix.cpp turns into / when it touches the file.
+bool PlatformIsFile(const wchar_t* path);
+bool PlatformGetFileStamp(const wchar_t* path, FileStamp& stamp);
+void PlatformFixPath(wchar_t* path);       // Converts \ to the platform's separator.
+
+// Fills in the search path and extensions for finding a program the way
+// the platform's shell does:  CMD on Windows, or a POSIX shell (which only
+// searches $PATH, and tries no extensions).
+bool PlatformProgramQuery(const wchar_t* name, const wchar_t* dir, Arena& arena, ProgramQuery& query);
+
+// Whether a command line needs the platform's shell, and whether a program
+// that was found can run without it (e.g. a .bat file can't on Windows).
+bool PlatformNeedsShell(const wchar_t* line);
+bool PlatformIsDirectProgram(const wchar_t* program);
+
+// Builds the command line that runs a line in the shell (%COMSPEC% /c, or
+// /bin/sh -c), and sets program to the shell.
+wchar_t* PlatformShellCommandLine(const wchar_t* line, Arena& arena, const wchar_t*& program);
+
+// A process started by the platform.
+struct PlatformProcess
+{
+    PlatformHandle      handle;         // Win32 process handle.
+    PlatformHandle      thread;         // Win32 main thread, while suspended.
+    int                 pid;
+    int                 group;          // POSIX process group, with SpawnOptions::new_group.
+    void*               tree;           // Accounting, with SpawnOptions::track_tree.
+};
+
+struct SpawnOptions
+{
+    const wchar_t*      program;        // Full path of the program.
+    const wchar_t*      command_line;   // Includes the program name.
+    const wchar_t*      dir;            // nullptr for the current directory.
+    const wchar_t*      environment;    // NAME=value\0...\0\0, or nullptr to inherit.
+    bool                background;     // Detached from the console.
+    bool                suspended;      // Resume with PlatformResume().
+    bool                new_group;      // Leads a new process group; see PlatformInterrupt().
+    bool                track_tree;     // Account for the process tree; see PlatformQueryStats().
+    const ProcessControls* controls;    // Applied before the program runs, or nullptr.
+};
+
+// Starts a program with this process's standard streams.
+bool PlatformSpawn(const SpawnOptions& options, Arena& arena, PlatformProcess& process);
+
+// Starts a program as another user (-u).  The password is only read.
+bool PlatformSpawnAsUser(const SpawnOptions& options, const wchar_t* user, const wchar_t* domain,
+                         const wchar_t* password, bool net_only, Arena& arena, PlatformProcess& process);
+
+// The elevation hop:  starts this program (self) again with privileges,
+// passing it parameters (which don't include the program name).  no_ui
+// fails instead of asking the user for consent.
+bool PlatformElevate(const wchar_t* self, const wchar_t* parameters, const wchar_t* dir, bool no_ui,
+                     Arena& arena, PlatformProcess& process);
+
+bool PlatformResume(PlatformProcess& process);
+void PlatformTerminate(PlatformProcess& process, unsigned exit_code);
+
+// Asks a process spawned with new_group, and the rest of its group, to stop:
+// Ctrl-Break on Windows (which needs a shared console), or SIGTERM.
+bool PlatformInterrupt(PlatformProcess& process);
+
+// Terminates a process and everything it started:  its job with
+// track_tree on Windows, or its process group on POSIX.  Without either,
+// only the process itself.  This still reaches the rest of the tree after
+// PlatformWait() has seen the process exit.
+void PlatformTerminateTree(PlatformProcess& process, unsigned exit_code);
+
+enum : unsigned { c_platform_wait_forever = ~0u };
+
+// Waits for a process to exit, and then for the rest of its tree if it was
+// spawned with track_tree.  Fails with PlatformError::Timeout if the process
+// is still running after timeout_ms.
+bool PlatformWait(PlatformProcess& process, unsigned& exit_code, unsigned timeout_ms=c_platform_wait_forever);
+
+// Reports the resources a process tree used (everything except the exit
+// code), once PlatformWait() has returned.  Needs track_tree.  On Windows
+// the tree is a job object; on POSIX it is the process and the descendants
+// it waited for.
+bool PlatformQueryStats(const PlatformProcess& process, ProcessStats& stats);
+
+void PlatformClose(PlatformProcess& process);
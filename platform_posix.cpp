@@ -0,0 +1,873 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "arena.h"
+#include "cmdline.h"
+#include "controls.h"
+#include "platform.h"
+#include "resolve.h"
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+extern char** environ;
+
+// Handles are file descriptors plus one, so that nullptr means no handle
+// (as it does for a HANDLE) and stdin is still a valid handle.
+static PlatformHandle
+FromFd(int fd)
+{
+    return (fd < 0) ? nullptr : reinterpret_cast<PlatformHandle>(intptr_t(fd) + 1);
+}
+
+static int
+ToFd(PlatformHandle h)
+{
+    return int(reinterpret_cast<intptr_t>(h) - 1);
+}
+
+//------------------------------------------------------------------------------
+// UTF-8 conversions.  wchar_t is UTF-32 here, but text that came from a
+// Windows style command line may still contain surrogate pairs.
+
+static size_t
+EncodeUtf8(unsigned c, char* out)
+{
+    if (c < 0x80)
+    {
+        out[0] = char(c);
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        out[0] = char(0xC0 | (c >> 6));
+        out[1] = char(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000)
+    {
+        out[0] = char(0xE0 | (c >> 12));
+        out[1] = char(0x80 | ((c >> 6) & 0x3F));
+        out[2] = char(0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = char(0xF0 | (c >> 18));
+    out[1] = char(0x80 | ((c >> 12) & 0x3F));
+    out[2] = char(0x80 | ((c >> 6) & 0x3F));
+    out[3] = char(0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Returns the next code point from text, advancing i.
+static unsigned
+NextCodePoint(const wchar_t* text, size_t len, size_t& i)
+{
+    unsigned c = unsigned(text[i++]);
+    if (c >= 0xD800 && c < 0xDC00 && i < len)
+    {
+        const unsigned low = unsigned(text[i]);
+        if (low >= 0xDC00 && low < 0xE000)
+        {
+            ++i;
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        }
+    }
+    if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+        c = 0xFFFD;
+    return c;
+}
+
+static char*
+ToUtf8(Arena& arena, const wchar_t* text)
+{
+    const size_t len = wcslen(text);
+    char* out = static_cast<char*>(arena.Alloc(len * 4 + 1));
+    if (!out)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    char* p = out;
+    for (size_t i = 0; i < len;)
+        p += EncodeUtf8(NextCodePoint(text, len, i), p);
+    *p = '\0';
+    return out;
+}
+
+static wchar_t*
+FromUtf8(Arena& arena, const char* text)
+{
+    const size_t len = strlen(text);
+    wchar_t* out = static_cast<wchar_t*>(arena.Alloc((len + 1) * sizeof(*out)));
+    if (!out)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // Malformed sequences become U+FFFD.
+    wchar_t* p = out;
+    for (size_t i = 0; i < len;)
+    {
+        const unsigned char lead = static_cast<unsigned char>(text[i++]);
+        unsigned c = lead;
+        unsigned more = 0;
+        if (lead >= 0xF0 && lead < 0xF8)
+        {
+            c = lead & 0x07;
+            more = 3;
+        }
+        else if (lead >= 0xE0)
+        {
+            c = lead & 0x0F;
+            more = 2;
+        }
+        else if (lead >= 0xC0)
+        {
+            c = lead & 0x1F;
+            more = 1;
+        }
+        else if (lead >= 0x80)
+        {
+            c = 0xFFFD;
+        }
+        for (; more && i < len && (static_cast<unsigned char>(text[i]) & 0xC0) == 0x80; --more)
+            c = (c << 6) | (static_cast<unsigned char>(text[i++]) & 0x3F);
+        *(p++) = wchar_t(more ? 0xFFFD : c);
+    }
+    *p = '\0';
+    return out;
+}
+
+// The resolver builds paths with backslashes; returns a malloc'd UTF-8 path
+// with slashes instead.
+static char*
+ToPosixPath(const wchar_t* path)
+{
+    const size_t len = wcslen(path);
+    char* out = static_cast<char*>(malloc(len * 4 + 1));
+    if (!out)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    char* p = out;
+    for (size_t i = 0; i < len;)
+    {
+        const unsigned c = NextCodePoint(path, len, i);
+        p += EncodeUtf8((c == '\\') ? '/' : c, p);
+    }
+    *p = '\0';
+    return out;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+PlatformSetError(PlatformError error)
+{
+    static const int c_errors[] =
+    {
+        ENOMEM,
+        ENOENT,
+        ENOTSUP,
+        EINVAL,
+        ETIMEDOUT,
+    };
+    errno = c_errors[unsigned(error)];
+}
+
+unsigned
+PlatformGetError()
+{
+    return unsigned(errno);
+}
+
+//------------------------------------------------------------------------------
+// Streams and identities.
+
+PlatformHandle
+PlatformGetStdHandle(StdStream stream, bool console)
+{
+    if (console)
+    {
+        static int s_tty = -2;
+        if (s_tty == -2)
+            s_tty = open("/dev/tty", O_RDWR|O_CLOEXEC);
+        if (s_tty >= 0)
+            return FromFd(s_tty);
+    }
+
+    return FromFd(int(stream));
+}
+
+bool
+PlatformIsConsole(PlatformHandle h)
+{
+    return h && isatty(ToFd(h));
+}
+
+bool
+PlatformWrite(PlatformHandle h, const char* bytes, size_t len)
+{
+    while (len)
+    {
+        const ssize_t written = write(ToFd(h), bytes, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        len -= size_t(written);
+    }
+    return true;
+}
+
+bool
+PlatformWriteConsole(PlatformHandle h, const wchar_t* text, size_t len)
+{
+    // Terminals take UTF-8.
+    char buffer[1024];
+    size_t used = 0;
+    for (size_t i = 0; i < len;)
+    {
+        if (used + 4 > sizeof(buffer))
+        {
+            if (!PlatformWrite(h, buffer, used))
+                return false;
+            used = 0;
+        }
+        used += EncodeUtf8(NextCodePoint(text, len, i), buffer + used);
+    }
+    return PlatformWrite(h, buffer, used);
+}
+
+bool
+PlatformAttachConsole(unsigned /*pid*/)
+{
+    // The elevated sudo inherits the terminal.
+    return true;
+}
+
+unsigned
+PlatformGetPid()
+{
+    return unsigned(getpid());
+}
+
+bool
+PlatformIsElevated()
+{
+    const char* simulated = getenv("SUDO_SIMULATED_ELEVATION");
+    return geteuid() == 0 || (simulated && *simulated == '1');
+}
+
+wchar_t*
+PlatformGetUserName(Arena& arena)
+{
+    const struct passwd* pw = getpwuid(geteuid());
+    if (!pw)
+    {
+        if (!errno)
+            errno = ENOENT;
+        return nullptr;
+    }
+    return FromUtf8(arena, pw->pw_name);
+}
+
+wchar_t*
+PlatformGetHostName(Arena& arena, bool fully_qualified)
+{
+    char name[256];
+    if (gethostname(name, sizeof(name) - 1))
+        return nullptr;
+    name[sizeof(name) - 1] = '\0';
+    if (!fully_qualified)
+    {
+        char* dot = strchr(name, '.');
+        if (dot)
+            *dot = '\0';
+    }
+    return FromUtf8(arena, name);
+}
+
+//------------------------------------------------------------------------------
+// Finding programs.
+
+bool
+PlatformIsFile(const wchar_t* path)
+{
+    // Only executables, since a shell skips anything else on $PATH.
+    char* narrow = ToPosixPath(path);
+    struct stat st;
+    const bool ok = narrow && !stat(narrow, &st) && S_ISREG(st.st_mode) && !access(narrow, X_OK);
+    free(narrow);
+    return ok;
+}
+
+bool
+PlatformGetFileStamp(const wchar_t* path, FileStamp& stamp)
+{
+    char* narrow = ToPosixPath(path);
+    struct stat st;
+    const bool ok = narrow && !stat(narrow, &st);
+    free(narrow);
+    if (ok)
+    {
+        stamp.id = (unsigned long long)st.st_ino;
+        stamp.mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    return ok;
+}
+
+void
+PlatformFixPath(wchar_t* path)
+{
+    for (wchar_t* p = path; *p; ++p)
+    {
+        if (*p == '\\')
+            *p = '/';
+    }
+}
+
+bool
+PlatformProgramQuery(const wchar_t* name, const wchar_t* dir, Arena& arena, ProgramQuery& query)
+{
+    const char* path = getenv("PATH");
+    wchar_t* wpath = FromUtf8(arena, (path && *path) ? path : "/usr/bin:/bin");
+    if (!wpath)
+        return false;
+    for (wchar_t* p = wpath; *p; ++p)
+    {
+        if (*p == ':')
+            *p = ';';
+    }
+
+    // The resolver always tries its directory first, like CMD.  A shell
+    // only does that for names with a directory; for other names the first
+    // directory in $PATH takes its place.
+    query.name = name;
+    query.dir = dir;
+    query.path = wpath;
+    query.pathext = L"";
+    if (!wcschr(name, '/'))
+    {
+        wchar_t* sep = wcschr(wpath, ';');
+        query.dir = wpath;
+        query.path = nullptr;
+        if (sep)
+        {
+            *sep = '\0';
+            query.path = sep + 1;
+        }
+    }
+    return true;
+}
+
+bool
+PlatformNeedsShell(const wchar_t* line)
+{
+    // CMD's rules decide most of it, but a POSIX shell also expands
+    // variables, globs, and ~, and quotes with single quotes and backslashes.
+    return NeedsShell(line) || wcspbrk(line, L"$`*?[~'\\");
+}
+
+bool
+PlatformIsDirectProgram(const wchar_t* /*program*/)
+{
+    // Scripts start with #!, so the kernel runs them without help.
+    return true;
+}
+
+wchar_t*
+PlatformShellCommandLine(const wchar_t* line, Arena& arena, const wchar_t*& program)
+{
+    program = L"/bin/sh";
+
+    CommandLineBuilder args;
+    args.Program(program);
+    args.Arg(L"-c");
+    args.Arg(line);
+    wchar_t* out = static_cast<wchar_t*>(arena.Alloc((args.Length() + 1) * sizeof(*out)));
+    if (!out || !args.Emit(out))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return out;
+}
+
+//------------------------------------------------------------------------------
+// Processes.
+
+// What PlatformWait() learns about a process spawned with track_tree.
+struct ProcessTree
+{
+    unsigned long long  start_us;
+    ProcessStats        stats;
+};
+
+// Splits a Windows style command line into a UTF-8 argv, using the same
+// rules the child's C runtime would on Windows.
+static char**
+SplitCommandLine(const wchar_t* line, Arena& arena)
+{
+    // Each argument takes at least one character and a separator, so there
+    // are at most half as many arguments as characters (plus one).
+    wchar_t* storage = static_cast<wchar_t*>(arena.Alloc((wcslen(line) + 1) * sizeof(*storage)));
+    char** argv = static_cast<char**>(arena.Alloc((wcslen(line) / 2 + 2) * sizeof(*argv)));
+    if (!storage || !argv)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    size_t argc = 0;
+    const wchar_t* p = line;
+    bool program = true;
+    while (*p)
+    {
+        wchar_t* out = storage;
+        p = program ? ScanProgramName(p, out) : ScanCommandArg(p, out);
+        *out = '\0';
+        program = false;
+        argv[argc] = ToUtf8(arena, storage);
+        if (!argv[argc])
+            return nullptr;
+        ++argc;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+    }
+    argv[argc] = nullptr;
+
+    if (!argc)
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return argv;
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR
+#endif
+
+// Applies the controls to the calling process, which its descendants then
+// inherit.  Only async-signal-safe calls, since it runs in a forked child.
+// The memory limit is per process (RLIMIT_AS), not for the whole tree.
+// Returns 0, or an errno value.
+static int
+ApplyControls(const ProcessControls& controls)
+{
+    static const int c_nice[] = { 0, 19, 10, 0, -5, -10 };
+    if (controls.priority != PriorityLevel::Default &&
+        setpriority(PRIO_PROCESS, 0, c_nice[unsigned(controls.priority)]))
+        return errno;
+
+#ifdef __linux__
+    if (controls.io_priority != IoPriorityLevel::Default)
+    {
+        // ioprio_set has no libc wrapper.  Very low is the idle class, and
+        // the others are levels (0 is highest) of the best effort class.
+        enum { c_who_process = 1, c_class_shift = 13, c_class_be = 2, c_class_idle = 3 };
+        int ioprio = c_class_idle << c_class_shift;
+        if (controls.io_priority != IoPriorityLevel::VeryLow)
+            ioprio = (c_class_be << c_class_shift) | ((controls.io_priority == IoPriorityLevel::Low) ? 7 : 4);
+        if (syscall(SYS_ioprio_set, c_who_process, 0, ioprio))
+            return errno;
+    }
+
+    if (controls.affinity)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu = 0; cpu < 64; ++cpu)
+        {
+            if (controls.affinity & (1ull << cpu))
+                CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set))
+            return errno;
+    }
+#else
+    if (controls.io_priority != IoPriorityLevel::Default || controls.affinity)
+        return ENOTSUP;
+#endif
+
+    if (controls.max_memory)
+    {
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = rlim_t(controls.max_memory);
+        if (setrlimit(RLIMIT_AS, &limit))
+            return errno;
+    }
+    return 0;
+}
+
+// Forks and prepares the child itself, for what posix_spawn can't do.  The
+// child reports a failure before exec through a close-on-exec pipe, so the
+// caller gets the same errors as from posix_spawn.
+static bool
+ForkSpawn(const char* program, char** argv, char** envp, const char* dir, const SpawnOptions& options,
+          pid_t& pid)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC))
+        return false;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        const int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = err;
+        return false;
+    }
+
+    if (!pid)
+    {
+        close(fds[0]);
+        int err = 0;
+        if (options.background)
+            setsid();
+        else if (options.new_group)
+            setpgid(0, 0);
+        if (dir && chdir(dir))
+            err = errno;
+        if (!err && options.controls)
+            err = ApplyControls(*options.controls);
+        if (!err)
+        {
+            execve(program, argv, envp);
+            err = errno;
+        }
+        (void)!write(fds[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    int err = 0;
+    ssize_t cb;
+    do
+        cb = read(fds[0], &err, sizeof(err));
+    while (cb < 0 && errno == EINTR);
+    close(fds[0]);
+    if (cb == sizeof(err))
+    {
+        waitpid(pid, nullptr, 0);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+static bool
+Spawn(const char* program, char** argv, char** envp, const char* dir, const SpawnOptions& options,
+      PlatformProcess& process)
+{
+    pid_t pid = -1;
+    int err = 0;
+
+    bool fork_child = (options.controls && options.controls->Any());
+#ifndef HAVE_SPAWN_CHDIR
+    // Without posix_spawn_file_actions_addchdir_np(), the child has to
+    // change directory itself.
+    fork_child = fork_child || dir;
+#endif
+
+    if (fork_child)
+    {
+        if (!ForkSpawn(program, argv, envp, dir, options, pid))
+            return false;
+    }
+    else
+    {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+#ifdef HAVE_SPAWN_CHDIR
+        if (dir)
+            err = posix_spawn_file_actions_addchdir_np(&actions, dir);
+#endif
+#ifdef POSIX_SPAWN_SETSID
+        if (options.background)
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+        if (options.new_group && !options.background)
+        {
+            posix_spawnattr_setpgroup(&attr, 0);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        }
+        if (!err)
+            err = posix_spawn(&pid, program, &actions, &attr, argv, envp);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (err)
+        {
+            errno = err;
+            return false;
+        }
+    }
+
+    process.handle = reinterpret_cast<PlatformHandle>(intptr_t(pid));
+    process.thread = nullptr;
+    process.pid = int(pid);
+    process.group = (options.new_group && !options.background) ? int(pid) : 0;
+    process.tree = nullptr;
+    return true;
+}
+
+// Converts an environment block (NAME=value\0...\0\0) to an envp.
+static char**
+ToEnvp(const wchar_t* block, Arena& arena)
+{
+    size_t count = 0;
+    for (const wchar_t* p = block; *p; p += wcslen(p) + 1)
+        ++count;
+    char** envp = static_cast<char**>(arena.Alloc((count + 1) * sizeof(*envp)));
+    if (!envp)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    size_t n = 0;
+    for (const wchar_t* p = block; *p; p += wcslen(p) + 1)
+    {
+        envp[n] = ToUtf8(arena, p);
+        if (!envp[n++])
+            return nullptr;
+    }
+    envp[n] = nullptr;
+    return envp;
+}
+
+bool
+PlatformSpawn(const SpawnOptions& options, Arena& arena, PlatformProcess& process)
+{
+    // Processes can't be created suspended here; PlatformResume() does
+    // nothing.
+    char** argv = SplitCommandLine(options.command_line, arena);
+    char* program = argv ? ToUtf8(arena, options.program) : nullptr;
+    char* dir = (program && options.dir) ? ToUtf8(arena, options.dir) : nullptr;
+    char** envp = (program && options.environment) ? ToEnvp(options.environment, arena) : environ;
+    if (!program || (options.dir && !dir) || !envp)
+        return false;
+
+    // There is no CPU rate cap without cgroups.
+    if (options.controls && options.controls->cpu_rate)
+    {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    ProcessTree* tree = nullptr;
+    if (options.track_tree)
+    {
+        tree = static_cast<ProcessTree*>(calloc(1, sizeof(*tree)));
+        if (!tree)
+        {
+            errno = ENOMEM;
+            return false;
+        }
+        tree->start_us = NowMicroseconds();
+    }
+
+    if (!Spawn(program, argv, envp, dir, options, process))
+    {
+        const int err = errno;
+        free(tree);
+        errno = err;
+        return false;
+    }
+    process.tree = tree;
+    return true;
+}
+
+bool
+PlatformSpawnAsUser(const SpawnOptions& /*options*/, const wchar_t* /*user*/, const wchar_t* /*domain*/,
+                    const wchar_t* /*password*/, bool /*net_only*/, Arena& /*arena*/, PlatformProcess& /*process*/)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+bool
+PlatformElevate(const wchar_t* self, const wchar_t* parameters, const wchar_t* dir, bool /*no_ui*/,
+                Arena& arena, PlatformProcess& process)
+{
+    // Run this program again, with SUDO_SIMULATED_ELEVATION=1 added to the
+    // environment so that it takes the elevated path.
+    CommandLineBuilder line;
+    line.Program(self);
+    line.Raw(L" ");
+    line.Raw(parameters);
+    wchar_t* command_line = static_cast<wchar_t*>(arena.Alloc((line.Length() + 1) * sizeof(wchar_t)));
+    if (!command_line || !line.Emit(command_line))
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    char** argv = SplitCommandLine(command_line, arena);
+    char* program = argv ? ToUtf8(arena, self) : nullptr;
+    char* cdir = (program && dir) ? ToUtf8(arena, dir) : nullptr;
+    if (!program || (dir && !cdir))
+        return false;
+
+    static char s_simulated[] = "SUDO_SIMULATED_ELEVATION=1";
+    size_t count = 0;
+    while (environ[count])
+        ++count;
+    char** envp = static_cast<char**>(arena.Alloc((count + 2) * sizeof(*envp)));
+    if (!envp)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (strncmp(environ[i], "SUDO_SIMULATED_ELEVATION=", 25))
+            envp[n++] = environ[i];
+    }
+    envp[n++] = s_simulated;
+    envp[n] = nullptr;
+
+    const SpawnOptions options = {};
+    return Spawn(program, argv, envp, cdir, options, process);
+}
+
+bool
+PlatformResume(PlatformProcess& /*process*/)
+{
+    return true;
+}
+
+void
+PlatformTerminate(PlatformProcess& process, unsigned /*exit_code*/)
+{
+    if (process.pid > 0)
+        kill(pid_t(process.pid), SIGKILL);
+}
+
+bool
+PlatformInterrupt(PlatformProcess& process)
+{
+    if (process.group > 0)
+        return !kill(-pid_t(process.group), SIGTERM);
+    return process.pid > 0 && !kill(pid_t(process.pid), SIGTERM);
+}
+
+void
+PlatformTerminateTree(PlatformProcess& process, unsigned exit_code)
+{
+    // The group outlives its leader while any of its members are running.
+    // Once the group is empty, ESRCH is all there is to report.
+    if (process.group > 0)
+        kill(-pid_t(process.group), SIGKILL);
+    PlatformTerminate(process, exit_code);
+}
+
+bool
+PlatformWait(PlatformProcess& process, unsigned& exit_code, unsigned timeout_ms)
+{
+    // There is no waitpid() with a timeout, so a timed wait polls, backing
+    // off from 1 ms to 20 ms between polls.
+    const bool forever = (timeout_ms == c_platform_wait_forever);
+    const unsigned long long deadline = forever ? 0 : NowMicroseconds() + (unsigned long long)timeout_ms * 1000;
+    unsigned long long backoff_us = 1000;
+    int status = 0;
+    struct rusage usage = {};
+    pid_t pid;
+    for (;;)
+    {
+        pid = wait4(pid_t(process.pid), &status, forever ? 0 : WNOHANG, &usage);
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid != 0)
+            break;
+
+        const unsigned long long now = NowMicroseconds();
+        if (now >= deadline)
+        {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        const unsigned long long sleep_us = (deadline - now < backoff_us) ? deadline - now : backoff_us;
+        const struct timespec ts = { time_t(sleep_us / 1000000), long(sleep_us % 1000000) * 1000 };
+        nanosleep(&ts, nullptr);
+        if (backoff_us < 20000)
+            backoff_us *= 2;
+    }
+    if (pid < 0)
+        return false;
+
+    // The usage includes the descendants the process waited for.
+    ProcessTree* tree = static_cast<ProcessTree*>(process.tree);
+    if (tree)
+    {
+        ProcessStats& stats = tree->stats;
+        stats.wall_us = NowMicroseconds() - tree->start_us;
+        stats.user_us = (unsigned long long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+        stats.kernel_us = (unsigned long long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+        stats.peak_process_memory = (unsigned long long)usage.ru_maxrss * 1024;
+        stats.peak_job_memory = stats.peak_process_memory;
+        stats.read_ops = (unsigned long long)usage.ru_inblock;
+        stats.write_ops = (unsigned long long)usage.ru_oublock;
+        stats.processes = 1;
+    }
+
+    // Like a shell, a signal becomes 128 + the signal number.
+    exit_code = WIFEXITED(status) ? unsigned(WEXITSTATUS(status)) : 128 + unsigned(WTERMSIG(status));
+    process.pid = 0;
+    return true;
+}
+
+bool
+PlatformQueryStats(const PlatformProcess& process, ProcessStats& stats)
+{
+    if (!process.tree)
+    {
+        errno = ENOTSUP;
+        return false;
+    }
+    stats = static_cast<const ProcessTree*>(process.tree)->stats;
+    return true;
+}
+
+void
+PlatformClose(PlatformProcess& process)
+{
+    free(process.tree);
+    process.handle = nullptr;
+    process.thread = nullptr;
+    process.group = 0;
+    process.tree = nullptr;
+}
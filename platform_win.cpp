@@ -0,0 +1,547 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+#include <objbase.h>
+#include <shellapi.h>
+#include <shlwapi.h>
+#include <stdlib.h>
+#include <new>
+
+#include "arena.h"
+#include "cmdline.h"
+#include "controls.h"
+#include "job.h"
+#include "platform.h"
+#include "resolve.h"
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#define PACKVERSION(major,minor)    MAKELONG(minor,major)
+
+static const DWORD c_std_handles[] = { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE };
+
+static LPWSTR
+AllocString(Arena& arena, size_t cch)
+{
+    LPWSTR psz = LPWSTR(arena.Alloc(cch * sizeof(*psz)));
+    if (!psz)
+        SetLastError(ERROR_OUTOFMEMORY);
+    return psz;
+}
+
+// The value can change between asking its length and reading it, so this
+// retries with the new length.
+static LPWSTR
+GetEnvironmentString(Arena& arena, LPCWSTR pszName)
+{
+    DWORD cch = GetEnvironmentVariableW(pszName, nullptr, 0);
+    while (cch)
+    {
+        LPWSTR psz = AllocString(arena, cch);
+        if (!psz)
+            return nullptr;
+        const DWORD len = GetEnvironmentVariableW(pszName, psz, cch);
+        if (len < cch)
+            return len ? psz : nullptr;
+        cch = len;
+    }
+    return nullptr;
+}
+
+void
+PlatformSetError(PlatformError error)
+{
+    static const DWORD c_errors[] =
+    {
+        ERROR_OUTOFMEMORY,
+        ERROR_FILE_NOT_FOUND,
+        ERROR_NOT_SUPPORTED,
+        ERROR_INVALID_PARAMETER,
+        WAIT_TIMEOUT,
+    };
+    SetLastError(c_errors[unsigned(error)]);
+}
+
+unsigned
+PlatformGetError()
+{
+    return GetLastError();
+}
+
+PlatformHandle
+PlatformGetStdHandle(StdStream stream, bool console)
+{
+    if (console)
+    {
+        static HANDLE s_hcon[2] = {};
+        const bool fIn = (stream == StdStream::In);
+        if (!s_hcon[fIn])
+        {
+            // IMPORTANT: CONIN$ requires both read and write access so that
+            // SetConsoleMode() can change the mode, e.g. to disable echo to
+            // hide password input.
+            const DWORD dwShare = FILE_SHARE_READ|FILE_SHARE_WRITE;
+            s_hcon[fIn] = (fIn ?
+                CreateFileW(L"CONIN$", GENERIC_READ|GENERIC_WRITE, dwShare, 0, OPEN_EXISTING, 0, 0) :
+                CreateFileW(L"CONOUT$", GENERIC_WRITE, dwShare, 0, OPEN_EXISTING, 0, 0));
+        }
+        if (s_hcon[fIn])
+            return s_hcon[fIn];
+    }
+
+    return GetStdHandle(c_std_handles[unsigned(stream)]);
+}
+
+bool
+PlatformIsConsole(PlatformHandle h)
+{
+    DWORD dummy;
+    return !!GetConsoleMode(h, &dummy);
+}
+
+bool
+PlatformWrite(PlatformHandle h, const char* bytes, size_t len)
+{
+    DWORD dummy;
+    return !!WriteFile(h, bytes, DWORD(len), &dummy, nullptr);
+}
+
+bool
+PlatformWriteConsole(PlatformHandle h, const wchar_t* text, size_t len)
+{
+    DWORD dummy;
+    return !!WriteConsoleW(h, text, DWORD(len), &dummy, 0);
+}
+
+bool
+PlatformAttachConsole(unsigned pid)
+{
+    FreeConsole();
+    return !!AttachConsole(pid);
+}
+
+unsigned
+PlatformGetPid()
+{
+    return GetCurrentProcessId();
+}
+
+static DWORD
+GetDllVersion(LPCWSTR lpszDllName)
+{
+    DWORD dwVersion = 0;
+    HINSTANCE hinstDll = LoadLibrary(lpszDllName);
+
+    if (hinstDll)
+    {
+        DLLGETVERSIONPROC pDllGetVersion = DLLGETVERSIONPROC(GetProcAddress(hinstDll, "DllGetVersion"));
+
+        // Because some DLLs might not implement this function, you must test
+        // for it explicitly.  Depending on the particular DLL, the lack of a
+        // DllGetVersion function can be a useful indicator of the version.
+        if (pDllGetVersion)
+        {
+            DLLVERSIONINFO dvi = { sizeof(dvi) };
+            HRESULT hr = (*pDllGetVersion)(&dvi);
+            if (SUCCEEDED(hr))
+                dwVersion = PACKVERSION(dvi.dwMajorVersion, dvi.dwMinorVersion);
+        }
+
+        FreeLibrary(hinstDll);
+    }
+
+    return dwVersion;
+}
+
+bool
+PlatformIsElevated()
+{
+    if (GetDllVersion(L"shell32.dll") < PACKVERSION(5,0))
+        return true; // Elevation is not supported.
+
+    HMODULE const hLib = LoadLibrary(L"shell32.dll");
+    if (!hLib)
+        return true;
+
+    union
+    {
+        FARPROC proc[1];
+        struct
+        {
+            BOOL (WINAPI* IsUserAnAdmin)();
+        };
+    } shell32;
+
+    shell32.proc[0] = GetProcAddress(hLib, "IsUserAnAdmin");
+    bool const fElevated = !shell32.proc[0] || shell32.IsUserAnAdmin();
+    FreeLibrary(hLib);
+    return fElevated;
+}
+
+wchar_t*
+PlatformGetUserName(Arena& arena)
+{
+    DWORD cch = 0;
+    GetUserNameW(nullptr, &cch);
+    if (!cch)
+        return nullptr;
+
+    LPWSTR psz = AllocString(arena, cch);
+    if (psz && !GetUserNameW(psz, &cch))
+        psz = nullptr;
+    return psz;
+}
+
+wchar_t*
+PlatformGetHostName(Arena& arena, bool fully_qualified)
+{
+    const COMPUTER_NAME_FORMAT format = fully_qualified ? ComputerNameDnsFullyQualified : ComputerNameDnsHostname;
+    DWORD cch = 0;
+    GetComputerNameExW(format, nullptr, &cch);
+    if (!cch)
+        return nullptr;
+
+    LPWSTR psz = AllocString(arena, cch);
+    if (psz && !GetComputerNameExW(format, psz, &cch))
+        psz = nullptr;
+    return psz;
+}
+
+bool
+PlatformIsFile(const wchar_t* path)
+{
+    const DWORD dwAttr = GetFileAttributesW(path);
+    return dwAttr != INVALID_FILE_ATTRIBUTES && !(dwAttr & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+bool
+PlatformGetFileStamp(const wchar_t* path, FileStamp& stamp)
+{
+    // Directories can only be opened with backup semantics.
+    HANDLE hFile = CreateFileW(path, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    const bool ok = !!GetFileInformationByHandle(hFile, &info);
+    CloseHandle(hFile);
+    if (ok)
+    {
+        stamp.id = ((unsigned long long)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+        stamp.mtime = ((unsigned long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    }
+    return ok;
+}
+
+void
+PlatformFixPath(wchar_t* /*path*/)
+{
+}
+
+bool
+PlatformProgramQuery(const wchar_t* name, const wchar_t* dir, Arena& arena, ProgramQuery& query)
+{
+    // A missing %PATH% or %PATHEXT% gets the resolver's defaults.
+    query.name = name;
+    query.dir = dir;
+    query.path = GetEnvironmentString(arena, L"PATH");
+    query.pathext = GetEnvironmentString(arena, L"PATHEXT");
+    return true;
+}
+
+bool
+PlatformNeedsShell(const wchar_t* line)
+{
+    return NeedsShell(line);
+}
+
+bool
+PlatformIsDirectProgram(const wchar_t* program)
+{
+    // Anything else (such as a script that runs through a file association)
+    // needs CMD.
+    const wchar_t* ext = FindExtension(program);
+    return ext && (!_wcsicmp(ext, L".exe") || !_wcsicmp(ext, L".com"));
+}
+
+wchar_t*
+PlatformShellCommandLine(const wchar_t* line, Arena& arena, const wchar_t*& program)
+{
+    program = GetEnvironmentString(arena, L"COMSPEC");
+    if (!program)
+        program = L"cmd.exe";
+
+    CommandLineBuilder args;
+    args.Program(program);
+    args.Arg(L"/c");
+    args.Raw(line);
+    LPWSTR psz = AllocString(arena, args.Length() + 1);
+    if (psz && !args.Emit(psz))
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return nullptr;
+    }
+    return psz;
+}
+
+static void
+InitStartupInfo(STARTUPINFO& si)
+{
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+}
+
+static void
+SetProcess(const PROCESS_INFORMATION& pi, bool fSuspended, PlatformProcess& process)
+{
+    process.handle = pi.hProcess;
+    process.pid = int(pi.dwProcessId);
+    process.group = 0;
+    process.thread = nullptr;
+    process.tree = nullptr;
+    if (fSuspended)
+        process.thread = pi.hThread;
+    else
+        CloseHandle(pi.hThread);
+}
+
+static void
+DestroyTree(ProcessTreeJob* job)
+{
+    if (job)
+    {
+        job->~ProcessTreeJob();
+        free(job);
+    }
+}
+
+// Prepares the creation flags, and the job for a tracked or controlled
+// process tree.  The process is created suspended so that everything it
+// starts is in the job, and none of it runs without the controls.
+static bool
+BeginSpawn(const SpawnOptions& options, DWORD& dwFlags, ProcessTreeJob*& job)
+{
+    job = nullptr;
+    if (options.suspended)
+        dwFlags |= CREATE_SUSPENDED;
+    if (options.environment)
+        dwFlags |= CREATE_UNICODE_ENVIRONMENT;
+    const bool fControls = (options.controls && options.controls->Any());
+    if (!options.track_tree && !fControls)
+        return true;
+
+    void* p = malloc(sizeof(ProcessTreeJob));
+    if (!p)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+    job = new (p) ProcessTreeJob;
+    if (!job->Create() || (fControls && !job->SetControls(*options.controls)))
+    {
+        const DWORD err = GetLastError();
+        DestroyTree(job);
+        SetLastError(err);
+        return false;
+    }
+    dwFlags |= CREATE_SUSPENDED;
+    return true;
+}
+
+static bool
+EndSpawn(bool fCreated, const PROCESS_INFORMATION& pi, const SpawnOptions& options, ProcessTreeJob* job, PlatformProcess& process)
+{
+    if (!fCreated)
+    {
+        const DWORD err = GetLastError();
+        DestroyTree(job);
+        SetLastError(err);
+        return false;
+    }
+
+    if (job)
+    {
+        if (!job->Assign(pi.hProcess))
+        {
+            const DWORD err = GetLastError();
+            TerminateProcess(pi.hProcess, DWORD(-1));
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+            DestroyTree(job);
+            SetLastError(err);
+            return false;
+        }
+        if (!options.suspended)
+            ResumeThread(pi.hThread);
+    }
+
+    SetProcess(pi, options.suspended, process);
+    process.tree = job;
+    return true;
+}
+
+bool
+PlatformSpawn(const SpawnOptions& options, Arena& arena, PlatformProcess& process)
+{
+    // CreateProcessW can modify the command line, so it needs a copy.
+    LPWSTR pszCmdLine = arena.Copy(options.command_line);
+    if (!pszCmdLine)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    STARTUPINFO si;
+    InitStartupInfo(si);
+
+    DWORD dwFlags = options.background ? CREATE_NEW_PROCESS_GROUP|CREATE_NO_WINDOW : 0;
+    if (options.new_group)
+        dwFlags |= CREATE_NEW_PROCESS_GROUP;
+    ProcessTreeJob* job;
+    if (!BeginSpawn(options, dwFlags, job))
+        return false;
+
+    PROCESS_INFORMATION pi = {};
+    const bool fCreated = !!CreateProcessW(options.program, pszCmdLine, nullptr, nullptr, true, dwFlags,
+                                           LPVOID(options.environment), options.dir, &si, &pi);
+    return EndSpawn(fCreated, pi, options, job, process);
+}
+
+bool
+PlatformSpawnAsUser(const SpawnOptions& options, const wchar_t* user, const wchar_t* domain,
+                    const wchar_t* password, bool net_only, Arena& arena, PlatformProcess& process)
+{
+    LPWSTR pszCmdLine = arena.Copy(options.command_line);
+    if (!pszCmdLine)
+    {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    STARTUPINFO si;
+    InitStartupInfo(si);
+
+    DWORD dwFlags = CREATE_NO_WINDOW;
+    if (options.new_group)
+        dwFlags |= CREATE_NEW_PROCESS_GROUP;
+    ProcessTreeJob* job;
+    if (!BeginSpawn(options, dwFlags, job))
+        return false;
+
+    PROCESS_INFORMATION pi = {};
+    const DWORD dwLogon = net_only ? LOGON_NETCREDENTIALS_ONLY : LOGON_WITH_PROFILE;
+    const bool fCreated = !!CreateProcessWithLogonW(user, domain, password, dwLogon, options.program, pszCmdLine,
+                                                    dwFlags, LPVOID(options.environment), options.dir, &si, &pi);
+    return EndSpawn(fCreated, pi, options, job, process);
+}
+
+bool
+PlatformElevate(const wchar_t* self, const wchar_t* parameters, const wchar_t* dir, bool no_ui,
+                Arena& /*arena*/, PlatformProcess& process)
+{
+    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED|COINIT_DISABLE_OLE1DDE);
+
+    // Must use SW_HIDE so that FreeConsole() and AttachConsole() can work.
+    SHELLEXECUTEINFO sei = {};
+    sei.cbSize = sizeof(sei);
+    sei.hwnd = NULL;
+    sei.fMask = SEE_MASK_NOASYNC|SEE_MASK_NOCLOSEPROCESS|(no_ui ? SEE_MASK_FLAG_NO_UI : 0);
+    sei.lpVerb = L"runas";
+    sei.lpFile = self;
+    sei.lpParameters = parameters;
+    sei.lpDirectory = dir;
+    sei.nShow = SW_HIDE;
+
+    if (!ShellExecuteEx(&sei))
+        return false;
+
+    process.handle = sei.hProcess;
+    process.thread = nullptr;
+    process.tree = nullptr;
+    process.pid = sei.hProcess ? int(GetProcessId(sei.hProcess)) : 0;
+    process.group = 0;
+    return true;
+}
+
+bool
+PlatformResume(PlatformProcess& process)
+{
+    if (!process.thread)
+        return true;
+    const bool ok = (ResumeThread(process.thread) != DWORD(-1));
+    CloseHandle(process.thread);
+    process.thread = nullptr;
+    return ok;
+}
+
+void
+PlatformTerminate(PlatformProcess& process, unsigned exit_code)
+{
+    if (process.handle)
+        TerminateProcess(process.handle, exit_code);
+}
+
+bool
+PlatformInterrupt(PlatformProcess& process)
+{
+    return !!GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, DWORD(process.pid));
+}
+
+void
+PlatformTerminateTree(PlatformProcess& process, unsigned exit_code)
+{
+    if (process.tree)
+        static_cast<ProcessTreeJob*>(process.tree)->Terminate(exit_code);
+    PlatformTerminate(process, exit_code);
+}
+
+bool
+PlatformWait(PlatformProcess& process, unsigned& exit_code, unsigned timeout_ms)
+{
+    const DWORD dwWait = WaitForSingleObject(process.handle, (timeout_ms == c_platform_wait_forever) ? INFINITE : timeout_ms);
+    if (dwWait == WAIT_TIMEOUT)
+    {
+        SetLastError(WAIT_TIMEOUT);
+        return false;
+    }
+    if (dwWait == WAIT_FAILED)
+        return false;
+
+    if (process.tree)
+        static_cast<ProcessTreeJob*>(process.tree)->WaitForTree();
+
+    DWORD dwExit = 0;
+    if (!GetExitCodeProcess(process.handle, &dwExit))
+        return false;
+    exit_code = dwExit;
+    return true;
+}
+
+bool
+PlatformQueryStats(const PlatformProcess& process, ProcessStats& stats)
+{
+    if (!process.tree)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+    return static_cast<const ProcessTreeJob*>(process.tree)->Query(stats);
+}
+
+void
+PlatformClose(PlatformProcess& process)
+{
+    if (process.thread)
+        CloseHandle(process.thread);
+    if (process.handle)
+        CloseHandle(process.handle);
+    DestroyTree(static_cast<ProcessTreeJob*>(process.tree));
+    process.thread = nullptr;
+    process.handle = nullptr;
+    process.tree = nullptr;
+}
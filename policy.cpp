@@ -0,0 +1,1032 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "policy.h"
+#include "cmdline.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Image layout (all numbers are little endian u32 unless noted):
+//
+//  header      "SUDOPOL1", version, image size, u64 source size, u64 source
+//              mtime, node count, nodes offset, edge count, edges offset,
+//              rule count, rules offset, string count, strings offset
+//  nodes       first edge, literal edge count, glob edge count, end rule,
+//              rest rule
+//  edges       string offset, string length, flags, child node
+//  rules       line, flags, options
+//  strings     u16 code units (UTF-16, with ASCII letters lowercased)
+//
+// Node 0 is the root.  Level 0 of the trie matches the user, level 1 the
+// program, and the rest match arguments.  A node's literal edges come first,
+// sorted by flags and then string, followed by its glob edges.  Rule numbers
+// in nodes are 1-based (0 means none); "end rule" matches when there are no
+// more arguments, and "rest rule" matches regardless of further arguments.
+
+typedef unsigned short PolicyChar;
+
+static const char c_image_magic[8] = { 'S','U','D','O','P','O','L','1' };
+static const unsigned c_image_version = 2;
+
+enum
+{
+    c_header_size       = 72,
+    c_node_size         = 20,
+    c_edge_size         = 16,
+    c_rule_size         = 12,
+};
+
+enum : unsigned
+{
+    EDGE_QUALIFIED      = 0x0001,   // Matches DOMAIN\name, or the full path.
+    EDGE_GLOB           = 0x0002,
+    EDGE_FLAGS_MASK     = 0x0003,
+
+    RULE_DENY           = 0x0001,
+};
+
+enum
+{
+    LEVEL_USER          = 0,
+    LEVEL_PROGRAM       = 1,
+    LEVEL_ARGS          = 2,
+};
+
+static void
+PutU32(unsigned char* p, unsigned v)
+{
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void
+PutU64(unsigned char* p, unsigned long long v)
+{
+    PutU32(p, unsigned(v));
+    PutU32(p + 4, unsigned(v >> 32));
+}
+
+static unsigned
+GetU32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (unsigned(p[3]) << 24);
+}
+
+static unsigned long long
+GetU64(const unsigned char* p)
+{
+    return GetU32(p) | ((unsigned long long)GetU32(p + 4) << 32);
+}
+
+static PolicyChar
+GetChar(const unsigned char* strings, unsigned index)
+{
+    return PolicyChar(strings[index * 2] | (strings[index * 2 + 1] << 8));
+}
+
+//------------------------------------------------------------------------------
+// Folding and comparing strings.
+
+static PolicyChar
+FoldChar(unsigned c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return PolicyChar(c - 'A' + 'a');
+    return PolicyChar(c);
+}
+
+template <class T>
+struct PolicyArray
+{
+                    ~PolicyArray() { free(p); }
+
+    bool            Push(const T& value)
+                    {
+                        if (count >= capacity)
+                        {
+                            const unsigned grow = capacity ? capacity * 2 : 64;
+                            T* q = static_cast<T*>(realloc(p, size_t(grow) * sizeof(T)));
+                            if (!q)
+                                return false;
+                            p = q;
+                            capacity = grow;
+                        }
+                        p[count++] = value;
+                        return true;
+                    }
+
+    T*              p = nullptr;
+    unsigned        count = 0;
+    unsigned        capacity = 0;
+};
+
+// Appends s as folded UTF-16.  For paths, / becomes \.
+static bool
+AppendFolded(PolicyArray<PolicyChar>& out, const wchar_t* s, size_t len, bool path)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned c = unsigned(s[i]);
+        if (path && c == '/')
+            c = '\\';
+        if (c >= 0x10000 && c <= 0x10ffff)
+        {
+            c -= 0x10000;
+            if (!out.Push(PolicyChar(0xd800 + (c >> 10))) || !out.Push(PolicyChar(0xdc00 + (c & 0x3ff))))
+                return false;
+            continue;
+        }
+        if (!out.Push(FoldChar(c & 0xffff)))
+            return false;
+    }
+    return true;
+}
+
+static bool
+IsPathSeparator(wchar_t c)
+{
+    return c == '\\' || c == '/' || c == ':';
+}
+
+// Returns the length of a program name without a .exe, .com, .bat, or .cmd
+// extension.
+static size_t
+StripProgramExtension(const wchar_t* s, size_t len)
+{
+    static const char* const c_exts[] = { ".exe", ".com", ".bat", ".cmd" };
+    if (len < 4)
+        return len;
+    for (const char* ext : c_exts)
+    {
+        size_t i = 0;
+        while (i < 4 && FoldChar(unsigned(s[len - 4 + i])) == PolicyChar(ext[i]))
+            ++i;
+        if (i == 4)
+            return len - 4;
+    }
+    return len;
+}
+
+static int
+CompareKeys(unsigned flags1, const PolicyChar* s1, unsigned len1, unsigned flags2, const PolicyChar* s2, unsigned len2)
+{
+    if (flags1 != flags2)
+        return flags1 < flags2 ? -1 : 1;
+    const unsigned len = len1 < len2 ? len1 : len2;
+    for (unsigned i = 0; i < len; ++i)
+    {
+        if (s1[i] != s2[i])
+            return s1[i] < s2[i] ? -1 : 1;
+    }
+    return (len1 == len2) ? 0 : (len1 < len2 ? -1 : 1);
+}
+
+//------------------------------------------------------------------------------
+// Compiling.
+
+struct BuildNode
+{
+    unsigned        end_rule;
+    unsigned        rest_rule;
+};
+
+struct BuildEdge
+{
+    unsigned        parent;
+    unsigned        str;
+    unsigned        len;
+    unsigned        flags;
+    unsigned        child;
+};
+
+struct BuildRule
+{
+    unsigned        line;
+    unsigned        flags;
+    unsigned        options;
+};
+
+struct SortEdge
+{
+    unsigned        parent;
+    unsigned        flags;
+    const PolicyChar* s;
+    unsigned        len;
+    unsigned        edge;
+};
+
+static int
+CompareSortEdges(const void* a, const void* b)
+{
+    const SortEdge* e1 = static_cast<const SortEdge*>(a);
+    const SortEdge* e2 = static_cast<const SortEdge*>(b);
+    if (e1->parent != e2->parent)
+        return e1->parent < e2->parent ? -1 : 1;
+
+    // Literal edges sort before glob edges because EDGE_GLOB is the higher
+    // flag bit.  Glob edges keep rule order.
+    if ((e1->flags & EDGE_GLOB) && (e2->flags & EDGE_GLOB))
+        return (e1->edge < e2->edge) ? -1 : (e1->edge > e2->edge);
+    return CompareKeys(e1->flags, e1->s, e1->len, e2->flags, e2->s, e2->len);
+}
+
+class PolicyBuilder
+{
+public:
+                    ~PolicyBuilder() { free(m_table); }
+
+    bool            Init();
+    bool            AddRule(unsigned line, unsigned flags, unsigned options, const wchar_t* const* tokens, const bool* quoted, unsigned count);
+    unsigned char*  Serialize(const PolicyStamp& stamp, size_t& image_size);
+
+private:
+    bool            AddKey(unsigned level, const wchar_t* token, bool quoted, unsigned& flags, unsigned& str, unsigned& len);
+    bool            Descend(unsigned& node, unsigned flags, unsigned str, unsigned len);
+    bool            Grow();
+    unsigned        Hash(unsigned parent, unsigned flags, unsigned str, unsigned len) const;
+
+    PolicyArray<BuildNode> m_nodes;
+    PolicyArray<BuildEdge> m_edges;
+    PolicyArray<BuildRule> m_rules;
+    PolicyArray<PolicyChar> m_strings;
+    unsigned*       m_table = nullptr;  // Edge index + 1; 0 means empty.
+    unsigned        m_table_size = 0;
+};
+
+bool
+PolicyBuilder::Init()
+{
+    const BuildNode root = {};
+    return m_nodes.Push(root) && Grow();
+}
+
+unsigned
+PolicyBuilder::Hash(unsigned parent, unsigned flags, unsigned str, unsigned len) const
+{
+    unsigned h = 2166136261u;
+    h = (h ^ parent) * 16777619u;
+    h = (h ^ flags) * 16777619u;
+    for (unsigned i = 0; i < len; ++i)
+        h = (h ^ m_strings.p[str + i]) * 16777619u;
+    return h;
+}
+
+bool
+PolicyBuilder::Grow()
+{
+    const unsigned size = m_table_size ? m_table_size * 2 : 1024;
+    unsigned* table = static_cast<unsigned*>(calloc(size, sizeof(*table)));
+    if (!table)
+        return false;
+
+    for (unsigned i = 0; i < m_edges.count; ++i)
+    {
+        const BuildEdge& e = m_edges.p[i];
+        unsigned slot = Hash(e.parent, e.flags, e.str, e.len) & (size - 1);
+        while (table[slot])
+            slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+
+    free(m_table);
+    m_table = table;
+    m_table_size = size;
+    return true;
+}
+
+// Finds or adds the edge for a key, and moves to its child.  The key's
+// string is the last thing in m_strings; it is removed if the edge exists.
+bool
+PolicyBuilder::Descend(unsigned& node, unsigned flags, unsigned str, unsigned len)
+{
+    unsigned slot = Hash(node, flags, str, len) & (m_table_size - 1);
+    while (m_table[slot])
+    {
+        const BuildEdge& e = m_edges.p[m_table[slot] - 1];
+        if (e.parent == node && e.flags == flags &&
+            !CompareKeys(0, m_strings.p + e.str, e.len, 0, m_strings.p + str, len))
+        {
+            m_strings.count = str;
+            node = e.child;
+            return true;
+        }
+        slot = (slot + 1) & (m_table_size - 1);
+    }
+
+    const BuildNode child = {};
+    const BuildEdge edge = { node, str, len, flags, m_nodes.count };
+    if (!m_nodes.Push(child) || !m_edges.Push(edge))
+        return false;
+    m_table[slot] = m_edges.count;
+    node = edge.child;
+
+    return (m_edges.count * 2 < m_table_size) || Grow();
+}
+
+bool
+PolicyBuilder::AddKey(unsigned level, const wchar_t* token, bool quoted, unsigned& flags, unsigned& str, unsigned& len)
+{
+    size_t cch = wcslen(token);
+    flags = 0;
+
+    if (!quoted && level < LEVEL_ARGS && !wcscmp(token, L"ALL"))
+    {
+        token = L"*";
+        cch = 1;
+    }
+    else if (level == LEVEL_USER)
+    {
+        if (wcschr(token, '\\'))
+            flags |= EDGE_QUALIFIED;
+    }
+    else if (level == LEVEL_PROGRAM)
+    {
+        bool qualified = false;
+        for (size_t i = 0; i < cch; ++i)
+            qualified = qualified || IsPathSeparator(token[i]);
+        if (qualified)
+            flags |= EDGE_QUALIFIED;
+        else
+            cch = StripProgramExtension(token, cch);
+    }
+
+    for (size_t i = 0; i < cch; ++i)
+    {
+        if (token[i] == '*' || token[i] == '?')
+            flags |= EDGE_GLOB;
+    }
+
+    str = m_strings.count;
+    if (!AppendFolded(m_strings, token, cch, level == LEVEL_PROGRAM))
+        return false;
+    len = m_strings.count - str;
+    return true;
+}
+
+bool
+PolicyBuilder::AddRule(unsigned line, unsigned flags, unsigned options, const wchar_t* const* tokens, const bool* quoted, unsigned count)
+{
+    const BuildRule rule = { line, flags, options };
+    if (!m_rules.Push(rule))
+        return false;
+    const unsigned number = m_rules.count;
+
+    // With no arg patterns, any arguments are allowed.  "" alone allows no
+    // arguments.  A trailing * allows any further arguments.
+    bool rest = (count == LEVEL_ARGS);
+    if (count == LEVEL_ARGS + 1 && !*tokens[LEVEL_ARGS])
+        --count;
+    else if (count > LEVEL_ARGS && !quoted[count - 1] && !wcscmp(tokens[count - 1], L"*"))
+    {
+        --count;
+        rest = true;
+    }
+
+    unsigned node = 0;
+    for (unsigned level = 0; level < count; ++level)
+    {
+        unsigned edge_flags;
+        unsigned str;
+        unsigned len;
+        if (!AddKey(level, tokens[level], quoted[level], edge_flags, str, len))
+            return false;
+        if (!Descend(node, edge_flags, str, len))
+            return false;
+    }
+
+    // The last matching rule decides, and later rules have higher numbers.
+    BuildNode& n = m_nodes.p[node];
+    if (rest)
+        n.rest_rule = number;
+    else
+        n.end_rule = number;
+    return true;
+}
+
+unsigned char*
+PolicyBuilder::Serialize(const PolicyStamp& stamp, size_t& image_size)
+{
+    const unsigned long long size = (unsigned long long)c_header_size +
+        (unsigned long long)m_nodes.count * c_node_size +
+        (unsigned long long)m_edges.count * c_edge_size +
+        (unsigned long long)m_rules.count * c_rule_size +
+        (unsigned long long)m_strings.count * 2;
+    if (size > 0xffffffffull)
+        return nullptr;
+
+    SortEdge* sorted = static_cast<SortEdge*>(malloc((m_edges.count + 1) * sizeof(*sorted)));
+    unsigned char* image = static_cast<unsigned char*>(calloc(size_t(size), 1));
+    if (!sorted || !image)
+    {
+        free(sorted);
+        free(image);
+        return nullptr;
+    }
+
+    for (unsigned i = 0; i < m_edges.count; ++i)
+    {
+        const BuildEdge& e = m_edges.p[i];
+        sorted[i] = { e.parent, e.flags, m_strings.p + e.str, e.len, i };
+    }
+    qsort(sorted, m_edges.count, sizeof(*sorted), CompareSortEdges);
+
+    const unsigned nodes_offset = c_header_size;
+    const unsigned edges_offset = nodes_offset + m_nodes.count * c_node_size;
+    const unsigned rules_offset = edges_offset + m_edges.count * c_edge_size;
+    const unsigned strings_offset = rules_offset + m_rules.count * c_rule_size;
+
+    memcpy(image, c_image_magic, sizeof(c_image_magic));
+    PutU32(image + 8, c_image_version);
+    PutU32(image + 12, unsigned(size));
+    PutU64(image + 16, stamp.size);
+    PutU64(image + 24, stamp.mtime);
+    PutU32(image + 32, m_nodes.count);
+    PutU32(image + 36, nodes_offset);
+    PutU32(image + 40, m_edges.count);
+    PutU32(image + 44, edges_offset);
+    PutU32(image + 48, m_rules.count);
+    PutU32(image + 52, rules_offset);
+    PutU32(image + 56, m_strings.count);
+    PutU32(image + 60, strings_offset);
+
+    // Edges are written in sorted order, so each node's edges are a run.
+    unsigned* first = static_cast<unsigned*>(calloc(m_nodes.count, sizeof(*first)));
+    if (!first)
+    {
+        free(sorted);
+        free(image);
+        return nullptr;
+    }
+    for (unsigned i = m_edges.count; i--;)
+        first[sorted[i].parent] = i;
+
+    for (unsigned i = 0; i < m_edges.count; ++i)
+    {
+        const BuildEdge& e = m_edges.p[sorted[i].edge];
+        unsigned char* p = image + edges_offset + i * c_edge_size;
+        PutU32(p + 0, e.str);
+        PutU32(p + 4, e.len);
+        PutU32(p + 8, e.flags);
+        PutU32(p + 12, e.child);
+
+        unsigned char* n = image + nodes_offset + e.parent * c_node_size;
+        PutU32(n + ((e.flags & EDGE_GLOB) ? 8 : 4), GetU32(n + ((e.flags & EDGE_GLOB) ? 8 : 4)) + 1);
+    }
+
+    for (unsigned i = 0; i < m_nodes.count; ++i)
+    {
+        unsigned char* n = image + nodes_offset + i * c_node_size;
+        PutU32(n + 0, first[i]);
+        PutU32(n + 12, m_nodes.p[i].end_rule);
+        PutU32(n + 16, m_nodes.p[i].rest_rule);
+    }
+
+    for (unsigned i = 0; i < m_rules.count; ++i)
+    {
+        unsigned char* p = image + rules_offset + i * c_rule_size;
+        PutU32(p + 0, m_rules.p[i].line);
+        PutU32(p + 4, m_rules.p[i].flags);
+        PutU32(p + 8, m_rules.p[i].options);
+    }
+
+    for (unsigned i = 0; i < m_strings.count; ++i)
+    {
+        image[strings_offset + i * 2] = (unsigned char)(m_strings.p[i]);
+        image[strings_offset + i * 2 + 1] = (unsigned char)(m_strings.p[i] >> 8);
+    }
+
+    free(first);
+    free(sorted);
+    image_size = size_t(size);
+    return image;
+}
+
+// Decodes UTF-8; invalid sequences become U+FFFD.  Returns the number of
+// characters written.
+static size_t
+DecodeUtf8(const char* s, size_t len, wchar_t* out)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(s);
+    const unsigned char* const end = p + len;
+    wchar_t* const start = out;
+    while (p < end)
+    {
+        unsigned c = *(p++);
+        unsigned extra = 0;
+        if (c >= 0xf0 && c < 0xf8)
+            extra = 3, c &= 0x07;
+        else if (c >= 0xe0)
+            extra = (c < 0xf0) ? 2 : 0, c &= 0x0f;
+        else if (c >= 0xc0)
+            extra = 1, c &= 0x1f;
+        else if (c >= 0x80)
+            c = 0xfffd;
+
+        for (; extra; --extra)
+        {
+            if (p >= end || (*p & 0xc0) != 0x80)
+            {
+                c = 0xfffd;
+                break;
+            }
+            c = (c << 6) | (*(p++) & 0x3f);
+        }
+
+        if (c > 0x10ffff)
+            c = 0xfffd;
+        if (c >= 0x10000 && sizeof(wchar_t) == 2)
+        {
+            c -= 0x10000;
+            *(out++) = wchar_t(0xd800 + (c >> 10));
+            *(out++) = wchar_t(0xdc00 + (c & 0x3ff));
+        }
+        else
+        {
+            *(out++) = wchar_t(c);
+        }
+    }
+    return size_t(out - start);
+}
+
+static bool
+ParseOption(const wchar_t* name, unsigned& options)
+{
+    static const struct { const char* name; unsigned flag; } c_names[] =
+    {
+        { "all",        POLICY_OPT_ALL },
+        { "background", POLICY_OPT_BACKGROUND },
+        { "setenv",     POLICY_OPT_SETENV },
+        { "shell",      POLICY_OPT_SHELL },
+    };
+
+    for (const auto& n : c_names)
+    {
+        size_t i = 0;
+        while (n.name[i] && FoldChar(unsigned(name[i])) == PolicyChar(n.name[i]))
+            ++i;
+        if (!n.name[i] && !name[i])
+        {
+            options |= n.flag;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses and adds one line.  Returns false if the line is invalid; sets
+// oom if it failed for lack of memory instead.
+static bool
+AddLine(PolicyBuilder& builder, unsigned line_number, wchar_t* line, size_t len, wchar_t* scratch, const wchar_t** tokens, bool* quoted, bool& oom)
+{
+    line[len] = '\0';
+
+    // Split into tokens, which are copied unquoted into scratch.
+    unsigned count = 0;
+    bool deny = false;
+    const wchar_t* p = line;
+    wchar_t* out = scratch;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            ++p;
+        if (!*p || *p == '#')
+            break;
+        // An unquoted ! before the program makes a deny rule.
+        if (count == LEVEL_PROGRAM && *p == '!')
+        {
+            deny = true;
+            ++p;
+        }
+        const wchar_t* const start = p;
+        tokens[count] = out;
+        p = ScanCommandArg(p, out);
+        *(out++) = '\0';
+        quoted[count] = false;
+        for (const wchar_t* q = start; q < p; ++q)
+            quoted[count] = quoted[count] || (*q == '"');
+        ++count;
+    }
+
+    if (!count)
+        return true;
+
+    // Split off the options.
+    unsigned options = 0;
+    unsigned patterns = count;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (!quoted[i] && !wcscmp(tokens[i], L":"))
+        {
+            patterns = i;
+            for (unsigned j = i + 1; j < count; ++j)
+            {
+                if (!ParseOption(tokens[j], options))
+                    return false;
+            }
+            break;
+        }
+    }
+
+    if (patterns < LEVEL_ARGS || !*tokens[LEVEL_USER])
+        return false;
+
+    const unsigned flags = deny ? unsigned(RULE_DENY) : 0u;
+    if (!*tokens[LEVEL_PROGRAM])
+        return false;
+
+    // "" is only allowed alone, meaning no arguments.
+    for (unsigned i = LEVEL_ARGS; i < patterns; ++i)
+    {
+        if (!*tokens[i] && patterns != LEVEL_ARGS + 1)
+            return false;
+    }
+
+    if (!builder.AddRule(line_number, flags, options, tokens, quoted, patterns))
+    {
+        oom = true;
+        return false;
+    }
+    return true;
+}
+
+unsigned char*
+CompilePolicy(const char* text, size_t len, const PolicyStamp& stamp, size_t& image_size, unsigned& error_line)
+{
+    error_line = 0;
+
+    // Skip a UTF-8 BOM.
+    if (len >= 3 && !memcmp(text, "\xef\xbb\xbf", 3))
+    {
+        text += 3;
+        len -= 3;
+    }
+
+    // A line can't have more tokens than half its length plus one, and the
+    // unquoted tokens plus terminators fit in twice its length.
+    size_t longest = 0;
+    for (size_t i = 0, start = 0; i <= len; ++i)
+    {
+        if (i == len || text[i] == '\n')
+        {
+            if (i - start > longest)
+                longest = i - start;
+            start = i + 1;
+        }
+    }
+
+    PolicyBuilder builder;
+    wchar_t* line = static_cast<wchar_t*>(malloc((longest * 2 + 1) * sizeof(*line)));
+    wchar_t* scratch = static_cast<wchar_t*>(malloc((longest * 4 + 2) * sizeof(*scratch)));
+    const wchar_t** tokens = static_cast<const wchar_t**>(malloc((longest + 2) * sizeof(*tokens)));
+    bool* quoted = static_cast<bool*>(malloc((longest + 2) * sizeof(*quoted)));
+    bool ok = (line && scratch && tokens && quoted && builder.Init());
+
+    unsigned line_number = 0;
+    for (size_t start = 0; ok && start <= len;)
+    {
+        const char* nl = static_cast<const char*>(memchr(text + start, '\n', len - start));
+        const size_t end = nl ? size_t(nl - text) : len;
+        ++line_number;
+
+        bool oom = false;
+        const size_t cch = DecodeUtf8(text + start, end - start, line);
+        if (!AddLine(builder, line_number, line, cch, scratch, tokens, quoted, oom))
+        {
+            if (!oom)
+                error_line = line_number;
+            ok = false;
+        }
+        start = end + 1;
+    }
+
+    unsigned char* image = ok ? builder.Serialize(stamp, image_size) : nullptr;
+    free(line);
+    free(scratch);
+    free(tokens);
+    free(quoted);
+    return image;
+}
+
+//------------------------------------------------------------------------------
+// Querying.
+
+struct PolicyImage::Query
+{
+    // For the user and program, [0] is the short form (name, or program
+    // name without extension) and [1] is the qualified form (DOMAIN\name,
+    // or the full path).  Arguments only have one form.
+    struct Token
+    {
+        const PolicyChar* s[2];
+        unsigned        len[2];
+    };
+
+    Token*          tokens;
+    unsigned        count;
+};
+
+bool
+PolicyImage::Attach(const void* p, size_t cb)
+{
+    m_p = nullptr;
+    const unsigned char* const image = static_cast<const unsigned char*>(p);
+    if (cb < c_header_size || memcmp(image, c_image_magic, sizeof(c_image_magic)) ||
+        GetU32(image + 8) != c_image_version || GetU32(image + 12) != cb)
+        return false;
+
+    const unsigned node_count = GetU32(image + 32);
+    const unsigned edge_count = GetU32(image + 40);
+    const unsigned rule_count = GetU32(image + 48);
+    const unsigned string_count = GetU32(image + 56);
+    const unsigned long long nodes_end = GetU32(image + 36) + (unsigned long long)node_count * c_node_size;
+    const unsigned long long edges_end = GetU32(image + 44) + (unsigned long long)edge_count * c_edge_size;
+    const unsigned long long rules_end = GetU32(image + 52) + (unsigned long long)rule_count * c_rule_size;
+    const unsigned long long strings_end = GetU32(image + 60) + (unsigned long long)string_count * 2;
+    if (!node_count || GetU32(image + 36) < c_header_size || GetU32(image + 44) < c_header_size ||
+        GetU32(image + 52) < c_header_size || GetU32(image + 60) < c_header_size ||
+        nodes_end > cb || edges_end > cb || rules_end > cb || strings_end > cb)
+        return false;
+
+    const unsigned char* const nodes = image + GetU32(image + 36);
+    const unsigned char* const edges = image + GetU32(image + 44);
+    for (unsigned i = 0; i < node_count; ++i)
+    {
+        const unsigned char* n = nodes + i * c_node_size;
+        const unsigned long long end = (unsigned long long)GetU32(n) + GetU32(n + 4) + GetU32(n + 8);
+        if (end > edge_count || GetU32(n + 12) > rule_count || GetU32(n + 16) > rule_count)
+            return false;
+    }
+    for (unsigned i = 0; i < edge_count; ++i)
+    {
+        const unsigned char* e = edges + i * c_edge_size;
+        if ((unsigned long long)GetU32(e) + GetU32(e + 4) > string_count ||
+            (GetU32(e + 8) & ~unsigned(EDGE_FLAGS_MASK)) || GetU32(e + 12) >= node_count)
+            return false;
+    }
+
+    m_p = image;
+    m_cb = cb;
+    m_node_count = node_count;
+    m_edge_count = edge_count;
+    m_rule_count = rule_count;
+    m_string_count = string_count;
+    m_nodes = nodes;
+    m_edges = edges;
+    m_rules = image + GetU32(image + 52);
+    m_strings = image + GetU32(image + 60);
+    return true;
+}
+
+bool
+PolicyImage::IsFrom(const PolicyStamp& stamp) const
+{
+    return m_p && GetU64(m_p + 16) == stamp.size && GetU64(m_p + 24) == stamp.mtime;
+}
+
+static int
+CompareEdge(const unsigned char* strings, const unsigned char* e, unsigned flags, const PolicyChar* s, unsigned len)
+{
+    const unsigned edge_flags = GetU32(e + 8);
+    if (edge_flags != flags)
+        return edge_flags < flags ? -1 : 1;
+
+    const unsigned str = GetU32(e);
+    const unsigned edge_len = GetU32(e + 4);
+    const unsigned n = edge_len < len ? edge_len : len;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        const PolicyChar c = GetChar(strings, str + i);
+        if (c != s[i])
+            return c < s[i] ? -1 : 1;
+    }
+    return (edge_len == len) ? 0 : (edge_len < len ? -1 : 1);
+}
+
+// Matches * and ? wildcards, backtracking to the most recent *.
+static bool
+GlobMatch(const unsigned char* strings, unsigned pattern, unsigned pattern_len, const PolicyChar* s, unsigned len)
+{
+    unsigned p = 0;
+    unsigned i = 0;
+    unsigned star = unsigned(-1);
+    unsigned star_i = 0;
+    while (i < len)
+    {
+        const PolicyChar c = (p < pattern_len) ? GetChar(strings, pattern + p) : 0;
+        if (p < pattern_len && c == '*')
+        {
+            star = p++;
+            star_i = i;
+        }
+        else if (p < pattern_len && (c == '?' || c == s[i]))
+        {
+            ++p;
+            ++i;
+        }
+        else if (star != unsigned(-1))
+        {
+            p = star + 1;
+            i = ++star_i;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pattern_len && GetChar(strings, pattern + p) == '*')
+        ++p;
+    return p == pattern_len;
+}
+
+void
+PolicyImage::Walk(const Query& query, unsigned node, unsigned level, unsigned& best) const
+{
+    const unsigned char* const n = m_nodes + node * c_node_size;
+    const unsigned rest_rule = GetU32(n + 16);
+    if (rest_rule > best)
+        best = rest_rule;
+    if (level == query.count)
+    {
+        const unsigned end_rule = GetU32(n + 12);
+        if (end_rule > best)
+            best = end_rule;
+        return;
+    }
+
+    const Query::Token& token = query.tokens[level];
+    const unsigned first = GetU32(n);
+    const unsigned literals = GetU32(n + 4);
+    const unsigned globs = GetU32(n + 8);
+
+    // Binary search the literal edges for each form of the token.
+    const unsigned forms = (level < LEVEL_ARGS) ? 2 : 1;
+    for (unsigned form = 0; form < forms; ++form)
+    {
+        unsigned lo = first;
+        unsigned hi = first + literals;
+        while (lo < hi)
+        {
+            const unsigned mid = lo + (hi - lo) / 2;
+            const unsigned char* e = m_edges + mid * c_edge_size;
+            const int cmp = CompareEdge(m_strings, e, form ? unsigned(EDGE_QUALIFIED) : 0u, token.s[form], token.len[form]);
+            if (!cmp)
+            {
+                Walk(query, GetU32(e + 12), level + 1, best);
+                break;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+
+    for (unsigned i = first + literals; i < first + literals + globs; ++i)
+    {
+        const unsigned char* e = m_edges + i * c_edge_size;
+        const unsigned form = (level < LEVEL_ARGS && (GetU32(e + 8) & EDGE_QUALIFIED)) ? 1 : 0;
+        if (GlobMatch(m_strings, GetU32(e), GetU32(e + 4), token.s[form], token.len[form]))
+            Walk(query, GetU32(e + 12), level + 1, best);
+    }
+}
+
+PolicyVerdict
+PolicyImage::Check(const PolicySubject& subject) const
+{
+    PolicyVerdict verdict = { PolicyDecision::NoMatch, 0, 0 };
+    if (!m_p)
+        return verdict;
+
+    // Fold every token once, up front.
+    const unsigned count = LEVEL_ARGS + subject.arg_count;
+    Query query = { static_cast<Query::Token*>(malloc(count * sizeof(Query::Token))), count };
+    PolicyArray<PolicyChar> folded;
+    if (!query.tokens)
+    {
+        verdict.decision = PolicyDecision::Deny;
+        return verdict;
+    }
+
+    // Offsets are recorded first, because the array can move as it grows.
+    unsigned offsets[2 * LEVEL_ARGS];
+    bool ok = true;
+    for (unsigned level = 0; ok && level < LEVEL_ARGS; ++level)
+    {
+        const wchar_t* s = level ? subject.program : subject.user;
+        const size_t len = wcslen(s);
+        size_t start = 0;
+        size_t short_len = len;
+        if (level == LEVEL_USER)
+        {
+            for (size_t i = 0; i < len; ++i)
+                if (s[i] == '\\')
+                    start = i + 1;
+        }
+        else
+        {
+            for (size_t i = 0; i < len; ++i)
+                if (IsPathSeparator(s[i]))
+                    start = i + 1;
+            short_len = start + StripProgramExtension(s + start, len - start);
+        }
+
+        offsets[level * 2] = folded.count;
+        ok = AppendFolded(folded, s + start, short_len - start, level == LEVEL_PROGRAM);
+        query.tokens[level].len[0] = folded.count - offsets[level * 2];
+        offsets[level * 2 + 1] = folded.count;
+        ok = ok && AppendFolded(folded, s, len, level == LEVEL_PROGRAM);
+        query.tokens[level].len[1] = folded.count - offsets[level * 2 + 1];
+    }
+
+    unsigned* arg_offsets = static_cast<unsigned*>(malloc((subject.arg_count + 1) * sizeof(*arg_offsets)));
+    ok = ok && arg_offsets;
+    for (unsigned i = 0; ok && i < subject.arg_count; ++i)
+    {
+        arg_offsets[i] = folded.count;
+        ok = AppendFolded(folded, subject.args[i], wcslen(subject.args[i]), false);
+        query.tokens[LEVEL_ARGS + i].len[0] = query.tokens[LEVEL_ARGS + i].len[1] = folded.count - arg_offsets[i];
+    }
+
+    if (ok)
+    {
+        static const PolicyChar c_empty = 0;
+        const PolicyChar* base = folded.p ? folded.p : &c_empty;
+        for (unsigned level = 0; level < LEVEL_ARGS; ++level)
+        {
+            query.tokens[level].s[0] = base + offsets[level * 2];
+            query.tokens[level].s[1] = base + offsets[level * 2 + 1];
+        }
+        for (unsigned i = 0; i < subject.arg_count; ++i)
+            query.tokens[LEVEL_ARGS + i].s[0] = query.tokens[LEVEL_ARGS + i].s[1] = base + arg_offsets[i];
+
+        unsigned best = 0;
+        Walk(query, 0, 0, best);
+
+        if (best)
+        {
+            const unsigned char* rule = m_rules + (best - 1) * c_rule_size;
+            verdict.line = GetU32(rule);
+            verdict.missing = subject.options & ~GetU32(rule + 8);
+            if (GetU32(rule + 4) & RULE_DENY)
+                verdict.decision = PolicyDecision::Deny;
+            else if (verdict.missing)
+                verdict.decision = PolicyDecision::NeedsOption;
+            else
+                verdict.decision = PolicyDecision::Allow;
+        }
+    }
+    else
+    {
+        verdict.decision = PolicyDecision::Deny;
+    }
+
+    free(arg_offsets);
+    free(query.tokens);
+    return verdict;
+}
+
+PolicyVerdict
+PolicyImage::CheckCommandLine(const wchar_t* user, const wchar_t* line, const wchar_t* program_path, unsigned options) const
+{
+    // Unquoted copies plus terminators fit in twice the length, and there
+    // can't be more arguments than characters.
+    const size_t len = wcslen(line);
+    wchar_t* buffer = static_cast<wchar_t*>(malloc((len * 2 + 2) * sizeof(*buffer)));
+    const wchar_t** args = static_cast<const wchar_t**>(malloc((len + 1) * sizeof(*args)));
+    if (!buffer || !args)
+    {
+        free(buffer);
+        free(args);
+        const PolicyVerdict verdict = { PolicyDecision::Deny, 0, 0 };
+        return verdict;
+    }
+
+    wchar_t* out = buffer;
+    const wchar_t* program = out;
+    const wchar_t* p = ScanProgramName(line, out);
+    *(out++) = '\0';
+
+    unsigned count = 0;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (!*p)
+            break;
+        args[count++] = out;
+        p = ScanCommandArg(p, out);
+        *(out++) = '\0';
+    }
+
+    const PolicySubject subject = { user, program_path ? program_path : program, args, count, options };
+    const PolicyVerdict verdict = Check(subject);
+    free(buffer);
+    free(args);
+    return verdict;
+}
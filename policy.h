@@ -0,0 +1,107 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Sudoers-style rules, saying which users may run which commands with which
+// arguments.  Each line of the rule file is:
+//
+//      user  [!]program  [arg patterns...]  [: options...]
+//
+//  - user is a user name, DOMAIN\name, or ALL.
+//  - program is a program name (e.g. net or net.exe), a full path, or ALL.
+//    A name matches the program in any directory, and a path only matches
+//    that exact program.  A ! makes the rule deny instead of allow.
+//  - Each arg pattern matches one argument.  With no arg patterns, any
+//    arguments are allowed; "" alone allows no arguments; and * as the last
+//    pattern allows any further arguments.
+//  - options are sudo options the rule allows:  background (-b), shell (the
+//    command line uses CMD syntax such as pipes or redirection), setenv
+//    (-E), or ALL.
+//
+// Users, programs, and arguments may use the * and ? wildcards, and are
+// matched case-insensitively (for ASCII letters).  Tokens are quoted the
+// same way as command line arguments.  # starts a comment.  The last rule
+// that matches a command decides; if no rule matches, the command is denied.
+//
+// The rules are compiled into a trie over (user, program, arg, arg, ...),
+// where each node's literal edges are sorted for binary search.  The trie is
+// stored in a flat, position independent image, so the image can be saved
+// and later memory mapped and queried directly, without parsing anything.
+
+enum : unsigned
+{
+    POLICY_OPT_BACKGROUND       = 0x0001,
+    POLICY_OPT_SHELL            = 0x0002,
+    POLICY_OPT_SETENV           = 0x0004,
+    POLICY_OPT_ALL              = 0x0007,
+};
+
+// Identifies the rule file an image was compiled from, so a saved image can
+// be recognized as out of date.
+struct PolicyStamp
+{
+    unsigned long long  size;
+    unsigned long long  mtime;
+};
+
+// Compiles rules (UTF-8 text) into a malloc'd image.  Returns nullptr if
+// out of memory, or if the rules are invalid (error_line is then the line
+// number, otherwise 0).
+unsigned char* CompilePolicy(const char* text, size_t len, const PolicyStamp& stamp, size_t& image_size, unsigned& error_line);
+
+struct PolicySubject
+{
+    const wchar_t*      user;           // DOMAIN\name or name.
+    const wchar_t*      program;        // Full path if known, else as typed.
+    const wchar_t* const* args;
+    unsigned            arg_count;
+    unsigned            options;        // POLICY_OPT_ flags that are in use.
+};
+
+enum class PolicyDecision : unsigned char
+{
+    Allow,
+    Deny,                               // A deny rule matched.
+    NoMatch,                            // No rule matched.
+    NeedsOption,                        // The rule doesn't allow an option.
+};
+
+struct PolicyVerdict
+{
+    PolicyDecision      decision;
+    unsigned            line;           // Line number of the deciding rule.
+    unsigned            missing;        // POLICY_OPT_ flags not allowed.
+};
+
+// A read-only view of an image (e.g. memory mapped from a file).
+class PolicyImage
+{
+public:
+    // Validates the whole image once, so that queries don't need to.
+    bool                Attach(const void* p, size_t cb);
+    bool                IsFrom(const PolicyStamp& stamp) const;
+
+    PolicyVerdict       Check(const PolicySubject& subject) const;
+
+    // Splits a command line into program and arguments, and checks it.
+    // program_path, if not null, replaces the program name for matching.
+    PolicyVerdict       CheckCommandLine(const wchar_t* user, const wchar_t* line, const wchar_t* program_path, unsigned options) const;
+
+private:
+    struct Query;
+    void                Walk(const Query& query, unsigned node, unsigned level, unsigned& best) const;
+
+    const unsigned char* m_p = nullptr;
+    size_t              m_cb = 0;
+    unsigned            m_node_count = 0;
+    unsigned            m_edge_count = 0;
+    unsigned            m_rule_count = 0;
+    const unsigned char* m_nodes = nullptr;
+    const unsigned char* m_edges = nullptr;
+    const unsigned char* m_rules = nullptr;
+    const unsigned char* m_strings = nullptr;
+    unsigned            m_string_count = 0;
+};
@@ -0,0 +1,485 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark and fuzzer for the sudoers policy engine.
+//
+// The benchmark compiles a large generated rule set, saves the image, maps
+// it back in, and times queries against it.  The fuzzer compiles random
+// small rule sets and checks every query against a simple reference that
+// tries each rule in turn, and then feeds damaged text and images to the
+// compiler and to Attach() to check they are rejected or handled safely.
+//
+//      g++ -std=c++17 -O2 policybench.cpp policy.cpp cmdline.cpp -o policybench
+//      ./policybench [-r rules] [-q queries] [-z iterations] [-s seed]
+//
+// Building with -DPOLICY_FUZZER instead provides LLVMFuzzerTestOneInput():
+//
+//      clang++ -std=c++17 -g -fsanitize=fuzzer,address -DPOLICY_FUZZER policybench.cpp policy.cpp cmdline.cpp
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "policy.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const PolicyStamp c_stamp = { 1234, 5678 };
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const wchar_t* const c_sample_user = L"CONTOSO\\alice";
+static const wchar_t* const c_sample_program = L"C:\\Windows\\System32\\net.exe";
+static const wchar_t* const c_sample_args[] = { L"user", L"alice", L"/add" };
+
+#ifdef POLICY_FUZZER
+
+extern "C" int
+LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+    PolicyImage image;
+    const PolicySubject subject = { c_sample_user, c_sample_program, c_sample_args, 3, POLICY_OPT_SHELL };
+
+    // The input as rule text.
+    size_t image_size;
+    unsigned error_line;
+    unsigned char* compiled = CompilePolicy(reinterpret_cast<const char*>(data), size, c_stamp, image_size, error_line);
+    if (compiled)
+    {
+        if (!image.Attach(compiled, image_size))
+            abort();
+        image.Check(subject);
+        image.CheckCommandLine(L"alice", L"\"C:\\Program Files\\x.exe\" a \"b c\" \"\"", nullptr, 0);
+        free(compiled);
+    }
+
+    // The input as an image.
+    unsigned char* copy = static_cast<unsigned char*>(malloc(size ? size : 1));
+    memcpy(copy, data, size);
+    if (image.Attach(copy, size))
+        image.Check(subject);
+    free(copy);
+    return 0;
+}
+
+#else // !POLICY_FUZZER
+
+//------------------------------------------------------------------------------
+// Reference matcher.
+
+struct RefRule
+{
+    const char*         user;
+    const char*         program;
+    const char*         args[4];
+    unsigned            arg_count;
+    bool                deny;
+    unsigned            options;
+};
+
+static wchar_t
+Fold(wchar_t c)
+{
+    if (c == '/')
+        c = '\\';
+    return (c >= 'A' && c <= 'Z') ? wchar_t(c - 'A' + 'a') : c;
+}
+
+static bool
+RefGlob(const char* pattern, const wchar_t* s)
+{
+    if (!*pattern)
+        return !*s;
+    if (*pattern == '*')
+        return RefGlob(pattern + 1, s) || (*s && RefGlob(pattern, s + 1));
+    if (!*s)
+        return false;
+    if (*pattern != '?' && Fold(wchar_t(*pattern)) != Fold(*s))
+        return false;
+    return RefGlob(pattern + 1, s + 1);
+}
+
+static void
+StripExtension(wchar_t* s)
+{
+    const size_t len = wcslen(s);
+    if (len >= 4)
+    {
+        const wchar_t* ext = s + len - 4;
+        static const wchar_t* const c_exts[] = { L".exe", L".com", L".bat", L".cmd" };
+        for (const wchar_t* e : c_exts)
+        {
+            if (wcscasecmp(ext, e) == 0)
+                s[len - 4] = '\0';
+        }
+    }
+}
+
+static bool
+RefMatch(const RefRule& rule, const PolicySubject& subject)
+{
+    // User.
+    if (strcmp(rule.user, "ALL"))
+    {
+        const wchar_t* name = subject.user;
+        if (!strchr(rule.user, '\\') && wcsrchr(name, '\\'))
+            name = wcsrchr(name, '\\') + 1;
+        if (!RefGlob(rule.user, name))
+            return false;
+    }
+
+    // Program.
+    if (strcmp(rule.program, "ALL"))
+    {
+        if (strpbrk(rule.program, "\\/:"))
+        {
+            if (!RefGlob(rule.program, subject.program))
+                return false;
+        }
+        else
+        {
+            const wchar_t* base = subject.program;
+            for (const wchar_t* p = base; *p; ++p)
+                if (*p == '\\' || *p == '/' || *p == ':')
+                    base = p + 1;
+            wchar_t name[64];
+            wchar_t pattern[64];
+            swprintf(name, 64, L"%ls", base);
+            swprintf(pattern, 64, L"%s", rule.program);
+            StripExtension(name);
+            StripExtension(pattern);
+            char narrow[64];
+            for (size_t i = 0; i < 64 && (i == 0 || pattern[i - 1]); ++i)
+                narrow[i] = char(pattern[i]);
+            if (!RefGlob(narrow, name))
+                return false;
+        }
+    }
+
+    // Arguments.
+    unsigned count = rule.arg_count;
+    bool rest = !count;
+    if (count == 1 && !*rule.args[0])
+        count = 0;
+    else if (count && !strcmp(rule.args[count - 1], "*"))
+    {
+        --count;
+        rest = true;
+    }
+    if (rest ? subject.arg_count < count : subject.arg_count != count)
+        return false;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (!RefGlob(rule.args[i], subject.args[i]))
+            return false;
+    }
+    return true;
+}
+
+static PolicyVerdict
+RefCheck(const RefRule* rules, unsigned count, const PolicySubject& subject)
+{
+    PolicyVerdict verdict = { PolicyDecision::NoMatch, 0, 0 };
+    for (unsigned i = count; i--;)
+    {
+        const RefRule& rule = rules[i];
+        if (!RefMatch(rule, subject))
+            continue;
+        verdict.line = i + 1;
+        verdict.missing = subject.options & ~rule.options;
+        if (rule.deny)
+            verdict.decision = PolicyDecision::Deny;
+        else if (verdict.missing)
+            verdict.decision = PolicyDecision::NeedsOption;
+        else
+            verdict.decision = PolicyDecision::Allow;
+        break;
+    }
+    return verdict;
+}
+
+// Renders rules as text, one per line, so that line numbers are rule
+// numbers.
+static char*
+RenderRules(const RefRule* rules, unsigned count, size_t& len)
+{
+    size_t capacity = 256 + size_t(count) * 160;
+    char* text = static_cast<char*>(malloc(capacity));
+    len = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const RefRule& rule = rules[i];
+        const char* quote = strchr(rule.program, ' ') ? "\"" : "";
+        len += snprintf(text + len, capacity - len, "%s %s%s%s%s", rule.user, rule.deny ? "!" : "", quote, rule.program, quote);
+        for (unsigned j = 0; j < rule.arg_count; ++j)
+        {
+            const char* arg = rule.args[j];
+            if (!*arg || strchr(arg, ' '))
+                len += snprintf(text + len, capacity - len, " \"%s\"", arg);
+            else
+                len += snprintf(text + len, capacity - len, " %s", arg);
+        }
+        if (rule.options)
+        {
+            len += snprintf(text + len, capacity - len, " :%s%s%s",
+                            (rule.options & POLICY_OPT_BACKGROUND) ? " background" : "",
+                            (rule.options & POLICY_OPT_SHELL) ? " shell" : "",
+                            (rule.options & POLICY_OPT_SETENV) ? " setenv" : "");
+        }
+        len += snprintf(text + len, capacity - len, (i & 3) ? "\n" : "\t# comment\r\n");
+    }
+    return text;
+}
+
+static bool
+SameVerdict(const PolicyVerdict& a, const PolicyVerdict& b)
+{
+    return a.decision == b.decision && a.line == b.line && a.missing == b.missing;
+}
+
+//------------------------------------------------------------------------------
+// Fuzzing.
+
+static const char* const c_fuzz_users[] = { "alice", "BOB", "contoso\\alice", "*\\bob", "a*", "?o?", "ALL" };
+static const char* const c_fuzz_programs[] = { "net", "NET.exe", "c:\\w\\net.exe", "c:/w/*", "n?t", "*.com", "ALL", "x y" };
+static const char* const c_fuzz_args[] = { "a", "A", "*", "?", "b*", "a b", "", "*a*" };
+
+static const wchar_t* const c_query_users[] = { L"CONTOSO\\Alice", L"alice", L"bob", L"x\\BOB", L"carol" };
+static const wchar_t* const c_query_programs[] = { L"C:\\W\\Net.exe", L"c:/w/net.EXE", L"D:\\net.com", L"nat", L"x y.bat", L"net" };
+static const wchar_t* const c_query_args[] = { L"a", L"A", L"b", L"ba", L"", L"a b", L"xax" };
+
+template <class T, size_t N>
+static T
+Pick(T const (&array)[N])
+{
+    return array[Random(N)];
+}
+
+static bool
+FuzzCompare(unsigned iterations)
+{
+    for (unsigned iteration = 0; iteration < iterations; ++iteration)
+    {
+        RefRule rules[12];
+        const unsigned count = 1 + Random(12);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            RefRule& rule = rules[i];
+            rule.user = Pick(c_fuzz_users);
+            rule.program = Pick(c_fuzz_programs);
+            rule.arg_count = Random(4);
+            for (unsigned j = 0; j < rule.arg_count; ++j)
+            {
+                rule.args[j] = Pick(c_fuzz_args);
+                if (!*rule.args[j] && rule.arg_count > 1)
+                    rule.args[j] = "a";
+            }
+            rule.deny = !Random(4);
+            rule.options = Random(8);
+        }
+
+        size_t len;
+        char* text = RenderRules(rules, count, len);
+        size_t image_size;
+        unsigned error_line;
+        unsigned char* compiled = CompilePolicy(text, len, c_stamp, image_size, error_line);
+        PolicyImage image;
+        if (!compiled || !image.Attach(compiled, image_size))
+        {
+            fprintf(stderr, "compile failed at line %u:\n%s", error_line, text);
+            return false;
+        }
+
+        for (unsigned q = 0; q < 64; ++q)
+        {
+            const wchar_t* args[3];
+            const unsigned arg_count = Random(4);
+            for (unsigned j = 0; j < arg_count; ++j)
+                args[j] = Pick(c_query_args);
+            const PolicySubject subject = { Pick(c_query_users), Pick(c_query_programs), args, arg_count, Random(8) };
+
+            const PolicyVerdict expected = RefCheck(rules, count, subject);
+            const PolicyVerdict actual = image.Check(subject);
+            if (!SameVerdict(expected, actual))
+            {
+                fprintf(stderr, "mismatch for %ls %ls (%u args, options %u): expected %u line %u, got %u line %u\n%s",
+                        subject.user, subject.program, arg_count, subject.options,
+                        unsigned(expected.decision), expected.line, unsigned(actual.decision), actual.line, text);
+                return false;
+            }
+        }
+
+        // Damage the text and the image; neither may crash.
+        for (unsigned m = 0; m < 8; ++m)
+        {
+            char* bad_text = static_cast<char*>(malloc(len + 1));
+            memcpy(bad_text, text, len);
+            for (unsigned k = 1 + Random(4); k--;)
+                bad_text[Random(unsigned(len))] = char(Random(256));
+            size_t bad_size;
+            unsigned char* bad_compiled = CompilePolicy(bad_text, Random(unsigned(len + 1)), c_stamp, bad_size, error_line);
+            free(bad_compiled);
+            free(bad_text);
+
+            unsigned char* bad_image = static_cast<unsigned char*>(malloc(image_size));
+            memcpy(bad_image, compiled, image_size);
+            for (unsigned k = 1 + Random(4); k--;)
+                bad_image[Random(unsigned(image_size))] = (unsigned char)Random(256);
+            PolicyImage damaged;
+            if (damaged.Attach(bad_image, image_size))
+            {
+                const PolicySubject subject = { c_sample_user, c_sample_program, c_sample_args, 3, 0 };
+                damaged.Check(subject);
+            }
+            free(bad_image);
+        }
+
+        free(compiled);
+        free(text);
+    }
+
+    printf("fuzz             %8u rule sets checked against the reference\n", iterations);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static char*
+GenerateRules(unsigned count, size_t& len)
+{
+    size_t capacity = 256 + size_t(count) * 96;
+    char* text = static_cast<char*>(malloc(capacity));
+    len = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        switch (i % 8)
+        {
+        case 0:     len += snprintf(text + len, capacity - len, "user%u prog%u\n", i % 1000, i); break;
+        case 1:     len += snprintf(text + len, capacity - len, "user%u prog%u \"\"\n", i % 1000, i); break;
+        case 2:     len += snprintf(text + len, capacity - len, "CORP\\user%u C:\\Tools\\prog%u.exe -v *\n", i % 1000, i); break;
+        case 3:     len += snprintf(text + len, capacity - len, "user%u prog%u arg%u file*.txt : background\n", i % 1000, i, i); break;
+        case 4:     len += snprintf(text + len, capacity - len, "user%u !prog%u --force *\n", i % 1000, i); break;
+        case 5:     len += snprintf(text + len, capacity - len, "user%u prog%u-* *\n", i % 1000, i); break;
+        case 6:     len += snprintf(text + len, capacity - len, "ALL prog%u status : shell\n", i); break;
+        default:    len += snprintf(text + len, capacity - len, "user%u prog%u a b c d\n", i % 1000, i); break;
+        }
+    }
+    return text;
+}
+
+static bool
+RunBench(unsigned rules, unsigned queries)
+{
+    size_t len;
+    char* text = GenerateRules(rules, len);
+
+    unsigned long long start = NowMicroseconds();
+    size_t image_size;
+    unsigned error_line;
+    unsigned char* compiled = CompilePolicy(text, len, c_stamp, image_size, error_line);
+    const unsigned long long compile_time = NowMicroseconds() - start;
+    free(text);
+    if (!compiled)
+    {
+        fprintf(stderr, "compile failed at line %u.\n", error_line);
+        return false;
+    }
+
+    // Save the image and map it back in, as sudo does.
+    const char* file = "policybench.bin";
+    const int fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    const bool written = fd >= 0 && write(fd, compiled, image_size) == ssize_t(image_size);
+    free(compiled);
+    if (!written)
+        return false;
+
+    start = NowMicroseconds();
+    void* view = mmap(nullptr, image_size, PROT_READ, MAP_SHARED, fd, 0);
+    PolicyImage image;
+    if (view == MAP_FAILED || !image.Attach(view, image_size) || !image.IsFrom(c_stamp))
+        return false;
+    const unsigned long long attach_time = NowMicroseconds() - start;
+
+    wchar_t user[32];
+    wchar_t program[64];
+    wchar_t arg[32];
+    const wchar_t* args[4] = { arg, L"file1.txt", L"c", L"d" };
+    unsigned allowed = 0;
+    start = NowMicroseconds();
+    for (unsigned i = 0; i < queries; ++i)
+    {
+        const unsigned r = Random(rules);
+        swprintf(user, 32, (r % 8 == 2) ? L"CORP\\user%u" : L"user%u", r % 1000);
+        swprintf(program, 64, L"C:\\Tools\\prog%u.exe", r);
+        swprintf(arg, 32, (r % 8 == 3) ? L"arg%u" : L"-v", r);
+        const PolicySubject subject = { user, program, args, 1 + (r % 4), (r % 8 == 3) ? POLICY_OPT_BACKGROUND : 0u };
+        allowed += image.Check(subject).decision == PolicyDecision::Allow;
+    }
+    const unsigned long long query_time = NowMicroseconds() - start;
+
+    printf("compile          %8u rules    %8.1f ms  %10zu byte image\n", rules, compile_time / 1000.0, image_size);
+    printf("map and attach   %8.1f ms\n", attach_time / 1000.0);
+    printf("query            %8u queries  %8.1f ms  %10.2f us/query  (%u allowed)\n",
+           queries, query_time / 1000.0, double(query_time) / (queries ? queries : 1), allowed);
+
+    munmap(view, image_size);
+    close(fd);
+    unlink(file);
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned rules = 100000;
+    unsigned queries = 1000000;
+    unsigned iterations = 2000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            rules = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-q") && i + 1 < argc)
+            queries = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: policybench [-r rules] [-q queries] [-z iterations] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!rules)
+        return 1;
+
+    if (!FuzzCompare(iterations) || !RunBench(rules, queries))
+        return 1;
+    return 0;
+}
+
+#endif // !POLICY_FUZZER
@@ -175,11 +175,60 @@ workspace("sudo")
     configuration("*")
         includedirs(".build")           -- for commit_file.h
 
+--------------------------------------------------------------------------------
+-- The C API in libsudo.h for launching commands in-process, and the launch
+-- internals that sudo shares with it.  sudo doesn't use the C API itself.
+define_lib("libsudo")
+    targetname("libsudo")
+    files("libsudo.cpp")
+    files("launch.cpp")
+    files("arena.cpp")
+    files("cmdline.cpp")
+    files("controls.cpp")
+    files("password.cpp")
+    files("resolve.cpp")
+    files("stats.cpp")
+    files("watchdog.cpp")
+    if os.istarget("linux") then
+        files("platform_posix.cpp")
+    else
+        files("platform_win.cpp")
+        files("job.cpp")
+    end
+
+    configuration("vs*")
+        defines("_HAS_EXCEPTIONS=0")
+        defines("_CRT_SECURE_NO_WARNINGS")
+        defines("_CRT_NONSTDC_NO_WARNINGS")
+
+    configuration("gmake")
+        buildoptions("-std=c++17")
+
 --------------------------------------------------------------------------------
 define_exe("sudo")
     targetname("sudo")
     files("main.cpp")
+    files("audit.cpp")
+    files("batch.cpp")
+    files("batchrun.cpp")
+    files("broker.cpp")
+    files("brokerwire.cpp")
+    files("coalesce.cpp")
+    files("handoff.cpp")
+    files("iolog.cpp")
+    files("jobrecord.cpp")
+    files("jobtable.cpp")
+    files("logonagent.cpp")
+    files("logoncache.cpp")
+    files("options.cpp")
+    files("pipe.cpp")
+    files("policy.cpp")
+    files("prompt.cpp")
+    files("session.cpp")
+    files("trace.cpp")
+    files("writer.cpp")
     files("version.rc")
+    links("libsudo")
 
     configuration("vs*")
         defines("_HAS_EXCEPTIONS=0")
@@ -191,6 +240,77 @@ define_exe("sudo")
         buildoptions("-std=c++17")
         linkgroups("on")
 
+--------------------------------------------------------------------------------
+-- sudo without the C runtime (see sudo_min.cpp):  its own entry point, and
+-- only kernel32, advapi32, and shell32.  Compare it with sudo.exe using
+-- `premake5 startup`.
+define_exe("sudo-min")
+    targetname("sudo-min")
+    files("sudo_min.cpp")
+    files("options.cpp")
+    files("cmdline.cpp")
+    files("version.rc")
+    rtti("off")
+    links({"kernel32", "shell32"})
+
+    configuration("vs*")
+        defines("_HAS_EXCEPTIONS=0")
+        flags({"NoRuntimeChecks", "NoBufferSecurityCheck"})
+        entrypoint("SudoMinMain")
+        linkoptions("/NODEFAULTLIB")
+
+    configuration("gmake")
+        buildoptions("-std=c++17")
+        buildoptions("-fno-exceptions")
+        buildoptions("-fno-asynchronous-unwind-tables")
+        buildoptions("-fno-stack-protector")
+        buildoptions("-ffreestanding")  -- else -O2 turns loops into strlen() calls
+        linkoptions("-nostdlib")
+        linkoptions("-Wl,--gc-sections")
+        links("gcc")                    -- only for ___chkstk_ms and the like
+
+    configuration({"gmake", "x32"})
+        linkoptions("-Wl,-e,_SudoMinMain")
+
+    configuration({"gmake", "x64"})
+        linkoptions("-Wl,-e,SudoMinMain")
+
+--------------------------------------------------------------------------------
+-- Only uses the standard library, so recordings can also be played back on
+-- other platforms (e.g. `g++ -std=c++17 -O2 sudoreplay.cpp iolog.cpp`).
+define_exe("sudoreplay")
+    targetname("sudoreplay")
+    files("sudoreplay.cpp")
+    files("iolog.cpp")
+
+    configuration("vs*")
+        defines("_CRT_SECURE_NO_WARNINGS")
+
+    configuration("gmake")
+        buildoptions("-std=c++17")
+
+--------------------------------------------------------------------------------
+-- The portable parts of sudo on platform_posix.cpp, so they can be profiled
+-- and run under sanitizers with the Linux toolchain (`premake5 gmake` on
+-- Linux, then e.g. `make config=debug_x64 sudo-posix`).  See sudo_posix.cpp.
+if os.istarget("linux") then
+define_exe("sudo-posix")
+    targetname("sudo-posix")
+    files("sudo_posix.cpp")
+    files("options.cpp")
+    files("trace.cpp")
+    files("writer.cpp")
+    links("libsudo")
+
+    configuration("gmake")
+        buildoptions("-std=c++17")
+        buildoptions("-fno-omit-frame-pointer")     -- for perf
+
+    configuration({"gmake", "debug"})
+        buildoptions("-fsanitize=address,undefined")
+        linkoptions("-fsanitize=address,undefined")
+end
+
 --------------------------------------------------------------------------------
 local any_warnings_or_failures = nil
 
@@ -429,3 +549,405 @@ newaction {
     end
 }
 
+
+
+--------------------------------------------------------------------------------
+newoption {
+    trigger = "exe",
+    value = "path",
+    description = "bench: sudo to time (default is the x64 release sudo.exe, or on Linux a sudo-posix the action builds)",
+}
+
+newoption {
+    trigger = "iterations",
+    value = "n",
+    description = "bench: number of sudo invocations to time (default 1000)",
+}
+
+newoption {
+    trigger = "sudo-args",
+    value = "args",
+    description = "bench: extra sudo options, e.g. --broker=60",
+}
+
+newoption {
+    trigger = "save-baseline",
+    description = "bench: save the results as the new baseline for this platform",
+}
+
+--------------------------------------------------------------------------------
+-- The baseline is committed, with separate entries for sudo.exe ("windows.")
+-- and sudo-posix ("posix.").  The arena counters are the gate:  the bench
+-- runs a copy of sudo from a fixed directory with a fixed environment, so
+-- they don't depend on the machine, and any increase is a regression.  Times
+-- do depend on the machine, so they are only reported, unless the baseline
+-- has times for the platform (added by hand on a machine kept for
+-- benchmarking); then they may grow by the tolerance.
+local bench_baseline_file = "bench_baseline.txt"
+local bench_tolerance = 1.25
+local bench_dir = os.ishost("linux") and "/tmp/sudo-bench" or ((os.getenv("SystemDrive") or "C:") .. "\\sudo-bench")
+
+-- Trace files are numbered from here, so their names are all the same length.
+local bench_first_trace = 1000001
+
+local bench_posix_sources = {
+    "sudo_posix.cpp", "options.cpp", "trace.cpp", "writer.cpp", "libsudo.cpp",
+    "launch.cpp", "platform_posix.cpp", "arena.cpp", "cmdline.cpp", "controls.cpp",
+    "password.cpp", "resolve.cpp", "stats.cpp", "watchdog.cpp",
+}
+
+--------------------------------------------------------------------------------
+-- Reads a trace written by both sudo processes.  Returns the time from the
+-- earliest span to the end of the latest span, in milliseconds, which covers
+-- both processes from parsing options until the command has exited.  Also
+-- returns the arena counters of each process, keyed "sudo" and "elevated".
+local function read_trace(file)
+    local f = io.open(file, "r")
+    if not f then
+        return nil
+    end
+    local text = f:read("*all")
+    f:close()
+
+    -- Each process appends "{...},\n" lines, with no closing bracket.
+    local events = json.decode(text:gsub("[%s,]*$", "") .. "]")
+    if not events then
+        return nil
+    end
+
+    local names = {}
+    for _,e in ipairs(events) do
+        if e.ph == "M" and e.name == "process_name" then
+            names[e.pid] = e.args.name:find("^sudo %-%-elevated") and "elevated" or "sudo"
+        end
+    end
+
+    local first, last
+    local counters = {}
+    for _,e in ipairs(events) do
+        if e.ph == "X" then
+            if not first or e.ts < first then first = e.ts end
+            if not last or e.ts + e.dur > last then last = e.ts + e.dur end
+        elseif e.ph == "C" and e.name == "arena" and names[e.pid] then
+            for key, value in pairs(e.args) do
+                counters[names[e.pid] .. "_" .. key] = value
+            end
+        end
+    end
+    return first and (last - first) / 1000, counters
+end
+
+--------------------------------------------------------------------------------
+local function percentile(sorted, p)
+    return sorted[math.max(1, math.ceil(#sorted * p / 100))]
+end
+
+--------------------------------------------------------------------------------
+local function format_result(value)
+    if math.floor(value) == value then
+        return string.format("%.0f", value)
+    end
+    return string.format("%.2f", value)
+end
+
+--------------------------------------------------------------------------------
+local function read_baseline()
+    local baseline = {}
+    local f = io.open(bench_baseline_file, "r")
+    if not f then
+        return nil
+    end
+    for line in f:lines() do
+        local name, value = line:match("^([%w_.]+)%s*=%s*([%d.]+)")
+        if name then
+            baseline[name] = tonumber(value)
+        end
+    end
+    f:close()
+    return baseline
+end
+
+--------------------------------------------------------------------------------
+-- Replaces this platform's entries for names in the baseline, keeping the
+-- others.
+local function save_baseline(platform, names, results)
+    local lines = {}
+    local f = io.open(bench_baseline_file, "r")
+    if f then
+        for line in f:lines() do
+            local name = line:match("^" .. platform .. "%.([%w_]+)")
+            if not name or not table.contains(names, name) then
+                table.insert(lines, line)
+            end
+        end
+        f:close()
+    end
+    for _,name in ipairs(names) do
+        if results[name] then
+            table.insert(lines, string.format("%s.%s = %s", platform, name, format_result(results[name])))
+        end
+    end
+    table.sort(lines)
+    f = io.open(bench_baseline_file, "w")
+    f:write(table.concat(lines, "\n") .. "\n")
+    f:close()
+end
+
+--------------------------------------------------------------------------------
+-- Runs `"exe" args command` iterations times in one loop, with its output
+-- discarded, and returns the wall clock milliseconds per invocation and how
+-- many invocations failed.  The args can use $i for the iteration number
+-- (from first, default 1).  With a dir, the loop runs there with only a
+-- fixed %PATH% (and on Linux nothing else) in its environment.  The loop is
+-- a PowerShell script timed with Measure-Command, or on Linux a sh script
+-- timed with `date +%s%N`, since os.time() only counts whole seconds and
+-- os.clock() only counts premake's own CPU time.
+local function time_invocations(exe, args, command, iterations, first, dir)
+    local posix = os.ishost("linux")
+    local script = path.getabsolute(".build/bench/loop" .. (posix and ".sh" or ".ps1"))
+    first = first or 1
+    local last = first + iterations - 1
+    local text
+    if posix then
+        text = {
+            dir and ('cd "' .. dir .. '" || exit 1') or '',
+            'failed=0',
+            'start=$(date +%s%N)',
+            'i=' .. first,
+            'while [ $i -le ' .. last .. ' ]; do',
+            '    "' .. exe .. '" ' .. args .. ' ' .. command .. ' >/dev/null 2>&1 || failed=$((failed + 1))',
+            '    i=$((i + 1))',
+            'done',
+            'end=$(date +%s%N)',
+            'echo $(((end - start) / 1000)) $failed',
+        }
+    else
+        -- No "--" before the command; Windows PowerShell drops it from the
+        -- arguments of native programs.
+        text = {
+            dir and ('Set-Location "' .. dir .. '"; $env:PATH = "$env:SystemRoot\\system32;$env:SystemRoot"') or '',
+            '$failed = 0',
+            '$elapsed = Measure-Command {',
+            '    for ($i = ' .. first .. '; $i -le ' .. last .. '; $i++) {',
+            '        & "' .. exe .. '" ' .. args .. ' ' .. command .. ' *> $null',
+            '        if ($LASTEXITCODE -ne 0) { $script:failed++ }',
+            '    }',
+            '}',
+            '"$([long]($elapsed.Ticks / 10)) $failed"',
+        }
+    end
+
+    local f = io.open(script, "w")
+    if not f then
+        error("Unable to write '" .. script .. "'")
+    end
+    f:write(table.concat(text, "\n") .. "\n")
+    f:close()
+
+    local prev_norm = path.normalize
+    path.normalize = function (x) return x end
+    local shell = (dir and "env -i PATH=/usr/bin:/bin " or "") .. 'sh "' .. script .. '"'
+    local out = os.outputof(posix and shell or ('powershell -NoProfile -ExecutionPolicy Bypass -File "' .. path.translate(script) .. '"'))
+    path.normalize = prev_norm
+
+    local us, failures = (out or ""):match("(%d+)%s+(%d+)%s*$")
+    if not us then
+        return nil
+    end
+    return tonumber(us) / 1000 / iterations, tonumber(failures)
+end
+
+--------------------------------------------------------------------------------
+-- Builds sudo-posix for the bench, optimized and without sanitizers.
+local function build_bench_posix(exe)
+    local cmd = "g++ -std=c++17 -O2 -I.build -o " .. exe .. " " .. table.concat(bench_posix_sources, " ")
+    print("Building " .. exe)
+    local _, _, ret = os.execute(cmd)
+    if ret ~= 0 then
+        error("Unable to build " .. exe)
+    end
+end
+
+--------------------------------------------------------------------------------
+newaction {
+    trigger = "bench",
+    description = "Times sudo invocations end to end and checks them against the baseline; on Windows run it from an elevated console",
+    execute = function ()
+        -- On Linux this times sudo-posix, whose elevation hop is simulated
+        -- (see sudo_posix.cpp), so the bench runs anywhere.
+        local posix = os.ishost("linux")
+        local platform = posix and "posix" or "windows"
+        local exe = _OPTIONS["exe"]
+        local iterations = tonumber(_OPTIONS["iterations"] or "1000")
+        local sudo_args = _OPTIONS["sudo-args"] or ""
+
+        -- sudo runs from a copy in bench_dir, so its own path is always the
+        -- same length (see the comment on bench_baseline_file).
+        os.mkdir(".build/bench")
+        os.mkdir(bench_dir)
+        local run_sep = posix and "/" or "\\"
+        local run_exe = bench_dir .. run_sep .. (posix and "sudo-posix" or "sudo.exe")
+        if posix and not exe then
+            write_commit_file(select(2, get_git_info()), "SUDO_")
+            build_bench_posix(run_exe)
+        else
+            exe = exe or (".build/" .. (_OPTIONS["vsver"] or "vs2019") .. "/bin/release/x64/sudo.exe")
+            if not os.isfile(exe) then
+                error("Unable to find '" .. exe .. "'; build it first or use --exe=path")
+            end
+            local ok, err = os.copyfile(path.getabsolute(exe), run_exe)
+            if not ok then
+                error("Unable to copy '" .. exe .. "' to '" .. run_exe .. "': " .. tostring(err))
+            end
+        end
+
+        -- Each invocation writes its own trace in bench_dir, read after the
+        -- loop.  The times come from the traces, so they leave out the shell
+        -- and sudo's own process startup and exit; the loop's wall clock
+        -- time includes them, and is only reported.
+        local function trace_file(i)
+            return bench_dir .. run_sep .. "trace-" .. i .. ".json"
+        end
+        local last_trace = bench_first_trace + iterations - 1
+        for i = bench_first_trace, last_trace do
+            os.remove(trace_file(i))
+        end
+
+        local args = sudo_args .. ' "--trace=trace-$i.json"'
+        local command = posix and "true" or "rem"
+        print("Timing " .. iterations .. " invocations of: \"" .. run_exe .. "\" " .. args .. " " .. command)
+        local wall, failures = time_invocations(run_exe, args, command, iterations, bench_first_trace, bench_dir)
+        if not wall then
+            error("Unable to run the invocations")
+        end
+
+        local times = {}
+        local results = {}
+        for i = bench_first_trace, last_trace do
+            local ms, counters = read_trace(trace_file(i))
+            if ms then
+                table.insert(times, ms)
+                for name, value in pairs(counters) do
+                    results[name] = math.max(results[name] or 0, value)
+                end
+            end
+            os.remove(trace_file(i))
+        end
+        failures = math.max(failures, iterations - #times)
+
+        if #times == 0 then
+            error("Every invocation failed")
+        end
+
+        table.sort(times)
+        results.p50 = percentile(times, 50)
+        results.p95 = percentile(times, 95)
+        results.p99 = percentile(times, 99)
+
+        local time_names = { "p50", "p95", "p99" }
+        local arena_names = { "sudo_allocations", "sudo_peak_bytes", "elevated_allocations", "elevated_peak_bytes" }
+        print("")
+        print(string.format("  %-22s %10.2f ms", "wall clock (each)", wall))
+        for _,name in ipairs(time_names) do
+            print(string.format("  %-22s %10.2f ms", name, results[name]))
+        end
+        for _,name in ipairs(arena_names) do
+            print(string.format("  %-22s %10s", name, results[name] and format_result(results[name]) or "-"))
+        end
+        if failures > 0 then
+            failed(failures .. " invocations failed or produced no trace")
+        end
+
+        if _OPTIONS["save-baseline"] then
+            save_baseline(platform, arena_names, results)
+            print("Saved the " .. platform .. " arena counters to " .. bench_baseline_file)
+            return
+        end
+
+        local baseline = read_baseline()
+        if not baseline then
+            error("Unable to read " .. bench_baseline_file)
+        end
+
+        -- The counters must all have a baseline, unless the platform has
+        -- none yet.  Times are only checked if the baseline has them.
+        local have_counters = false
+        for _,name in ipairs(arena_names) do
+            have_counters = have_counters or baseline[platform .. "." .. name] ~= nil
+        end
+        local gated = {}
+        if have_counters then
+            for _,name in ipairs(arena_names) do table.insert(gated, name) end
+        else
+            print("")
+            print(bench_baseline_file .. " has no " .. platform .. " arena counters; use --save-baseline to record them.")
+        end
+        for _,name in ipairs(time_names) do
+            if baseline[platform .. "." .. name] then
+                table.insert(gated, name)
+            end
+        end
+
+        local regressed = failures > 0
+        for _,name in ipairs(gated) do
+            local base = baseline[platform .. "." .. name]
+            local limit = base and (table.contains(time_names, name) and base * bench_tolerance or base)
+            if not base then
+                failed(string.format("%s has no baseline for %s; use --save-baseline", bench_baseline_file, platform .. "." .. name))
+                regressed = true
+            elseif not results[name] then
+                failed(string.format("%s was not reported", name))
+                regressed = true
+            elseif results[name] > limit then
+                failed(string.format("%s is %s; the baseline is %s", name, format_result(results[name]), format_result(base)))
+                regressed = true
+            end
+        end
+        if regressed then
+            os.exit(1)
+        end
+        local checked = {}
+        if have_counters then
+            table.insert(checked, "no more arena allocations or bytes")
+        end
+        if #gated > (have_counters and #arena_names or 0) then
+            table.insert(checked, "times within " .. math.floor((bench_tolerance - 1) * 100 + 0.5) .. "%")
+        end
+        if #checked > 0 then
+            print("\x1b[0;32;1mWithin the " .. platform .. " baseline (" .. table.concat(checked, ", ") .. ").\x1b[m")
+        end
+    end
+}
+
+
+
+--------------------------------------------------------------------------------
+newaction {
+    trigger = "startup",
+    description = "Compares the size and startup time of sudo.exe and sudo-min.exe; run it from an elevated console",
+    execute = function ()
+        local dir = ".build/" .. (_OPTIONS["vsver"] or "vs2019") .. "/bin/release/x64/"
+        local iterations = tonumber(_OPTIONS["iterations"] or "1000")
+
+        -- Unlike the bench action, this times the whole invocation, since
+        -- what differs is how fast each sudo process starts and exits.  Both
+        -- run `rem` through CMD from the same loop, so those costs are the
+        -- same for both.
+        print("Timing " .. iterations .. " invocations of each, in " .. dir)
+        print("")
+        print(string.format("  %-14s %10s %12s", "", "bytes", "ms/call"))
+        for _,name in ipairs({ "sudo.exe", "sudo-min.exe" }) do
+            local exe = path.translate(path.getabsolute(dir .. name))
+            local stat = os.stat(exe)
+            if not stat then
+                error("Unable to find '" .. exe .. "'; build it first")
+            end
+            local ms, failures = time_invocations(exe, "", "rem", iterations)
+            if not ms or failures > 0 then
+                failed(name .. " failed")
+            else
+                print(string.format("  %-14s %10d %12.2f", name, stat.size, ms))
+            end
+        end
+    end
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "prompt.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static size_t
+StrLen(const wchar_t* s)
+{
+    size_t len = 0;
+    while (s[len])
+        ++len;
+    return len;
+}
+
+static PromptField
+EscapeField(wchar_t c)
+{
+    switch (c)
+    {
+    case 'H':   return PromptField::FullHost;
+    case 'h':   return PromptField::ShortHost;
+    // TODO: How is "name of user whose password is requested" meant to
+    // differ from "user the command will be run as"?
+    case 'p':
+    case 'U':   return PromptField::TargetUser;
+    case 'u':   return PromptField::InvokingUser;
+    default:    return PromptField::Count;
+    }
+}
+
+CompiledPrompt::~CompiledPrompt()
+{
+    free(m_text);
+    free(m_tokens);
+}
+
+bool
+CompiledPrompt::Compile(const wchar_t* prompt)
+{
+    free(m_text);
+    free(m_tokens);
+    m_text = nullptr;
+    m_tokens = nullptr;
+    m_count = 0;
+    m_needs = 0;
+
+    // Each token consumes at least one character of the template.
+    const size_t len = StrLen(prompt);
+    m_text = static_cast<wchar_t*>(malloc((len + 1) * sizeof(*m_text)));
+    m_tokens = static_cast<Token*>(malloc((len ? len : 1) * sizeof(*m_tokens)));
+    if (!m_text || !m_tokens)
+        return false;
+    memcpy(m_text, prompt, (len + 1) * sizeof(*m_text));
+
+    const wchar_t* walk = m_text;
+    while (*walk)
+    {
+        Token& token = m_tokens[m_count];
+        if (*walk != '%')
+        {
+            const wchar_t* end = walk;
+            while (*end && *end != '%')
+                ++end;
+            token = { PromptField::Text, walk, size_t(end - walk) };
+            walk = end;
+            ++m_count;
+            continue;
+        }
+
+        // Unknown escapes (and a trailing %) expand to nothing.
+        const wchar_t c = *(++walk);
+        if (!c)
+            break;
+        ++walk;
+
+        if (c == '%')
+        {
+            token = { PromptField::Text, walk - 1, 1 };
+            ++m_count;
+            continue;
+        }
+
+        const PromptField field = EscapeField(c);
+        if (field != PromptField::Count)
+        {
+            token = { field, nullptr, 0 };
+            m_needs |= 1 << unsigned(field);
+            ++m_count;
+        }
+    }
+
+    return true;
+}
+
+wchar_t*
+CompiledPrompt::Expand(PromptLookupProc lookup, void* context) const
+{
+    const wchar_t* values[unsigned(PromptField::Count)] = {};
+    size_t lens[unsigned(PromptField::Count)] = {};
+
+    for (unsigned i = 1; i < unsigned(PromptField::Count); ++i)
+    {
+        if (m_needs & (1 << i))
+        {
+            values[i] = lookup(PromptField(i), context);
+            lens[i] = values[i] ? StrLen(values[i]) : 0;
+        }
+    }
+
+    size_t len = 0;
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        const Token& token = m_tokens[i];
+        len += (token.field == PromptField::Text) ? token.len : lens[unsigned(token.field)];
+    }
+
+    wchar_t* const buffer = static_cast<wchar_t*>(malloc((len + 1) * sizeof(*buffer)));
+    if (!buffer)
+        return nullptr;
+
+    wchar_t* out = buffer;
+    for (unsigned i = 0; i < m_count; ++i)
+    {
+        const Token& token = m_tokens[i];
+        if (token.field == PromptField::Text)
+        {
+            memcpy(out, token.text, token.len * sizeof(*out));
+            out += token.len;
+        }
+        else
+        {
+            const unsigned f = unsigned(token.field);
+            if (lens[f])
+                memcpy(out, values[f], lens[f] * sizeof(*out));
+            out += lens[f];
+        }
+    }
+    *out = '\0';
+    return buffer;
+}
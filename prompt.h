@@ -0,0 +1,57 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// A password prompt template is compiled once into a list of tokens.  The
+// identity lookups it needs are reported by Needs(), so they can be resolved
+// ahead of time (e.g. on another thread), and Expand() asks for each distinct
+// lookup at most once.
+
+enum class PromptField : unsigned char
+{
+    Text,                       // Literal text from the template.
+    FullHost,                   // %H
+    ShortHost,                  // %h
+    TargetUser,                 // %p or %U
+    InvokingUser,               // %u
+    Count
+};
+
+// Returns the value for a field, or nullptr if it is unavailable (in which
+// case the field expands to nothing).
+typedef const wchar_t* (*PromptLookupProc)(PromptField field, void* context);
+
+class CompiledPrompt
+{
+public:
+                    CompiledPrompt() = default;
+                    ~CompiledPrompt();
+
+    // Returns false if out of memory.
+    bool            Compile(const wchar_t* prompt);
+
+    // Bit mask of the fields used by the template:  1 << PromptField.
+    unsigned        Needs() const { return m_needs; }
+
+    // Returns a malloc'd string, or nullptr if out of memory.
+    wchar_t*        Expand(PromptLookupProc lookup, void* context) const;
+
+private:
+    struct Token
+    {
+        PromptField     field;
+        const wchar_t*  text;       // Only for PromptField::Text.
+        size_t          len;
+    };
+
+    wchar_t*        m_text = nullptr;
+    Token*          m_tokens = nullptr;
+    unsigned        m_count = 0;
+    unsigned        m_needs = 0;
+
+                    CompiledPrompt(const CompiledPrompt&) = delete;
+    CompiledPrompt& operator=(const CompiledPrompt&) = delete;
+};
@@ -0,0 +1,430 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for compiled password prompts.
+//
+// The checker expands a table of templates (every escape, %%, unknown
+// escapes, a trailing %, and fields whose lookup fails) with fake host and
+// user names, and checks the text, Needs(), and that each field is looked up
+// at most once per expansion and only if the template uses it.  It expands
+// random templates with long random values and compares them with a simple
+// reference that walks the template and looks up each escape where it
+// appears.  Then, like sudo, it resolves the slow lookups on a thread while
+// the rest of startup runs, and reports how long the prompt waited compared
+// with doing both in turn.  The benchmark compares expanding a compiled
+// prompt with the reference.
+//
+//      g++ -std=c++17 -O2 -pthread promptbench.cpp prompt.cpp -o promptbench
+//      ./promptbench [-n iterations] [-z templates] [-d delay_ms] [-s seed]
+
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "prompt.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned s_seed = 1;
+
+static unsigned
+Random(unsigned n)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffffff) % n;
+}
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fake identities, and how many times each was looked up.
+struct FakeIdentities
+{
+    const wchar_t*      values[unsigned(PromptField::Count)];
+    unsigned            lookups[unsigned(PromptField::Count)];
+};
+
+static const wchar_t*
+FakeLookup(PromptField field, void* context)
+{
+    FakeIdentities* const fake = static_cast<FakeIdentities*>(context);
+    ++fake->lookups[unsigned(field)];
+    return fake->values[unsigned(field)];
+}
+
+static void
+InitFake(FakeIdentities& fake)
+{
+    memset(&fake, 0, sizeof(fake));
+    fake.values[unsigned(PromptField::FullHost)] = L"build01.corp.example.com";
+    fake.values[unsigned(PromptField::ShortHost)] = L"build01";
+    fake.values[unsigned(PromptField::TargetUser)] = L"Administrator";
+    fake.values[unsigned(PromptField::InvokingUser)] = L"j\u00f6rg";
+}
+
+// Expands the template the way sudo used to:  walking it, and looking up
+// each escape where it appears.
+static wchar_t*
+ReferenceExpand(const wchar_t* prompt, PromptLookupProc lookup, void* context)
+{
+    size_t cap = 64;
+    size_t len = 0;
+    wchar_t* out = static_cast<wchar_t*>(malloc(cap * sizeof(*out)));
+    for (const wchar_t* p = prompt; *p; ++p)
+    {
+        const wchar_t* value = nullptr;
+        wchar_t ch[2] = { *p, '\0' };
+        if (*p != '%')
+            value = ch;
+        else
+        {
+            switch (*(++p))
+            {
+            case '\0':  --p; break;
+            case '%':   value = L"%"; break;
+            case 'H':   value = lookup(PromptField::FullHost, context); break;
+            case 'h':   value = lookup(PromptField::ShortHost, context); break;
+            case 'p':
+            case 'U':   value = lookup(PromptField::TargetUser, context); break;
+            case 'u':   value = lookup(PromptField::InvokingUser, context); break;
+            }
+        }
+
+        const size_t add = value ? wcslen(value) : 0;
+        if (len + add + 1 > cap)
+        {
+            cap = (len + add + 1) * 2;
+            out = static_cast<wchar_t*>(realloc(out, cap * sizeof(*out)));
+        }
+        wmemcpy(out + len, value ? value : L"", add);
+        len += add;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+//------------------------------------------------------------------------------
+// Table of templates.
+
+enum : unsigned
+{
+    c_full = 1 << unsigned(PromptField::FullHost),
+    c_short = 1 << unsigned(PromptField::ShortHost),
+    c_target = 1 << unsigned(PromptField::TargetUser),
+    c_invoking = 1 << unsigned(PromptField::InvokingUser),
+};
+
+struct PromptCase
+{
+    const wchar_t*      prompt;
+    const wchar_t*      expected;
+    unsigned            needs;
+    bool                no_short_host = false;  // The short host lookup fails.
+};
+
+static const PromptCase c_prompt_cases[] =
+{
+    { L"",                              L"",                                        0 },
+    { L"Password: ",                    L"Password: ",                              0 },
+    { L"[sudo] password for %p: ",      L"[sudo] password for Administrator: ",     c_target },
+    { L"%u@%h's password: ",            L"j\u00f6rg@build01's password: ",          c_invoking|c_short },
+    { L"%H",                            L"build01.corp.example.com",                c_full },
+    { L"%h%h%h",                        L"build01build01build01",                   c_short },
+    { L"%U and %p",                     L"Administrator and Administrator",         c_target },
+    { L"%H %h %p %U %u",                L"build01.corp.example.com build01 Administrator Administrator j\u00f6rg", c_full|c_short|c_target|c_invoking },
+    { L"100%%",                         L"100%",                                    0 },
+    { L"%%h",                           L"%h",                                      0 },
+    { L"%%%h",                          L"%build01",                                c_short },
+    { L"a%xb%qc",                       L"abc",                                     0 },
+    { L"trailing %",                    L"trailing ",                               0 },
+    { L"%",                             L"",                                        0 },
+    { L"\u00e9%u\u4e2d",                L"\u00e9j\u00f6rg\u4e2d",                   c_invoking },
+    { L"[%h] ",                         L"[] ",                                     c_short, true },
+};
+
+static bool
+CheckPromptCases()
+{
+    for (const PromptCase& c : c_prompt_cases)
+    {
+        FakeIdentities fake;
+        InitFake(fake);
+        if (c.no_short_host)
+            fake.values[unsigned(PromptField::ShortHost)] = nullptr;
+
+        CompiledPrompt prompt;
+        bool ok = prompt.Compile(c.prompt) && prompt.Needs() == c.needs;
+        wchar_t* text = ok ? prompt.Expand(FakeLookup, &fake) : nullptr;
+        ok = ok && text && !wcscmp(text, c.expected);
+        for (unsigned i = 0; ok && i < unsigned(PromptField::Count); ++i)
+            ok = fake.lookups[i] == ((c.needs >> i) & 1);
+
+        // Expanding again looks each field up again, once.
+        free(text);
+        text = ok ? prompt.Expand(FakeLookup, &fake) : nullptr;
+        ok = ok && text && !wcscmp(text, c.expected);
+        for (unsigned i = 0; ok && i < unsigned(PromptField::Count); ++i)
+            ok = fake.lookups[i] == 2 * ((c.needs >> i) & 1);
+
+        if (!ok)
+            fprintf(stderr, "expanding \"%ls\" gave \"%ls\".\n", c.prompt, text ? text : L"(null)");
+        free(text);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Random templates.
+
+static wchar_t*
+RandomText(wchar_t* p, unsigned max)
+{
+    static const wchar_t c_chars[] = L"ab %:.-\u00e9\u4e2d";
+    const unsigned len = Random(max + 1);
+    for (unsigned i = 0; i < len; ++i)
+        *(p++) = c_chars[Random(sizeof(c_chars) / sizeof(c_chars[0]) - 1)];
+    *p = '\0';
+    return p;
+}
+
+static bool
+Fuzz(unsigned templates)
+{
+    static const wchar_t c_escapes[] = L"HhpUu%x";
+    wchar_t* values = static_cast<wchar_t*>(malloc(4 * 20001 * sizeof(wchar_t)));
+    wchar_t source[256];
+
+    for (unsigned n = 0; n < templates; ++n)
+    {
+        // Values are sometimes long, or missing.
+        FakeIdentities fake;
+        memset(&fake, 0, sizeof(fake));
+        for (unsigned i = 1; i < unsigned(PromptField::Count); ++i)
+        {
+            wchar_t* value = values + (i - 1) * 20001;
+            RandomText(value, Random(16) ? 24 : 20000);
+            fake.values[i] = Random(8) ? value : nullptr;
+        }
+
+        wchar_t* p = source;
+        const unsigned pieces = Random(12);
+        for (unsigned i = 0; i < pieces; ++i)
+        {
+            if (Random(2))
+                p = RandomText(p, 8);
+            else
+            {
+                *(p++) = '%';
+                *(p++) = c_escapes[Random(sizeof(c_escapes) / sizeof(c_escapes[0]) - 1)];
+            }
+        }
+        *p = '\0';
+
+        FakeIdentities reference_fake = fake;
+        wchar_t* expected = ReferenceExpand(source, FakeLookup, &reference_fake);
+
+        CompiledPrompt prompt;
+        bool ok = prompt.Compile(source);
+        wchar_t* text = ok ? prompt.Expand(FakeLookup, &fake) : nullptr;
+        ok = ok && text && !wcscmp(text, expected);
+        for (unsigned i = 0; ok && i < unsigned(PromptField::Count); ++i)
+            ok = (fake.lookups[i] == (reference_fake.lookups[i] ? 1u : 0u)) && (fake.lookups[i] == ((prompt.Needs() >> i) & 1));
+
+        if (!ok)
+            fprintf(stderr, "expanding \"%ls\" did not match the reference.\n", source);
+        free(text);
+        free(expected);
+        if (!ok)
+        {
+            free(values);
+            return false;
+        }
+    }
+
+    free(values);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Resolving the lookups during startup, as PromptIdentities does in main.cpp.
+
+static unsigned s_delay_ms = 50;
+
+struct SlowIdentities
+{
+    FakeIdentities      fake;
+    unsigned            needs;
+    pthread_t           thread;
+    bool                started;
+    const wchar_t*      values[unsigned(PromptField::Count)];
+};
+
+static void*
+ResolveSlow(void* param)
+{
+    SlowIdentities* const self = static_cast<SlowIdentities*>(param);
+    for (unsigned i = 1; i < unsigned(PromptField::Count); ++i)
+    {
+        if (i != unsigned(PromptField::TargetUser) && (self->needs & (1 << i)))
+        {
+            // Like ComputerNameDnsFullyQualified on a domain-joined machine.
+            if (i == unsigned(PromptField::FullHost))
+                usleep(s_delay_ms * 1000);
+            self->values[i] = FakeLookup(PromptField(i), &self->fake);
+        }
+    }
+    return nullptr;
+}
+
+static const wchar_t*
+SlowLookup(PromptField field, void* context)
+{
+    SlowIdentities* const self = static_cast<SlowIdentities*>(context);
+    if (field == PromptField::TargetUser)
+        return FakeLookup(field, &self->fake);
+    if (self->started)
+    {
+        pthread_join(self->thread, nullptr);
+        self->started = false;
+    }
+    return self->values[unsigned(field)];
+}
+
+static bool
+CheckStartup()
+{
+    unsigned long long elapsed[2];
+    for (unsigned concurrent = 0; concurrent < 2; ++concurrent)
+    {
+        const unsigned long long start = NowMicroseconds();
+
+        CompiledPrompt prompt;
+        if (!prompt.Compile(L"[sudo] %u@%H password for %p: "))
+            return false;
+
+        SlowIdentities identities;
+        memset(&identities, 0, sizeof(identities));
+        InitFake(identities.fake);
+        identities.needs = prompt.Needs();
+        if (concurrent)
+            identities.started = !pthread_create(&identities.thread, nullptr, ResolveSlow, &identities);
+        if (!identities.started)
+            ResolveSlow(&identities);
+
+        // The rest of startup:  parsing the policy, resolving the program.
+        usleep(s_delay_ms * 1000);
+
+        wchar_t* text = prompt.Expand(SlowLookup, &identities);
+        const bool ok = text && !wcscmp(text, L"[sudo] j\u00f6rg@build01.corp.example.com password for Administrator: ") &&
+                        identities.fake.lookups[unsigned(PromptField::FullHost)] == 1 &&
+                        identities.fake.lookups[unsigned(PromptField::InvokingUser)] == 1 &&
+                        !identities.fake.lookups[unsigned(PromptField::ShortHost)];
+        free(text);
+        if (!ok)
+        {
+            fprintf(stderr, "the prompt resolved %s was wrong.\n", concurrent ? "on a thread" : "in turn");
+            return false;
+        }
+
+        elapsed[concurrent] = NowMicroseconds() - start;
+    }
+
+    printf("startup with a %u ms host lookup:  %.1f ms in turn, %.1f ms on a thread\n",
+           s_delay_ms, elapsed[0] / 1000.0, elapsed[1] / 1000.0);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static void
+RunBench(unsigned iterations)
+{
+    const wchar_t* const source = L"[sudo] %u@%h (%H) password for %p; %p is not %u: ";
+
+    FakeIdentities fake;
+    InitFake(fake);
+    CompiledPrompt prompt;
+    prompt.Compile(source);
+
+    size_t total = 0;
+    unsigned long long start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        wchar_t* text = prompt.Expand(FakeLookup, &fake);
+        total += wcslen(text);
+        free(text);
+    }
+    const unsigned long long compiled_us = NowMicroseconds() - start;
+    unsigned compiled_lookups = 0;
+    for (unsigned i = 0; i < unsigned(PromptField::Count); ++i)
+        compiled_lookups += fake.lookups[i];
+
+    InitFake(fake);
+    start = NowMicroseconds();
+    for (unsigned n = 0; n < iterations; ++n)
+    {
+        wchar_t* text = ReferenceExpand(source, FakeLookup, &fake);
+        total -= wcslen(text);
+        free(text);
+    }
+    const unsigned long long reference_us = NowMicroseconds() - start;
+    unsigned reference_lookups = 0;
+    for (unsigned i = 0; i < unsigned(PromptField::Count); ++i)
+        reference_lookups += fake.lookups[i];
+
+    printf("compiled:   %.1f ns per expansion, %.1f lookups\n",
+           compiled_us * 1000.0 / iterations, double(compiled_lookups) / iterations);
+    printf("reference:  %.1f ns per expansion, %.1f lookups%s\n",
+           reference_us * 1000.0 / iterations, double(reference_lookups) / iterations, total ? " (DIFFERENT)" : "");
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned iterations = 1000000;
+    unsigned templates = 20000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+            templates = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            s_delay_ms = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            s_seed = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: promptbench [-n iterations] [-z templates] [-d delay_ms] [-s seed]\n");
+            return 1;
+        }
+    }
+
+    if (!iterations)
+        return 1;
+
+    setlocale(LC_CTYPE, "C.UTF-8");
+    if (!CheckPromptCases() || !Fuzz(templates))
+        return 1;
+    printf("checks passed (%zu templates, %u random templates).\n",
+           sizeof(c_prompt_cases) / sizeof(c_prompt_cases[0]), templates);
+
+    if (!CheckStartup())
+        return 1;
+    RunBench(iterations);
+    return 0;
+}
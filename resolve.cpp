@@ -0,0 +1,380 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <string.h>
+#include <wchar.h>
+#include <atomic>
+
+#include "resolve.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const wchar_t* const c_default_pathext = L".COM;.EXE;.BAT;.CMD";
+
+//------------------------------------------------------------------------------
+// Searching.
+
+const wchar_t*
+FindExtension(const wchar_t* name)
+{
+    const wchar_t* ext = nullptr;
+    for (const wchar_t* p = name; *p; ++p)
+    {
+        if (*p == '.')
+            ext = p;
+        else if (*p == '\\' || *p == '/' || *p == ':')
+            ext = nullptr;
+    }
+    return ext;
+}
+
+size_t
+ProgramPathLength(const ProgramQuery& query)
+{
+    // No directory or extension is longer than the whole string it comes
+    // from.
+    const wchar_t* dir = query.dir ? query.dir : L".";
+    const wchar_t* pathext = query.pathext ? query.pathext : c_default_pathext;
+    const size_t cch_path = query.path ? wcslen(query.path) : 0;
+    const size_t cch_dir = wcslen(dir);
+    return ((cch_path > cch_dir) ? cch_path : cch_dir) + 1 + wcslen(query.name) + wcslen(pathext) + 1;
+}
+
+bool
+SearchProgram(const ProgramQuery& query, const ResolveOps& ops, wchar_t* out)
+{
+    const wchar_t* name = query.name;
+    const wchar_t* pathext = query.pathext ? query.pathext : c_default_pathext;
+
+    // Names with a directory are only looked up relative to the directory.
+    const bool has_dir = !!wcspbrk(name, L"\\/:");
+    const bool has_ext = !!FindExtension(name);
+    const bool absolute = (has_dir && (name[0] == '\\' || name[0] == '/' || name[1] == ':'));
+    const size_t cch_name = wcslen(name);
+
+    const wchar_t* next_dir = query.dir ? query.dir : L".";
+    bool first_dir = true;
+    while (next_dir)
+    {
+        // The first directory is the current directory; the rest come from
+        // %PATH%.
+        const wchar_t* this_dir = next_dir;
+        size_t cch_dir;
+        if (first_dir)
+        {
+            cch_dir = wcslen(this_dir);
+            next_dir = has_dir ? nullptr : query.path;
+            first_dir = false;
+        }
+        else
+        {
+            const wchar_t* sep = wcschr(this_dir, ';');
+            cch_dir = sep ? size_t(sep - this_dir) : wcslen(this_dir);
+            next_dir = sep ? sep + 1 : nullptr;
+            if (cch_dir && *this_dir == '"')
+            {
+                ++this_dir;
+                --cch_dir;
+            }
+            if (cch_dir && this_dir[cch_dir - 1] == '"')
+                --cch_dir;
+            if (!cch_dir)
+                continue;
+        }
+
+        const wchar_t* next_ext = pathext;
+        bool try_as_is = has_ext || !*pathext;
+        while (try_as_is || (next_ext && *next_ext))
+        {
+            const wchar_t* ext = L"";
+            size_t cch_ext = 0;
+            if (try_as_is)
+            {
+                try_as_is = false;
+            }
+            else
+            {
+                ext = next_ext;
+                const wchar_t* sep = wcschr(ext, ';');
+                cch_ext = sep ? size_t(sep - ext) : wcslen(ext);
+                next_ext = sep ? sep + 1 : nullptr;
+                if (!cch_ext)
+                    continue;
+            }
+
+            // Relative names are relative to the directory, and absolute
+            // names are used as they are.
+            wchar_t* p = out;
+            if (!absolute)
+            {
+                wmemcpy(p, this_dir, cch_dir);
+                p += cch_dir;
+                *(p++) = '\\';
+            }
+            wmemcpy(p, name, cch_name);
+            p += cch_name;
+            wmemcpy(p, ext, cch_ext);
+            p += cch_ext;
+            *p = '\0';
+
+            if (ops.is_file(out, ops.context))
+                return true;
+        }
+    }
+
+    *out = '\0';
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Caching.
+
+enum
+{
+    c_ways          = 4,            // Entries a key can go in.
+    c_entry_count   = 256,
+    c_path_max      = 520,          // UTF-16 units, including the terminator.
+};
+
+static const char c_magic[8] = { 'S', 'U', 'D', 'O', 'P', 'R', 'G', '1' };
+
+struct ProgramCache::Header
+{
+    char                    magic[8];
+    unsigned                entry_count;
+    unsigned                path_max;
+    std::atomic<unsigned long long> ticks;  // Orders stores, for replacement.
+};
+
+struct ProgramCache::Entry
+{
+    std::atomic<unsigned>   seq;            // Odd while being written.
+    unsigned                len;            // 0 means empty.
+    unsigned long long      tick;
+    unsigned long long      hash;
+    unsigned long long      check;
+    FileStamp               file;
+    FileStamp               dir;
+    unsigned short          path[c_path_max];
+};
+
+size_t
+ProgramCache::EntriesOffset()
+{
+    const size_t align = alignof(unsigned long long);
+    return (sizeof(Header) + align - 1) & ~(align - 1);
+}
+
+size_t
+ProgramCache::ImageSize()
+{
+    return EntriesOffset() + c_entry_count * sizeof(Entry);
+}
+
+bool
+ProgramCache::Attach(void* image, size_t size, bool writable)
+{
+    m_header = nullptr;
+    m_entries = nullptr;
+    if (!image || size < ImageSize())
+        return false;
+
+    Header* header = static_cast<Header*>(image);
+    Entry* entries = reinterpret_cast<Entry*>(static_cast<char*>(image) + EntriesOffset());
+    if (memcmp(header->magic, c_magic, sizeof(c_magic)) ||
+        header->entry_count != c_entry_count ||
+        header->path_max != c_path_max)
+    {
+        if (!writable)
+            return false;
+
+        // The magic goes last, so a reader never trusts a half initialized
+        // image.
+        memset(image, 0, ImageSize());
+        header->entry_count = c_entry_count;
+        header->path_max = c_path_max;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, c_magic, sizeof(c_magic));
+    }
+
+    m_header = header;
+    m_entries = entries;
+    m_writable = writable;
+    return true;
+}
+
+static unsigned long long
+Unit(wchar_t c)
+{
+    // wchar_t is UTF-32 on some platforms; fold it to 16 bits.
+    const unsigned u = unsigned(c);
+    return (u ^ (u >> 16)) & 0xFFFF;
+}
+
+ProgramCache::Key
+ProgramCache::MakeKey(const ProgramQuery& query)
+{
+    // Two unrelated hashes (FNV-1a and a polynomial hash), so a false match
+    // needs both to collide.  %PATH% can be tens of thousands of characters,
+    // so they take four UTF-16 units at a time.  Each string's terminator is
+    // included, so the strings can't run together.
+    Key key = { 14695981039346656037ull, 0 };
+    const wchar_t* const strings[] = { query.name, query.dir, query.path, query.pathext };
+    for (const wchar_t* s : strings)
+    {
+        const wchar_t* p = s ? s : L"";
+        const size_t len = wcslen(p) + 1;
+        size_t i = 0;
+        for (bool more = true; more;)
+        {
+            unsigned long long word;
+            if (i + 4 <= len)
+            {
+                word = Unit(p[i]) | (Unit(p[i + 1]) << 16) | (Unit(p[i + 2]) << 32) | (Unit(p[i + 3]) << 48);
+                i += 4;
+                more = (i < len);
+            }
+            else
+            {
+                word = 0;
+                for (unsigned shift = 0; i < len; ++i, shift += 16)
+                    word |= Unit(p[i]) << shift;
+                more = false;
+            }
+            key.hash = (key.hash ^ word) * 1099511628211ull;
+            key.check = (key.check + word + 1) * 0x9E3779B97F4A7C15ull;
+        }
+    }
+
+    // Mix the high bits into the low ones, which pick the set.
+    key.hash ^= key.hash >> 33;
+    key.hash *= 0xFF51AFD7ED558CCDull;
+    key.hash ^= key.hash >> 33;
+    key.check ^= key.check >> 29;
+    return key;
+}
+
+static bool
+SameStamp(const FileStamp& a, const FileStamp& b)
+{
+    return a.id == b.id && a.mtime == b.mtime;
+}
+
+bool
+ProgramCache::Lookup(const Key& key, const ProgramQuery& query, const ResolveOps& ops, wchar_t* out, size_t max)
+{
+    Entry* const set = m_entries + (key.hash % (c_entry_count / c_ways)) * c_ways;
+    for (unsigned way = 0; way < c_ways; ++way)
+    {
+        Entry& entry = set[way];
+        const unsigned seq = entry.seq.load(std::memory_order_acquire);
+        if ((seq & 1) || entry.hash != key.hash || entry.check != key.check)
+            continue;
+
+        // Copy the entry, and then make sure no writer changed it meanwhile.
+        const unsigned len = entry.len;
+        const FileStamp file = entry.file;
+        const FileStamp dir = entry.dir;
+        if (!len || len >= c_path_max || len >= max)
+            continue;
+        for (unsigned i = 0; i < len; ++i)
+            out[i] = wchar_t(entry.path[i]);
+        out[len] = '\0';
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.seq.load(std::memory_order_relaxed) != seq)
+            continue;
+
+        // The program must still be the same file, and the directory must
+        // not have changed (e.g. a program added that would be found first).
+        FileStamp stamp;
+        if (!ops.stamp(out, stamp, ops.context) || !SameStamp(stamp, file))
+            return false;
+        if (!ops.stamp(query.dir, stamp, ops.context) || !SameStamp(stamp, dir))
+            return false;
+        return true;
+    }
+    return false;
+}
+
+void
+ProgramCache::Store(const Key& key, const ProgramQuery& query, const ResolveOps& ops, const wchar_t* program)
+{
+    const size_t len = wcslen(program);
+    if (!len || len >= c_path_max)
+        return;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (unsigned(program[i]) > 0xFFFF)
+            return;
+    }
+
+    FileStamp file;
+    FileStamp dir;
+    if (!ops.stamp(program, file, ops.context) || !ops.stamp(query.dir, dir, ops.context))
+        return;
+
+    // Replace the entry for the same key, else the one stored longest ago.
+    Entry* const set = m_entries + (key.hash % (c_entry_count / c_ways)) * c_ways;
+    Entry* victim = set;
+    for (unsigned way = 0; way < c_ways; ++way)
+    {
+        if (set[way].hash == key.hash && set[way].check == key.check)
+        {
+            victim = set + way;
+            break;
+        }
+        if (set[way].tick < victim->tick)
+            victim = set + way;
+    }
+
+    // Another process writing the same entry wins; this result is not
+    // needed that badly.
+    unsigned seq = victim->seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !victim->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    victim->len = unsigned(len);
+    victim->tick = ++m_header->ticks;
+    victim->hash = key.hash;
+    victim->check = key.check;
+    victim->file = file;
+    victim->dir = dir;
+    for (size_t i = 0; i < len; ++i)
+        victim->path[i] = static_cast<unsigned short>(program[i]);
+    victim->path[len] = 0;
+
+    victim->seq.store(seq + 2, std::memory_order_release);
+}
+
+bool
+ProgramCache::Resolve(const ProgramQuery& query, const ResolveOps& ops, wchar_t* out, bool* hit)
+{
+    if (hit)
+        *hit = false;
+
+    ProgramQuery q = query;
+    if (!q.dir)
+        q.dir = L".";
+    if (!q.pathext)
+        q.pathext = c_default_pathext;
+
+    Key key = {};
+    if (m_header)
+    {
+        key = MakeKey(q);
+        if (Lookup(key, q, ops, out, ProgramPathLength(q)))
+        {
+            if (hit)
+                *hit = true;
+            return true;
+        }
+    }
+
+    if (!SearchProgram(q, ops, out))
+        return false;
+
+    if (m_header && m_writable)
+        Store(key, q, ops, out);
+    return true;
+}
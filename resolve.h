@@ -0,0 +1,96 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Finds the program a command names, the way CMD does:  in the current
+// directory and then in each directory in %PATH%, trying each extension in
+// %PATHEXT% unless the name already has an extension.
+//
+// With a long %PATH% (e.g. on network shares) the search costs a file system
+// probe per directory per extension, so results are remembered in a cache
+// that lives in a memory mapped file shared by every sudo process.  An entry
+// is keyed by the name, the directory, %PATH%, and %PATHEXT%, and is used
+// again only if the program file and the directory are still the same (same
+// file ID and modification time), which costs two probes instead of a
+// search.  A program added to an earlier %PATH% directory afterwards is not
+// noticed until the cached program or the directory changes.
+
+// Identifies a version of a file or directory.
+struct FileStamp
+{
+    unsigned long long  id;             // File ID (inode).
+    unsigned long long  mtime;          // Last write time.
+};
+
+struct ResolveOps
+{
+    // Returns whether the path names a file (not a directory).
+    bool                (*is_file)(const wchar_t* path, void* context);
+
+    // Gets the stamp of a file or directory.  Returns false if it doesn't
+    // exist.
+    bool                (*stamp)(const wchar_t* path, FileStamp& stamp, void* context);
+
+    void*               context;
+};
+
+struct ProgramQuery
+{
+    const wchar_t*      name;           // As typed, without quotes.
+    const wchar_t*      dir;            // The current directory.
+    const wchar_t*      path;           // %PATH%, or nullptr.
+    const wchar_t*      pathext;        // %PATHEXT%, or nullptr for the default; "" tries only the name.
+};
+
+// Returns the extension of the file name at the end of a path, or nullptr.
+const wchar_t* FindExtension(const wchar_t* name);
+
+// The buffer for a result must have room for this many characters.
+size_t ProgramPathLength(const ProgramQuery& query);
+
+// Searches for the program, and writes its path to out.  Returns false if
+// the program isn't found.
+bool SearchProgram(const ProgramQuery& query, const ResolveOps& ops, wchar_t* out);
+
+// The cache of resolved programs.  The image is a fixed size file, which
+// can be created empty (all zeros).  Readers never wait:  each entry has a
+// sequence number that a writer makes odd while it changes the entry, and a
+// reader that sees an odd or changed sequence number treats it as a miss.
+class ProgramCache
+{
+public:
+    static size_t   ImageSize();
+
+    // Attaches to a mapped image.  A writable image that is empty (or has
+    // an unknown format) is initialized.  Returns false if the image can't
+    // be used.
+    bool            Attach(void* image, size_t size, bool writable);
+    bool            IsAttached() const { return !!m_header; }
+
+    // Finds a program through the cache, searching and remembering the
+    // result on a miss (if the cache is writable).  Works without a cache,
+    // too.  Returns false if the program isn't found.
+    bool            Resolve(const ProgramQuery& query, const ResolveOps& ops, wchar_t* out, bool* hit=nullptr);
+
+private:
+    struct Header;
+    struct Entry;
+
+    struct Key
+    {
+        unsigned long long  hash;
+        unsigned long long  check;
+    };
+
+    static size_t   EntriesOffset();
+    static Key      MakeKey(const ProgramQuery& query);
+    bool            Lookup(const Key& key, const ProgramQuery& query, const ResolveOps& ops, wchar_t* out, size_t max);
+    void            Store(const Key& key, const ProgramQuery& query, const ResolveOps& ops, const wchar_t* program);
+
+    Header*         m_header = nullptr;
+    Entry*          m_entries = nullptr;
+    bool            m_writable = false;
+};
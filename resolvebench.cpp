@@ -0,0 +1,299 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark for the program cache:  builds a synthetic %PATH% with thousands
+// of real directories (the program is in the last one), and compares a full
+// search with a lookup in the memory mapped cache.  It also checks that a
+// cache entry is dropped when the program or the current directory changes,
+// and that several processes can share the cache at once.
+//
+// This uses mmap() and fork(), so it only builds on Linux (and other POSIX
+// systems):
+//
+//      g++ -std=c++17 -O2 resolvebench.cpp resolve.cpp -o resolvebench
+//      ./resolvebench [-d directories] [-n lookups] [-p processes] [-t tmpdir]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "resolve.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long s_probes;
+
+// The resolver builds Windows paths; turn them into POSIX paths.
+static bool
+ToNarrowPath(const wchar_t* path, char* out, size_t max)
+{
+    size_t i = 0;
+    for (; path[i]; ++i)
+    {
+        if (i + 1 >= max || unsigned(path[i]) > 0x7F)
+            return false;
+        out[i] = (path[i] == '\\') ? '/' : char(path[i]);
+    }
+    out[i] = '\0';
+    return true;
+}
+
+static bool
+IsFile(const wchar_t* path, void*)
+{
+    ++s_probes;
+    char narrow[4096];
+    struct stat st;
+    return ToNarrowPath(path, narrow, sizeof(narrow)) && !stat(narrow, &st) && S_ISREG(st.st_mode);
+}
+
+static bool
+GetStamp(const wchar_t* path, FileStamp& stamp, void*)
+{
+    ++s_probes;
+    char narrow[4096];
+    struct stat st;
+    if (!ToNarrowPath(path, narrow, sizeof(narrow)) || stat(narrow, &st))
+        return false;
+    stamp.id = (unsigned long long)st.st_ino;
+    stamp.mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool
+Touch(const char* path)
+{
+    const int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0755);
+    if (fd < 0)
+        return false;
+    close(fd);
+    return true;
+}
+
+static void
+Widen(const char* s, wchar_t* out)
+{
+    while ((*(out++) = wchar_t(*(s++))))
+    {
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned dirs = 2000;
+    unsigned lookups = 20000;
+    unsigned processes = 8;
+    const char* tmp = "/tmp";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            dirs = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            lookups = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            processes = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            tmp = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: resolvebench [-d directories] [-n lookups] [-p processes] [-t tmpdir]\n");
+            return 1;
+        }
+    }
+    if (!dirs || !lookups)
+        return 1;
+
+    // The tree:  root/cwd is the current directory, root/bin0 ... are on
+    // %PATH%, and root/bin<last>/tool.EXE is the program.
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/resolvebench.XXXXXX", tmp);
+    if (!mkdtemp(root))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    const size_t cch_root = strlen(root);
+    const size_t cch_path = size_t(dirs) * (cch_root + 16);
+    char* path = static_cast<char*>(malloc(cch_path));
+    wchar_t* wpath = static_cast<wchar_t*>(malloc(cch_path * sizeof(*wpath)));
+    if (!path || !wpath)
+        return 1;
+    size_t len = 0;
+    char dir[1024];
+    for (unsigned i = 0; i < dirs; ++i)
+    {
+        snprintf(dir, sizeof(dir), "%s/bin%u", root, i);
+        mkdir(dir, 0755);
+        len += snprintf(path + len, cch_path - len, "%s%s", i ? ";" : "", dir);
+    }
+    char program[1100];
+    snprintf(program, sizeof(program), "%s/tool.EXE", dir);
+    char cwd[1024];
+    snprintf(cwd, sizeof(cwd), "%s/cwd", root);
+    char cache_file[1024];
+    snprintf(cache_file, sizeof(cache_file), "%s/sudoprogs.bin", root);
+    if (mkdir(cwd, 0755) || !Touch(program))
+    {
+        perror(root);
+        return 1;
+    }
+    Widen(path, wpath);
+
+    wchar_t wcwd[1024];
+    Widen(cwd, wcwd);
+    ProgramQuery query;
+    query.name = L"tool";
+    query.dir = wcwd;
+    query.path = wpath;
+    query.pathext = L".COM;.EXE;.BAT;.CMD;.VBS;.VBE;.JS;.JSE;.WSF;.WSH;.MSC";
+
+    ResolveOps ops = {};
+    ops.is_file = IsFile;
+    ops.stamp = GetStamp;
+
+    wchar_t* out = static_cast<wchar_t*>(malloc(ProgramPathLength(query) * sizeof(*out)));
+    if (!out)
+        return 1;
+
+    // The cache file, mapped the way sudo maps it.
+    const size_t cb_image = ProgramCache::ImageSize();
+    const int fd = open(cache_file, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, off_t(cb_image)))
+    {
+        perror(cache_file);
+        return 1;
+    }
+    void* image = mmap(nullptr, cb_image, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    bool ok = true;
+
+    // Searching every time.
+    const unsigned searches = (lookups / 100) ? lookups / 100 : 1;
+    s_probes = 0;
+    unsigned long long start = NowMicroseconds();
+    for (unsigned i = 0; ok && i < searches; ++i)
+        ok = SearchProgram(query, ops, out);
+    const unsigned long long search_time = NowMicroseconds() - start;
+    const unsigned long long search_probes = s_probes;
+
+    // Through the cache; the first lookup misses and fills it.
+    ProgramCache cache;
+    bool hit = false;
+    ok = ok && cache.Attach(image, cb_image, true) && cache.Resolve(query, ops, out, &hit) && !hit;
+    s_probes = 0;
+    start = NowMicroseconds();
+    for (unsigned i = 0; ok && i < lookups; ++i)
+        ok = cache.Resolve(query, ops, out, &hit) && hit;
+    const unsigned long long cache_time = NowMicroseconds() - start;
+    const unsigned long long cache_probes = s_probes;
+
+    char found[4096];
+    ok = ok && ToNarrowPath(out, found, sizeof(found)) && !strcmp(found, program);
+    if (!ok)
+    {
+        fprintf(stderr, "lookups failed.\n");
+        return 1;
+    }
+
+    printf("%u directories:  search %9.2f us (%llu probes)   cached %7.2f us (%llu probes)\n",
+           dirs, double(search_time) / searches, search_probes / searches,
+           double(cache_time) / lookups, cache_probes / lookups);
+
+    // A program added to the current directory changes the directory, so
+    // it is found instead of the cached one.
+    char shadow[1100];
+    snprintf(shadow, sizeof(shadow), "%s/tool.EXE", cwd);
+    ok = Touch(shadow) && cache.Resolve(query, ops, out, &hit) && !hit &&
+         ToNarrowPath(out, found, sizeof(found)) && !strcmp(found, shadow);
+    // A replaced program is a different file.
+    ok = ok && !unlink(shadow) && cache.Resolve(query, ops, out, &hit) && !hit &&
+         !unlink(program) && Touch(program) && cache.Resolve(query, ops, out, &hit) && !hit &&
+         cache.Resolve(query, ops, out, &hit) && hit;
+    if (!ok)
+    {
+        fprintf(stderr, "a stale cache entry was used.\n");
+        return 1;
+    }
+
+    // Several processes resolving different names at once.  Every result
+    // must be right, hit or miss.
+    for (unsigned i = 0; i < 16; ++i)
+    {
+        char name[1100];
+        snprintf(name, sizeof(name), "%s/bin%u/t%u.EXE", root, (i * 7919) % dirs, i);
+        Touch(name);
+    }
+    fflush(stdout);
+    for (unsigned p = 0; p < processes; ++p)
+    {
+        const pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (!pid)
+        {
+            ProgramCache shared;
+            if (!shared.Attach(image, cb_image, true))
+                _exit(1);
+            for (unsigned n = 0; n < lookups / 10; ++n)
+            {
+                const unsigned i = (n * 31 + p) % 16;
+                wchar_t wname[16];
+                swprintf(wname, 16, L"t%u", i);
+                ProgramQuery q = query;
+                q.name = wname;
+                char expect[1100];
+                snprintf(expect, sizeof(expect), "%s/bin%u/t%u.EXE", root, (i * 7919) % dirs, i);
+                if (!shared.Resolve(q, ops, out) || !ToNarrowPath(out, found, sizeof(found)) || strcmp(found, expect))
+                    _exit(2);
+            }
+            _exit(0);
+        }
+    }
+    for (unsigned p = 0; p < processes; ++p)
+    {
+        int status = 0;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ok = false;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "a process sharing the cache got a wrong result.\n");
+        return 1;
+    }
+    printf("%u processes sharing the cache:  ok\n", processes);
+
+    munmap(image, cb_image);
+    free(out);
+    free(wpath);
+    free(path);
+    char command[1100];
+    snprintf(command, sizeof(command), "rm -rf '%s'", root);
+    return system(command) ? 1 : 0;
+}
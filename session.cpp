@@ -0,0 +1,192 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <windows.h>
+
+#include "session.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const DWORD c_std_handles[] = { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE };
+static const DWORD c_drain_interval = 50;       // Milliseconds.
+static const DWORD c_output_grace = 1000;       // Milliseconds.
+
+IoLogTime
+SessionRecorder::Now() const
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    const unsigned long long ticks = li.QuadPart - m_liStart.QuadPart;
+    const unsigned long long freq = m_liFrequency.QuadPart;
+    return (ticks / freq) * 1000000 + (ticks % freq) * 1000000 / freq;
+}
+
+bool
+SessionRecorder::WriteToFile(const void* p, size_t cb, void* context)
+{
+    DWORD dw;
+    return WriteFile(HANDLE(context), p, DWORD(cb), &dw, nullptr) && dw == cb;
+}
+
+DWORD WINAPI
+SessionRecorder::PumpThread(void* param)
+{
+    Pump* const pump = static_cast<Pump*>(param);
+    const bool fInput = (pump->stream == IoLogStream::Stdin);
+
+    char buffer[4096];
+    for (;;)
+    {
+        DWORD cb;
+        if (!ReadFile(pump->hFrom, buffer, sizeof(buffer), &cb, nullptr) || !cb)
+            break;
+
+        // Pass the data along first; recording it never blocks.
+        const IoLogTime time = pump->pRecorder->Now();
+        bool fWrote = true;
+        for (DWORD done = 0; fWrote && done < cb;)
+        {
+            DWORD dw;
+            fWrote = WriteFile(pump->hTo, buffer + done, cb - done, &dw, nullptr) && dw;
+            done += dw;
+        }
+        pump->pRecorder->m_recorder.Record(pump->stream, time, buffer, cb);
+
+        // Once the command stops reading its input, stop reading input for
+        // it.  Output keeps getting recorded even if the original handle
+        // can't be written to anymore.
+        if (fInput && !fWrote)
+            break;
+    }
+    return 0;
+}
+
+DWORD WINAPI
+SessionRecorder::DrainThread(void* param)
+{
+    SessionRecorder* const self = static_cast<SessionRecorder*>(param);
+    while (WaitForSingleObject(self->m_hStop, c_drain_interval) == WAIT_TIMEOUT)
+        self->m_recorder.Drain(self->Now());
+    self->m_recorder.Finish(self->Now());
+    return 0;
+}
+
+bool
+SessionRecorder::Start(HANDLE hFile)
+{
+    QueryPerformanceFrequency(&m_liFrequency);
+    QueryPerformanceCounter(&m_liStart);
+
+    m_hFile = hFile;
+
+    // The file header records the wall clock time, as microseconds since
+    // 1970-01-01 UTC.
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    const unsigned long long ft64 = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    const unsigned long long start_time = (ft64 - 116444736000000000ull) / 10;
+
+    m_hStop = CreateEventW(nullptr, true, false, nullptr);
+    if (!m_hStop || !m_recorder.Begin(start_time, WriteToFile, m_hFile))
+    {
+        if (GetLastError() == NOERROR)
+            SetLastError(ERROR_OUTOFMEMORY);
+        return false;
+    }
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, true };
+    for (unsigned i = 0; i < c_streams; ++i)
+    {
+        const HANDLE hOriginal = GetStdHandle(c_std_handles[i]);
+        if (!hOriginal || hOriginal == INVALID_HANDLE_VALUE)
+            continue;
+
+        HANDLE hRead;
+        HANDLE hWrite;
+        if (!CreatePipe(&hRead, &hWrite, &sa, 0))
+            return false;
+
+        // The command inherits one end of the pipe; the pump keeps the other.
+        const bool fInput = (c_std_handles[i] == STD_INPUT_HANDLE);
+        Pump& pump = m_pumps[i];
+        pump.pRecorder = this;
+        pump.stream = IoLogStream(unsigned(IoLogStream::Stdin) + i);
+        pump.hFrom = fInput ? hOriginal : hRead;
+        pump.hTo = fInput ? hWrite : hOriginal;
+        m_hChildEnd[i] = fInput ? hRead : hWrite;
+        SetHandleInformation(fInput ? hWrite : hRead, HANDLE_FLAG_INHERIT, 0);
+
+        pump.hThread = CreateThread(nullptr, 0, PumpThread, &pump, 0, nullptr);
+        if (!pump.hThread)
+        {
+            const DWORD err = GetLastError();
+            CloseHandle(hRead);
+            CloseHandle(hWrite);
+            m_hChildEnd[i] = nullptr;
+            SetLastError(err);
+            return false;
+        }
+
+        m_hOriginal[i] = hOriginal;
+        SetStdHandle(c_std_handles[i], m_hChildEnd[i]);
+    }
+
+    m_hDrain = CreateThread(nullptr, 0, DrainThread, this, 0, nullptr);
+    return !!m_hDrain;
+}
+
+void
+SessionRecorder::Stop()
+{
+    // Put back the original std handles, and close this process's copies of
+    // the command's ends of the pipes.  The output pipes reach end of file
+    // once every process that inherited them has exited.
+    for (unsigned i = 0; i < c_streams; ++i)
+    {
+        if (m_hOriginal[i])
+            SetStdHandle(c_std_handles[i], m_hOriginal[i]);
+        if (m_hChildEnd[i])
+            CloseHandle(m_hChildEnd[i]);
+        m_hChildEnd[i] = nullptr;
+    }
+
+    for (unsigned i = 0; i < c_streams; ++i)
+    {
+        Pump& pump = m_pumps[i];
+        if (!pump.hThread)
+            continue;
+
+        // The input pump is usually waiting for input that the command will
+        // never read, and an output pump can wait forever if the command
+        // left a process running in the background.  So don't wait long.
+        // If a pump still doesn't finish, it is left to end when sudo exits.
+        const bool fInput = (pump.stream == IoLogStream::Stdin);
+        if (fInput || WaitForSingleObject(pump.hThread, c_output_grace) == WAIT_TIMEOUT)
+        {
+            CancelSynchronousIo(pump.hThread);
+            if (WaitForSingleObject(pump.hThread, c_output_grace) == WAIT_TIMEOUT)
+            {
+                pump.hThread = nullptr;
+                continue;
+            }
+        }
+        CloseHandle(pump.hThread);
+        CloseHandle(fInput ? pump.hTo : pump.hFrom);
+        pump.hThread = nullptr;
+    }
+
+    if (m_hDrain)
+    {
+        SetEvent(m_hStop);
+        WaitForSingleObject(m_hDrain, INFINITE);
+        CloseHandle(m_hDrain);
+        m_hDrain = nullptr;
+    }
+
+    if (m_hStop)
+        CloseHandle(m_hStop);
+    m_hStop = nullptr;
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "iolog.h"
+
+// Records the launched command's stdin, stdout, and stderr for --log-output.
+//
+// Start() takes over a file handle opened for writing (the caller creates
+// the file), and replaces the std handles with pipes, so that commands
+// launched afterwards inherit the pipes.  A thread per stream copies between each
+// pipe and the original handle, and hands a copy of the data to the
+// recorder's lock-free queues.  Another thread drains the queues into the
+// file, so that writing the file never holds up the command's output.
+class SessionRecorder
+{
+public:
+                    SessionRecorder() = default;
+                    ~SessionRecorder() { Stop(); }
+
+    bool            Start(HANDLE hFile);
+
+    // Restores the std handles, waits for the command's remaining output,
+    // and finishes the file.
+    void            Stop();
+
+private:
+    struct Pump
+    {
+        SessionRecorder* pRecorder;
+        IoLogStream     stream;
+        HANDLE          hFrom;
+        HANDLE          hTo;
+        HANDLE          hThread;
+    };
+
+    enum { c_streams = 3 };
+
+    IoLogTime       Now() const;
+    static bool     WriteToFile(const void* p, size_t cb, void* context);
+    static DWORD WINAPI PumpThread(void* param);
+    static DWORD WINAPI DrainThread(void* param);
+
+    IoLogRecorder   m_recorder;
+    HANDLE          m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE          m_hStop = nullptr;
+    HANDLE          m_hDrain = nullptr;
+    Pump            m_pumps[c_streams] = {};
+    HANDLE          m_hOriginal[c_streams] = {};
+    HANDLE          m_hChildEnd[c_streams] = {};    // The pipe ends the command inherits.
+    LARGE_INTEGER   m_liStart = {};
+    LARGE_INTEGER   m_liFrequency = {};
+
+                    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+};
@@ -0,0 +1,88 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+enum class StatUnit : unsigned char
+{
+    Signed,
+    Count,
+    Seconds,                    // Value is in microseconds.
+    Bytes,                      // Shown as KB in the text report.
+};
+
+struct StatField
+{
+    const char*         label;
+    const char*         key;
+    StatUnit            unit;
+    unsigned long long  value;
+};
+
+static void
+FormatValue(char* out, size_t cb, const StatField& field, bool json)
+{
+    switch (field.unit)
+    {
+    case StatUnit::Signed:
+        snprintf(out, cb, "%d", int(field.value));
+        break;
+    case StatUnit::Count:
+        snprintf(out, cb, "%llu", field.value);
+        break;
+    case StatUnit::Seconds:
+        snprintf(out, cb, json ? "%llu.%03llu" : "%llu.%03llu s", field.value / 1000000, (field.value % 1000000) / 1000);
+        break;
+    case StatUnit::Bytes:
+        if (json)
+            snprintf(out, cb, "%llu", field.value);
+        else
+            snprintf(out, cb, "%llu KB", field.value / 1024);
+        break;
+    }
+}
+
+void
+WriteProcessStats(const ProcessStats& stats, StatsFormat format, StatsWriter write, void* context)
+{
+    const StatField fields[] =
+    {
+        { "Exit code:",                  "exit_code",                  StatUnit::Signed,    (unsigned long long)(long long)stats.exit_code },
+        { "Elapsed (wall clock) time:",  "wall_seconds",               StatUnit::Seconds,   stats.wall_us },
+        { "User time:",                  "user_seconds",               StatUnit::Seconds,   stats.user_us },
+        { "Kernel time:",                "kernel_seconds",             StatUnit::Seconds,   stats.kernel_us },
+        { "Processes:",                  "processes",                  StatUnit::Count,     stats.processes },
+        { "Peak memory, all processes:", "peak_job_memory_bytes",      StatUnit::Bytes,     stats.peak_job_memory },
+        { "Peak memory, one process:",   "peak_process_memory_bytes",  StatUnit::Bytes,     stats.peak_process_memory },
+        { "Read operations:",            "read_operations",            StatUnit::Count,     stats.read_ops },
+        { "Read bytes:",                 "read_bytes",                 StatUnit::Count,     stats.read_bytes },
+        { "Write operations:",           "write_operations",           StatUnit::Count,     stats.write_ops },
+        { "Write bytes:",                "write_bytes",                StatUnit::Count,     stats.write_bytes },
+        { "Other I/O operations:",       "other_operations",           StatUnit::Count,     stats.other_ops },
+        { "Other I/O bytes:",            "other_bytes",                StatUnit::Count,     stats.other_bytes },
+    };
+    const size_t count = sizeof(fields) / sizeof(fields[0]);
+    const bool json = (format == StatsFormat::Json);
+
+    if (json)
+        write("{\r\n", context);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        char value[48];
+        char line[128];
+        FormatValue(value, sizeof(value), fields[i], json);
+        if (json)
+            snprintf(line, sizeof(line), "  \"%s\": %s%s\r\n", fields[i].key, value, (i + 1 < count) ? "," : "");
+        else
+            snprintf(line, sizeof(line), "  %-31s %s\r\n", fields[i].label, value);
+        write(line, context);
+    }
+
+    if (json)
+        write("}\r\n", context);
+}
@@ -0,0 +1,33 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// Resource usage of a launched command's whole process tree, for --stats.
+
+struct ProcessStats
+{
+    unsigned long long  wall_us;
+    unsigned long long  user_us;
+    unsigned long long  kernel_us;
+    unsigned long long  peak_job_memory;        // Bytes committed by the tree.
+    unsigned long long  peak_process_memory;    // Bytes committed by one process.
+    unsigned long long  read_ops;
+    unsigned long long  read_bytes;
+    unsigned long long  write_ops;
+    unsigned long long  write_bytes;
+    unsigned long long  other_ops;
+    unsigned long long  other_bytes;
+    unsigned            processes;
+    int                 exit_code;
+};
+
+enum class StatsFormat : unsigned char
+{
+    Text,
+    Json,
+};
+
+// Writes the report one line at a time (each line ends with \r\n).
+typedef void (*StatsWriter)(const char* line, void* context);
+void WriteProcessStats(const ProcessStats& stats, StatsFormat format, StatsWriter write, void* context);
@@ -0,0 +1,483 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Checker and benchmark for --stats:  accounting for a whole process tree,
+// and the text and JSON reports.
+//
+// A job object is stood in for by a process that makes itself the child
+// subreaper, so that it inherits any orphaned descendants, starts the
+// command, and reaps every process in the tree, adding up their rusage.
+// The command (standing in for CMD) starts a few grandchildren that burn
+// known amounts of CPU time and touch known amounts of memory; it waits for
+// some of them and leaves the others running when it exits, the way
+// "start /b" does.  The checker verifies that the stand-in reaps the command
+// and every orphan, and counts all of the CPU time, the largest process's memory, and the wall
+// time until the last one exits, and reports what waiting for only the
+// command (as sudo used to) misses.  Then it checks the reports for a table
+// of stats, including the extremes:  every field is present, once, in order,
+// and the JSON is a flat object of numbers.  The benchmark times the
+// reports.
+//
+//      g++ -std=c++17 -O2 statsbench.cpp stats.cpp -o statsbench
+//      ./statsbench [-n iterations] [-g grandchildren] [-c cpu_ms]
+//
+// Linux only, for PR_SET_CHILD_SUBREAPER.  rusage has no byte counts, so the
+// stand-in leaves those zero; on Windows the job object provides them.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+enum : unsigned { c_max_grandchildren = 32 };
+
+static unsigned s_grandchildren = 6;
+static unsigned s_cpu_ms = 40;
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long
+Microseconds(const struct timeval& tv)
+{
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+//------------------------------------------------------------------------------
+// The process tree.
+
+static unsigned
+CpuMs(unsigned i)
+{
+    return s_cpu_ms * (1 + i % 3);
+}
+
+static unsigned
+MemoryMb(unsigned i)
+{
+    return 8 + 8 * i;
+}
+
+// Grandchildren with odd indices are left running when the command exits.
+static bool
+Detached(unsigned i)
+{
+    return i & 1;
+}
+
+static void
+Burn(unsigned ms)
+{
+    struct timespec ts;
+    const unsigned long long target = (unsigned long long)ms * 1000000;
+    volatile unsigned long long spin = 0;
+    do
+    {
+        for (unsigned i = 0; i < 10000; ++i)
+            spin = spin + i;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    }
+    while ((unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec < target);
+}
+
+static void
+Grandchild(unsigned i)
+{
+    // Touch each page, through volatile so the writes aren't elided.
+    const size_t cb = size_t(MemoryMb(i)) << 20;
+    volatile char* p = static_cast<volatile char*>(malloc(cb));
+    for (size_t j = 0; p && j < cb; j += 4096)
+        p[j] = char(i + 1);
+    Burn(CpuMs(i));
+    _exit(0);
+}
+
+// Stands in for CMD:  starts the grandchildren, waits for the ones that
+// aren't detached, and exits with 3.
+static void
+Command()
+{
+    pid_t pids[c_max_grandchildren];
+    for (unsigned i = 0; i < s_grandchildren; ++i)
+    {
+        pids[i] = fork();
+        if (!pids[i])
+            Grandchild(i);
+    }
+    for (unsigned i = 0; i < s_grandchildren; ++i)
+    {
+        if (pids[i] > 0 && !Detached(i))
+            waitpid(pids[i], nullptr, 0);
+    }
+    _exit(3);
+}
+
+// Stands in for the job object:  runs the command as the subreaper of its
+// tree, and adds up the usage of every process in it.  With whole_tree
+// false, only waits for the command, as sudo used to.
+static bool
+RunJob(bool whole_tree, ProcessStats& stats)
+{
+    int fds[2];
+    if (pipe(fds))
+        return false;
+
+    const pid_t job = fork();
+    if (job < 0)
+        return false;
+    if (!job)
+    {
+        close(fds[0]);
+        if (whole_tree)
+            prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+        ProcessStats result;
+        memset(&result, 0, sizeof(result));
+        const unsigned long long start = NowMicroseconds();
+        const pid_t command = fork();
+        if (!command)
+            Command();
+
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(whole_tree ? -1 : command, &status, 0, &usage)) != -1 || errno == EINTR)
+        {
+            if (pid < 0)
+                continue;
+            // Each process's usage includes the descendants it waited for,
+            // and the subreaper only inherits the ones nobody waited for,
+            // so nothing is counted twice.
+            result.user_us += Microseconds(usage.ru_utime);
+            result.kernel_us += Microseconds(usage.ru_stime);
+            result.read_ops += (unsigned long long)usage.ru_inblock;
+            result.write_ops += (unsigned long long)usage.ru_oublock;
+            if ((unsigned long long)usage.ru_maxrss * 1024 > result.peak_process_memory)
+                result.peak_process_memory = (unsigned long long)usage.ru_maxrss * 1024;
+            // rusage counts a process and the descendants it waited for as
+            // one, so this counts the command and the orphans.
+            ++result.processes;
+            if (pid == command)
+                result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if (!whole_tree)
+                break;
+        }
+        result.wall_us = NowMicroseconds() - start;
+        result.peak_job_memory = result.peak_process_memory;
+        const bool ok = write(fds[1], &result, sizeof(result)) == ssize_t(sizeof(result));
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    const bool ok = read(fds[0], &stats, sizeof(stats)) == ssize_t(sizeof(stats));
+    close(fds[0]);
+    int status;
+    waitpid(job, &status, 0);
+
+    // Without the subreaper, the detached grandchildren outlive the job;
+    // reap them so the next run starts clean.
+    while (waitpid(-1, nullptr, WNOHANG) > 0)
+        ;
+    return ok && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static bool
+CheckTree()
+{
+    unsigned long long cpu_us = 0;
+    unsigned long long detached_cpu_us = 0;
+    unsigned long long longest_us = 0;
+    unsigned long long largest = 0;
+    unsigned detached = 0;
+    for (unsigned i = 0; i < s_grandchildren; ++i)
+    {
+        const unsigned long long us = CpuMs(i) * 1000ull;
+        cpu_us += us;
+        if (Detached(i))
+        {
+            detached_cpu_us += us;
+            ++detached;
+        }
+        if (us > longest_us)
+            longest_us = us;
+        if ((unsigned long long)MemoryMb(i) << 20 > largest)
+            largest = (unsigned long long)MemoryMb(i) << 20;
+    }
+
+    ProcessStats tree;
+    ProcessStats command;
+    if (!RunJob(true, tree) || !RunJob(false, command))
+    {
+        fprintf(stderr, "running the job failed.\n");
+        return false;
+    }
+
+    // CPU time is measured in ticks, so allow a little slack.
+    const unsigned long long tree_cpu = tree.user_us + tree.kernel_us;
+    const unsigned long long command_cpu = command.user_us + command.kernel_us;
+    bool ok = true;
+    if (tree.exit_code != 3 || tree.processes != 1 + detached)
+    {
+        fprintf(stderr, "the job reported exit code %d and %u processes.\n", tree.exit_code, tree.processes);
+        ok = false;
+    }
+    if (tree_cpu < cpu_us * 9 / 10 || tree.wall_us < longest_us * 9 / 10)
+    {
+        fprintf(stderr, "the job reported %llu us of CPU time in %llu us; the tree used %llu us, the longest %llu us.\n",
+                tree_cpu, tree.wall_us, cpu_us, longest_us);
+        ok = false;
+    }
+    if (tree.peak_process_memory < largest)
+    {
+        fprintf(stderr, "the job reported a peak of %llu bytes; the largest process used %llu.\n",
+                tree.peak_process_memory, largest);
+        ok = false;
+    }
+    if (command.exit_code != 3 || command_cpu + detached_cpu_us / 2 > tree_cpu)
+    {
+        fprintf(stderr, "waiting for only the command reported %llu us of CPU time.\n", command_cpu);
+        ok = false;
+    }
+
+    if (ok)
+    {
+        printf("whole tree:    %u reaped,    %6.1f ms CPU, %6.1f ms wall, %4llu MB peak\n",
+               tree.processes, tree_cpu / 1000.0, tree.wall_us / 1000.0, tree.peak_process_memory >> 20);
+        printf("command only:  %u reaped,    %6.1f ms CPU, %6.1f ms wall, %4llu MB peak (missed %.1f ms CPU)\n",
+               command.processes, command_cpu / 1000.0, command.wall_us / 1000.0, command.peak_process_memory >> 20,
+               (tree_cpu - command_cpu) / 1000.0);
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Reports.
+
+static const char* const c_keys[] =
+{
+    "exit_code", "wall_seconds", "user_seconds", "kernel_seconds", "processes",
+    "peak_job_memory_bytes", "peak_process_memory_bytes", "read_operations",
+    "read_bytes", "write_operations", "write_bytes", "other_operations", "other_bytes",
+};
+enum : unsigned { c_key_count = sizeof(c_keys) / sizeof(c_keys[0]) };
+
+struct Report
+{
+    char                text[4096];
+    size_t              len;
+    unsigned            lines;
+    bool                bad_ending;
+};
+
+static void
+CollectLine(const char* line, void* context)
+{
+    Report* const report = static_cast<Report*>(context);
+    const size_t len = strlen(line);
+    if (len < 2 || strcmp(line + len - 2, "\r\n") || memchr(line, '\n', len - 1))
+        report->bad_ending = true;
+    if (report->len + len < sizeof(report->text))
+    {
+        memcpy(report->text + report->len, line, len + 1);
+        report->len += len;
+    }
+    ++report->lines;
+}
+
+// Returns the value for a key in the JSON report, checking the line's shape.
+static const char*
+JsonValue(const Report& report, unsigned index, char* value, size_t cb)
+{
+    // Line 0 is "{", then one line per key, in order.
+    const char* line = report.text;
+    for (unsigned i = 0; i <= index; ++i)
+        line = strstr(line, "\r\n") + 2;
+
+    char key[64];
+    snprintf(key, sizeof(key), "  \"%s\": ", c_keys[index]);
+    if (strncmp(line, key, strlen(key)))
+        return nullptr;
+    const char* p = line + strlen(key);
+    const char* end = strstr(p, "\r\n");
+    const char* number = p;
+    if (*p == '-')
+        ++p;
+    while (*p >= '0' && *p <= '9')
+        ++p;
+    if (*p == '.')
+    {
+        ++p;
+        if (!(p[0] >= '0' && p[0] <= '9'))
+            return nullptr;
+        while (*p >= '0' && *p <= '9')
+            ++p;
+    }
+    const bool last = (index + 1 == c_key_count);
+    if (p == number || (last ? p != end : (*p != ',' || p + 1 != end)))
+        return nullptr;
+    snprintf(value, cb, "%.*s", int(p - number), number);
+    return value;
+}
+
+// Returns the value for a label in the text report.
+static const char*
+TextValue(const Report& report, unsigned index, char* value, size_t cb)
+{
+    const char* line = report.text;
+    for (unsigned i = 0; i < index; ++i)
+        line = strstr(line, "\r\n") + 2;
+    const char* end = strstr(line, "\r\n");
+
+    // "  label" padded to 33 columns, a space, and the value.
+    if (end - line < 35 || strncmp(line, "  ", 2) || line[2] == ' ' || line[33] != ' ' || line[34] == ' ')
+        return nullptr;
+    snprintf(value, cb, "%.*s", int(end - line - 34), line + 34);
+    return value;
+}
+
+// The expected values are in report order:  exit code, times, processes,
+// memory, then I/O.
+struct ReportCase
+{
+    ProcessStats        stats;
+    const char*         json[c_key_count];
+    const char*         text[c_key_count];
+};
+
+static const ReportCase c_report_cases[] =
+{
+    {
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+        { "0", "0.000", "0.000", "0.000", "0", "0", "0", "0", "0", "0", "0", "0", "0" },
+        { "0", "0.000 s", "0.000 s", "0.000 s", "0", "0 KB", "0 KB", "0", "0", "0", "0", "0", "0" },
+    },
+    {
+        { 1999999, 1000, 999, 1023, 1024, 1, 2, 3, 4, 5, 6, 7, -1 },
+        { "-1", "1.999", "0.001", "0.000", "7", "1023", "1024", "1", "2", "3", "4", "5", "6" },
+        { "-1", "1.999 s", "0.001 s", "0.000 s", "7", "0 KB", "1 KB", "1", "2", "3", "4", "5", "6" },
+    },
+    {
+        { ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, ULLONG_MAX, UINT_MAX, int(0xc0000005) },
+        { "-1073741819", "18446744073709.551", "18446744073709.551", "18446744073709.551", "4294967295",
+          "18446744073709551615", "18446744073709551615", "18446744073709551615", "18446744073709551615",
+          "18446744073709551615", "18446744073709551615", "18446744073709551615", "18446744073709551615" },
+        { "-1073741819", "18446744073709.551 s", "18446744073709.551 s", "18446744073709.551 s", "4294967295",
+          "18014398509481983 KB", "18014398509481983 KB", "18446744073709551615", "18446744073709551615",
+          "18446744073709551615", "18446744073709551615", "18446744073709551615", "18446744073709551615" },
+    },
+};
+
+static bool
+CheckReports()
+{
+    for (const ReportCase& c : c_report_cases)
+    {
+        for (unsigned json = 0; json < 2; ++json)
+        {
+            Report report;
+            memset(&report, 0, sizeof(report));
+            WriteProcessStats(c.stats, json ? StatsFormat::Json : StatsFormat::Text, CollectLine, &report);
+
+            bool ok = !report.bad_ending && report.lines == c_key_count + (json ? 2 : 0);
+            if (ok && json)
+                ok = !strncmp(report.text, "{\r\n", 3) && !strcmp(report.text + report.len - 3, "}\r\n");
+            for (unsigned i = 0; ok && i < c_key_count; ++i)
+            {
+                char value[64];
+                const char* got = json ? JsonValue(report, i, value, sizeof(value)) : TextValue(report, i, value, sizeof(value));
+                const char* want = (json ? c.json : c.text)[i];
+                if (!got || strcmp(got, want))
+                {
+                    fprintf(stderr, "%s report line %u is \"%s\", not \"%s\".\n", json ? "JSON" : "text", i, got ? got : "(malformed)", want);
+                    ok = false;
+                }
+            }
+            if (!ok)
+            {
+                fprintf(stderr, "%s", report.text);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Benchmark.
+
+static void
+RunBench(unsigned iterations)
+{
+    ProcessStats stats;
+    memset(&stats, 0, sizeof(stats));
+    RunJob(true, stats);
+
+    unsigned long long elapsed[2];
+    size_t bytes[2] = {};
+    for (unsigned json = 0; json < 2; ++json)
+    {
+        const unsigned long long start = NowMicroseconds();
+        for (unsigned n = 0; n < iterations; ++n)
+        {
+            Report report;
+            report.len = 0;
+            report.lines = 0;
+            report.bad_ending = false;
+            stats.wall_us += n;
+            WriteProcessStats(stats, json ? StatsFormat::Json : StatsFormat::Text, CollectLine, &report);
+            bytes[json] += report.len;
+        }
+        elapsed[json] = NowMicroseconds() - start;
+    }
+
+    printf("text report:  %zu bytes, %.2f us\n", bytes[0] / iterations, elapsed[0] / double(iterations));
+    printf("JSON report:  %zu bytes, %.2f us\n", bytes[1] / iterations, elapsed[1] / double(iterations));
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned iterations = 100000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            iterations = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+            s_grandchildren = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            s_cpu_ms = unsigned(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: statsbench [-n iterations] [-g grandchildren] [-c cpu_ms]\n");
+            return 1;
+        }
+    }
+
+    if (!iterations || s_grandchildren < 2 || s_grandchildren > c_max_grandchildren)
+        return 1;
+
+    if (!CheckReports())
+        return 1;
+    printf("checks passed (%zu reports, text and JSON).\n", sizeof(c_report_cases) / sizeof(c_report_cases[0]));
+
+    if (!CheckTree())
+        return 1;
+    RunBench(iterations);
+    return 0;
+}
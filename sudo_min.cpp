@@ -0,0 +1,446 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// sudo-min:  sudo without the C runtime.
+//
+// Every sudo invocation starts sudo.exe twice (the caller's sudo and the
+// elevated sudo), so the startup of the image itself is paid twice.  This
+// build has its own entry point instead of the CRT's startup code, and only
+// imports from kernel32 and shell32.  It shares the option parser,
+// the command line quoting, and the decision whether a command needs CMD
+// with sudo.exe, which don't use the CRT either.
+//
+// It handles the same command lines as sudo.exe, but only the core options:
+// -b, -D, -n, --direct, and --shell.  Everything else (-u, --batch, the
+// broker, the handoff section, tracing, and so on) needs sudo.exe.  Since it
+// is always sudo-min on both sides, the request goes on the elevated sudo's
+// command line, as the options that produced it.
+
+#include <windows.h>
+#include <shellapi.h>
+
+#include "version.h"
+#include "cmdline.h"
+#include "options.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+//------------------------------------------------------------------------------
+// What the compiler and cmdline.cpp expect from the runtime.  The loops use
+// volatile so they can't be turned back into calls to themselves.  Nothing
+// uses floating point and no stack frame comes near a page, so neither
+// _fltused nor __chkstk is needed; the MinGW build uses -ffreestanding so GCC
+// doesn't turn loops into calls to strlen and the like.
+
+#ifdef _MSC_VER
+#pragma function(memset, memcpy, memcmp)
+#endif
+
+extern "C" void* __cdecl
+memset(void* p, int c, size_t cb)
+{
+    volatile unsigned char* d = static_cast<unsigned char*>(p);
+    while (cb--)
+        *(d++) = static_cast<unsigned char>(c);
+    return p;
+}
+
+extern "C" void* __cdecl
+memcpy(void* p, const void* q, size_t cb)
+{
+    volatile unsigned char* d = static_cast<unsigned char*>(p);
+    const unsigned char* s = static_cast<const unsigned char*>(q);
+    while (cb--)
+        *(d++) = *(s++);
+    return p;
+}
+
+extern "C" void* __cdecl
+memmove(void* p, const void* q, size_t cb)
+{
+    volatile unsigned char* d = static_cast<unsigned char*>(p);
+    const unsigned char* s = static_cast<const unsigned char*>(q);
+    if (d <= s)
+    {
+        while (cb--)
+            *(d++) = *(s++);
+    }
+    else
+    {
+        while (cb--)
+            d[cb] = s[cb];
+    }
+    return p;
+}
+
+extern "C" int __cdecl
+memcmp(const void* p, const void* q, size_t cb)
+{
+    const volatile unsigned char* a = static_cast<const unsigned char*>(p);
+    const unsigned char* b = static_cast<const unsigned char*>(q);
+    for (; cb--; ++a, ++b)
+    {
+        if (*a != *b)
+            return (*a < *b) ? -1 : 1;
+    }
+    return 0;
+}
+
+extern "C" void* __cdecl
+malloc(size_t cb)
+{
+    return HeapAlloc(GetProcessHeap(), 0, cb);
+}
+
+extern "C" void __cdecl
+free(void* p)
+{
+    if (p)
+        HeapFree(GetProcessHeap(), 0, p);
+}
+
+//------------------------------------------------------------------------------
+// Output.  Text goes to the console as UTF-16, or as UTF-8 when redirected.
+
+static void
+WriteText(DWORD dwStd, LPCWSTR psz)
+{
+    const HANDLE h = GetStdHandle(dwStd);
+    const int cch = lstrlenW(psz);
+    DWORD dw;
+    if (GetConsoleMode(h, &dw))
+    {
+        WriteConsoleW(h, psz, DWORD(cch), &dw, nullptr);
+        return;
+    }
+
+    const int cb = WideCharToMultiByte(CP_UTF8, 0, psz, cch, nullptr, 0, nullptr, nullptr);
+    char* const p = static_cast<char*>(malloc(cb ? cb : 1));
+    if (p && WideCharToMultiByte(CP_UTF8, 0, psz, cch, p, cb, nullptr, nullptr) == cb)
+        WriteFile(h, p, DWORD(cb), &dw, nullptr);
+    free(p);
+}
+
+static void
+OutText(LPCWSTR psz)
+{
+    WriteText(STD_OUTPUT_HANDLE, psz);
+}
+
+static void
+ErrText(LPCWSTR psz)
+{
+    WriteText(STD_ERROR_HANDLE, psz);
+}
+
+static void
+ShowHelp()
+{
+    OutText(L"Runs the specified command line with elevation (as super user).\r\n"
+            L"\r\n"
+            L"SUDO-MIN [options] {command line}\r\n"
+            L"\r\n"
+            L"  -?, -h, --help            Display a short help message and exit.\r\n"
+            L"  -b, --background          Run the command in the background.\r\n"
+            L"  -D dir, --chdir=dir       Run the command in the specified directory.\r\n"
+            L"  -n, --non-interactive     Avoid showing any UI.\r\n"
+            L"  -V, --version             Print the sudo version string.\r\n"
+            L"  --direct                  Run the program directly, without CMD.\r\n"
+            L"  --shell                   Run the command line with CMD.\r\n"
+            L"\r\n"
+            L"This is the minimal build of sudo; the other options need sudo.exe.\r\n");
+}
+
+// Like sudo.exe, reports the error and exits with -1.
+static void
+ExitFailure(DWORD err)
+{
+    const DWORD dwFlags = FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS;
+    LPWSTR psz = nullptr;
+    if (FormatMessageW(dwFlags, 0, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), LPWSTR(&psz), 0, 0) && psz)
+    {
+        for (int i = lstrlenW(psz); i > 0 && (psz[i - 1] == ' ' || psz[i - 1] == '\r' || psz[i - 1] == '\n'); --i)
+            psz[i - 1] = '\0';
+        ErrText(psz);
+        LocalFree(psz);
+    }
+    else
+    {
+        WCHAR sz[16];
+        CommandLineBuilder number;
+        number.Arg(unsigned(err));
+        number.Emit(sz);
+        ErrText(L"Error ");
+        ErrText(sz);
+        ErrText(L".");
+    }
+
+    ErrText(L"\r\nsudo failed.\r\n");
+    ExitProcess(DWORD(-1));
+}
+
+//------------------------------------------------------------------------------
+// Both sides.
+
+// Emits a command line into a new allocation, or exits.
+static LPWSTR
+EmitCommandLine(const CommandLineBuilder& args)
+{
+    LPWSTR psz = static_cast<LPWSTR>(malloc((args.Length() + 1) * sizeof(WCHAR)));
+    if (!psz || !args.Emit(psz))
+        ExitFailure(ERROR_OUTOFMEMORY);
+    return psz;
+}
+
+static DWORD
+WaitForExitCode(HANDLE hProcess)
+{
+    DWORD dwExit = 0;
+    WaitForSingleObject(hProcess, INFINITE);
+    if (!GetExitCodeProcess(hProcess, &dwExit))
+        ExitFailure(GetLastError());
+    return dwExit;
+}
+
+// Elevated side:  runs the command in the caller's console.  Like sudo.exe,
+// a command runs directly unless it needs CMD (or --shell says so); a
+// program that CreateProcess can't find itself also runs with CMD.
+static DWORD
+RunCommand(LPCWSTR pszLine, LPCWSTR pszDir, ExecMode mode, bool fBackground)
+{
+    STARTUPINFOW si = {};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+    const DWORD dwFlags = fBackground ? CREATE_NEW_PROCESS_GROUP|CREATE_NO_WINDOW : 0;
+    PROCESS_INFORMATION pi = {};
+    bool fCreated = false;
+    DWORD err = ERROR_FILE_NOT_FOUND;
+
+    if (mode == ExecMode::Direct || (mode == ExecMode::Auto && !NeedsShell(pszLine)))
+    {
+        CommandLineBuilder args;
+        args.Raw(pszLine);
+        fCreated = !!CreateProcessW(nullptr, EmitCommandLine(args), nullptr, nullptr, true, dwFlags, nullptr,
+                                    pszDir, &si, &pi);
+        err = GetLastError();
+        if (!fCreated && (mode == ExecMode::Direct || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND &&
+                                                       err != ERROR_BAD_EXE_FORMAT)))
+            ExitFailure(err);
+    }
+
+    if (!fCreated)
+    {
+        WCHAR szComspec[MAX_PATH];
+        const DWORD cch = GetEnvironmentVariableW(L"COMSPEC", szComspec, ARRAYSIZE(szComspec));
+        if (!cch || cch >= ARRAYSIZE(szComspec))
+            lstrcpyW(szComspec, L"cmd.exe");
+
+        CommandLineBuilder args;
+        args.Program(szComspec);
+        args.Arg(L"/c");
+        args.Raw(pszLine);
+        if (!CreateProcessW(nullptr, EmitCommandLine(args), nullptr, nullptr, true, dwFlags, nullptr,
+                            pszDir, &si, &pi))
+            ExitFailure(GetLastError());
+    }
+
+    CloseHandle(pi.hThread);
+    const DWORD dwExit = fBackground ? 0 : WaitForExitCode(pi.hProcess);
+    CloseHandle(pi.hProcess);
+    return dwExit;
+}
+
+// Unelevated side:  runs this program again elevated, with --elevated and
+// the options it needs, and the command line verbatim.
+static DWORD
+Elevate(LPCWSTR pszLine, LPCWSTR pszDir, ExecMode mode, bool fBackground, bool fNOUI)
+{
+    WCHAR szModule[MAX_PATH];
+    const DWORD cchModule = GetModuleFileNameW(nullptr, szModule, ARRAYSIZE(szModule));
+    if (!cchModule || cchModule >= ARRAYSIZE(szModule))
+        ExitFailure(cchModule ? ERROR_FILENAME_EXCED_RANGE : GetLastError());
+
+    CommandLineBuilder args;
+    args.Arg(L"--elevated");
+    args.Arg(unsigned(GetCurrentProcessId()));
+    if (fBackground)
+        args.Arg(L"-b");
+    args.Arg(L"-D");
+    args.Arg(pszDir);
+    if (mode == ExecMode::Direct)
+        args.Arg(L"--direct");
+    else if (mode == ExecMode::Shell)
+        args.Arg(L"--shell");
+    args.Arg(L"--");
+    args.Raw(pszLine);
+
+    // Must use SW_HIDE so that FreeConsole() and AttachConsole() can work.
+    SHELLEXECUTEINFOW sei = {};
+    sei.cbSize = sizeof(sei);
+    sei.fMask = SEE_MASK_NOASYNC|SEE_MASK_NOCLOSEPROCESS|(fNOUI ? SEE_MASK_FLAG_NO_UI : 0);
+    sei.lpVerb = L"runas";
+    sei.lpFile = szModule;
+    sei.lpParameters = EmitCommandLine(args);
+    sei.lpDirectory = pszDir;
+    sei.nShow = SW_HIDE;
+    if (!ShellExecuteExW(&sei))
+        ExitFailure(GetLastError());
+    if (!sei.hProcess)
+        return 0;
+
+    const DWORD dwExit = fBackground ? 0 : WaitForExitCode(sei.hProcess);
+    CloseHandle(sei.hProcess);
+    return dwExit;
+}
+
+// sudo-min has neither the sudoers policy nor the audit journal, so it refuses
+// to run where either is configured rather than bypass them.  The elevated
+// side checks the policy files again, since it is what the policy protects.
+// Anything but "not found" counts as present.
+static bool
+HasPolicyFile()
+{
+    WCHAR szPath[MAX_PATH];
+    const DWORD cchModule = GetModuleFileNameW(nullptr, szPath, ARRAYSIZE(szPath));
+    if (!cchModule || cchModule >= ARRAYSIZE(szPath))
+        return true;
+
+    DWORD cchDir = 0;
+    for (DWORD i = 0; i < cchModule; ++i)
+    {
+        if (szPath[i] == '\\' || szPath[i] == '/' || szPath[i] == ':')
+            cchDir = i + 1;
+    }
+
+    static const LPCWSTR c_names[] = { L"sudoers", L"sudoers.bin" };
+    for (size_t i = 0; i < ARRAYSIZE(c_names); ++i)
+    {
+        const LPCWSTR pszName = c_names[i];
+        const int cchName = lstrlenW(pszName);
+        if (cchDir + cchName >= ARRAYSIZE(szPath))
+            return true;
+        memcpy(szPath + cchDir, pszName, (cchName + 1) * sizeof(*szPath));
+        if (GetFileAttributesW(szPath) != INVALID_FILE_ATTRIBUTES)
+            return true;
+        const DWORD err = GetLastError();
+        if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+            return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Entry point.
+
+static DWORD
+Main()
+{
+    LPCWSTR pszLine = OptionParser::SkipArg(GetCommandLineW());
+    LPCWSTR pszDir = nullptr;
+    ExecMode execMode = ExecMode::Auto;
+    bool fBackground = false;
+    bool fNOUI = false;
+    bool fElevated = false;
+    DWORD dwPID = 0;
+
+    LPWSTR pszStorage = static_cast<LPWSTR>(malloc(OptionParser::StorageNeeded(pszLine) * sizeof(WCHAR)));
+    if (!pszStorage)
+        ExitFailure(ERROR_OUTOFMEMORY);
+
+    OptionParser parser(pszLine, pszStorage);
+    for (bool fMore = true; fMore;)
+    {
+        const OptionId id = parser.Next();
+        LPWSTR pszValue = parser.Value();
+        switch (id)
+        {
+        case OptionId::None:
+            fMore = false;
+            break;
+        case OptionId::Help:
+            ShowHelp();
+            return 0;
+        case OptionId::Version:
+            OutText(L"SUDO " SUDO_VERSION_LSTR L" (min); " SUDO_COPYRIGHT_STR L"; MIT License.\r\n");
+            return 0;
+        case OptionId::Background:
+            fBackground = true;
+            break;
+        case OptionId::NonInteractive:
+            fNOUI = true;
+            break;
+        case OptionId::ChDir:
+            if (!pszDir)
+                pszDir = pszValue;
+            break;
+        case OptionId::Direct:
+        case OptionId::Shell:
+            if (execMode == ExecMode::Auto)
+                execMode = (id == OptionId::Direct) ? ExecMode::Direct : ExecMode::Shell;
+            break;
+        case OptionId::Elevated:
+            if (!fElevated)
+            {
+                for (LPCWSTR p = pszValue; *p >= '0' && *p <= '9'; ++p)
+                    dwPID = dwPID * 10 + (*p - '0');
+                fElevated = true;
+            }
+            break;
+        case OptionId::Unknown:
+            ShowHelp();
+            return 1;
+        default:
+            ErrText(L"sudo-min only supports -b, -D, -n, --direct, and --shell; use sudo.exe for the other options.\r\n");
+            return 1;
+        }
+    }
+
+    pszLine = parser.Remaining();
+    if (!*pszLine)
+    {
+        ErrText(L"Missing command to execute.\r\n");
+        OutText(L"\r\nUsage:\r\n\r\n");
+        ShowHelp();
+        return 1;
+    }
+
+    if (HasPolicyFile())
+    {
+        ErrText(L"sudo-min does not support the sudoers policy; use sudo.exe where there is a sudoers file.\r\n");
+        return 1;
+    }
+    if (!fElevated && GetEnvironmentVariableW(L"SUDO_AUDIT_LOG", nullptr, 0))
+    {
+        ErrText(L"sudo-min does not support the audit journal; use sudo.exe when %SUDO_AUDIT_LOG% is set.\r\n");
+        return 1;
+    }
+
+    // CreateProcess looks for a program in the current directory, too.
+    if (fElevated)
+    {
+        FreeConsole();
+        AttachConsole(dwPID);
+        if (pszDir)
+            SetCurrentDirectoryW(pszDir);
+        return RunCommand(pszLine, pszDir, execMode, fBackground);
+    }
+
+    // The elevated sudo doesn't necessarily start in the same directory, so
+    // it always gets a full path.
+    WCHAR szDir[MAX_PATH];
+    const DWORD cchDir = (pszDir ? GetFullPathNameW(pszDir, ARRAYSIZE(szDir), szDir, nullptr) :
+                          GetCurrentDirectoryW(ARRAYSIZE(szDir), szDir));
+    if (!cchDir || cchDir >= ARRAYSIZE(szDir))
+        ExitFailure(cchDir ? ERROR_FILENAME_EXCED_RANGE : GetLastError());
+    return Elevate(pszLine, szDir, execMode, fBackground, fNOUI);
+}
+
+extern "C" void __cdecl
+SudoMinMain()
+{
+    ExitProcess(Main());
+}
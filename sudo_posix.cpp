@@ -0,0 +1,589 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// sudo for Linux (and other POSIX systems), built on platform_posix.cpp.
+//
+// This exists so that the portable parts of sudo -- option parsing, command
+// line quoting, deciding whether a command needs the shell, finding the
+// program, the elevation hop, spawning, and buffered output -- can be built,
+// profiled (perf), and sanitized (ASan, UBSan) with the Linux toolchain.  It
+// handles the same command lines as sudo.exe, but only a subset of the
+// options; the rest need Windows.
+//
+// The elevation hop runs this program again with --elevated, the same as
+// sudo.exe, but nothing is actually gained:  the elevated sudo just has
+// SUDO_SIMULATED_ELEVATION=1 in its environment.  Commands that need the
+// shell run with /bin/sh -c instead of CMD.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "version.h"
+#include "arena.h"
+#include "cmdline.h"
+#include "controls.h"
+#include "launch.h"
+#include "options.h"
+#include "platform.h"
+#include "resolve.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "writer.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static Arena s_arena;
+
+//------------------------------------------------------------------------------
+// Output.
+
+static bool
+WriteStream(const char* bytes, size_t len, void* context)
+{
+    return PlatformWrite(context, bytes, len);
+}
+
+static TextWriter s_out;
+static TextWriter s_err;
+
+template <class T> void
+OutText(const T* text)
+{
+    s_err.Flush();
+    s_out.Write(text);
+}
+
+template <class T> void
+ErrText(const T* text)
+{
+    s_out.Flush();
+    s_err.Write(text);
+}
+
+static void
+FlushOutput()
+{
+    s_out.Flush();
+    s_err.Flush();
+}
+
+static int
+ExitFailure(int err)
+{
+    ErrText("sudo: ");
+    ErrText(strerror(err));
+    ErrText("\n");
+    FlushOutput();
+    return 1;
+}
+
+static void
+WriteUsageLine(const char* line, void* /*context*/)
+{
+    OutText(line);
+}
+
+static void
+ShowHelp()
+{
+    OutText("Usage: sudo [options] [--] command_line\n\n");
+    GenerateOptionsUsage(WriteUsageLine, nullptr);
+    OutText("\nOn this platform only -b, -D, --direct, --shell, --debug, --trace, and\n"
+            "the scheduling and resource controls (except --cpu-rate), --timeout,\n"
+            "and --kill-after are supported.\n");
+}
+
+static wchar_t*
+ToWide(const char* s)
+{
+    const size_t len = strlen(s);
+    wchar_t* out = static_cast<wchar_t*>(s_arena.Alloc((len + 1) * sizeof(*out)));
+    if (!out)
+        return nullptr;
+    if (mbstowcs(out, s, len + 1) == size_t(-1))
+    {
+        // Not valid in the current locale; keep the bytes.
+        for (size_t i = 0; i <= len; ++i)
+            out[i] = wchar_t(static_cast<unsigned char>(s[i]));
+    }
+    return out;
+}
+
+static char*
+ToNarrow(const wchar_t* s)
+{
+    const size_t cb = wcstombs(nullptr, s, 0);
+    if (cb == size_t(-1))
+    {
+        errno = EILSEQ;
+        return nullptr;
+    }
+    char* out = static_cast<char*>(s_arena.Alloc(cb + 1));
+    if (out)
+        wcstombs(out, s, cb + 1);
+    return out;
+}
+
+//------------------------------------------------------------------------------
+// Tracing, the same as sudo.exe:  the unelevated sudo creates the file, and
+// each process appends its own events when it exits.  CLOCK_MONOTONIC is
+// comparable across processes.
+
+static const char* s_trace_file = nullptr;
+
+static TraceTicks
+QueryTraceClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return TraceTicks(ts.tv_sec) * 1000000000 + TraceTicks(ts.tv_nsec);
+}
+
+struct TraceText
+{
+    char*       p = nullptr;
+    size_t      len = 0;
+    size_t      capacity = 0;
+    bool        ok = true;
+};
+
+static void
+AppendTraceText(const char* text, size_t len, void* context)
+{
+    TraceText* const buffer = static_cast<TraceText*>(context);
+    if (!buffer->ok)
+        return;
+    if (buffer->len + len > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->len + len)
+            capacity *= 2;
+        char* p = static_cast<char*>(realloc(buffer->p, capacity));
+        if (!p)
+        {
+            buffer->ok = false;
+            return;
+        }
+        buffer->p = p;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->p + buffer->len, text, len);
+    buffer->len += len;
+}
+
+static bool
+CreateTraceFile(const char* file)
+{
+    const int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    TraceText text;
+    TraceWriteHeader(AppendTraceText, &text);
+    const bool ok = text.ok && write(fd, text.p, text.len) == ssize_t(text.len);
+    const int err = errno;
+    close(fd);
+    free(text.p);
+    errno = err;
+    return ok;
+}
+
+// Appends this process's events with a single write (O_APPEND), so they
+// cannot interleave with the other sudo process's.
+static void
+FlushTrace()
+{
+    if (!g_trace_enabled || !s_trace_file)
+        return;
+
+    const ArenaStats& stats = s_arena.Stats();
+    TraceCounterEvent("arena", "allocations", stats.allocations);
+    TraceCounterEvent("arena", "peak_bytes", stats.peak);
+
+    TraceText text;
+    TraceWriteEvents(AppendTraceText, &text);
+    if (text.ok && text.len)
+    {
+        const int fd = open(s_trace_file, O_WRONLY|O_APPEND|O_CLOEXEC);
+        if (fd >= 0)
+        {
+            if (write(fd, text.p, text.len) != ssize_t(text.len))
+                errno = EIO;
+            close(fd);
+        }
+    }
+    free(text.p);
+}
+
+class FlushTraceAtExit
+{
+public:
+    ~FlushTraceAtExit() { FlushTrace(); }
+};
+
+//------------------------------------------------------------------------------
+// Launching.
+
+static wchar_t*
+EmitCommandLine(const CommandLineBuilder& builder)
+{
+    wchar_t* out = static_cast<wchar_t*>(s_arena.Alloc((builder.Length() + 1) * sizeof(wchar_t)));
+    if (out && !builder.Emit(out))
+        out = nullptr;
+    return out;
+}
+
+static WatchdogWait
+WatchdogWaitProcess(unsigned timeout_ms, unsigned& exit_code, void* context)
+{
+    if (PlatformWait(*static_cast<PlatformProcess*>(context), exit_code, timeout_ms))
+        return WatchdogWait::Exited;
+    return (errno == ETIMEDOUT) ? WatchdogWait::Running : WatchdogWait::Failed;
+}
+
+static void
+WatchdogInterruptProcess(void* context)
+{
+    PlatformInterrupt(*static_cast<PlatformProcess*>(context));
+}
+
+static void
+WatchdogKillProcess(void* context)
+{
+    PlatformTerminateTree(*static_cast<PlatformProcess*>(context), c_exit_killed);
+}
+
+static int
+Launch(const wchar_t* line, const wchar_t* dir, ExecMode mode, bool background, bool debug,
+       const ProcessControls& controls, unsigned timeout_ms, unsigned kill_after_ms)
+{
+    // There is no cache file here, so the cache just searches.
+    ProgramCache cache;
+    wchar_t* found;
+    TraceSpan find_span("find program");
+    if (!LocateDirectProgram(line, dir, mode, cache, s_arena, found))
+        return ExitFailure(errno);
+    find_span.End();
+
+    const wchar_t* program = found;
+    const wchar_t* command_line = line;
+    if (!program)
+    {
+        command_line = PlatformShellCommandLine(line, s_arena, program);
+        if (!command_line)
+            return ExitFailure(errno);
+    }
+
+    if (debug)
+    {
+        OutText("\n---- posix_spawn ----\n");
+        OutText("FILE='"); OutText(program); OutText("'\n");
+        OutText("CMDLINE='"); OutText(command_line); OutText("'\n");
+        if (dir)
+        {
+            OutText("DIR='"); OutText(dir); OutText("'\n");
+        }
+    }
+    FlushOutput();
+
+    SpawnOptions spawn = {};
+    spawn.program = program;
+    spawn.command_line = command_line;
+    spawn.dir = dir;
+    spawn.background = background;
+    spawn.controls = &controls;
+    spawn.new_group = !!timeout_ms;
+
+    PlatformProcess process = {};
+    TraceSpan spawn_span("posix_spawn");
+    if (!PlatformSpawn(spawn, s_arena, process))
+        return ExitFailure(errno);
+    spawn_span.End();
+
+    TraceSpan wait_span("wait for command");
+    unsigned exit_code = 0;
+    if (background)
+    {
+        if (debug)
+            OutText("BACKGROUND; not waiting for completion.\n");
+    }
+    else if (timeout_ms)
+    {
+        const WatchdogOps ops = { WatchdogWaitProcess, WatchdogInterruptProcess, WatchdogKillProcess, &process };
+        const WatchdogResult result = RunWatchdog(ops, timeout_ms, kill_after_ms, exit_code);
+        if (result == WatchdogResult::Failed)
+            return ExitFailure(errno);
+        if (debug && result == WatchdogResult::TimedOut)
+            OutText("TIMED OUT; the command stopped after SIGTERM.\n");
+        else if (debug && result == WatchdogResult::Killed)
+            OutText("TIMED OUT; killed the command's process group.\n");
+    }
+    else if (!PlatformWait(process, exit_code))
+    {
+        return ExitFailure(errno);
+    }
+    PlatformClose(process);
+    return int(exit_code);
+}
+
+//------------------------------------------------------------------------------
+int
+main(int argc, char** argv)
+{
+    const TraceTicks start = QueryTraceClock();
+    setlocale(LC_CTYPE, "");
+
+    s_out.AttachBytes(WriteStream, nullptr, PlatformGetStdHandle(StdStream::Out));
+    s_err.AttachBytes(WriteStream, nullptr, PlatformGetStdHandle(StdStream::Err));
+
+    // Quote the arguments back into a Windows style command line, so that
+    // the same parser and quoting rules apply as for sudo.exe.
+    size_t cch = 1;
+    wchar_t** wargv = static_cast<wchar_t**>(s_arena.Alloc(argc * sizeof(*wargv)));
+    if (!wargv)
+        return ExitFailure(ENOMEM);
+    for (int i = 1; i < argc; ++i)
+    {
+        wargv[i] = ToWide(argv[i]);
+        if (!wargv[i])
+            return ExitFailure(ENOMEM);
+        cch += CommandLineBuilder::QuotedLength(wargv[i]) + 1;
+    }
+    wchar_t* line = static_cast<wchar_t*>(s_arena.Alloc(cch * sizeof(*line)));
+    wchar_t* storage = static_cast<wchar_t*>(s_arena.Alloc(cch * sizeof(*storage)));
+    if (!line || !storage)
+        return ExitFailure(ENOMEM);
+    wchar_t* p = line;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i > 1)
+            *(p++) = ' ';
+        p = CommandLineBuilder::AppendQuoted(p, wargv[i]);
+    }
+    *p = '\0';
+
+    const wchar_t* dir = nullptr;
+    ExecMode mode = ExecMode::Auto;
+    bool background = false;
+    bool debug = false;
+    bool elevated = false;
+    unsigned pid = 0;
+    ProcessControls controls;
+    const wchar_t* timeout = nullptr;
+    const wchar_t* kill_after = nullptr;
+    const wchar_t* trace = nullptr;
+    unsigned timeout_ms = 0;
+    unsigned kill_after_ms = 0;
+
+    OptionParser parser(line, storage);
+    for (OptionId id; (id = parser.Next()) != OptionId::None;)
+    {
+        switch (id)
+        {
+        case OptionId::Help:
+            ShowHelp();
+            return 0;
+        case OptionId::Version:
+            OutText("sudo " SUDO_VERSION_STR "\n" SUDO_COPYRIGHT_STR "\n");
+            return 0;
+        case OptionId::Background:
+            background = true;
+            break;
+        case OptionId::ChDir:
+            if (!dir)
+                dir = parser.Value();
+            break;
+        case OptionId::Direct:
+        case OptionId::Shell:
+            if (mode == ExecMode::Auto)
+                mode = (id == OptionId::Direct) ? ExecMode::Direct : ExecMode::Shell;
+            break;
+        case OptionId::Debug:
+            debug = true;
+            break;
+        case OptionId::Elevated:
+            elevated = true;
+            pid = unsigned(wcstoul(parser.Value(), nullptr, 10));
+            break;
+        case OptionId::Priority:
+            if (!ParsePriority(parser.Value(), controls.priority))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::IoPriority:
+            if (!ParseIoPriority(parser.Value(), controls.io_priority))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::Affinity:
+            if (!ParseAffinity(parser.Value(), controls.affinity))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::MaxMemory:
+            if (!ParseMemorySize(parser.Value(), controls.max_memory))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::CpuRate:
+            if (!ParseCpuRate(parser.Value(), controls.cpu_rate))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::Controls:
+            if (!ParseControls(parser.Value(), controls))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::Timeout:
+            if (!timeout && !ParseDuration(timeout = parser.Value(), timeout_ms))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::KillAfter:
+            if (!kill_after && !ParseDuration(kill_after = parser.Value(), kill_after_ms))
+                return ExitFailure(EINVAL);
+            break;
+        case OptionId::Trace:
+            if (!trace)
+                trace = parser.Value();
+            break;
+        case OptionId::Unknown:
+            ShowHelp();
+            return 1;
+        default:
+            ErrText("sudo: that option is not supported on this platform.\n");
+            return 1;
+        }
+    }
+
+    line = const_cast<wchar_t*>(parser.Remaining());
+    if (!*line)
+    {
+        ErrText("Missing command to execute.\n\nUsage:\n\n");
+        ShowHelp();
+        return 1;
+    }
+    if (timeout_ms && background)
+    {
+        ErrText("--timeout cannot be used with -b.\n");
+        return 1;
+    }
+
+    // Tracing starts after parsing the options, but includes the parsing.
+    FlushTraceAtExit flush_trace;
+    if (trace)
+    {
+        static char s_process_name[64];
+        char* file = ToNarrow(trace);
+        if (!file)
+            return ExitFailure(errno ? errno : ENOMEM);
+        if (elevated)
+        {
+            snprintf(s_process_name, sizeof(s_process_name), "sudo --elevated (for %u)", pid);
+            s_trace_file = file;
+        }
+        else
+        {
+            // The elevated sudo gets the full path, since it may start
+            // somewhere else.
+            strcpy(s_process_name, "sudo");
+            char full[PATH_MAX];
+            if (!CreateTraceFile(file) || !realpath(file, full))
+                return ExitFailure(errno);
+            s_trace_file = s_arena.Copy(full);
+            trace = ToWide(full);
+            if (!s_trace_file || !trace)
+                return ExitFailure(ENOMEM);
+        }
+
+        TraceStart(PlatformGetPid(), s_process_name, QueryTraceClock, 1000000000);
+        TraceSpanEvent("parse options", start, TraceNow());
+    }
+
+    if (elevated)
+    {
+        if (!PlatformIsElevated())
+            return ExitFailure(EPERM);
+        PlatformAttachConsole(pid);
+        return Launch(line, dir, mode, background, debug, controls, timeout_ms, kill_after_ms);
+    }
+
+    // The elevation hop.  The elevated sudo needs the full path of the
+    // directory, since it may start somewhere else.
+    char self[PATH_MAX];
+    const ssize_t cb_self = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (cb_self <= 0)
+        return ExitFailure(errno);
+    self[cb_self] = '\0';
+
+    char cwd[PATH_MAX];
+    if (!dir)
+    {
+        if (!getcwd(cwd, sizeof(cwd)))
+            return ExitFailure(errno);
+        dir = ToWide(cwd);
+    }
+
+    CommandLineBuilder args;
+    args.Arg(L"--elevated");
+    args.Arg(PlatformGetPid());
+    if (background)
+        args.Arg(L"-b");
+    if (debug)
+        args.Arg(L"--debug");
+    if (mode != ExecMode::Auto)
+        args.Arg((mode == ExecMode::Direct) ? L"--direct" : L"--shell");
+    wchar_t spec[c_controls_spec_max];
+    if (controls.Any())
+    {
+        FormatControls(controls, spec);
+        args.Arg(L"--controls");
+        args.Arg(spec);
+    }
+    if (timeout)
+    {
+        args.Arg(L"--timeout");
+        args.Arg(timeout);
+    }
+    if (kill_after)
+    {
+        args.Arg(L"--kill-after");
+        args.Arg(kill_after);
+    }
+    if (trace)
+    {
+        args.Arg(L"--trace");
+        args.Arg(trace);
+    }
+    args.Arg(L"-D");
+    args.Arg(dir);
+    args.Arg(L"--");
+    args.Raw(line);
+    const wchar_t* parameters = EmitCommandLine(args);
+    const wchar_t* wself = ToWide(self);
+    if (!parameters || !wself)
+        return ExitFailure(ENOMEM);
+
+    if (debug)
+    {
+        OutText("ELEVATE:\n");
+        OutText("FILE='"); OutText(wself); OutText("'\n");
+        OutText("PARAMETERS='"); OutText(parameters); OutText("'\n");
+    }
+    FlushOutput();
+
+    PlatformProcess process = {};
+    TraceSpan elevate_span("elevate");
+    if (!PlatformElevate(wself, parameters, dir, false, s_arena, process))
+        return ExitFailure(errno);
+    elevate_span.End();
+
+    TraceSpan wait_span("wait for elevated sudo");
+    unsigned exit_code = 0;
+    if (!PlatformWait(process, exit_code))
+        return ExitFailure(errno);
+    PlatformClose(process);
+    return int(exit_code);
+}
@@ -0,0 +1,281 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Plays back a recording made by sudo --log-output.  This only uses the
+// standard library, so it also builds on other platforms, for looking at
+// recordings copied off of the machine that made them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iolog.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+static const char c_usage[] =
+"Usage:  sudoreplay [options] file\r\n"
+"\r\n"
+"Plays back the input and output recorded by sudo --log-output=file.\r\n"
+"\r\n"
+"  -e, --end=secs            Stop at secs seconds into the recording.\r\n"
+"  -h, --help                Show this help text.\r\n"
+"  -l, --list                List the recording's chunks instead.\r\n"
+"  -m, --streams=ioe         Play back the streams listed:  i for stdin, o\r\n"
+"                            for stdout, e for stderr (default is oe).\r\n"
+"  -s, --start=secs          Start at secs seconds into the recording.\r\n"
+"  -t, --timestamps          Show the time of each event.\r\n"
+"\r\n"
+"Only the chunk containing the start time and the chunks after it are\r\n"
+"decompressed, so starting partway through a long recording is fast.\r\n";
+
+struct ReplayContext
+{
+    IoLogTime       start;
+    IoLogTime       end;
+    unsigned        streams;
+    bool            timestamps;
+    bool            done;
+};
+
+static bool
+ReadFromFile(unsigned long long offset, void* p, size_t cb, void* context)
+{
+    FILE* f = static_cast<FILE*>(context);
+    return fseek64(f, offset, SEEK_SET) == 0 && fread(p, 1, cb, f) == cb;
+}
+
+static bool
+ParseSeconds(const char* arg, IoLogTime& time)
+{
+    char* end;
+    const double secs = strtod(arg, &end);
+    if (end == arg || *end || secs < 0)
+        return false;
+    time = IoLogTime(secs * 1000000);
+    return true;
+}
+
+static bool
+ParseStreams(const char* arg, unsigned& streams)
+{
+    streams = 0;
+    for (; *arg; ++arg)
+    {
+        switch (*arg)
+        {
+        case 'i':   streams |= 1 << unsigned(IoLogStream::Stdin); break;
+        case 'o':   streams |= 1 << unsigned(IoLogStream::Stdout); break;
+        case 'e':   streams |= 1 << unsigned(IoLogStream::Stderr); break;
+        default:    return false;
+        }
+    }
+    return !!streams;
+}
+
+static void
+FormatTime(char* out, size_t cb, IoLogTime time)
+{
+    snprintf(out, cb, "%llu.%06u", time / 1000000, unsigned(time % 1000000));
+}
+
+static bool
+ReplayEvent(IoLogStream stream, IoLogTime time, const unsigned char* p, size_t cb, void* context)
+{
+    ReplayContext* const ctx = static_cast<ReplayContext*>(context);
+
+    if (time < ctx->start)
+        return true;
+    if (time > ctx->end)
+    {
+        ctx->done = true;
+        return false;
+    }
+
+    if (stream == IoLogStream::Dropped)
+    {
+        unsigned long long dropped = 0;
+        for (unsigned shift = 0; cb--; shift += 7)
+            dropped |= (unsigned long long)(*(p++) & 0x7f) << shift;
+        char szTime[32];
+        FormatTime(szTime, sizeof(szTime), time);
+        fprintf(stderr, "\n[%s: %llu bytes were not recorded]\n", szTime, dropped);
+        return true;
+    }
+
+    if (!(ctx->streams & (1 << unsigned(stream))))
+        return true;
+
+    FILE* out = (stream == IoLogStream::Stderr) ? stderr : stdout;
+    if (ctx->timestamps)
+    {
+        static const char* const c_names[] = { "stdin", "stdout", "stderr" };
+        char szTime[32];
+        FormatTime(szTime, sizeof(szTime), time);
+        fprintf(out, "\n[%s %s]\n", szTime, c_names[unsigned(stream)]);
+    }
+    fwrite(p, 1, cb, out);
+    return true;
+}
+
+static void
+ListChunks(const IoLogReader& reader)
+{
+    const time_t start = time_t(reader.StartTime() / 1000000);
+    char szStart[64] = "?";
+    const struct tm* tm = gmtime(&start);
+    if (tm)
+        strftime(szStart, sizeof(szStart), "%Y-%m-%d %H:%M:%S UTC", tm);
+
+    printf("started   %s\r\n", szStart);
+    printf("index     %s\r\n", reader.HasIndex() ? "yes" : "no (recording was cut off)");
+    printf("chunks    %u\r\n", reader.ChunkCount());
+    for (unsigned i = 0; i < reader.ChunkCount(); ++i)
+    {
+        const IoLogChunkInfo& info = reader.Chunk(i);
+        char szFirst[32];
+        char szLast[32];
+        FormatTime(szFirst, sizeof(szFirst), info.first_time);
+        FormatTime(szLast, sizeof(szLast), info.last_time);
+        printf("%8u  %s - %s  at offset %llu\r\n", i, szFirst, szLast, info.offset);
+    }
+}
+
+static bool
+MatchOption(const char* arg, char short_name, const char* long_name, const char*& value)
+{
+    if (arg[0] != '-')
+        return false;
+    if (arg[1] == short_name && !arg[2])
+        return true;
+    if (arg[1] != '-')
+        return false;
+    const size_t len = strlen(long_name);
+    if (strncmp(arg + 2, long_name, len))
+        return false;
+    if (arg[2 + len] == '=')
+    {
+        value = arg + 2 + len + 1;
+        return true;
+    }
+    return !arg[2 + len];
+}
+
+int
+main(int argc, char** argv)
+{
+    ReplayContext ctx = {};
+    ctx.end = ~IoLogTime(0);
+    ctx.streams = (1 << unsigned(IoLogStream::Stdout)) | (1 << unsigned(IoLogStream::Stderr));
+    bool fList = false;
+    const char* pszFile = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = nullptr;
+        bool ok = true;
+
+        if (MatchOption(arg, 'h', "help", value) || !strcmp(arg, "-?"))
+        {
+            fputs(c_usage, stdout);
+            return 0;
+        }
+        else if (MatchOption(arg, 'l', "list", value))
+        {
+            fList = true;
+        }
+        else if (MatchOption(arg, 't', "timestamps", value))
+        {
+            ctx.timestamps = true;
+        }
+        else if (MatchOption(arg, 's', "start", value))
+        {
+            value = value ? value : (i + 1 < argc ? argv[++i] : "");
+            ok = ParseSeconds(value, ctx.start);
+        }
+        else if (MatchOption(arg, 'e', "end", value))
+        {
+            value = value ? value : (i + 1 < argc ? argv[++i] : "");
+            ok = ParseSeconds(value, ctx.end);
+        }
+        else if (MatchOption(arg, 'm', "streams", value))
+        {
+            value = value ? value : (i + 1 < argc ? argv[++i] : "");
+            ok = ParseStreams(value, ctx.streams);
+        }
+        else if (arg[0] == '-' || pszFile)
+        {
+            ok = false;
+        }
+        else
+        {
+            pszFile = arg;
+        }
+
+        if (!ok)
+        {
+            fprintf(stderr, "sudoreplay: invalid argument '%s'.\r\n", arg);
+            return 1;
+        }
+    }
+
+    if (!pszFile)
+    {
+        fputs(c_usage, stderr);
+        return 1;
+    }
+
+    FILE* f = fopen(pszFile, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "sudoreplay: unable to open '%s'.\r\n", pszFile);
+        return 1;
+    }
+
+    unsigned long long size = 0;
+    if (fseek64(f, 0, SEEK_END) == 0)
+    {
+#ifdef _WIN32
+        size = _ftelli64(f);
+#else
+        size = ftello(f);
+#endif
+    }
+
+    IoLogReader reader;
+    if (!reader.Open(size, ReadFromFile, f))
+    {
+        fprintf(stderr, "sudoreplay: '%s' is not a sudo recording.\r\n", pszFile);
+        fclose(f);
+        return 1;
+    }
+
+    int ret = 0;
+    if (fList)
+    {
+        ListChunks(reader);
+    }
+    else
+    {
+        for (unsigned i = reader.FindChunk(ctx.start); i < reader.ChunkCount() && !ctx.done; ++i)
+        {
+            if (!reader.ReadChunk(i, ReplayEvent, &ctx) && !ctx.done)
+            {
+                fprintf(stderr, "\r\nsudoreplay: chunk %u is damaged.\r\n", i);
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,168 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+
+#include "trace.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// The events are written as lines of the form "{...},".  The trace viewers
+// accept a JSON array with no closing bracket and a trailing comma, which is
+// what lets several processes append to the same file independently.
+
+struct TraceEvent
+{
+    const char*     name;
+    const char*     key;        // Only for counters.
+    TraceTicks      start;
+    TraceTicks      end;        // The value, for counters.
+};
+
+enum { c_max_trace_events = 256 };
+
+bool g_trace_enabled = false;
+
+static TraceEvent s_events[c_max_trace_events];
+static unsigned s_count = 0;
+static unsigned s_dropped = 0;
+static unsigned s_pid = 0;
+static const char* s_process_name = nullptr;
+static TraceClockProc s_clock = nullptr;
+static TraceTicks s_frequency = 1;
+
+void
+TraceStart(unsigned pid, const char* process_name, TraceClockProc clock, TraceTicks frequency)
+{
+    s_pid = pid;
+    s_process_name = process_name;
+    s_clock = clock;
+    s_frequency = frequency ? frequency : 1;
+    s_count = 0;
+    s_dropped = 0;
+    g_trace_enabled = true;
+}
+
+TraceTicks
+TraceNow()
+{
+    return s_clock ? s_clock() : 0;
+}
+
+void
+TraceSpanEvent(const char* name, TraceTicks start, TraceTicks end)
+{
+    if (!g_trace_enabled)
+        return;
+    if (s_count >= c_max_trace_events)
+    {
+        ++s_dropped;
+        return;
+    }
+    s_events[s_count++] = { name, nullptr, start, end < start ? start : end };
+}
+
+void
+TraceCounterEvent(const char* name, const char* key, unsigned long long value)
+{
+    if (!g_trace_enabled)
+        return;
+    if (s_count >= c_max_trace_events)
+    {
+        ++s_dropped;
+        return;
+    }
+    s_events[s_count++] = { name, key, TraceNow(), value };
+}
+
+// Formats ticks as microseconds with three decimals, without overflowing
+// for large tick counts.
+static void
+FormatMicroseconds(char* out, size_t cb, TraceTicks ticks)
+{
+    const TraceTicks whole = ticks / s_frequency;
+    const TraceTicks part = ticks % s_frequency;
+    const TraceTicks ns = whole * 1000000000ull + part * 1000000000ull / s_frequency;
+    snprintf(out, cb, "%llu.%03u", ns / 1000, unsigned(ns % 1000));
+}
+
+static void
+WriteJsonString(TraceWriter write, void* context, const char* s)
+{
+    write("\"", 1, context);
+    const char* run = s;
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\' || unsigned(*s) < 0x20)
+        {
+            if (s > run)
+                write(run, size_t(s - run), context);
+            char esc[8];
+            const int len = snprintf(esc, sizeof(esc), "\\u%04x", unsigned(*s) & 0xff);
+            write(esc, size_t(len), context);
+            run = s + 1;
+        }
+    }
+    if (s > run)
+        write(run, size_t(s - run), context);
+    write("\"", 1, context);
+}
+
+void
+TraceWriteHeader(TraceWriter write, void* context)
+{
+    write("[\n", 2, context);
+}
+
+void
+TraceWriteEvents(TraceWriter write, void* context)
+{
+    char line[160];
+    int len;
+
+    if (s_process_name)
+    {
+        len = snprintf(line, sizeof(line), "{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"name\":\"process_name\",\"args\":{\"name\":", s_pid, s_pid);
+        write(line, size_t(len), context);
+        WriteJsonString(write, context, s_process_name);
+        write("}},\n", 4, context);
+    }
+
+    for (unsigned i = 0; i < s_count; ++i)
+    {
+        const TraceEvent& event = s_events[i];
+        char ts[32];
+        char dur[32];
+        FormatMicroseconds(ts, sizeof(ts), event.start);
+
+        if (event.key)
+        {
+            len = snprintf(line, sizeof(line), "{\"ph\":\"C\",\"pid\":%u,\"tid\":%u,\"ts\":%s,\"name\":", s_pid, s_pid, ts);
+            write(line, size_t(len), context);
+            WriteJsonString(write, context, event.name);
+            write(",\"args\":{", 9, context);
+            WriteJsonString(write, context, event.key);
+            len = snprintf(line, sizeof(line), ":%llu}},\n", event.end);
+            write(line, size_t(len), context);
+            continue;
+        }
+
+        FormatMicroseconds(dur, sizeof(dur), event.end - event.start);
+
+        len = snprintf(line, sizeof(line), "{\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%s,\"dur\":%s,\"name\":", s_pid, s_pid, ts, dur);
+        write(line, size_t(len), context);
+        WriteJsonString(write, context, event.name);
+        write("},\n", 3, context);
+    }
+
+    if (s_dropped)
+    {
+        char ts[32];
+        FormatMicroseconds(ts, sizeof(ts), TraceNow());
+        len = snprintf(line, sizeof(line), "{\"ph\":\"i\",\"s\":\"p\",\"pid\":%u,\"tid\":%u,\"ts\":%s,\"name\":\"%u events dropped\"},\n", s_pid, s_pid, ts, s_dropped);
+        write(line, size_t(len), context);
+    }
+
+    s_count = 0;
+    s_dropped = 0;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Records timing spans for --trace, and writes them as Chrome trace events
+// (JSON array format), which chrome://tracing and Perfetto can load.  Each
+// sudo process appends its own events to the same file, so the unelevated
+// and elevated processes show up together in one trace.
+//
+// The clock is supplied by the caller and must be comparable across
+// processes (e.g. QueryPerformanceCounter).  Until TraceStart() is called,
+// spans cost one test of a global flag.
+
+typedef unsigned long long TraceTicks;
+typedef TraceTicks (*TraceClockProc)();
+
+// Writes part of the trace file.
+typedef void (*TraceWriter)(const char* text, size_t len, void* context);
+
+extern bool g_trace_enabled;
+
+void TraceStart(unsigned pid, const char* process_name, TraceClockProc clock, TraceTicks frequency);
+TraceTicks TraceNow();
+
+// Records a span.  The name must be a string literal (it is not copied).
+void TraceSpanEvent(const char* name, TraceTicks start, TraceTicks end);
+
+// Records the value of a counter now, such as how many allocations the arena
+// has made.  The name and key must be string literals.
+void TraceCounterEvent(const char* name, const char* key, unsigned long long value);
+
+// Writes the opening of a new trace file.
+void TraceWriteHeader(TraceWriter write, void* context);
+
+// Writes and then discards the recorded events.
+void TraceWriteEvents(TraceWriter write, void* context);
+
+// Records a span for the lifetime of the object.
+class TraceSpan
+{
+public:
+                    TraceSpan(const char* name) : m_name(name), m_start(g_trace_enabled ? TraceNow() : 0) {}
+                    ~TraceSpan() { End(); }
+
+    void            End()
+                    {
+                        if (g_trace_enabled && m_name)
+                            TraceSpanEvent(m_name, m_start, TraceNow());
+                        m_name = nullptr;
+                    }
+
+private:
+    const char*     m_name;
+    TraceTicks      m_start;
+};
@@ -0,0 +1,94 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "watchdog.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const unsigned c_wait_forever = ~0u;
+static const unsigned long long c_longest_wait = c_wait_forever - 1;
+
+bool
+ParseDuration(const wchar_t* text, unsigned& ms)
+{
+    // Whole units, and then the fraction in thousandths of a unit (further
+    // digits only keep a tiny duration from becoming 0, which would mean no
+    // timeout).
+    bool nonzero = false;
+    unsigned long long whole = 0;
+    const wchar_t* p = text;
+    for (; *p >= '0' && *p <= '9'; ++p)
+    {
+        whole = whole * 10 + (*p - '0');
+        nonzero |= (*p != '0');
+        if (whole > c_longest_wait)
+            whole = c_longest_wait + 1;
+    }
+    bool digits = (p > text);
+
+    unsigned long long thousandths = 0;
+    if (*p == '.')
+    {
+        unsigned scale = 100;
+        for (++p; *p >= '0' && *p <= '9'; ++p, digits = true)
+        {
+            thousandths += (*p - '0') * scale;
+            nonzero |= (*p != '0');
+            scale /= 10;
+        }
+    }
+    if (!digits)
+        return false;
+
+    unsigned long long unit_ms = 1000;
+    switch (*p)
+    {
+    case '\0':                          break;
+    case 's':   ++p;                    break;
+    case 'm':   ++p; unit_ms *= 60;     break;
+    case 'h':   ++p; unit_ms *= 3600;   break;
+    case 'd':   ++p; unit_ms *= 86400;  break;
+    default:    return false;
+    }
+    if (*p)
+        return false;
+
+    // whole is at most c_longest_wait + 1, so this can't overflow.
+    const unsigned long long total = whole * unit_ms + thousandths * unit_ms / 1000;
+    ms = unsigned((total > c_longest_wait) ? c_longest_wait : total);
+    if (!ms && nonzero)
+        ms = 1;
+    return true;
+}
+
+WatchdogResult
+RunWatchdog(const WatchdogOps& ops, unsigned timeout_ms, unsigned kill_after_ms, unsigned& exit_code)
+{
+    WatchdogWait wait = ops.wait(timeout_ms ? timeout_ms : c_wait_forever, exit_code, ops.context);
+    if (wait != WatchdogWait::Running)
+        return (wait == WatchdogWait::Exited) ? WatchdogResult::Exited : WatchdogResult::Failed;
+
+    ops.interrupt(ops.context);
+    wait = ops.wait(kill_after_ms ? kill_after_ms : c_wait_forever, exit_code, ops.context);
+    if (wait == WatchdogWait::Running)
+    {
+        ops.kill(ops.context);
+        wait = ops.wait(c_wait_forever, exit_code, ops.context);
+        if (wait == WatchdogWait::Exited)
+        {
+            exit_code = c_exit_killed;
+            return WatchdogResult::Killed;
+        }
+    }
+    if (wait != WatchdogWait::Exited)
+        return WatchdogResult::Failed;
+
+    // The command stopped, but processes it started may have ignored the
+    // interrupt (such as a shell's child).  With a grace period, nothing in
+    // a timed out tree outlives it.
+    if (kill_after_ms)
+        ops.kill(ops.context);
+
+    exit_code = c_exit_timed_out;
+    return WatchdogResult::TimedOut;
+}
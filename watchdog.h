@@ -0,0 +1,61 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+// The --timeout watchdog, with the same semantics as coreutils timeout:
+// when the command has run for the duration, its process group is asked to
+// stop (Ctrl-Break, or SIGTERM).  With --kill-after, if it is still running
+// after the grace period, the whole tree is terminated.  Only the command
+// itself is watched; processes it leaves behind don't extend the timeout,
+// but with --kill-after they are terminated when the command times out.
+//
+// The watchdog only drives the process through WatchdogOps, so the same
+// logic runs against a job object on Windows, a process group on POSIX, or
+// a fake process tree.
+
+// Exit codes, as in coreutils:  the command timed out (and then exited), or
+// had to be killed (128 + SIGKILL, as a shell reports it).
+enum : unsigned
+{
+    c_exit_timed_out = 124,
+    c_exit_killed = 137,
+};
+
+enum class WatchdogWait : unsigned char
+{
+    Exited,
+    Running,                    // Still running after the timeout.
+    Failed,
+};
+
+struct WatchdogOps
+{
+    // Waits up to timeout_ms (~0u to wait forever) for the command to exit.
+    WatchdogWait        (*wait)(unsigned timeout_ms, unsigned& exit_code, void* context);
+
+    // Asks the command's process group to stop.
+    void                (*interrupt)(void* context);
+
+    // Terminates the command and everything it started.
+    void                (*kill)(void* context);
+
+    void*               context;
+};
+
+enum class WatchdogResult : unsigned char
+{
+    Exited,                     // Before the timeout; exit_code is the command's.
+    TimedOut,                   // Exited after being interrupted; exit_code is c_exit_timed_out.
+    Killed,                     // exit_code is c_exit_killed.
+    Failed,                     // Waiting failed (with the platform's last error set).
+};
+
+// Durations are a number (which may have a fraction) and an optional unit:
+// s (the default), m, h, or d.  0 disables the timeout.  Durations too long
+// to represent are clamped to the longest finite wait.
+bool ParseDuration(const wchar_t* text, unsigned& ms);
+
+// Waits for the command, enforcing the timeout (0 for none) and the grace
+// period (0 to never kill it).
+WatchdogResult RunWatchdog(const WatchdogOps& ops, unsigned timeout_ms, unsigned kill_after_ms, unsigned& exit_code);
@@ -0,0 +1,340 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include <string.h>
+#include <wchar.h>
+
+#include "writer.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static const unsigned c_replacement = 0xFFFD;
+
+static bool
+IsHighSurrogate(wchar_t c)
+{
+    return unsigned(c) >= 0xD800 && unsigned(c) <= 0xDBFF;
+}
+
+static bool
+IsLowSurrogate(wchar_t c)
+{
+    return unsigned(c) >= 0xDC00 && unsigned(c) <= 0xDFFF;
+}
+
+void
+TextWriter::AttachBytes(WriteBytesProc write, EncodeProc encode, void* context)
+{
+    Detach();
+    m_write_bytes = write;
+    m_encode = encode;
+    m_context = context;
+}
+
+void
+TextWriter::AttachWide(WriteWideProc write, void* context)
+{
+    Detach();
+    m_write_wide = write;
+    m_context = context;
+}
+
+void
+TextWriter::Detach()
+{
+    Flush();
+    m_write_bytes = nullptr;
+    m_write_wide = nullptr;
+    m_encode = nullptr;
+    m_context = nullptr;
+    m_high = 0;
+}
+
+bool
+TextWriter::Flush()
+{
+    if (!m_used)
+        return true;
+
+    bool ok;
+    if (m_write_bytes)
+        ok = m_write_bytes(m_bytes, m_used, m_context);
+    else
+        ok = m_write_wide(m_wide, m_used, m_context);
+    ++m_writes;
+    m_used = 0;
+    return ok;
+}
+
+void
+TextWriter::PutUtf8(unsigned cp)
+{
+    if (c_buffer_bytes - m_used < 4)
+        Flush();
+
+    char* out = m_bytes + m_used;
+    if (cp < 0x80)
+    {
+        *(out++) = char(cp);
+    }
+    else if (cp < 0x800)
+    {
+        *(out++) = char(0xC0 | (cp >> 6));
+        *(out++) = char(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        *(out++) = char(0xE0 | (cp >> 12));
+        *(out++) = char(0x80 | ((cp >> 6) & 0x3F));
+        *(out++) = char(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        *(out++) = char(0xF0 | (cp >> 18));
+        *(out++) = char(0x80 | ((cp >> 12) & 0x3F));
+        *(out++) = char(0x80 | ((cp >> 6) & 0x3F));
+        *(out++) = char(0x80 | (cp & 0x3F));
+    }
+    m_used = out - m_bytes;
+}
+
+void
+TextWriter::PutUtf16(unsigned cp)
+{
+    if (c_buffer_wide - m_used < 2)
+        Flush();
+
+    if (cp >= 0x10000 && sizeof(wchar_t) == 2)
+    {
+        cp -= 0x10000;
+        m_wide[m_used++] = wchar_t(0xD800 | (cp >> 10));
+        m_wide[m_used++] = wchar_t(0xDC00 | (cp & 0x3FF));
+    }
+    else
+    {
+        m_wide[m_used++] = wchar_t(cp);
+    }
+}
+
+// Encodes UTF-16 as UTF-8 straight into the buffer.  A surrogate pair may
+// be split across calls; an unpaired surrogate becomes U+FFFD.
+void
+TextWriter::AppendUtf8(const wchar_t* text, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        const wchar_t c = text[i];
+        if (m_high)
+        {
+            const wchar_t high = m_high;
+            m_high = 0;
+            if (IsLowSurrogate(c))
+            {
+                PutUtf8(0x10000 + ((unsigned(high) - 0xD800) << 10) + (unsigned(c) - 0xDC00));
+                continue;
+            }
+            PutUtf8(c_replacement);
+        }
+
+        if (IsHighSurrogate(c))
+            m_high = c;
+        else if (IsLowSurrogate(c) || unsigned(c) > 0x10FFFF)
+            PutUtf8(c_replacement);
+        else
+            PutUtf8(unsigned(c));
+    }
+}
+
+// Encodes UTF-16 with the encoder, in pieces that are sure to fit in the
+// rest of the buffer.
+void
+TextWriter::AppendEncoded(const wchar_t* text, size_t len)
+{
+    if (m_high && len)
+    {
+        // Finish the pair (or the lone surrogate) left by the last call.
+        const wchar_t pair[2] = { m_high, text[0] };
+        const size_t cch = IsLowSurrogate(text[0]) ? 2 : 1;
+        m_high = 0;
+        if (c_buffer_bytes - m_used < 8)
+            Flush();
+        const size_t cb = m_encode(pair, cch, m_bytes + m_used, c_buffer_bytes - m_used, m_context);
+        if (cb != size_t(-1))
+            m_used += cb;
+        text += cch - 1;
+        len -= cch - 1;
+    }
+
+    while (len)
+    {
+        if (c_buffer_bytes - m_used < 16)
+            Flush();
+
+        size_t cch = (c_buffer_bytes - m_used) / 4;
+        if (cch >= len)
+        {
+            cch = len;
+            if (IsHighSurrogate(text[len - 1]))
+            {
+                m_high = text[len - 1];
+                --cch;
+                --len;
+            }
+        }
+        else if (IsHighSurrogate(text[cch - 1]))
+        {
+            --cch;
+        }
+
+        if (cch)
+        {
+            const size_t cb = m_encode(text, cch, m_bytes + m_used, c_buffer_bytes - m_used, m_context);
+            if (cb != size_t(-1))
+                m_used += cb;
+        }
+        text += cch;
+        len -= cch;
+    }
+}
+
+// Decodes UTF-8 into the UTF-16 buffer.  Invalid sequences become U+FFFD.
+void
+TextWriter::AppendWide(const char* text, size_t len)
+{
+    static const unsigned c_min[] = { 0, 0x80, 0x800, 0x10000 };
+
+    for (size_t i = 0; i < len;)
+    {
+        const unsigned char c = text[i++];
+        unsigned cp;
+        unsigned more;
+        if (c < 0x80)
+        {
+            PutUtf16(c);
+            continue;
+        }
+        else if ((c & 0xE0) == 0xC0)
+        {
+            cp = c & 0x1F;
+            more = 1;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            cp = c & 0x0F;
+            more = 2;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            cp = c & 0x07;
+            more = 3;
+        }
+        else
+        {
+            PutUtf16(c_replacement);
+            continue;
+        }
+
+        const unsigned n = more;
+        for (; more && i < len && (text[i] & 0xC0) == 0x80; --more)
+            cp = (cp << 6) | (text[i++] & 0x3F);
+
+        if (more || cp < c_min[n] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            cp = c_replacement;
+        PutUtf16(cp);
+    }
+}
+
+void
+TextWriter::Write(const char* text)
+{
+    Write(text, strlen(text));
+}
+
+void
+TextWriter::Write(const wchar_t* text)
+{
+    Write(text, wcslen(text));
+}
+
+void
+TextWriter::Write(const char* text, size_t len)
+{
+    ++m_calls;
+    if (m_write_bytes)
+    {
+        if (m_high)
+        {
+            m_high = 0;
+            if (m_encode)
+                AppendEncoded(L"?", 1);
+            else
+                PutUtf8(c_replacement);
+        }
+
+        for (size_t done = 0; done < len;)
+        {
+            if (m_used == c_buffer_bytes)
+                Flush();
+            size_t cb = c_buffer_bytes - m_used;
+            if (cb > len - done)
+                cb = len - done;
+            memcpy(m_bytes + m_used, text + done, cb);
+            m_used += cb;
+            done += cb;
+        }
+    }
+    else if (m_write_wide)
+    {
+        AppendWide(text, len);
+    }
+    else
+    {
+        return;
+    }
+
+    if (memchr(text, '\n', len))
+        Flush();
+}
+
+void
+TextWriter::Write(const wchar_t* text, size_t len)
+{
+    ++m_calls;
+    if (m_write_bytes)
+    {
+        if (m_encode)
+            AppendEncoded(text, len);
+        else
+            AppendUtf8(text, len);
+    }
+    else if (m_write_wide)
+    {
+        // The console takes UTF-16 as is; only avoid splitting a surrogate
+        // pair between two writes.
+        for (size_t done = 0; done < len;)
+        {
+            size_t cch = c_buffer_wide - m_used;
+            if (cch > len - done)
+                cch = len - done;
+            else if (cch > 1 && IsHighSurrogate(text[done + cch - 1]))
+                --cch;
+            if (cch < 2 && done + cch < len && IsHighSurrogate(text[done]))
+                cch = 0;
+            if (!cch)
+            {
+                Flush();
+                continue;
+            }
+            wmemcpy(m_wide + m_used, text + done, cch);
+            m_used += cch;
+            done += cch;
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    if (wmemchr(text, '\n', len))
+        Flush();
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <stddef.h>
+
+// Buffers the text written to one output stream (e.g. stdout), so that a
+// line assembled from several pieces reaches the stream in one write.  The
+// kind of stream is decided once, when the writer is attached:
+//
+//  - A byte stream (a file or pipe) gets UTF-8, or another encoding if an
+//    encoder is supplied.  Wide text is converted as it is appended, in one
+//    pass, straight into the buffer.
+//  - A wide stream (a console) gets UTF-16.
+//
+// Narrow text is UTF-8 (sudo's own messages are ASCII).  It is passed
+// through unchanged to a byte stream, and decoded for a wide stream.
+//
+// The buffer is flushed when a newline is written, when it fills, and by
+// Flush().  Output that must be seen before anything else happens (e.g. a
+// prompt) needs an explicit Flush().  A writer may only be used by one
+// thread at a time.
+
+// Writes bytes or UTF-16 to the stream.  Returns false on failure.
+typedef bool (*WriteBytesProc)(const char* bytes, size_t len, void* context);
+typedef bool (*WriteWideProc)(const wchar_t* text, size_t len, void* context);
+
+// Converts UTF-16 to another encoding, writing at most max bytes.  Returns
+// the number of bytes written, or size_t(-1) on failure.  Each call is
+// given at most max / 4 characters and never a lone high surrogate at the
+// end.
+typedef size_t (*EncodeProc)(const wchar_t* text, size_t len, char* out, size_t max, void* context);
+
+class TextWriter
+{
+public:
+                    ~TextWriter() { Flush(); }
+
+    // Attaches to a byte stream.  If encode is nullptr the stream gets UTF-8.
+    void            AttachBytes(WriteBytesProc write, EncodeProc encode, void* context);
+    // Attaches to a wide stream.
+    void            AttachWide(WriteWideProc write, void* context);
+    // Flushes, and then writes nowhere until attached again.
+    void            Detach();
+    bool            IsAttached() const { return m_write_bytes || m_write_wide; }
+
+    void            Write(const char* text);
+    void            Write(const char* text, size_t len);
+    void            Write(const wchar_t* text);
+    void            Write(const wchar_t* text, size_t len);
+
+    // Writes whatever is buffered.  Returns false if the stream failed.
+    bool            Flush();
+
+    // Calls to Write() and to the stream, for measuring the buffering.
+    unsigned long long Calls() const { return m_calls; }
+    unsigned long long Writes() const { return m_writes; }
+
+private:
+    enum { c_buffer_bytes = 4096, c_buffer_wide = c_buffer_bytes / sizeof(wchar_t) };
+
+    void            AppendUtf8(const wchar_t* text, size_t len);
+    void            AppendEncoded(const wchar_t* text, size_t len);
+    void            AppendWide(const char* text, size_t len);
+    void            PutUtf8(unsigned cp);
+    void            PutUtf16(unsigned cp);
+
+    WriteBytesProc  m_write_bytes = nullptr;
+    WriteWideProc   m_write_wide = nullptr;
+    EncodeProc      m_encode = nullptr;
+    void*           m_context = nullptr;
+
+    union
+    {
+        char        m_bytes[c_buffer_bytes];
+        wchar_t     m_wide[c_buffer_wide];
+    };
+    size_t          m_used = 0;
+    wchar_t         m_high = 0;         // High surrogate awaiting its pair.
+
+    unsigned long long m_calls = 0;
+    unsigned long long m_writes = 0;
+};
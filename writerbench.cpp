@@ -0,0 +1,314 @@
+// Copyright (c) 2022-2023 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// Benchmark for the buffered console writer:  writes the text of sudo's
+// --debug output (a line at a time, in several pieces per line, with wide
+// and narrow pieces mixed) the way sudo used to, and through a TextWriter.
+// The old way checks the kind of stream for each piece (isatty() stands in
+// for GetConsoleMode), converts wide text in two passes into a heap buffer,
+// and writes each piece on its own.  It reports syscalls and time for a
+// file sink and a pipe sink, and checks that both ways write the same
+// bytes.
+//
+// This uses fork() and pipes, so it only builds on Linux (and other POSIX
+// systems):
+//
+//      g++ -std=c++17 -O2 writerbench.cpp writer.cpp -o writerbench
+//      ./writerbench [-n repeats] [-f file]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "writer.h"
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+static unsigned long long
+NowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long s_syscalls;
+
+// Encodes UTF-16 as UTF-8, or only measures it if out is nullptr, like
+// WideCharToMultiByte.
+static size_t
+EncodeUtf8(const wchar_t* text, size_t len, char* out)
+{
+    size_t cb = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned cp = unsigned(text[i]);
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < len && unsigned(text[i + 1]) >= 0xDC00 && unsigned(text[i + 1]) <= 0xDFFF)
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (unsigned(text[i + 1]) - 0xDC00);
+            ++i;
+        }
+        else if (cp >= 0xD800 && cp <= 0xDFFF)
+        {
+            cp = 0xFFFD;
+        }
+
+        char tmp[4];
+        size_t n;
+        if (cp < 0x80)
+        {
+            tmp[0] = char(cp);
+            n = 1;
+        }
+        else if (cp < 0x800)
+        {
+            tmp[0] = char(0xC0 | (cp >> 6));
+            tmp[1] = char(0x80 | (cp & 0x3F));
+            n = 2;
+        }
+        else if (cp < 0x10000)
+        {
+            tmp[0] = char(0xE0 | (cp >> 12));
+            tmp[1] = char(0x80 | ((cp >> 6) & 0x3F));
+            tmp[2] = char(0x80 | (cp & 0x3F));
+            n = 3;
+        }
+        else
+        {
+            tmp[0] = char(0xF0 | (cp >> 18));
+            tmp[1] = char(0x80 | ((cp >> 12) & 0x3F));
+            tmp[2] = char(0x80 | ((cp >> 6) & 0x3F));
+            tmp[3] = char(0x80 | (cp & 0x3F));
+            n = 4;
+        }
+        if (out)
+            memcpy(out + cb, tmp, n);
+        cb += n;
+    }
+    return cb;
+}
+
+static void
+WriteAll(int fd, const char* bytes, size_t len)
+{
+    while (len)
+    {
+        ++s_syscalls;
+        const ssize_t written = write(fd, bytes, len);
+        if (written <= 0)
+            return;
+        bytes += written;
+        len -= size_t(written);
+    }
+}
+
+// The old way:  detect, convert, and write for every piece.
+static void
+OldOutText(int fd, const char* text)
+{
+    ++s_syscalls;
+    (void)isatty(fd);
+    WriteAll(fd, text, strlen(text));
+}
+
+static void
+OldOutText(int fd, const wchar_t* text)
+{
+    ++s_syscalls;
+    (void)isatty(fd);
+    const size_t len = wcslen(text);
+    const size_t cb = EncodeUtf8(text, len, nullptr);
+    char* tmp = static_cast<char*>(malloc(cb + 1));
+    if (tmp)
+    {
+        EncodeUtf8(text, len, tmp);
+        WriteAll(fd, tmp, cb);
+        free(tmp);
+    }
+}
+
+// The new way.
+static bool
+WriteBytes(const char* bytes, size_t len, void* context)
+{
+    WriteAll(*static_cast<int*>(context), bytes, len);
+    return true;
+}
+
+struct NewOut
+{
+    TextWriter&         writer;
+
+    void                operator()(int, const char* text) { writer.Write(text); }
+    void                operator()(int, const wchar_t* text) { writer.Write(text); }
+};
+
+struct OldOut
+{
+    void                operator()(int fd, const char* text) { OldOutText(fd, text); }
+    void                operator()(int fd, const wchar_t* text) { OldOutText(fd, text); }
+};
+
+// The --debug output of one sudo invocation, piece by piece as main.cpp
+// writes it.
+template <class Out>
+static unsigned
+WriteDebugOutput(Out&& out, int fd)
+{
+    static const wchar_t* const c_file = L"C:\\Program Files\\sudo\\sudo.exe";
+    static const wchar_t* const c_line = L"--elevated 1234 -D \"C:\\Users\\Zo\u00eb\\src\" -- build --config release \U0001F680";
+    static const wchar_t* const c_dir = L"C:\\Users\\Zo\u00eb\\src";
+
+    unsigned pieces = 0;
+    auto put = [&](auto text) { out(fd, text); ++pieces; };
+
+    put("MODULE='"); put(c_file); put("'\r\n");
+    put("ARGUMENTS='"); put(c_line); put("'\r\n");
+    put("ABSDIR='"); put(L"."); put(L"' -> '"); put(c_dir); put("'\r\n");
+    put("FREECONSOLE, ATTACH TO "); put("1234\r\n");
+    put("BROKER STARTED\r\n");
+    put("\r\n---- CreateProcessW ----\r\n");
+    put("FILE='"); put(L"C:\\Tools\\build.exe"); put("'\r\n");
+    put("CMDLINE='"); put(c_line); put("'\r\n");
+    put("DIR='"); put(c_dir); put("'\r\n");
+    put("ShellExecuteEx:\r\n");
+    put("FILE='"); put(c_file); put("'\r\n");
+    put("PARAMETERS='"); put(c_line); put("'\r\n");
+    put("DIR='"); put(c_dir); put("'\r\n");
+    put("ARENA: 13 allocations, 6416 bytes peak, 18368 bytes in 1 blocks\r\n");
+    return pieces;
+}
+
+struct Result
+{
+    unsigned long long  pieces;
+    unsigned long long  syscalls;
+    unsigned long long  usec;
+};
+
+template <class Run>
+static Result
+Measure(Run&& run, unsigned repeats)
+{
+    Result result = {};
+    s_syscalls = 0;
+    const unsigned long long start = NowMicroseconds();
+    for (unsigned i = 0; i < repeats; ++i)
+        result.pieces += run();
+    result.usec = NowMicroseconds() - start;
+    result.syscalls = s_syscalls;
+    return result;
+}
+
+// Runs both ways against one sink.
+static bool
+RunSink(const char* name, int fd, unsigned repeats)
+{
+    const Result before = Measure([&]() { return WriteDebugOutput(OldOut(), fd); }, repeats);
+
+    const Result after = Measure([&]() {
+        // A writer per invocation, so each detects the stream once.
+        TextWriter writer;
+        ++s_syscalls;
+        (void)isatty(fd);
+        writer.AttachBytes(WriteBytes, nullptr, &fd);
+        const unsigned pieces = WriteDebugOutput(NewOut{ writer }, fd);
+        writer.Flush();
+        return pieces;
+    }, repeats);
+
+    printf("%-5s  %llu pieces per run   before: %6.2f syscalls %7.2f us   after: %5.2f syscalls %7.2f us\n",
+           name, before.pieces / repeats,
+           double(before.syscalls) / repeats, double(before.usec) / repeats,
+           double(after.syscalls) / repeats, double(after.usec) / repeats);
+    return true;
+}
+
+static bool
+SameHalves(const char* file)
+{
+    FILE* f = fopen(file, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = static_cast<char*>(malloc(size_t(size) + 1));
+    const bool ok = (data && size % 2 == 0 && fread(data, 1, size_t(size), f) == size_t(size) &&
+                     !memcmp(data, data + size / 2, size_t(size / 2)));
+    free(data);
+    fclose(f);
+    return ok;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned repeats = 20000;
+    const char* file = "writerbench.out";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            repeats = unsigned(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            file = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: writerbench [-n repeats] [-f file]\n");
+            return 1;
+        }
+    }
+    if (!repeats)
+        return 1;
+
+    // File sink.  Both ways write to the same file, which must then hold
+    // the same bytes twice.
+    const int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(file);
+        return 1;
+    }
+    RunSink("file", fd, repeats);
+    close(fd);
+    const bool same = SameHalves(file);
+    unlink(file);
+    if (!same)
+    {
+        fprintf(stderr, "file: the buffered output differs.\n");
+        return 1;
+    }
+
+    // Pipe sink, drained by a child process.
+    int fds[2];
+    if (pipe(fds))
+    {
+        perror("pipe");
+        return 1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (!pid)
+    {
+        close(fds[1]);
+        char buffer[65536];
+        while (read(fds[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+        _exit(0);
+    }
+    close(fds[0]);
+    RunSink("pipe", fds[1], repeats);
+    close(fds[1]);
+    waitpid(pid, nullptr, 0);
+    return 0;
+}